@@ -0,0 +1,152 @@
+/*
+ * Start code scanning shared by the MPEG-1 system stream demuxers
+ * (mpeg_packet_reader, vcd_player, mpeg_vcd_audio_player).
+ *
+ * This folder is an Arduino library: with the repository as the sketchbook
+ * location, the sketches find it as <mpeg_scan.h>.
+ */
+
+#ifndef MPEG_SCAN_H
+#define MPEG_SCAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define MPEG_SCAN_CHUNK_SIZE 1024
+
+/*
+ * Return the offset of the first 00 00 01 start code prefix that lies fully
+ * within bytes[0, length), or -1 if there is none. A prefix can only begin at
+ * a zero byte, so blocks without any zero byte are skipped whole: 16 bytes at
+ * a time with SSE2, otherwise one aligned 32 bit word at a time.
+ * Same scanner as plm_scan_start_code() in pl_mpeg.h.
+ */
+static int mpeg_scan_start_code(const uint8_t *bytes, uint32_t length)
+{
+  if (length < 3)
+  {
+    return -1;
+  }
+  uint32_t end = length - 2;
+  uint32_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= end)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0)
+    {
+      i += 16;
+      continue;
+    }
+    for (uint32_t stop = i + 16; i < stop; i++)
+    {
+      if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+      {
+        return i;
+      }
+    }
+  }
+#else
+  while (i < end && ((uintptr_t)(bytes + i) & 3))
+  {
+    if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+    {
+      return i;
+    }
+    i++;
+  }
+  while (i + 4 <= end)
+  {
+    uint32_t word;
+    memcpy(&word, bytes + i, 4);
+    if (((word - 0x01010101) & ~word & 0x80808080) == 0)
+    {
+      i += 4;
+      continue;
+    }
+    for (uint32_t stop = i + 4; i < stop; i++)
+    {
+      if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+      {
+        return i;
+      }
+    }
+  }
+#endif
+
+  for (; i < end; i++)
+  {
+    if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Find the pack start codes (00 00 01 BA) from the current position of f on,
+ * reading MPEG_SCAN_CHUNK_SIZE bytes at a time and carrying the last 3 bytes
+ * of each chunk over to the next. Sets first_pack_offset to the offset of the
+ * first pack relative to the starting position and pack_size to the distance
+ * between the third and the fourth one; both are left alone if the file ends
+ * first. Returns the number of packs found, at most 4.
+ */
+static int mpeg_scan_packs(FILE *f, uint32_t *first_pack_offset, uint32_t *pack_size)
+{
+  int found_pack_count = 0;
+  uint32_t thrid_pack_offset = 0;
+  uint32_t chunk_offset = 0; // offset of scan_buf[0]
+  uint8_t scan_buf[MPEG_SCAN_CHUNK_SIZE];
+  uint16_t kept = 0;
+  size_t bytes_read;
+  while ((found_pack_count < 4) && (bytes_read = fread(scan_buf + kept, 1, sizeof(scan_buf) - kept, f)))
+  {
+    uint16_t length = kept + bytes_read;
+    uint16_t i = 0;
+    int offset;
+    while ((found_pack_count < 4) && ((offset = mpeg_scan_start_code(scan_buf + i, length - i)) != -1))
+    {
+      i += offset;
+      if (i + 3 >= length)
+      {
+        break; // need the code byte from the next chunk
+      }
+      if (scan_buf[i + 3] == 0xBA)
+      {
+        ++found_pack_count;
+        if (found_pack_count == 1)
+        {
+          *first_pack_offset = chunk_offset + i;
+        }
+        else if (found_pack_count == 3)
+        {
+          thrid_pack_offset = chunk_offset + i;
+        }
+        else if (found_pack_count == 4)
+        {
+          *pack_size = chunk_offset + i - thrid_pack_offset;
+        }
+      }
+      i += 3;
+    }
+
+    // carry over the tail so that start codes across chunks are found
+    if (i < length - 3)
+    {
+      i = length - 3;
+    }
+    kept = length - i;
+    memmove(scan_buf, scan_buf + i, kept);
+    chunk_offset += i;
+  }
+  return found_pack_count;
+}
+
+#endif // MPEG_SCAN_H
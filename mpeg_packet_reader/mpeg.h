@@ -4,7 +4,8 @@
 
 #define PRINT_DEBUG_MSG
 
-#define MPEG_START_CODE_PACK_32 0xBA010000
+#include <mpeg_scan.h>
+
 #define MPEG_START_CODE_PACK 0x000001BA
 #define MPEG_START_CODE_SYSTEM_HEADER 0x000001BB
 #define MPEG_PACKET_MASK 0x000001C0
@@ -37,30 +38,7 @@ uint32_t pack_size = 0;
 void mpeg_init(FILE *f)
 {
   fseek(f, 0, SEEK_SET);
-  file_index = 0;
-
-  int found_pack_count = 0;
-  uint32_t thrid_pack_offset = 0;
-  while (fread(&start_code, 4, 1, f) && (found_pack_count < 4))
-  {
-    if (start_code == MPEG_START_CODE_PACK_32)
-    {
-      ++found_pack_count;
-      if (found_pack_count == 1)
-      {
-        first_pack_offset = file_index;
-      }
-      else if (found_pack_count == 3)
-      {
-        thrid_pack_offset = file_index;
-      }
-      else if (found_pack_count == 4)
-      {
-        pack_size = file_index - thrid_pack_offset;
-      }
-    }
-    file_index += 4;
-  }
+  mpeg_scan_packs(f, &first_pack_offset, &pack_size);
 #ifdef PRINT_DEBUG_MSG
   Serial.printf(
       "first_pack_offset: 0x%08X, pack_size: 0x%08X\n",
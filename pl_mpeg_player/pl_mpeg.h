@@ -118,7 +118,8 @@ Data can be supplied to the high level interface, the demuxer and the decoders
 in three different ways:
 
  1. Using plm_create_from_filename() or with a file handle with 
-    plm_create_from_file().
+    plm_create_from_file(). The *_async() variants of these read the file
+    ahead on a separate thread, so that slow reads don't stall decoding.
 
  2. Using plm_create_with_memory() and supplying a pointer to memory that
     contains the whole file.
@@ -184,6 +185,7 @@ typedef struct plm_buffer_t plm_buffer_t;
 typedef struct plm_demux_t plm_demux_t;
 typedef struct plm_video_t plm_video_t;
 typedef struct plm_audio_t plm_audio_t;
+typedef struct plm_scaler_t plm_scaler_t;
 
 
 // Demuxed MPEG PS packet
@@ -218,7 +220,16 @@ typedef struct {
 
 // Decoded Video Frame
 // width and height denote the desired display size of the frame. This may be
-// different from the internal size of the 3 planes.
+// different from the internal size of the 3 planes. skipped_macroblocks is
+// the number of skipped macroblocks that were copied unchanged from a
+// reference frame instead of being predicted one by one. hidden_macroblocks is
+// the number of macroblocks of a B-picture outside the part that was decoded,
+// see plm_video_set_b_picture_rect(). rgb565 is the buffer the frame was
+// already converted into, see plm_video_set_rgb565_target(), or NULL. dirty has
+// one byte per macroblock of macroblock_size pixels, row by row, that is
+// non-zero if the macroblock changed since the frame returned before; a frame
+// that only skips macroblocks without motion changes few. dirty_macroblocks is
+// the number of them, see plm_frame_get_dirty_rects().
 
 typedef struct {
 	double time;
@@ -227,6 +238,12 @@ typedef struct {
 	plm_plane_t y;
 	plm_plane_t cr;
 	plm_plane_t cb;
+	unsigned int skipped_macroblocks;
+	unsigned int hidden_macroblocks;
+	uint16_t *rgb565;
+	uint8_t *dirty;
+	unsigned int dirty_macroblocks;
+	unsigned int macroblock_size;
 } plm_frame_t;
 
 
@@ -237,6 +254,13 @@ typedef void(*plm_video_decode_callback)
 	(plm_t *self, plm_frame_t *frame, void *user);
 
 
+// Callback function type for the luma plane of decoded video frames used by
+// the high-level plm_* interface, see plm_set_video_luma_callback()
+
+typedef void(*plm_video_luma_callback)
+	(plm_t *self, plm_plane_t *luma, void *user);
+
+
 // Decoded Audio Samples
 // Samples are stored as normalized (-1, 1) float either interleaved, or if
 // PLM_AUDIO_SEPARATE_CHANNELS is defined, in two separate arrays.
@@ -269,6 +293,59 @@ typedef void(*plm_audio_decode_callback)
 typedef void(*plm_buffer_load_callback)(plm_buffer_t *self, void *user);
 
 
+// Ways a plm_buffer gets its data, see plm_buffer_get_input_mode()
+
+typedef enum {
+	PLM_INPUT_BUFFER,     // Data written with plm_buffer_write()
+	PLM_INPUT_FILE,       // File streamed with fread()
+	PLM_INPUT_READ_AHEAD, // File streamed by a reader thread
+	PLM_INPUT_MEMORY,     // Memory supplied by the caller
+	PLM_INPUT_PRELOADED,  // Whole file read into memory
+	PLM_INPUT_MAPPED      // Whole file mapped into memory with mmap()
+} plm_input_mode_t;
+
+
+// Which frames plm_decode() may skip when it falls behind, see
+// plm_set_drop_policy()
+
+typedef enum {
+	PLM_DROP_NONE,         // Decode every frame
+	PLM_DROP_LATE_B_FRAMES // Skip B-pictures that are already late
+} plm_drop_policy_t;
+
+
+// Scaling filters for plm_scaler_create()
+
+typedef enum {
+	PLM_SCALE_NEAREST, // Repeat or skip source pixels
+	PLM_SCALE_DOUBLE,  // Exactly twice the source size in both directions
+	PLM_SCALE_BILINEAR // Blend the four nearest source pixels
+} plm_scale_mode_t;
+
+
+// Receiver of the RGB565 strips of plm_frame_to_rgb565_strips(). push is
+// called with each converted strip of width x height pixels at x, y and may
+// start an asynchronous transfer, e.g. with DMA, and return right away. wait is
+// called before a strip buffer is converted into again and must block until
+// no transfer from pixels is pending. wait may be NULL if push is synchronous.
+
+typedef struct {
+	void (*push)(int x, int y, int width, int height, uint16_t *pixels, void *user);
+	void (*wait)(uint16_t *pixels, void *user);
+	void *user;
+} plm_rgb565_sink_t;
+
+
+// Rect of width x height pixels at x, y, see plm_frame_get_dirty_rects()
+
+typedef struct {
+	int x;
+	int y;
+	int width;
+	int height;
+} plm_rect_t;
+
+
 
 // -----------------------------------------------------------------------------
 // plm_* public API
@@ -287,6 +364,21 @@ plm_t *plm_create_with_filename(const char *filename);
 plm_t *plm_create_with_file(FILE *fh, int close_when_done);
 
 
+// Create a plmpeg instance with a filename, loading small files as a whole
+// and reading others ahead on a separate thread, see
+// plm_buffer_create_with_filename_async(). Returns NULL if the file could not
+// be opened.
+
+plm_t *plm_create_with_filename_async(const char *filename);
+
+
+// Create a plmpeg instance with a file handle that is read ahead on a
+// separate thread. Pass TRUE to close_when_done to let plmpeg call fclose()
+// on the handle when plm_destroy() is called.
+
+plm_t *plm_create_with_file_async(FILE *fh, int close_when_done);
+
+
 // Create a plmpeg instance with a pointer to memory as source. This assumes the
 // whole file is in memory. The memory is not copied. Pass TRUE to 
 // free_when_done to let plmpeg call free() on the pointer when plm_destroy() 
@@ -337,6 +429,42 @@ int plm_get_video_enabled(plm_t *self);
 void plm_set_video_enabled(plm_t *self, int enabled);
 
 
+// Set the number of threads that decode video, see
+// plm_video_set_thread_count(). Default 1.
+
+void plm_set_video_thread_count(plm_t *self, int count);
+
+
+// Set whether video is decoded in grayscale, see plm_video_set_grayscale().
+// Default FALSE.
+
+void plm_set_video_grayscale(plm_t *self, int enabled);
+
+
+// Set a buffer that B-pictures are converted into as RGB565 while they are
+// decoded, see plm_video_set_rgb565_target(). Default NULL.
+
+void plm_set_video_rgb565_target(plm_t *self, uint16_t *dest, int stride, int big_endian);
+
+
+// Set the size of decoded frames to 1/factor of the coded size in both
+// directions, see plm_video_set_downscale(). Default 1.
+
+int plm_set_video_downscale(plm_t *self, int factor);
+
+
+// Set the part of the frame that is displayed, to which B-pictures are
+// decoded, see plm_video_set_b_picture_rect(). Default is the whole frame.
+
+void plm_set_video_b_picture_rect(plm_t *self, int x, int y, int width, int height);
+
+
+// Get the fraction of the macroblocks of B-pictures that were not decoded
+// because they lie outside the rect, see plm_video_get_hidden_b_fraction().
+
+double plm_get_video_hidden_b_fraction(plm_t *self);
+
+
 // Get the number of video streams (0--1) reported in the system header.
 
 int plm_get_num_video_streams(plm_t *self);
@@ -393,6 +521,11 @@ double plm_get_time(plm_t *self);
 double plm_get_duration(plm_t *self);
 
 
+// Get how the source data is read, see plm_buffer_get_input_mode().
+
+plm_input_mode_t plm_get_input_mode(plm_t *self);
+
+
 // Rewind all buffers back to the beginning.
 
 void plm_rewind(plm_t *self);
@@ -417,6 +550,14 @@ int plm_has_ended(plm_t *self);
 void plm_set_video_decode_callback(plm_t *self, plm_video_decode_callback fp, void *user);
 
 
+// Set a callback that gets only the luma (Y) plane of decoded video frames in
+// plm_decode() and plm_seek(), meant to go with plm_set_video_grayscale(). The
+// plane is padded to whole macroblocks; plm_get_width/height() give the size
+// to display. If a video decode callback is set as well, it is called first.
+
+void plm_set_video_luma_callback(plm_t *self, plm_video_luma_callback fp, void *user);
+
+
 // Set the callback for decoded audio samples used with plm_decode(). If no 
 // callback is set, audio data will be ignored and not be decoded. The *user
 // Parameter will be passed to your callback.
@@ -426,12 +567,28 @@ void plm_set_audio_decode_callback(plm_t *self, plm_audio_decode_callback fp, vo
 
 // Advance the internal timer by seconds and decode video/audio up to this time.
 // This will call the video_decode_callback and audio_decode_callback any number
-// of times. A frame-skip is not implemented, i.e. everything up to current time
-// will be decoded.
+// of times. Everything up to current time will be decoded, except for the
+// frames that plm_set_drop_policy() allows to skip.
 
 void plm_decode(plm_t *self, double seconds);
 
 
+// Set which frames plm_decode() may skip when it is behind, i.e. when it has
+// to decode more than one frame to reach the requested time. With
+// PLM_DROP_LATE_B_FRAMES, B-pictures that would be followed by another frame
+// within the same call are skipped at the bitstream level, without decoding
+// them. Reference pictures are always decoded. Default PLM_DROP_NONE.
+
+void plm_set_drop_policy(plm_t *self, plm_drop_policy_t policy);
+
+
+// Get the number of frames skipped by the drop policy, and of frames that
+// plm_decode() decoded although the next one was already due.
+
+int plm_get_dropped_frames(plm_t *self);
+int plm_get_late_frames(plm_t *self);
+
+
 // Decode and return one video frame. Returns NULL if no frame could be decoded
 // (either because the source ended or data is corrupt). If you only want to 
 // decode video, you should disable audio via plm_set_audio_enabled().
@@ -468,7 +625,8 @@ int plm_seek(plm_t *self, double time, int seek_exact);
 
 // Similar to plm_seek(), but will not call the video_decode_callback,
 // audio_decode_callback or make any attempts to sync audio.
-// Returns the found frame or NULL if no frame could be found.
+// Returns the found frame or NULL if no frame could be found. All of the
+// found frame is dirty, see plm_frame_get_dirty_rects().
 
 plm_frame_t *plm_seek_frame(plm_t *self, double time, int seek_exact);
 
@@ -486,6 +644,31 @@ plm_frame_t *plm_seek_frame(plm_t *self, double time, int seek_exact);
 #endif
 
 
+// The size and number of chunks that buffers created with
+// plm_buffer_create_with_file_async() keep read ahead
+
+#ifndef PLM_READ_AHEAD_CHUNK_SIZE
+#define PLM_READ_AHEAD_CHUNK_SIZE (16 * 1024)
+#endif
+
+#ifndef PLM_READ_AHEAD_CHUNKS
+#define PLM_READ_AHEAD_CHUNKS 3
+#endif
+
+
+// The largest files that plm_buffer_create_with_filename_async() maps into
+// memory (where mmap() is available) or reads into memory in one go. Larger
+// files are streamed. Define as 0 to always stream.
+
+#ifndef PLM_MMAP_MAX_SIZE
+#define PLM_MMAP_MAX_SIZE (256 * 1024 * 1024)
+#endif
+
+#ifndef PLM_PRELOAD_MAX_SIZE
+#define PLM_PRELOAD_MAX_SIZE (2 * 1024 * 1024)
+#endif
+
+
 // Create a buffer instance with a filename. Returns NULL if the file could not
 // be opened.
 
@@ -498,6 +681,26 @@ plm_buffer_t *plm_buffer_create_with_filename(const char *filename);
 plm_buffer_t *plm_buffer_create_with_file(FILE *fh, int close_when_done);
 
 
+// Create a buffer instance with a filename. Returns NULL if the file could not
+// be opened. A file that fits PLM_MMAP_MAX_SIZE is mapped into memory where
+// mmap() is available, else one that fits PLM_PRELOAD_MAX_SIZE is read into
+// memory in one go if that much can be allocated. Seeking then doesn't touch
+// the file. Larger files are read ahead on a separate thread, see
+// plm_buffer_create_with_file_async().
+
+plm_buffer_t *plm_buffer_create_with_filename_async(const char *filename);
+
+
+// Create a buffer instance with a file handle that a reader thread reads
+// ahead of the decoder, keeping up to PLM_READ_AHEAD_CHUNKS chunks of
+// PLM_READ_AHEAD_CHUNK_SIZE bytes ready, so that a slow read only stalls
+// decoding once all of them are used up. The handle must not be used
+// elsewhere while the buffer exists. Without thread support (or with
+// PLM_NO_THREADS defined) this is the same as plm_buffer_create_with_file().
+
+plm_buffer_t *plm_buffer_create_with_file_async(FILE *fh, int close_when_done);
+
+
 // Create a buffer instance with a pointer to memory as source. This assumes
 // the whole file is in memory. The bytes are not copied. Pass 1 to 
 // free_when_done to let plmpeg call free() on the pointer when plm_destroy() 
@@ -520,6 +723,16 @@ plm_buffer_t *plm_buffer_create_with_capacity(uint32_t capacity);
 plm_buffer_t *plm_buffer_create_for_appending(uint32_t initial_capacity);
 
 
+// Create a buffer that reads packet payloads in place from a source buffer,
+// e.g. the one a demuxer reads from. plm_buffer_write() takes data that lies
+// within the source's buffered bytes and only records where it is, so the
+// data is never copied. The source keeps those bytes until they have been
+// read; if it has to seek, the unread data is copied over. The source must
+// not be destroyed before this buffer.
+
+plm_buffer_t *plm_buffer_create_for_packets(plm_buffer_t *source);
+
+
 // Destroy a buffer instance and free all data
 
 void plm_buffer_destroy(plm_buffer_t *self);
@@ -565,6 +778,18 @@ uint32_t plm_buffer_get_size(plm_buffer_t *self);
 uint32_t plm_buffer_get_remaining(plm_buffer_t *self);
 
 
+// Get how the buffer gets its data.
+
+plm_input_mode_t plm_buffer_get_input_mode(plm_buffer_t *self);
+
+
+// Get the number of bytes that have been examined while searching for start
+// codes. Divided by the number of decoded frames, this shows how much data
+// is scanned per frame.
+
+uint32_t plm_buffer_get_scanned_bytes(plm_buffer_t *self);
+
+
 // Get whether the read position of the buffer is at the end and no more data 
 // is expected.
 
@@ -687,7 +912,7 @@ int plm_video_has_header(plm_video_t *self);
 double plm_video_get_framerate(plm_video_t *self);
 
 
-// Get the display width/height.
+// Get the display width/height, divided by the downscale factor.
 
 int plm_video_get_width(plm_video_t *self);
 int plm_video_get_height(plm_video_t *self);
@@ -700,6 +925,81 @@ int plm_video_get_height(plm_video_t *self);
 void plm_video_set_no_delay(plm_video_t *self, int no_delay);
 
 
+// Set the number of threads that decode the slices of each picture,
+// including the calling one. The others are worker threads: FreeRTOS tasks
+// pinned to the following cores on ESP32, pthreads elsewhere. Returns the
+// number of threads in use, which is 1 if no worker could be started. The
+// default is 1.
+
+int plm_video_set_thread_count(plm_video_t *self, int count);
+
+
+// Skip B-pictures without decoding them as long as the frame after them is
+// due before the given time in seconds; 0 disables this. This is how
+// plm_decode() drops late frames, see plm_set_drop_policy(). Default 0.
+
+void plm_video_set_drop_time(plm_video_t *self, double time);
+
+
+// Get the number of B-pictures skipped with plm_video_set_drop_time().
+
+int plm_video_get_dropped_frames(plm_video_t *self);
+
+
+// Set the size of decoded frames to 1/factor of the coded size in both
+// directions; factor is 1, 2, 4 or 8. Reduced sizes decode with 4x4, 2x2 or
+// DC-only inverse transforms, scaled motion vectors and smaller frames, which
+// cuts transform, motion compensation and frame memory accordingly. Motion
+// compensation at reduced size is not exact, so errors build up until the next
+// intra frame. Changing the factor reallocates the frames and drops the
+// reference frames; set it before decoding. Returns FALSE for an unsupported
+// factor.
+
+int plm_video_set_downscale(plm_video_t *self, int factor);
+
+
+// Set grayscale mode. Chroma coefficients are still parsed to keep in sync with
+// the bitstream, but chroma is neither transformed nor predicted and no memory
+// is allocated for it: the Cr and Cb planes of the frames are empty, with NULL
+// data. Changing the mode reallocates the frames and drops the reference
+// frames; set it before decoding. Default FALSE.
+
+void plm_video_set_grayscale(plm_video_t *self, int enabled);
+
+
+// Set a buffer that B-pictures are converted into as RGB565, macroblock by
+// macroblock right after they are reconstructed, instead of in a separate pass
+// over the returned frame. B-pictures are never used as references, so this
+// saves reading the whole frame back. The rgb565 member of a returned frame is
+// dest if it was converted like that, NULL otherwise; those frames still need
+// plm_frame_to_rgb565() or plm_frame_to_rgb565_be(), matching big_endian. The
+// stride is the width of dest in pixels, dest must hold (stride * height)
+// pixels of the decoded frame. Macroblocks outside the rect of
+// plm_video_set_b_picture_rect() are left out. Not used in grayscale mode.
+// Pass NULL to disable. Default NULL.
+
+void plm_video_set_rgb565_target(plm_video_t *self, uint16_t *dest, int stride, int big_endian);
+
+
+// Set the part of the frame that is displayed, in pixels of the decoded (maybe
+// downscaled) frame; a width or height of 0 selects the whole frame. This only
+// speeds up B-pictures: their slices outside the rect are not parsed and
+// their macroblocks outside it are not reconstructed, which is safe because
+// no other picture is predicted from them. I- and P-pictures are always
+// decoded whole, since motion vectors can carry pixels from anywhere in a
+// reference picture into the rect over the pictures that follow. Pixels of
+// B-pictures outside the rect are undefined.
+
+void plm_video_set_b_picture_rect(plm_video_t *self, int x, int y, int width, int height);
+
+
+// Get the fraction (0--1) of the macroblocks of the B-pictures decoded so far
+// that were outside the rect of plm_video_set_b_picture_rect() and skipped.
+// 0 for streams without B-pictures.
+
+double plm_video_get_hidden_b_fraction(plm_video_t *self);
+
+
 // Get the current internal time in seconds.
 
 double plm_video_get_time(plm_video_t *self);
@@ -735,6 +1035,7 @@ plm_frame_t *plm_video_decode(plm_video_t *self);
 // (frame->width * bytes_per_pixel). The buffer pointed to by *dest must have a
 // size of at least (stride * frame->height).
 // Note that the alpha component of the dest buffer is always left untouched.
+// Frames decoded in grayscale have no chroma and can not be converted.
 
 void plm_frame_to_rgb(plm_frame_t *frame, uint8_t *dest, int stride);
 void plm_frame_to_bgr(plm_frame_t *frame, uint8_t *dest, int stride);
@@ -744,6 +1045,80 @@ void plm_frame_to_argb(plm_frame_t *frame, uint8_t *dest, int stride);
 void plm_frame_to_abgr(plm_frame_t *frame, uint8_t *dest, int stride);
 
 
+// Convert the YCrCb data of a frame into RGB565 pixels, in native byte order or
+// byte swapped (_be) for displays that take the high byte first. The stride
+// is the width of the destination buffer in pixels and must be at least
+// frame->width. The buffer pointed to by *dest must have a size of at least
+// (stride * frame->height) pixels. The _rect variants only convert the given
+// part of the frame into the same place in dest; x and y must be even.
+// Define PLM_RGB565_DITHER to 1 for the implementation to dither the pixels
+// with a 4x4 Bayer matrix instead of truncating them, which hides the banding
+// of smooth gradients. This applies to all RGB565 conversions. Define
+// PLM_RGB565_ARDUINO_GFX_TABLES to 1 instead to convert with the tables of
+// Arduino_GFX, for the colours of its drawYCbCrBitmap().
+
+void plm_frame_to_rgb565(plm_frame_t *frame, uint16_t *dest, int stride);
+void plm_frame_to_rgb565_be(plm_frame_t *frame, uint16_t *dest, int stride);
+void plm_frame_rect_to_rgb565(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride);
+void plm_frame_rect_to_rgb565_be(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride);
+
+
+// Get the parts of a frame that changed since the frame plm_video_decode()
+// returned before, as up to max_rects rects in frame pixels. Dirty macroblocks
+// next to each other in a row, and runs of the same columns in the rows below,
+// make one rect. If more rects are needed, a single one around all dirty
+// macroblocks is returned. Returns the number of rects, 0 if nothing changed.
+// This only covers what is shown if every returned frame is shown.
+
+int plm_frame_get_dirty_rects(plm_frame_t *frame, plm_rect_t *rects, int max_rects);
+
+
+// -----------------------------------------------------------------------------
+// plm_scaler public API
+// Scale frames to another size while converting them to RGB565
+
+
+// Create a scaler from frames of src_width x src_height pixels to dest_width x
+// dest_height pixels. The source and destination positions of every row and
+// column are computed here once. PLM_SCALE_DOUBLE needs a destination of
+// exactly twice the source size. Returns NULL if the sizes are not supported.
+
+plm_scaler_t *plm_scaler_create(int src_width, int src_height, int dest_width, int dest_height, plm_scale_mode_t mode);
+
+
+// Destroy a scaler and free all data.
+
+void plm_scaler_destroy(plm_scaler_t *self);
+
+
+// Scale a frame of the source size and convert it into RGB565 pixels, in
+// native byte order or byte swapped (_be), see plm_frame_to_rgb565(). The
+// stride is the width of the destination buffer in pixels and must be at least
+// dest_width. The buffer pointed to by *dest must have a size of at least
+// (stride * dest_height) pixels.
+
+void plm_scaler_to_rgb565(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride);
+void plm_scaler_to_rgb565_be(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride);
+
+
+// Convert a frame into RGB565 pixels, scaled with scaler or at frame size if
+// scaler is NULL, one strip of strip_height rows at a time, and hand each strip
+// to sink. Two strips are converted into buffers in turn, so it must have a
+// size of at least (2 * width * strip_height) pixels, with width the scaled or
+// the frame width. strip_height must be even and for PLM_SCALE_DOUBLE a
+// multiple of 4; 16 rows match a macroblock row of unscaled frames.
+
+void plm_frame_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink);
+
+
+// Like plm_frame_to_rgb565_strips(), but only convert the parts of the
+// destination that show the given rects of the frame, e.g. the ones from
+// plm_frame_get_dirty_rects(). The strips of each rect are as wide as the rect,
+// and pushed at its place in the destination.
+
+void plm_frame_rects_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, const plm_rect_t *rects, int count, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink);
+
+
 // -----------------------------------------------------------------------------
 // plm_audio public API
 // Decode MPEG-1 Audio Layer II ("mp2") data into raw samples
@@ -819,6 +1194,38 @@ plm_samples_t *plm_audio_decode(plm_audio_t *self);
 
 #include <string.h>
 #include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#if !defined(PLM_NO_THREADS)
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#define PLM_THREADS_FREERTOS
+#elif defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define PLM_THREADS_PTHREAD
+#endif
+#endif
+
+#if !defined(PLM_NO_MMAP) && !defined(ESP_PLATFORM) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define PLM_HAVE_MMAP
+// fileno() is POSIX, not C99. <stdio.h> was included before this point, so
+// _POSIX_C_SOURCE would come too late; declare it if it is not a macro.
+#if !defined(fileno)
+#ifdef __cplusplus
+extern "C" int fileno(FILE *stream);
+#else
+int fileno(FILE *stream);
+#endif
+#endif
+#endif
 
 #ifndef TRUE
 #define TRUE 1
@@ -839,6 +1246,7 @@ plm_samples_t *plm_audio_decode(plm_audio_t *self);
 
 struct plm_t {
 	plm_demux_t *demux;
+	plm_buffer_t *demux_buffer; // Source of the video and audio packet chains
 	double time;
 	int has_ended;
 	int loop;
@@ -846,6 +1254,18 @@ struct plm_t {
 
 	int video_enabled;
 	int video_packet_type;
+	int video_thread_count;
+	int video_downscale;
+	int video_visible_x;
+	int video_visible_y;
+	int video_visible_width;
+	int video_visible_height;
+	int video_grayscale;
+	uint16_t *video_rgb565_target;
+	int video_rgb565_stride;
+	int video_rgb565_big_endian;
+	plm_drop_policy_t drop_policy;
+	int late_frames;
 	plm_buffer_t *video_buffer;
 	plm_video_t *video_decoder;
 
@@ -859,15 +1279,20 @@ struct plm_t {
 	plm_video_decode_callback video_decode_callback;
 	void *video_decode_callback_user_data;
 
+	plm_video_luma_callback video_luma_callback;
+	void *video_luma_callback_user_data;
+
 	plm_audio_decode_callback audio_decode_callback;
 	void *audio_decode_callback_user_data;
 };
 
 int plm_init_decoders(plm_t *self);
+void plm_video_callback(plm_t *self, plm_frame_t *frame);
 void plm_handle_end(plm_t *self);
 void plm_read_video_packet(plm_buffer_t *buffer, void *user);
 void plm_read_audio_packet(plm_buffer_t *buffer, void *user);
 void plm_read_packets(plm_t *self, int requested_type);
+void plm_buffer_detach(plm_buffer_t *self);
 
 plm_t *plm_create_with_filename(const char *filename) {
 	plm_buffer_t *buffer = plm_buffer_create_with_filename(filename);
@@ -882,6 +1307,19 @@ plm_t *plm_create_with_file(FILE *fh, int close_when_done) {
 	return plm_create_with_buffer(buffer, TRUE);
 }
 
+plm_t *plm_create_with_filename_async(const char *filename) {
+	plm_buffer_t *buffer = plm_buffer_create_with_filename_async(filename);
+	if (!buffer) {
+		return NULL;
+	}
+	return plm_create_with_buffer(buffer, TRUE);
+}
+
+plm_t *plm_create_with_file_async(FILE *fh, int close_when_done) {
+	plm_buffer_t *buffer = plm_buffer_create_with_file_async(fh, close_when_done);
+	return plm_create_with_buffer(buffer, TRUE);
+}
+
 plm_t *plm_create_with_memory(uint8_t *bytes, uint32_t length, int free_when_done) {
 	plm_buffer_t *buffer = plm_buffer_create_with_memory(bytes, length, free_when_done);
 	return plm_create_with_buffer(buffer, TRUE);
@@ -892,6 +1330,7 @@ plm_t *plm_create_with_buffer(plm_buffer_t *buffer, int destroy_when_done) {
 	memset(self, 0, sizeof(plm_t));
 
 	self->demux = plm_demux_create(buffer, destroy_when_done);
+	self->demux_buffer = buffer;
 	self->video_enabled = TRUE;
 	self->audio_enabled = TRUE;
 	plm_init_decoders(self);
@@ -913,9 +1352,28 @@ int plm_init_decoders(plm_t *self) {
 			self->video_packet_type = PLM_DEMUX_PACKET_VIDEO_1;
 		}
 		if (!self->video_decoder) {
-			self->video_buffer = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
+			self->video_buffer = plm_buffer_create_for_packets(self->demux_buffer);
 			plm_buffer_set_load_callback(self->video_buffer, plm_read_video_packet, self);
 			self->video_decoder = plm_video_create_with_buffer(self->video_buffer, TRUE);
+			if (self->video_thread_count > 1) {
+				plm_video_set_thread_count(self->video_decoder, self->video_thread_count);
+			}
+			if (self->video_downscale > 1) {
+				plm_video_set_downscale(self->video_decoder, self->video_downscale);
+			}
+			if (self->video_grayscale) {
+				plm_video_set_grayscale(self->video_decoder, TRUE);
+			}
+			if (self->video_rgb565_target) {
+				plm_video_set_rgb565_target(
+					self->video_decoder, self->video_rgb565_target,
+					self->video_rgb565_stride, self->video_rgb565_big_endian);
+			}
+			if (self->video_visible_width > 0) {
+				plm_video_set_b_picture_rect(
+					self->video_decoder, self->video_visible_x, self->video_visible_y,
+					self->video_visible_width, self->video_visible_height);
+			}
 		}
 	}
 
@@ -924,7 +1382,7 @@ int plm_init_decoders(plm_t *self) {
 			self->audio_packet_type = PLM_DEMUX_PACKET_AUDIO_1 + self->audio_stream_index;
 		}
 		if (!self->audio_decoder) {
-			self->audio_buffer = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
+			self->audio_buffer = plm_buffer_create_for_packets(self->demux_buffer);
 			plm_buffer_set_load_callback(self->audio_buffer, plm_read_audio_packet, self);
 			self->audio_decoder = plm_audio_create_with_buffer(self->audio_buffer, TRUE);
 		}
@@ -986,7 +1444,11 @@ void plm_set_audio_enabled(plm_t *self, int enabled) {
 	self->audio_enabled = enabled;
 
 	if (!enabled) {
+		// Pending packets must not hold on to demux data while disabled
 		self->audio_packet_type = 0;
+		if (self->audio_buffer) {
+			plm_buffer_detach(self->audio_buffer);
+		}
 		return;
 	}
 
@@ -1013,7 +1475,11 @@ void plm_set_video_enabled(plm_t *self, int enabled) {
 	self->video_enabled = enabled;
 
 	if (!enabled) {
+		// Pending packets must not hold on to demux data while disabled
 		self->video_packet_type = 0;
+		if (self->video_buffer) {
+			plm_buffer_detach(self->video_buffer);
+		}
 		return;
 	}
 
@@ -1022,6 +1488,58 @@ void plm_set_video_enabled(plm_t *self, int enabled) {
 		: 0;
 }
 
+void plm_set_video_thread_count(plm_t *self, int count) {
+	self->video_thread_count = count;
+	if (self->video_decoder) {
+		plm_video_set_thread_count(self->video_decoder, count);
+	}
+}
+
+void plm_set_video_grayscale(plm_t *self, int enabled) {
+	self->video_grayscale = enabled;
+	if (self->video_decoder) {
+		plm_video_set_grayscale(self->video_decoder, enabled);
+	}
+}
+
+void plm_set_video_rgb565_target(plm_t *self, uint16_t *dest, int stride, int big_endian) {
+	self->video_rgb565_target = dest;
+	self->video_rgb565_stride = stride;
+	self->video_rgb565_big_endian = big_endian;
+	if (self->video_decoder) {
+		plm_video_set_rgb565_target(self->video_decoder, dest, stride, big_endian);
+	}
+}
+
+int plm_set_video_downscale(plm_t *self, int factor) {
+	if (self->video_decoder) {
+		if (!plm_video_set_downscale(self->video_decoder, factor)) {
+			return FALSE;
+		}
+	}
+	else if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+		return FALSE;
+	}
+	self->video_downscale = factor;
+	return TRUE;
+}
+
+void plm_set_video_b_picture_rect(plm_t *self, int x, int y, int width, int height) {
+	self->video_visible_x = x;
+	self->video_visible_y = y;
+	self->video_visible_width = width;
+	self->video_visible_height = height;
+	if (self->video_decoder) {
+		plm_video_set_b_picture_rect(self->video_decoder, x, y, width, height);
+	}
+}
+
+double plm_get_video_hidden_b_fraction(plm_t *self) {
+	return self->video_decoder
+		? plm_video_get_hidden_b_fraction(self->video_decoder)
+		: 0;
+}
+
 int plm_get_num_video_streams(plm_t *self) {
 	return plm_demux_get_num_video_streams(self->demux);
 }
@@ -1066,6 +1584,10 @@ double plm_get_time(plm_t *self) {
 	return self->time;
 }
 
+plm_input_mode_t plm_get_input_mode(plm_t *self) {
+	return plm_buffer_get_input_mode(self->demux_buffer);
+}
+
 double plm_get_duration(plm_t *self) {
 	return plm_demux_get_duration(self->demux, PLM_DEMUX_PACKET_VIDEO_1);
 }
@@ -1100,6 +1622,11 @@ void plm_set_video_decode_callback(plm_t *self, plm_video_decode_callback fp, vo
 	self->video_decode_callback_user_data = user;
 }
 
+void plm_set_video_luma_callback(plm_t *self, plm_video_luma_callback fp, void *user) {
+	self->video_luma_callback = fp;
+	self->video_luma_callback_user_data = user;
+}
+
 void plm_set_audio_decode_callback(plm_t *self, plm_audio_decode_callback fp, void *user) {
 	self->audio_decode_callback = fp;
 	self->audio_decode_callback_user_data = user;
@@ -1110,7 +1637,10 @@ void plm_decode(plm_t *self, double tick) {
 		return;
 	}
 
-	int decode_video = (self->video_decode_callback && self->video_packet_type);
+	int decode_video = (
+		(self->video_decode_callback || self->video_luma_callback) &&
+		self->video_packet_type
+	);
 	int decode_audio = (self->audio_decode_callback && self->audio_packet_type);
 
 	if (!decode_video && !decode_audio) {
@@ -1125,13 +1655,22 @@ void plm_decode(plm_t *self, double tick) {
 	double video_target_time = self->time + tick;
 	double audio_target_time = self->time + tick + self->audio_lead_time;
 
+	int drop = decode_video && self->drop_policy == PLM_DROP_LATE_B_FRAMES;
+	if (drop) {
+		plm_video_set_drop_time(self->video_decoder, video_target_time);
+	}
+
 	do {
 		did_decode = FALSE;
 		
 		if (decode_video && plm_video_get_time(self->video_decoder) < video_target_time) {
 			plm_frame_t *frame = plm_video_decode(self->video_decoder);
 			if (frame) {
-				self->video_decode_callback(self, frame, self->video_decode_callback_user_data);
+				// The next frame is due within this call as well
+				if (plm_video_get_time(self->video_decoder) < video_target_time) {
+					self->late_frames++;
+				}
+				plm_video_callback(self, frame);
 				did_decode = TRUE;
 			}
 			else {
@@ -1151,6 +1690,10 @@ void plm_decode(plm_t *self, double tick) {
 		}
 	} while (did_decode);
 	
+	if (drop) {
+		plm_video_set_drop_time(self->video_decoder, 0);
+	}
+
 	// Did all sources we wanted to decode fail and the demuxer is at the end?
 	if (
 		(!decode_video || decode_video_failed) && 
@@ -1164,6 +1707,29 @@ void plm_decode(plm_t *self, double tick) {
 	self->time += tick;
 }
 
+void plm_set_drop_policy(plm_t *self, plm_drop_policy_t policy) {
+	self->drop_policy = policy;
+}
+
+int plm_get_dropped_frames(plm_t *self) {
+	return self->video_decoder
+		? plm_video_get_dropped_frames(self->video_decoder)
+		: 0;
+}
+
+int plm_get_late_frames(plm_t *self) {
+	return self->late_frames;
+}
+
+void plm_video_callback(plm_t *self, plm_frame_t *frame) {
+	if (self->video_decode_callback) {
+		self->video_decode_callback(self, frame, self->video_decode_callback_user_data);
+	}
+	if (self->video_luma_callback) {
+		self->video_luma_callback(self, &frame->y, self->video_luma_callback_user_data);
+	}
+}
+
 plm_frame_t *plm_decode_video(plm_t *self) {
 	if (!plm_init_decoders(self)) {
 		return NULL;
@@ -1296,6 +1862,11 @@ plm_frame_t *plm_seek_frame(plm_t *self, double time, int seek_exact) {
 	self->audio_packet_type = previous_audio_packet_type;
 
 	if (frame) {
+		// Frames decoded on the way were never shown, so the whole frame is
+		// dirty
+		unsigned int size = frame->macroblock_size;
+		frame->dirty_macroblocks = ((frame->width + size - 1) / size) * ((frame->height + size - 1) / size);
+		memset(frame->dirty, 1, frame->dirty_macroblocks);
 		self->time = frame->time;
 	}
 
@@ -1310,9 +1881,7 @@ int plm_seek(plm_t *self, double time, int seek_exact) {
 		return FALSE;
 	}
 
-	if (self->video_decode_callback) {
-		self->video_decode_callback(self, frame, self->video_decode_callback_user_data);	
-	}
+	plm_video_callback(self, frame);
 
 	// If audio is not enabled we are done here.
 	if (!self->audio_packet_type) {
@@ -1348,57 +1917,568 @@ int plm_seek(plm_t *self, double time, int seek_exact) {
 
 
 // -----------------------------------------------------------------------------
-// plm_buffer implementation
+// plm_read_ahead implementation
 
-enum plm_buffer_mode {
-	PLM_BUFFER_MODE_FILE,
-	PLM_BUFFER_MODE_FIXED_MEM,
-	PLM_BUFFER_MODE_RING,
-	PLM_BUFFER_MODE_APPEND
-};
+// A reader thread reads chunks of a file ahead of the decoder. free_chunks
+// counts the chunks the reader may fill, filled_chunks the ones the decoder
+// may take; a chunk of length 0 marks the end of the file. Threads are
+// FreeRTOS tasks on ESP32 and pthreads elsewhere; without either, creating a
+// read-ahead fails and file buffers read synchronously. The core given to
+// plm_thread_create() counts from the core of the calling task, -1 for any;
+// it only applies to FreeRTOS.
 
-struct plm_buffer_t {
-	uint32_t bit_index;
-	uint32_t capacity;
-	uint32_t length;
-	uint32_t total_size;
-	int discard_read_bytes;
-	int has_ended;
-	int free_when_done;
-	int close_when_done;
-	FILE *fh;
-	plm_buffer_load_callback load_callback;
-	void *load_callback_user_data;
-	uint8_t *bytes;
-	enum plm_buffer_mode mode;
-};
+#if defined(PLM_THREADS_FREERTOS)
+
+#ifndef PLM_THREAD_STACK_SIZE
+#define PLM_THREAD_STACK_SIZE 4096
+#endif
+
+#ifndef PLM_THREAD_PRIORITY
+#define PLM_THREAD_PRIORITY (tskIDLE_PRIORITY + 2)
+#endif
+
+#define PLM_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PLM_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define PLM_ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
 
 typedef struct {
-	int16_t index;
-	int16_t value;
-} plm_vlc_t;
+	SemaphoreHandle_t handle;
+} plm_semaphore_t;
 
 typedef struct {
-	int16_t index;
-	uint16_t value;
-} plm_vlc_uint_t;
+	TaskHandle_t task;
+	SemaphoreHandle_t done;
+	void (*entry)(void *arg);
+	void *arg;
+} plm_thread_t;
 
+#elif defined(PLM_THREADS_PTHREAD)
 
-void plm_buffer_seek(plm_buffer_t *self, uint32_t pos);
-uint32_t plm_buffer_tell(plm_buffer_t *self);
-void plm_buffer_discard_read_bytes(plm_buffer_t *self);
-void plm_buffer_load_file_callback(plm_buffer_t *self, void *user);
+#define PLM_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PLM_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define PLM_ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
 
-int plm_buffer_has(plm_buffer_t *self, uint32_t count);
-int plm_buffer_read(plm_buffer_t *self, int count);
-void plm_buffer_align(plm_buffer_t *self);
-void plm_buffer_skip(plm_buffer_t *self, uint32_t count);
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;
+} plm_semaphore_t;
+
+typedef struct {
+	pthread_t thread;
+	void (*entry)(void *arg);
+	void *arg;
+} plm_thread_t;
+
+#else
+
+#define PLM_ATOMIC_LOAD(p) (*(p))
+#define PLM_ATOMIC_STORE(p, v) (*(p) = (v))
+#define PLM_ATOMIC_FETCH_ADD(p, v) ((*(p) += (v)) - (v))
+
+typedef struct {
+	int count;
+} plm_semaphore_t;
+
+typedef struct {
+	void (*entry)(void *arg);
+	void *arg;
+} plm_thread_t;
+
+#endif
+
+typedef struct plm_read_ahead_t plm_read_ahead_t;
+
+struct plm_read_ahead_t {
+	FILE *fh;
+	uint8_t *chunks;
+	uint32_t *chunk_lengths;
+	uint32_t chunk_size;
+	int chunk_count;
+	plm_semaphore_t free_chunks;
+	plm_semaphore_t filled_chunks;
+	plm_thread_t thread;
+	int is_running;
+	int stop;
+
+	// Reader side: the next chunk to fill and the file offset it is read from
+	int write_index;
+	uint32_t read_pos;
+
+	// Decoder side: the chunk being taken, how much of it has been taken, and
+	// the file offset of the next byte handed out
+	int read_index;
+	int has_chunk;
+	uint32_t chunk_offset;
+	int has_ended;
+	uint32_t position;
+};
+
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg);
+void plm_thread_join(plm_thread_t *self);
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count);
+void plm_semaphore_destroy(plm_semaphore_t *self);
+void plm_semaphore_wait(plm_semaphore_t *self);
+int plm_semaphore_try_wait(plm_semaphore_t *self);
+void plm_semaphore_post(plm_semaphore_t *self);
+
+int plm_read_ahead_start(plm_read_ahead_t *self);
+void plm_read_ahead_stop(plm_read_ahead_t *self);
+void plm_read_ahead_thread(void *arg);
+plm_read_ahead_t *plm_read_ahead_create(FILE *fh);
+void plm_read_ahead_destroy(plm_read_ahead_t *self);
+uint32_t plm_read_ahead_read(plm_read_ahead_t *self, uint8_t *dest, uint32_t length);
+void plm_read_ahead_seek(plm_read_ahead_t *self, uint32_t pos);
+
+#if defined(PLM_THREADS_FREERTOS)
+
+void plm_thread_main(void *arg) {
+	plm_thread_t *self = (plm_thread_t *)arg;
+	self->entry(self->arg);
+	xSemaphoreGive(self->done);
+	vTaskDelete(NULL);
+}
+
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg) {
+	self->entry = entry;
+	self->arg = arg;
+	self->done = xSemaphoreCreateBinary();
+	if (!self->done) {
+		return FALSE;
+	}
+	BaseType_t core_id = core < 0
+		? tskNO_AFFINITY
+		: (BaseType_t)((xPortGetCoreID() + core) % portNUM_PROCESSORS);
+	if (xTaskCreatePinnedToCore(plm_thread_main, name, PLM_THREAD_STACK_SIZE, self, PLM_THREAD_PRIORITY, &self->task, core_id) != pdPASS) {
+		vSemaphoreDelete(self->done);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void plm_thread_join(plm_thread_t *self) {
+	xSemaphoreTake(self->done, portMAX_DELAY);
+	vSemaphoreDelete(self->done);
+}
+
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count) {
+	self->handle = xSemaphoreCreateCounting(max_count, count);
+	return self->handle != NULL;
+}
+
+void plm_semaphore_destroy(plm_semaphore_t *self) {
+	vSemaphoreDelete(self->handle);
+}
+
+void plm_semaphore_wait(plm_semaphore_t *self) {
+	xSemaphoreTake(self->handle, portMAX_DELAY);
+}
+
+int plm_semaphore_try_wait(plm_semaphore_t *self) {
+	return xSemaphoreTake(self->handle, 0) == pdTRUE;
+}
+
+void plm_semaphore_post(plm_semaphore_t *self) {
+	xSemaphoreGive(self->handle);
+}
+
+#elif defined(PLM_THREADS_PTHREAD)
+
+void *plm_thread_main(void *arg) {
+	plm_thread_t *self = (plm_thread_t *)arg;
+	self->entry(self->arg);
+	return NULL;
+}
+
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg) {
+	PLM_UNUSED(name);
+	PLM_UNUSED(core);
+	self->entry = entry;
+	self->arg = arg;
+	return pthread_create(&self->thread, NULL, plm_thread_main, self) == 0;
+}
+
+void plm_thread_join(plm_thread_t *self) {
+	pthread_join(self->thread, NULL);
+}
+
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count) {
+	PLM_UNUSED(max_count);
+	self->count = count;
+	if (pthread_mutex_init(&self->mutex, NULL) != 0) {
+		return FALSE;
+	}
+	if (pthread_cond_init(&self->cond, NULL) != 0) {
+		pthread_mutex_destroy(&self->mutex);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void plm_semaphore_destroy(plm_semaphore_t *self) {
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->mutex);
+}
+
+void plm_semaphore_wait(plm_semaphore_t *self) {
+	pthread_mutex_lock(&self->mutex);
+	while (self->count == 0) {
+		pthread_cond_wait(&self->cond, &self->mutex);
+	}
+	self->count--;
+	pthread_mutex_unlock(&self->mutex);
+}
+
+int plm_semaphore_try_wait(plm_semaphore_t *self) {
+	pthread_mutex_lock(&self->mutex);
+	int taken = self->count > 0;
+	if (taken) {
+		self->count--;
+	}
+	pthread_mutex_unlock(&self->mutex);
+	return taken;
+}
+
+void plm_semaphore_post(plm_semaphore_t *self) {
+	pthread_mutex_lock(&self->mutex);
+	self->count++;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->mutex);
+}
+
+#else
+
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg) {
+	PLM_UNUSED(self);
+	PLM_UNUSED(name);
+	PLM_UNUSED(core);
+	PLM_UNUSED(entry);
+	PLM_UNUSED(arg);
+	return FALSE;
+}
+
+void plm_thread_join(plm_thread_t *self) {
+	PLM_UNUSED(self);
+}
+
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count) {
+	PLM_UNUSED(max_count);
+	self->count = count;
+	return TRUE;
+}
+
+void plm_semaphore_destroy(plm_semaphore_t *self) {
+	PLM_UNUSED(self);
+}
+
+void plm_semaphore_wait(plm_semaphore_t *self) {
+	self->count--;
+}
+
+int plm_semaphore_try_wait(plm_semaphore_t *self) {
+	if (self->count == 0) {
+		return FALSE;
+	}
+	self->count--;
+	return TRUE;
+}
+
+void plm_semaphore_post(plm_semaphore_t *self) {
+	self->count++;
+}
+
+#endif
+
+plm_read_ahead_t *plm_read_ahead_create(FILE *fh) {
+	plm_read_ahead_t *self = (plm_read_ahead_t *)PLM_MALLOC(sizeof(plm_read_ahead_t));
+	memset(self, 0, sizeof(plm_read_ahead_t));
+	self->fh = fh;
+	self->chunk_size = PLM_READ_AHEAD_CHUNK_SIZE;
+	self->chunk_count = PLM_READ_AHEAD_CHUNKS;
+	self->chunks = (uint8_t *)PLM_MALLOC(self->chunk_size * self->chunk_count);
+	self->chunk_lengths = (uint32_t *)PLM_MALLOC(sizeof(uint32_t) * self->chunk_count);
+	self->read_pos = ftell(fh);
+	self->position = self->read_pos;
+
+	if (!plm_read_ahead_start(self)) {
+		plm_read_ahead_destroy(self);
+		return NULL;
+	}
+	return self;
+}
+
+void plm_read_ahead_destroy(plm_read_ahead_t *self) {
+	plm_read_ahead_stop(self);
+	PLM_FREE(self->chunk_lengths);
+	PLM_FREE(self->chunks);
+	PLM_FREE(self);
+}
+
+int plm_read_ahead_start(plm_read_ahead_t *self) {
+	self->write_index = 0;
+	self->read_index = 0;
+	self->has_chunk = FALSE;
+	self->chunk_offset = 0;
+	self->has_ended = FALSE;
+	self->stop = FALSE;
+
+	if (!plm_semaphore_init(&self->free_chunks, self->chunk_count, self->chunk_count)) {
+		return FALSE;
+	}
+	if (!plm_semaphore_init(&self->filled_chunks, 0, self->chunk_count)) {
+		plm_semaphore_destroy(&self->free_chunks);
+		return FALSE;
+	}
+	if (!plm_thread_create(&self->thread, "plm_read_ahead", -1, plm_read_ahead_thread, self)) {
+		plm_semaphore_destroy(&self->filled_chunks);
+		plm_semaphore_destroy(&self->free_chunks);
+		return FALSE;
+	}
+	self->is_running = TRUE;
+	return TRUE;
+}
+
+void plm_read_ahead_stop(plm_read_ahead_t *self) {
+	if (!self->is_running) {
+		return;
+	}
+
+	// Wake the reader if it waits for a free chunk; a read in progress is
+	// finished first.
+	PLM_ATOMIC_STORE(&self->stop, TRUE);
+	plm_semaphore_post(&self->free_chunks);
+	plm_thread_join(&self->thread);
+
+	plm_semaphore_destroy(&self->filled_chunks);
+	plm_semaphore_destroy(&self->free_chunks);
+	self->is_running = FALSE;
+}
+
+void plm_read_ahead_seek(plm_read_ahead_t *self, uint32_t pos) {
+	plm_read_ahead_stop(self);
+	fseek(self->fh, pos, SEEK_SET);
+	self->read_pos = pos;
+	self->position = pos;
+
+	// If the reader can't be restarted, plm_read_ahead_read() reads directly
+	plm_read_ahead_start(self);
+}
+
+void plm_read_ahead_thread(void *arg) {
+	plm_read_ahead_t *self = (plm_read_ahead_t *)arg;
+	for (;;) {
+		plm_semaphore_wait(&self->free_chunks);
+		if (PLM_ATOMIC_LOAD(&self->stop)) {
+			break;
+		}
+
+		// Read up to the next chunk_size boundary of the file, so that reads stay
+		// aligned after seeking to an arbitrary position.
+		uint32_t requested = self->chunk_size - self->read_pos % self->chunk_size;
+		uint8_t *chunk = self->chunks + self->write_index * self->chunk_size;
+		uint32_t bytes_read = fread(chunk, 1, requested, self->fh);
+		self->read_pos += bytes_read;
+		self->chunk_lengths[self->write_index] = bytes_read;
+		self->write_index = (self->write_index + 1) % self->chunk_count;
+		plm_semaphore_post(&self->filled_chunks);
+
+		if (bytes_read == 0) {
+			break;
+		}
+	}
+}
+
+uint32_t plm_read_ahead_read(plm_read_ahead_t *self, uint8_t *dest, uint32_t length) {
+	if (!self->is_running) {
+		uint32_t bytes_read = fread(dest, 1, length, self->fh);
+		self->position += bytes_read;
+		return bytes_read;
+	}
+
+	uint32_t total = 0;
+	while (total < length && !self->has_ended) {
+		if (!self->has_chunk) {
+			// Only wait for the reader while there is nothing to hand out yet
+			if (total == 0) {
+				plm_semaphore_wait(&self->filled_chunks);
+			}
+			else if (!plm_semaphore_try_wait(&self->filled_chunks)) {
+				break;
+			}
+			self->has_chunk = TRUE;
+			self->chunk_offset = 0;
+		}
+
+		uint32_t chunk_length = self->chunk_lengths[self->read_index];
+		if (chunk_length == 0) {
+			self->has_ended = TRUE;
+			break;
+		}
+
+		uint32_t count = chunk_length - self->chunk_offset;
+		if (count > length - total) {
+			count = length - total;
+		}
+		uint8_t *chunk = self->chunks + self->read_index * self->chunk_size;
+		memcpy(dest + total, chunk + self->chunk_offset, count);
+		total += count;
+		self->chunk_offset += count;
+		self->position += count;
+
+		if (self->chunk_offset == chunk_length) {
+			self->has_chunk = FALSE;
+			self->read_index = (self->read_index + 1) % self->chunk_count;
+			plm_semaphore_post(&self->free_chunks);
+		}
+	}
+	return total;
+}
+
+
+
+// -----------------------------------------------------------------------------
+// plm_buffer implementation
+
+enum plm_buffer_mode {
+	PLM_BUFFER_MODE_FILE,
+	PLM_BUFFER_MODE_FIXED_MEM,
+	PLM_BUFFER_MODE_RING,
+	PLM_BUFFER_MODE_APPEND,
+	PLM_BUFFER_MODE_CHAIN
+};
+
+// A packet chain buffer (PLM_BUFFER_MODE_CHAIN) reads its data from spans
+// of a source buffer. offset is relative to the start of the source's data
+// (see base_offset); data is set once the span had to be copied.
+#ifndef PLM_BUFFER_INITIAL_SPANS
+#define PLM_BUFFER_INITIAL_SPANS 16
+#endif
+
+typedef struct {
+	uint32_t offset;
+	uint32_t length;
+	uint8_t *data;
+} plm_buffer_span_t;
+
+struct plm_buffer_t {
+	uint32_t bit_index;
+	uint32_t capacity;
+	uint32_t length;
+	uint32_t total_size;
+	int discard_read_bytes;
+	int has_ended;
+	int free_when_done;
+	int close_when_done;
+	FILE *fh;
+	plm_read_ahead_t *read_ahead;
+	plm_buffer_load_callback load_callback;
+	void *load_callback_user_data;
+	uint8_t *bytes;
+	enum plm_buffer_mode mode;
+	plm_input_mode_t input_mode;
+
+	// Bit reservoir: up to 64 bits starting at byte bit_cache_start >> 3,
+	// valid for bit positions [bit_cache_start, bit_cache_end).
+	uint64_t bit_cache;
+	uint32_t bit_cache_start;
+	uint32_t bit_cache_end;
+
+	// Start code index: written bytes below index_scanned have been scanned for
+	// index_code (-1 if disabled); index_last is the byte offset of the last
+	// one found, or -1.
+	int index_code;
+	int index_last;
+	uint32_t index_scanned;
+	uint32_t scanned_bytes;
+
+	// Number of bytes discarded from the front since the last seek; packet
+	// chains reading from this buffer are linked through consumers.
+	uint32_t base_offset;
+	plm_buffer_t *consumers;
+
+	// Packet chain: spans in source, and the span found by the last lookup
+	plm_buffer_t *source;
+	plm_buffer_t *next_consumer;
+	plm_buffer_span_t *spans;
+	uint32_t span_count;
+	uint32_t span_capacity;
+	uint32_t span_cursor;
+	uint32_t span_cursor_start;
+};
+
+typedef struct {
+	int16_t index;
+	int16_t value;
+} plm_vlc_t;
+
+typedef struct {
+	int16_t index;
+	uint16_t value;
+} plm_vlc_uint_t;
+
+// Lookup table decoding of the plm_vlc_t trees. The first PLM_VLC_LOOKUP_BITS
+// bits of a code index the primary table; longer codes link to a second-level
+// table indexed by the remaining bits.
+#ifndef PLM_VLC_LOOKUP_BITS
+#define PLM_VLC_LOOKUP_BITS 8
+#endif
+
+typedef struct {
+	int16_t value;	// Decoded value, or offset of the second-level table
+	uint8_t length; // Code length in bits; 0 for a second-level link
+	uint8_t bits;		// Index width of the linked second-level table
+} plm_vlc_lookup_entry_t;
+
+typedef struct {
+	const plm_vlc_t *table;
+	int bits;
+	int max_length;
+	plm_vlc_lookup_entry_t *entries;
+} plm_vlc_lookup_t;
+
+
+void plm_buffer_seek(plm_buffer_t *self, uint32_t pos);
+uint32_t plm_buffer_tell(plm_buffer_t *self);
+void plm_buffer_discard_read_bytes(plm_buffer_t *self);
+void plm_buffer_index_start_code(plm_buffer_t *self, int code);
+void plm_buffer_update_index(plm_buffer_t *self);
+uint32_t plm_buffer_write_span(plm_buffer_t *self, uint8_t *bytes, uint32_t length);
+uint32_t plm_buffer_drop_spans(plm_buffer_t *self, uint32_t byte_pos);
+void plm_buffer_clear_spans(plm_buffer_t *self);
+uint8_t *plm_buffer_get_span_bytes(plm_buffer_t *self, uint32_t pos, uint32_t *available);
+uint8_t plm_buffer_get_byte(plm_buffer_t *self, uint32_t pos);
+int plm_buffer_scan_start_code(plm_buffer_t *self, uint32_t pos, uint32_t positions);
+uint32_t plm_buffer_get_retained_offset(plm_buffer_t *self, uint32_t byte_pos);
+void plm_buffer_detach_consumers(plm_buffer_t *self);
+void plm_buffer_load_file_callback(plm_buffer_t *self, void *user);
+plm_buffer_t *plm_buffer_create_with_whole_file(FILE *fh);
+
+int plm_buffer_has(plm_buffer_t *self, uint32_t count);
+void plm_buffer_refill(plm_buffer_t *self);
+void plm_buffer_invalidate_cache(plm_buffer_t *self);
+int plm_buffer_peek(plm_buffer_t *self, int count);
+int plm_buffer_fill_cache(plm_buffer_t *self, int count);
+int plm_buffer_read(plm_buffer_t *self, int count);
+void plm_buffer_align(plm_buffer_t *self);
+void plm_buffer_skip(plm_buffer_t *self, uint32_t count);
 int plm_buffer_skip_bytes(plm_buffer_t *self, uint8_t v);
 int plm_buffer_next_start_code(plm_buffer_t *self);
+int plm_buffer_next_start_code_append(plm_buffer_t *self, uint8_t **bytes, uint32_t *length, uint32_t *capacity);
+void plm_buffer_append_bytes(plm_buffer_t *self, uint32_t pos, uint32_t count, uint8_t **bytes, uint32_t *length, uint32_t *capacity);
+void plm_buffer_reset_memory(plm_buffer_t *self, uint8_t *bytes, uint32_t length);
+int plm_scan_start_code(const uint8_t *bytes, uint32_t length);
 int plm_buffer_find_start_code(plm_buffer_t *self, int code);
+int plm_buffer_peek_start_code(plm_buffer_t *self);
 int plm_buffer_no_start_code(plm_buffer_t *self);
+int plm_buffer_has_indexed_start_code(plm_buffer_t *self);
 int16_t plm_buffer_read_vlc(plm_buffer_t *self, const plm_vlc_t *table);
 uint16_t plm_buffer_read_vlc_uint(plm_buffer_t *self, const plm_vlc_uint_t *table);
+int16_t plm_buffer_read_vlc_lookup(plm_buffer_t *self, const plm_vlc_lookup_t *lookup);
+
+int plm_vlc_depth(const plm_vlc_t *table, int index);
+plm_vlc_lookup_entry_t plm_vlc_walk(const plm_vlc_t *table, int *index, uint32_t code, int bits);
+plm_vlc_lookup_t *plm_vlc_lookup_create(const plm_vlc_t *table);
+void plm_vlc_lookup_destroy(plm_vlc_lookup_t *self);
 
 plm_buffer_t *plm_buffer_create_with_filename(const char *filename) {
 	FILE *fh = fopen(filename, "rb");
@@ -1408,11 +2488,60 @@ plm_buffer_t *plm_buffer_create_with_filename(const char *filename) {
 	return plm_buffer_create_with_file(fh, TRUE);
 }
 
+plm_buffer_t *plm_buffer_create_with_filename_async(const char *filename) {
+	FILE *fh = fopen(filename, "rb");
+	if (!fh) {
+		return NULL;
+	}
+	plm_buffer_t *self = plm_buffer_create_with_whole_file(fh);
+	if (self) {
+		fclose(fh);
+		return self;
+	}
+	return plm_buffer_create_with_file_async(fh, TRUE);
+}
+
+plm_buffer_t *plm_buffer_create_with_whole_file(FILE *fh) {
+	fseek(fh, 0, SEEK_END);
+	long size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	if (size <= 0) {
+		return NULL;
+	}
+
+#if defined(PLM_HAVE_MMAP)
+	if ((unsigned long)size <= PLM_MMAP_MAX_SIZE) {
+		void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+		if (bytes != MAP_FAILED) {
+			plm_buffer_t *self = plm_buffer_create_with_memory((uint8_t *)bytes, size, FALSE);
+			self->input_mode = PLM_INPUT_MAPPED;
+			return self;
+		}
+	}
+#endif
+
+	if ((unsigned long)size > PLM_PRELOAD_MAX_SIZE) {
+		return NULL;
+	}
+	uint8_t *bytes = (uint8_t *)PLM_MALLOC(size);
+	if (!bytes) {
+		return NULL;
+	}
+	if (fread(bytes, 1, size, fh) != (size_t)size) {
+		PLM_FREE(bytes);
+		return NULL;
+	}
+	plm_buffer_t *self = plm_buffer_create_with_memory(bytes, size, TRUE);
+	self->input_mode = PLM_INPUT_PRELOADED;
+	return self;
+}
+
 plm_buffer_t *plm_buffer_create_with_file(FILE *fh, int close_when_done) {
 	plm_buffer_t *self = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
 	self->fh = fh;
 	self->close_when_done = close_when_done;
 	self->mode = PLM_BUFFER_MODE_FILE;
+	self->input_mode = PLM_INPUT_FILE;
 	self->discard_read_bytes = TRUE;
 	
 	fseek(self->fh, 0, SEEK_END);
@@ -1423,6 +2552,15 @@ plm_buffer_t *plm_buffer_create_with_file(FILE *fh, int close_when_done) {
 	return self;
 }
 
+plm_buffer_t *plm_buffer_create_with_file_async(FILE *fh, int close_when_done) {
+	plm_buffer_t *self = plm_buffer_create_with_file(fh, close_when_done);
+	self->read_ahead = plm_read_ahead_create(fh);
+	if (self->read_ahead) {
+		self->input_mode = PLM_INPUT_READ_AHEAD;
+	}
+	return self;
+}
+
 plm_buffer_t *plm_buffer_create_with_memory(uint8_t *bytes, uint32_t length, int free_when_done) {
 	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
 	memset(self, 0, sizeof(plm_buffer_t));
@@ -1432,7 +2570,10 @@ plm_buffer_t *plm_buffer_create_with_memory(uint8_t *bytes, uint32_t length, int
 	self->free_when_done = free_when_done;
 	self->bytes = bytes;
 	self->mode = PLM_BUFFER_MODE_FIXED_MEM;
+	self->input_mode = PLM_INPUT_MEMORY;
 	self->discard_read_bytes = FALSE;
+	self->index_code = -1;
+	self->index_last = -1;
 	return self;
 }
 
@@ -1444,6 +2585,8 @@ plm_buffer_t *plm_buffer_create_with_capacity(uint32_t capacity) {
 	self->bytes = (uint8_t *)PLM_MALLOC(capacity);
 	self->mode = PLM_BUFFER_MODE_RING;
 	self->discard_read_bytes = TRUE;
+	self->index_code = -1;
+	self->index_last = -1;
 	return self;
 }
 
@@ -1454,13 +2597,58 @@ plm_buffer_t *plm_buffer_create_for_appending(uint32_t initial_capacity) {
 	return self;
 }
 
+plm_buffer_t *plm_buffer_create_for_packets(plm_buffer_t *source) {
+	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
+	memset(self, 0, sizeof(plm_buffer_t));
+	self->span_capacity = PLM_BUFFER_INITIAL_SPANS;
+	self->spans = (plm_buffer_span_t *)PLM_MALLOC(sizeof(plm_buffer_span_t) * self->span_capacity);
+	self->mode = PLM_BUFFER_MODE_CHAIN;
+	self->discard_read_bytes = TRUE;
+	self->index_code = -1;
+	self->index_last = -1;
+
+	self->source = source;
+	self->next_consumer = source->consumers;
+	source->consumers = self;
+	return self;
+}
+
 void plm_buffer_destroy(plm_buffer_t *self) {
+	if (self->read_ahead) {
+		plm_read_ahead_destroy(self->read_ahead);
+	}
 	if (self->fh && self->close_when_done) {
 		fclose(self->fh);
 	}
 	if (self->free_when_done) {
 		PLM_FREE(self->bytes);
 	}
+#if defined(PLM_HAVE_MMAP)
+	if (self->input_mode == PLM_INPUT_MAPPED) {
+		munmap(self->bytes, self->capacity);
+	}
+#endif
+
+	// Packet chains reading from this buffer keep copies of their data
+	plm_buffer_detach_consumers(self);
+	while (self->consumers) {
+		plm_buffer_t *chain = self->consumers;
+		self->consumers = chain->next_consumer;
+		chain->source = NULL;
+		chain->next_consumer = NULL;
+	}
+
+	if (self->mode == PLM_BUFFER_MODE_CHAIN) {
+		plm_buffer_clear_spans(self);
+		PLM_FREE(self->spans);
+		if (self->source) {
+			plm_buffer_t **link = &self->source->consumers;
+			while (*link != self) {
+				link = &(*link)->next_consumer;
+			}
+			*link = self->next_consumer;
+		}
+	}
 	PLM_FREE(self);
 }
 
@@ -1470,21 +2658,37 @@ uint32_t plm_buffer_get_size(plm_buffer_t *self) {
 		: self->length;
 }
 
+plm_input_mode_t plm_buffer_get_input_mode(plm_buffer_t *self) {
+	return self->input_mode;
+}
+
 uint32_t plm_buffer_get_remaining(plm_buffer_t *self) {
 	return self->length - (self->bit_index >> 3);
 }
 
+uint32_t plm_buffer_get_scanned_bytes(plm_buffer_t *self) {
+	return self->scanned_bytes;
+}
+
 uint32_t plm_buffer_write(plm_buffer_t *self, uint8_t *bytes, uint32_t length) {
 	if (self->mode == PLM_BUFFER_MODE_FIXED_MEM) {
 		return 0;
 	}
+	if (self->mode == PLM_BUFFER_MODE_CHAIN) {
+		return plm_buffer_write_span(self, bytes, length);
+	}
 
 	if (self->discard_read_bytes) {
-		// This should be a ring buffer, but instead it just shifts all unread 
-		// data to the beginning of the buffer and appends new data at the end. 
-		// Seems to be good enough.
-
-		plm_buffer_discard_read_bytes(self);
+		// The allocation is used like a ring that only wraps back to the front
+		// when the new data no longer fits behind the unread bytes, or when
+		// nothing is left unread. The unread tail is moved at most once per
+		// wrap instead of on every write.
+		if (
+			(self->bit_index >> 3) == self->length ||
+			self->capacity - self->length < length
+		) {
+			plm_buffer_discard_read_bytes(self);
+		}
 		if (self->mode == PLM_BUFFER_MODE_RING) {
 			self->total_size = 0;
 		}
@@ -1504,6 +2708,10 @@ uint32_t plm_buffer_write(plm_buffer_t *self, uint8_t *bytes, uint32_t length) {
 	memcpy(self->bytes + self->length, bytes, length);
 	self->length += length;
 	self->has_ended = FALSE;
+
+	if (self->index_code != -1) {
+		plm_buffer_update_index(self);
+	}
 	return length;
 }
 
@@ -1522,20 +2730,38 @@ void plm_buffer_rewind(plm_buffer_t *self) {
 
 void plm_buffer_seek(plm_buffer_t *self, uint32_t pos) {
 	self->has_ended = FALSE;
+	plm_buffer_invalidate_cache(self);
 
 	if (self->mode == PLM_BUFFER_MODE_FILE) {
-		fseek(self->fh, pos, SEEK_SET);
+		plm_buffer_detach_consumers(self);
+		if (self->read_ahead) {
+			plm_read_ahead_seek(self->read_ahead, pos);
+		}
+		else {
+			fseek(self->fh, pos, SEEK_SET);
+		}
 		self->bit_index = 0;
 		self->length = 0;
+		self->base_offset = 0;
+		self->index_scanned = 0;
+		self->index_last = -1;
 	}
-	else if (self->mode == PLM_BUFFER_MODE_RING) {
+	else if (
+		self->mode == PLM_BUFFER_MODE_RING ||
+		self->mode == PLM_BUFFER_MODE_CHAIN
+	) {
 		if (pos != 0) {
 			// Seeking to non-0 is forbidden for dynamic-mem buffers
 			return; 
 		}
+		plm_buffer_detach_consumers(self);
+		plm_buffer_clear_spans(self);
 		self->bit_index = 0;
 		self->length = 0;
 		self->total_size = 0;
+		self->base_offset = 0;
+		self->index_scanned = 0;
+		self->index_last = -1;
 	}
 	else if (pos < self->length) {
 		self->bit_index = pos << 3;
@@ -1543,21 +2769,262 @@ void plm_buffer_seek(plm_buffer_t *self, uint32_t pos) {
 }
 
 uint32_t plm_buffer_tell(plm_buffer_t *self) {
-	return self->mode == PLM_BUFFER_MODE_FILE
-		? ftell(self->fh) + (self->bit_index >> 3) - self->length
-		: self->bit_index >> 3;
+	if (self->mode != PLM_BUFFER_MODE_FILE) {
+		return self->bit_index >> 3;
+	}
+	uint32_t file_pos = self->read_ahead ? self->read_ahead->position : ftell(self->fh);
+	return file_pos + (self->bit_index >> 3) - self->length;
 }
 
 void plm_buffer_discard_read_bytes(plm_buffer_t *self) {
 	uint32_t byte_pos = self->bit_index >> 3;
-	if (byte_pos == self->length) {
-		self->bit_index = 0;
-		self->length = 0;
+	if (self->mode == PLM_BUFFER_MODE_CHAIN) {
+		byte_pos = plm_buffer_drop_spans(self, byte_pos);
+	}
+	else if (self->consumers) {
+		byte_pos = plm_buffer_get_retained_offset(self, byte_pos);
+	}
+	if (byte_pos == 0) {
+		return;
 	}
-	else if (byte_pos > 0) {
+
+	if (self->mode != PLM_BUFFER_MODE_CHAIN && byte_pos < self->length) {
 		memmove(self->bytes, self->bytes + byte_pos, self->length - byte_pos);
-		self->bit_index -= byte_pos << 3;
-		self->length -= byte_pos;
+	}
+	self->bit_index -= byte_pos << 3;
+	self->length -= byte_pos;
+	self->base_offset += byte_pos;
+	plm_buffer_invalidate_cache(self);
+
+	// Keep the start code index relative to the moved data
+	self->index_scanned = self->index_scanned > byte_pos
+		? self->index_scanned - byte_pos
+		: 0;
+	self->index_last = self->index_last >= (int)byte_pos
+		? self->index_last - (int)byte_pos
+		: -1;
+}
+
+void plm_buffer_index_start_code(plm_buffer_t *self, int code) {
+	self->index_code = code;
+	self->index_scanned = self->bit_index >> 3;
+	self->index_last = -1;
+}
+
+void plm_buffer_update_index(plm_buffer_t *self) {
+	// Scan the bytes that arrived since the last update. As in
+	// plm_buffer_next_start_code(), a start code only counts once one more
+	// byte behind it is buffered, so the last 4 bytes wait for more data.
+	uint32_t scan_start = self->index_scanned;
+	while (self->index_scanned + 5 <= self->length) {
+		uint32_t positions = self->length - self->index_scanned - 4;
+		int offset = plm_buffer_scan_start_code(self, self->index_scanned, positions);
+		if (offset == -1) {
+			self->index_scanned += positions;
+			break;
+		}
+		if (plm_buffer_get_byte(self, self->index_scanned + offset + 3) == self->index_code) {
+			self->index_last = self->index_scanned + offset;
+		}
+		self->index_scanned += offset + 4;
+	}
+	self->scanned_bytes += self->index_scanned - scan_start;
+}
+
+uint32_t plm_buffer_write_span(plm_buffer_t *self, uint8_t *bytes, uint32_t length) {
+	// The data must lie within the source buffer; it is referenced, not copied
+	plm_buffer_t *source = self->source;
+	if (
+		!source ||
+		bytes < source->bytes ||
+		bytes + length > source->bytes + source->length
+	) {
+		return 0;
+	}
+
+	plm_buffer_discard_read_bytes(self);
+	self->total_size = 0;
+
+	uint32_t offset = source->base_offset + (uint32_t)(bytes - source->bytes);
+	plm_buffer_span_t *last = self->span_count ? &self->spans[self->span_count - 1] : NULL;
+	if (last && !last->data && last->offset + last->length == offset) {
+		last->length += length;
+	}
+	else {
+		if (self->span_count == self->span_capacity) {
+			self->span_capacity *= 2;
+			self->spans = (plm_buffer_span_t *)PLM_REALLOC(self->spans, sizeof(plm_buffer_span_t) * self->span_capacity);
+		}
+		plm_buffer_span_t *span = &self->spans[self->span_count++];
+		span->offset = offset;
+		span->length = length;
+		span->data = NULL;
+	}
+
+	self->length += length;
+	self->has_ended = FALSE;
+
+	if (self->index_code != -1) {
+		plm_buffer_update_index(self);
+	}
+	return length;
+}
+
+uint32_t plm_buffer_drop_spans(plm_buffer_t *self, uint32_t byte_pos) {
+	// Drop the spans that lie completely before byte_pos; returns the number
+	// of bytes dropped.
+	uint32_t dropped = 0;
+	uint32_t count = 0;
+	while (count < self->span_count && dropped + self->spans[count].length <= byte_pos) {
+		dropped += self->spans[count].length;
+		if (self->spans[count].data) {
+			PLM_FREE(self->spans[count].data);
+		}
+		count++;
+	}
+	if (count > 0) {
+		self->span_count -= count;
+		memmove(self->spans, self->spans + count, sizeof(plm_buffer_span_t) * self->span_count);
+		self->span_cursor = 0;
+		self->span_cursor_start = 0;
+	}
+	return dropped;
+}
+
+void plm_buffer_clear_spans(plm_buffer_t *self) {
+	for (uint32_t i = 0; i < self->span_count; i++) {
+		if (self->spans[i].data) {
+			PLM_FREE(self->spans[i].data);
+		}
+	}
+	self->span_count = 0;
+	self->span_cursor = 0;
+	self->span_cursor_start = 0;
+}
+
+uint8_t *plm_buffer_get_span_bytes(plm_buffer_t *self, uint32_t pos, uint32_t *available) {
+	// Find the span holding byte pos (which must be below self->length) and
+	// return a pointer to it, with the number of contiguous bytes from there.
+	// Reads are mostly sequential, so the search starts at the span found
+	// last time.
+	uint32_t i = self->span_cursor;
+	uint32_t start = self->span_cursor_start;
+	if (pos < start) {
+		i = 0;
+		start = 0;
+	}
+	while (pos - start >= self->spans[i].length) {
+		start += self->spans[i].length;
+		i++;
+	}
+	self->span_cursor = i;
+	self->span_cursor_start = start;
+
+	plm_buffer_span_t *span = &self->spans[i];
+	*available = span->length - (pos - start);
+	return span->data
+		? span->data + (pos - start)
+		: self->source->bytes + (span->offset + (pos - start) - self->source->base_offset);
+}
+
+uint8_t plm_buffer_get_byte(plm_buffer_t *self, uint32_t pos) {
+	if (self->mode != PLM_BUFFER_MODE_CHAIN) {
+		return self->bytes[pos];
+	}
+	uint32_t available;
+	return *plm_buffer_get_span_bytes(self, pos, &available);
+}
+
+int plm_buffer_scan_start_code(plm_buffer_t *self, uint32_t pos, uint32_t positions) {
+	// Like plm_scan_start_code() for the prefixes starting at the given number
+	// of positions from pos; returns the offset from pos or -1. The 2 bytes
+	// following the last position must be buffered.
+	if (self->mode != PLM_BUFFER_MODE_CHAIN) {
+		return plm_scan_start_code(self->bytes + pos, positions + 2);
+	}
+
+	uint32_t done = 0;
+	while (done < positions) {
+		uint32_t available;
+		uint8_t *bytes = plm_buffer_get_span_bytes(self, pos + done, &available);
+
+		// Prefixes that lie within this span
+		uint32_t inside = available > 2 ? available - 2 : 0;
+		if (inside > positions - done) {
+			inside = positions - done;
+		}
+		if (inside > 0) {
+			int offset = plm_scan_start_code(bytes, inside + 2);
+			if (offset != -1) {
+				return done + offset;
+			}
+			done += inside;
+		}
+
+		// Prefixes that cross into the next span
+		for (uint32_t end = done + available - inside; done < end && done < positions; done++) {
+			if (
+				plm_buffer_get_byte(self, pos + done) == 0x00 &&
+				plm_buffer_get_byte(self, pos + done + 1) == 0x00 &&
+				plm_buffer_get_byte(self, pos + done + 2) == 0x01
+			) {
+				return done;
+			}
+		}
+	}
+	return -1;
+}
+
+uint32_t plm_buffer_get_retained_offset(plm_buffer_t *self, uint32_t byte_pos) {
+	// Packet chains reading from this buffer may still need bytes before
+	// byte_pos; return the offset of the first such byte, or byte_pos.
+	for (plm_buffer_t *chain = self->consumers; chain; chain = chain->next_consumer) {
+		uint32_t read_pos = chain->bit_index >> 3;
+		uint32_t start = 0;
+		for (uint32_t i = 0; i < chain->span_count; i++) {
+			plm_buffer_span_t *span = &chain->spans[i];
+			if (!span->data && read_pos < start + span->length) {
+				uint32_t offset = span->offset - self->base_offset;
+				if (read_pos > start) {
+					offset = span->offset + (read_pos - start) - self->base_offset;
+				}
+				if (offset < byte_pos) {
+					byte_pos = offset;
+				}
+				break;
+			}
+			start += span->length;
+		}
+	}
+	return byte_pos;
+}
+
+void plm_buffer_detach(plm_buffer_t *self) {
+	// Give a packet chain its own copy of the spans it has not read yet, so
+	// that the source no longer has to keep them.
+	plm_buffer_t *source = self->source;
+	uint32_t read_pos = self->bit_index >> 3;
+	uint32_t start = 0;
+	for (uint32_t i = 0; i < self->span_count; i++) {
+		plm_buffer_span_t *span = &self->spans[i];
+		if (!span->data && read_pos < start + span->length) {
+			// Bytes before read_pos may already be gone; they are not read
+			// again, so only the rest is copied.
+			uint32_t skip = read_pos > start ? read_pos - start : 0;
+			span->data = (uint8_t *)PLM_MALLOC(span->length);
+			memcpy(
+					span->data + skip,
+					source->bytes + (span->offset + skip - source->base_offset),
+					span->length - skip);
+		}
+		start += span->length;
+	}
+}
+
+void plm_buffer_detach_consumers(plm_buffer_t *self) {
+	// Called before this buffer drops or replaces its data
+	for (plm_buffer_t *chain = self->consumers; chain; chain = chain->next_consumer) {
+		plm_buffer_detach(chain);
 	}
 }
 
@@ -1566,10 +3033,19 @@ void plm_buffer_load_file_callback(plm_buffer_t *self, void *user) {
 	
 	if (self->discard_read_bytes) {
 		plm_buffer_discard_read_bytes(self);
+
+		// If bytes retained for packet chains fill much of the buffer, give the
+		// chains their own copy rather than reading in small pieces.
+		if (self->consumers && self->length > self->capacity / 2) {
+			plm_buffer_detach_consumers(self);
+			plm_buffer_discard_read_bytes(self);
+		}
 	}
 
 	uint32_t bytes_available = self->capacity - self->length;
-	uint32_t bytes_read = fread(self->bytes + self->length, 1, bytes_available, self->fh);
+	uint32_t bytes_read = self->read_ahead
+		? plm_read_ahead_read(self->read_ahead, self->bytes + self->length, bytes_available)
+		: fread(self->bytes + self->length, 1, bytes_available, self->fh);
 	self->length += bytes_read;
 
 	if (bytes_read == 0) {
@@ -1600,26 +3076,106 @@ int plm_buffer_has(plm_buffer_t *self, uint32_t count) {
 	return FALSE;
 }
 
-int plm_buffer_read(plm_buffer_t *self, int count) {
-	if (!plm_buffer_has(self, count)) {
-		return 0;
+void plm_buffer_refill(plm_buffer_t *self) {
+	// Load the 8 bytes at the current byte position into the bit cache, MSB
+	// first. Only bytes below self->length are cached, so appending data never
+	// invalidates the cache - only moving or replacing existing bytes does.
+	uint32_t byte_index = self->bit_index >> 3;
+	uint32_t available = self->length - byte_index;
+	uint8_t *p;
+	uint8_t gathered[8];
+	uint64_t cache;
+
+	if (self->mode == PLM_BUFFER_MODE_CHAIN) {
+		// Collect the bytes from the following spans if this one ends early
+		uint32_t contiguous;
+		p = plm_buffer_get_span_bytes(self, byte_index, &contiguous);
+		if (contiguous < 8 && contiguous < available) {
+			for (uint32_t i = 0; i < 8 && i < available; i++) {
+				gathered[i] = plm_buffer_get_byte(self, byte_index + i);
+			}
+			p = gathered;
+		}
+	}
+	else {
+		p = self->bytes + byte_index;
+	}
+
+	if (available >= 8) {
+		available = 8;
+		cache =
+			((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+			((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+			((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+			((uint64_t)p[6] << 8) | ((uint64_t)p[7]);
+	}
+	else {
+		cache = 0;
+		for (uint32_t i = 0; i < 8; i++) {
+			cache = (cache << 8) | (i < available ? p[i] : 0);
+		}
+	}
+
+	self->bit_cache = cache;
+	self->bit_cache_start = byte_index << 3;
+	self->bit_cache_end = (byte_index + available) << 3;
+}
+
+void plm_buffer_invalidate_cache(plm_buffer_t *self) {
+	self->bit_cache_start = 0;
+	self->bit_cache_end = 0;
+}
+
+int plm_buffer_peek(plm_buffer_t *self, int count) {
+	// Callers must have checked plm_buffer_has(); count is 1--32 bits
+	if (
+		self->bit_index < self->bit_cache_start ||
+		self->bit_index + count > self->bit_cache_end
+	) {
+		plm_buffer_refill(self);
 	}
 
-	int value = 0;
-	while (count) {
-		int current_byte = self->bytes[self->bit_index >> 3];
+	uint32_t shift = self->bit_index - self->bit_cache_start;
+	return (int)((self->bit_cache << shift) >> (64 - count));
+}
 
-		int remaining = 8 - (self->bit_index & 7); // Remaining bits in byte
-		int read = remaining < count ? remaining : count; // Bits in self run
-		int shift = remaining - read;
-		int mask = (0xff >> (8 - read));
+int plm_buffer_fill_cache(plm_buffer_t *self, int count) {
+	// Make sure the next count bits are in the bit cache. Unlike
+	// plm_buffer_has() this never invokes the load callback; it returns FALSE
+	// if fewer bits are currently buffered.
+	if (
+		self->bit_index >= self->bit_cache_start &&
+		self->bit_index + count <= self->bit_cache_end
+	) {
+		return TRUE;
+	}
+	if (((self->length << 3) - self->bit_index) < (uint32_t)count) {
+		return FALSE;
+	}
+	plm_buffer_refill(self);
+	return TRUE;
+}
 
-		value = (value << read) | ((current_byte & (mask << shift)) >> shift);
+int plm_buffer_read(plm_buffer_t *self, int count) {
+	if (count == 0) {
+		return 0;
+	}
 
-		self->bit_index += read;
-		count -= read;
+	// Bits that are already in the cache are known to be below self->length,
+	// so the plm_buffer_has() check and any load callback can be skipped.
+	if (
+		self->bit_index < self->bit_cache_start ||
+		self->bit_index + count > self->bit_cache_end
+	) {
+		if (!plm_buffer_has(self, count)) {
+			return 0;
+		}
+		plm_buffer_refill(self);
 	}
 
+	uint32_t shift = self->bit_index - self->bit_cache_start;
+	int value = (int)((self->bit_cache << shift) >> (64 - count));
+	self->bit_index += count;
 	return value;
 }
 
@@ -1636,7 +3192,7 @@ void plm_buffer_skip(plm_buffer_t *self, uint32_t count) {
 int plm_buffer_skip_bytes(plm_buffer_t *self, uint8_t v) {
 	plm_buffer_align(self);
 	int skipped = 0;
-	while (plm_buffer_has(self, 8) && self->bytes[self->bit_index >> 3] == v) {
+	while (plm_buffer_has(self, 8) && plm_buffer_get_byte(self, self->bit_index >> 3) == v) {
 		self->bit_index += 8;
 		skipped++;
 	}
@@ -1647,16 +3203,138 @@ int plm_buffer_next_start_code(plm_buffer_t *self) {
 	plm_buffer_align(self);
 
 	while (plm_buffer_has(self, (5 << 3))) {
-		uint32_t byte_index = (self->bit_index) >> 3;
-		if (
-			self->bytes[byte_index] == 0x00 &&
-			self->bytes[byte_index + 1] == 0x00 &&
-			self->bytes[byte_index + 2] == 0x01
-		) {
+		// Scan every position that still has 5 bytes buffered behind it; only
+		// then ask for more data.
+		uint32_t byte_index = self->bit_index >> 3;
+		uint32_t positions = self->length - byte_index - 4;
+		int offset = plm_buffer_scan_start_code(self, byte_index, positions);
+		if (offset != -1) {
+			self->scanned_bytes += offset + 4;
+			byte_index += offset;
 			self->bit_index = (byte_index + 4) << 3;
-			return self->bytes[byte_index + 3];
+			return plm_buffer_get_byte(self, byte_index + 3);
+		}
+		self->scanned_bytes += positions;
+		self->bit_index = (byte_index + positions) << 3;
+	}
+	return -1;
+}
+
+int plm_buffer_next_start_code_append(plm_buffer_t *self, uint8_t **bytes, uint32_t *length, uint32_t *capacity) {
+	// Like plm_buffer_next_start_code(), but also append the bytes skipped and
+	// the start code to bytes, or the remaining bytes if no start code is found.
+	// Copying as we go keeps the bytes valid when loading more data discards
+	// the ones already read.
+	plm_buffer_align(self);
+
+	while (plm_buffer_has(self, (5 << 3))) {
+		uint32_t byte_index = self->bit_index >> 3;
+		uint32_t positions = self->length - byte_index - 4;
+		int offset = plm_buffer_scan_start_code(self, byte_index, positions);
+		if (offset != -1) {
+			plm_buffer_append_bytes(self, byte_index, offset + 4, bytes, length, capacity);
+			self->scanned_bytes += offset + 4;
+			byte_index += offset;
+			self->bit_index = (byte_index + 4) << 3;
+			return plm_buffer_get_byte(self, byte_index + 3);
+		}
+		plm_buffer_append_bytes(self, byte_index, positions, bytes, length, capacity);
+		self->scanned_bytes += positions;
+		self->bit_index = (byte_index + positions) << 3;
+	}
+
+	uint32_t byte_index = self->bit_index >> 3;
+	plm_buffer_append_bytes(self, byte_index, self->length - byte_index, bytes, length, capacity);
+	return -1;
+}
+
+void plm_buffer_append_bytes(plm_buffer_t *self, uint32_t pos, uint32_t count, uint8_t **bytes, uint32_t *length, uint32_t *capacity) {
+	// Copy count buffered bytes from pos to the end of bytes, growing it
+	if (*length + count > *capacity) {
+		*capacity = (*length + count) * 2;
+		*bytes = (uint8_t *)PLM_REALLOC(*bytes, *capacity);
+	}
+
+	uint8_t *dest = *bytes + *length;
+	*length += count;
+	while (count > 0) {
+		uint32_t available = count;
+		uint8_t *source = self->mode == PLM_BUFFER_MODE_CHAIN
+			? plm_buffer_get_span_bytes(self, pos, &available)
+			: self->bytes + pos;
+		if (available > count) {
+			available = count;
+		}
+		memcpy(dest, source, available);
+		dest += available;
+		pos += available;
+		count -= available;
+	}
+}
+
+void plm_buffer_reset_memory(plm_buffer_t *self, uint8_t *bytes, uint32_t length) {
+	// Point a buffer created with plm_buffer_create_with_memory() at other
+	// bytes and read them from the start
+	self->bytes = bytes;
+	self->capacity = length;
+	self->length = length;
+	self->total_size = length;
+	self->bit_index = 0;
+	self->has_ended = FALSE;
+	plm_buffer_invalidate_cache(self);
+}
+
+int plm_scan_start_code(const uint8_t *bytes, uint32_t length) {
+	// Return the offset of the first 00 00 01 start code prefix that lies
+	// fully within bytes[0, length), or -1 if there is none. A prefix can only
+	// begin at a zero byte, so blocks without any zero byte are skipped whole:
+	// 16 bytes at a time with SSE2, otherwise one aligned 32 bit word at a time.
+	if (length < 3) {
+		return -1;
+	}
+	uint32_t end = length - 2;
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	while (i + 16 <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0) {
+			i += 16;
+			continue;
+		}
+		for (uint32_t stop = i + 16; i < stop; i++) {
+			if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01) {
+				return i;
+			}
+		}
+	}
+#else
+	while (i < end && ((uintptr_t)(bytes + i) & 3)) {
+		if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01) {
+			return i;
+		}
+		i++;
+	}
+	while (i + 4 <= end) {
+		uint32_t word;
+		memcpy(&word, bytes + i, 4);
+		if (((word - 0x01010101) & ~word & 0x80808080) == 0) {
+			i += 4;
+			continue;
+		}
+		for (uint32_t stop = i + 4; i < stop; i++) {
+			if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01) {
+				return i;
+			}
+		}
+	}
+#endif
+
+	for (; i < end; i++) {
+		if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01) {
+			return i;
 		}
-		self->bit_index += 8;
 	}
 	return -1;
 }
@@ -1672,7 +3350,24 @@ int plm_buffer_find_start_code(plm_buffer_t *self, int code) {
 	return -1;
 }
 
+int plm_buffer_peek_start_code(plm_buffer_t *self) {
+	// Like plm_buffer_next_start_code(), but the read position does not move
+	uint32_t previous_bit_index = self->bit_index;
+	int previous_discard_read_bytes = self->discard_read_bytes;
+
+	self->discard_read_bytes = FALSE;
+	int code = plm_buffer_next_start_code(self);
+
+	self->bit_index = previous_bit_index;
+	self->discard_read_bytes = previous_discard_read_bytes;
+	return code;
+}
+
 int plm_buffer_has_start_code(plm_buffer_t *self, int code) {
+	if (code == self->index_code) {
+		return plm_buffer_has_indexed_start_code(self);
+	}
+
 	uint32_t previous_bit_index = self->bit_index;
 	int previous_discard_read_bytes = self->discard_read_bytes;
 	
@@ -1684,14 +3379,39 @@ int plm_buffer_has_start_code(plm_buffer_t *self, int code) {
 	return current;
 }
 
+int plm_buffer_has_indexed_start_code(plm_buffer_t *self) {
+	// Same result as plm_buffer_find_start_code() for the indexed code, but
+	// bytes that have been looked at before are not scanned again. The read
+	// position does not move, so loading more data may discard read bytes.
+	while (TRUE) {
+		plm_buffer_update_index(self);
+		if (self->index_last >= (int)((self->bit_index + 7) >> 3)) {
+			return self->index_code;
+		}
+
+		// Writing to a packet chain discards read bytes first, so the length
+		// alone does not tell whether anything arrived
+		uint32_t previous_end = self->base_offset + self->length;
+		if (self->load_callback) {
+			self->load_callback(self, self->load_callback_user_data);
+		}
+		if (self->base_offset + self->length == previous_end) {
+			break;
+		}
+	}
+
+	if (self->total_size != 0 && self->length == self->total_size) {
+		self->has_ended = TRUE;
+	}
+	return -1;
+}
+
 int plm_buffer_peek_non_zero(plm_buffer_t *self, int bit_count) {
 	if (!plm_buffer_has(self, bit_count)) {
 		return FALSE;
 	}
 
-	int val = plm_buffer_read(self, bit_count);
-	self->bit_index -= bit_count;
-	return val != 0;
+	return plm_buffer_peek(self, bit_count) != 0;
 }
 
 int16_t plm_buffer_read_vlc(plm_buffer_t *self, const plm_vlc_t *table) {
@@ -1706,6 +3426,99 @@ uint16_t plm_buffer_read_vlc_uint(plm_buffer_t *self, const plm_vlc_uint_t *tabl
 	return (uint16_t)plm_buffer_read_vlc(self, (const plm_vlc_t *)table);
 }
 
+int16_t plm_buffer_read_vlc_lookup(plm_buffer_t *self, const plm_vlc_lookup_t *lookup) {
+	// Near the end of the buffered data, walk the tree bit by bit so that the
+	// load callback is invoked exactly as before.
+	if (!plm_buffer_fill_cache(self, lookup->max_length)) {
+		return plm_buffer_read_vlc(self, lookup->table);
+	}
+
+	uint64_t window = self->bit_cache << (self->bit_index - self->bit_cache_start);
+	plm_vlc_lookup_entry_t entry = lookup->entries[window >> (64 - lookup->bits)];
+	if (entry.length == 0) {
+		self->bit_index += lookup->bits;
+		window <<= lookup->bits;
+		entry = lookup->entries[entry.value + (window >> (64 - entry.bits))];
+	}
+	self->bit_index += entry.length;
+	return entry.value;
+}
+
+int plm_vlc_depth(const plm_vlc_t *table, int index) {
+	// Length of the longest code below the tree node at index
+	int depth = 0;
+	for (int bit = 0; bit < 2; bit++) {
+		plm_vlc_t state = table[index + bit];
+		int d = 1 + ((state.index > 0) ? plm_vlc_depth(table, state.index) : 0);
+		if (d > depth) {
+			depth = d;
+		}
+	}
+	return depth;
+}
+
+plm_vlc_lookup_entry_t plm_vlc_walk(const plm_vlc_t *table, int *index, uint32_t code, int bits) {
+	// Walk the tree from *index along the bits of code, MSB first. Returns the
+	// leaf and the number of bits used, or length 0 with *index set to the
+	// inner node reached if the code is longer than bits.
+	plm_vlc_lookup_entry_t entry = {0, 0, 0};
+	for (int i = bits - 1; i >= 0; i--) {
+		plm_vlc_t state = table[*index + ((code >> i) & 1)];
+		entry.length++;
+		if (state.index <= 0) {
+			entry.value = state.value;
+			return entry;
+		}
+		*index = state.index;
+	}
+	entry.length = 0;
+	return entry;
+}
+
+plm_vlc_lookup_t *plm_vlc_lookup_create(const plm_vlc_t *table) {
+	int max_length = plm_vlc_depth(table, 0);
+	int bits = max_length < PLM_VLC_LOOKUP_BITS ? max_length : PLM_VLC_LOOKUP_BITS;
+
+	// Count the primary entries plus one second-level table for each prefix
+	// that does not resolve to a leaf within bits
+	uint32_t size = 1 << bits;
+	for (uint32_t i = 0; i < (1u << bits); i++) {
+		int index = 0;
+		if (plm_vlc_walk(table, &index, i, bits).length == 0) {
+			size += 1 << plm_vlc_depth(table, index);
+		}
+	}
+
+	plm_vlc_lookup_t *self = (plm_vlc_lookup_t *)PLM_MALLOC(
+		sizeof(plm_vlc_lookup_t) + size * sizeof(plm_vlc_lookup_entry_t));
+	self->table = table;
+	self->bits = bits;
+	self->max_length = max_length;
+	self->entries = (plm_vlc_lookup_entry_t *)(self + 1);
+
+	uint32_t next = 1 << bits;
+	for (uint32_t i = 0; i < (1u << bits); i++) {
+		int index = 0;
+		plm_vlc_lookup_entry_t entry = plm_vlc_walk(table, &index, i, bits);
+		if (entry.length == 0) {
+			int sub_bits = plm_vlc_depth(table, index);
+			for (uint32_t j = 0; j < (1u << sub_bits); j++) {
+				int sub_index = index;
+				self->entries[next + j] = plm_vlc_walk(table, &sub_index, j, sub_bits);
+			}
+			entry.value = next;
+			entry.bits = sub_bits;
+			next += 1 << sub_bits;
+		}
+		self->entries[i] = entry;
+	}
+	return self;
+}
+
+void plm_vlc_lookup_destroy(plm_vlc_lookup_t *self) {
+	PLM_FREE(self);
+}
+
 
 
 // ----------------------------------------------------------------------------
@@ -2276,6 +4089,18 @@ static const uint8_t PLM_VIDEO_PREMULTIPLIER_MATRIX[] = {
 	 9, 12, 12, 10,  9,  7,  5,  2
 };
 
+// The reduced transforms of downscaled decoding take plain coefficients
+static const uint8_t PLM_VIDEO_UNIT_MATRIX[] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1
+};
+
 static const plm_vlc_t PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT[] = {
 	{  1 << 1,    0}, {       0,    1},  //   0: x
 	{  2 << 1,    0}, {  3 << 1,    0},  //   1: 0x
@@ -2482,12 +4307,6 @@ static const plm_vlc_t PLM_VIDEO_DCT_SIZE_CHROMINANCE[] = {
 	{       0,    8}, {      -1,    0},  //   8: 1111 111x
 };
 
-static const plm_vlc_t *PLM_VIDEO_DCT_SIZE[] = {
-	PLM_VIDEO_DCT_SIZE_LUMINANCE,
-	PLM_VIDEO_DCT_SIZE_CHROMINANCE,
-	PLM_VIDEO_DCT_SIZE_CHROMINANCE
-};
-
 
 //  dct_coeff bitmap:
 //    0xff00  run
@@ -2618,22 +4437,104 @@ typedef struct {
 	int v;
 } plm_video_motion_t;
 
+// Combined dct_coeff + sign lookup, indexed by the next
+// PLM_VIDEO_DCT_COEFF_LOOKUP_BITS bits. Only used after the first coefficient
+// of a block, where a leading "10" is end_of_block. A length of 0 means the
+// code (escape or long code) has to be decoded by plm_video_decode_dct_coeff().
+#ifndef PLM_VIDEO_DCT_COEFF_LOOKUP_BITS
+#define PLM_VIDEO_DCT_COEFF_LOOKUP_BITS 8
+#endif
+
+// Implementation of plm_video_idct(). Define PLM_VIDEO_IDCT as one of these
+// to choose; by default the widest one the compiler targets is used. All of
+// them give the same output.
+#define PLM_VIDEO_IDCT_SCALAR 0
+#define PLM_VIDEO_IDCT_SSE2 1
+#define PLM_VIDEO_IDCT_AVX2 2
+
+#ifndef PLM_VIDEO_IDCT
+#if defined(__AVX2__)
+#define PLM_VIDEO_IDCT PLM_VIDEO_IDCT_AVX2
+#elif defined(__SSE2__)
+#define PLM_VIDEO_IDCT PLM_VIDEO_IDCT_SSE2
+#else
+#define PLM_VIDEO_IDCT PLM_VIDEO_IDCT_SCALAR
+#endif
+#endif
+
+// Whether blocks with nonzero coefficients only in the top left 4x4 go through
+// the reduced scalar transform. Vectorized full transforms with a native 32-bit
+// multiply are faster than that.
+#ifndef PLM_VIDEO_IDCT_4X4
+#if PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2 || (PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2 && defined(__SSE4_1__))
+#define PLM_VIDEO_IDCT_4X4 0
+#else
+#define PLM_VIDEO_IDCT_4X4 1
+#endif
+#endif
+
+typedef struct {
+	uint8_t run;
+	int8_t level;		// Signed level; 0 marks end_of_block
+	uint8_t length; // Code length including the sign bit
+} plm_video_dct_coeff_t;
+
+// Slice-parallel decoding: the slices of a picture are collected into
+// slice_data, each followed by the start code after it, and taken in turn by
+// the calling thread and thread_count - 1 worker threads. Slices reset the
+// DC predictors, motion vectors and quantizer scale, so each worker decodes
+// them with its own copy of the decoder state, reading from its own buffer.
+
+typedef struct {
+	int slice;
+	uint32_t offset;
+	uint32_t length;
+} plm_video_slice_t;
+
+typedef struct plm_video_worker_t plm_video_worker_t;
+
 struct plm_video_t {
 	double framerate;
 	double time;
 	int frames_decoded;
+	int frames_dropped;
+	double drop_time;
 	int width;
 	int height;
 	int mb_width;
 	int mb_height;
 	int mb_size;
 
+	// Plane sizes; divided by 1 << scale_shift like all pixel coordinates
 	int luma_width;
 	int luma_height;
 
 	int chroma_width;
 	int chroma_height;
 
+	int scale_shift;
+	const uint8_t *premultiplier_matrix;
+	int grayscale;
+
+	uint16_t *rgb565_target;
+	int rgb565_stride;
+	int rgb565_big_endian;
+
+	// Visible rect in pixels of the frame, and the part of the current picture
+	// that is decoded in macroblocks (x0, y0 inclusive, x1, y1 exclusive)
+	int visible_x;
+	int visible_y;
+	int visible_width;
+	int visible_height;
+	int window_x0;
+	int window_y0;
+	int window_x1;
+	int window_y1;
+	int macroblock_hidden;
+
+	uint64_t hidden_macroblocks;
+	uint64_t b_macroblocks;
+
 	int start_code;
 	int picture_type;
 
@@ -2663,12 +4564,55 @@ struct plm_video_t {
 
 	uint8_t *frames_data;
 
+	// The picture that last changed each macroblock of the 3 frames and of the
+	// frame returned before; macroblocks where the returned frame differs from
+	// that one are dirty
+	uint32_t picture_serial;
+	uint32_t *origins_data;
+	uint32_t *origins_current;
+	uint32_t *origins_forward;
+	uint32_t *origins_backward;
+	uint32_t *origins_returned;
+	uint8_t *dirty;
+
 	int block_data[64];
 	uint8_t intra_quant_matrix[64];
 	uint8_t non_intra_quant_matrix[64];
 
+	// quantizer_scale * quant matrix, in zig-zag order
+	int intra_quant_table[64];
+	int non_intra_quant_table[64];
+
 	int has_reference_frame;
 	int assume_no_b_frames;
+
+	int thread_count;
+	plm_video_worker_t *workers;
+	plm_semaphore_t workers_done;
+	int workers_stop;
+	plm_video_slice_t *slices;
+	int slice_count;
+	int slice_capacity;
+	int next_slice;
+	uint8_t *slice_data;
+	uint32_t slice_data_length;
+	uint32_t slice_data_capacity;
+
+	plm_vlc_lookup_t *macroblock_address_increment_lookup;
+	plm_vlc_lookup_t *macroblock_type_lookup[4];
+	plm_vlc_lookup_t *code_block_pattern_lookup;
+	plm_vlc_lookup_t *motion_lookup;
+	plm_vlc_lookup_t *dct_size_lookup[2];
+	plm_vlc_lookup_t *dct_coeff_lookup;
+	plm_video_dct_coeff_t dct_coeff_fast[1 << PLM_VIDEO_DCT_COEFF_LOOKUP_BITS];
+};
+
+struct plm_video_worker_t {
+	plm_video_t *parent;
+	plm_video_t *state;
+	plm_buffer_t *buffer;
+	plm_thread_t thread;
+	plm_semaphore_t start;
 };
 
 static inline uint8_t plm_clamp(int n) {
@@ -2682,10 +4626,29 @@ static inline uint8_t plm_clamp(int n) {
 }
 
 int plm_video_decode_sequence_header(plm_video_t *self);
+void plm_video_init_frames(plm_video_t *self);
+void plm_video_realloc_frames(plm_video_t *self);
 void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base);
+uint32_t *plm_video_origins(plm_video_t *self, plm_frame_t *frame);
+void plm_video_update_dirty(plm_video_t *self, plm_frame_t *frame);
 void plm_video_decode_picture(plm_video_t *self);
+int plm_video_is_late_b_picture(plm_video_t *self);
+void plm_video_skip_picture(plm_video_t *self);
+void plm_video_init_window(plm_video_t *self);
+int plm_video_skip_hidden_slice(plm_video_t *self);
+int plm_video_slice_is_hidden(plm_video_t *self, int slice, int next_start_code);
+int plm_video_macroblock_is_hidden(plm_video_t *self);
 void plm_video_decode_slice(plm_video_t *self, int slice);
+void plm_video_decode_slices_threaded(plm_video_t *self);
+void plm_video_decode_worker_slices(plm_video_worker_t *worker);
+void plm_video_worker_thread(void *arg);
+void plm_video_start_workers(plm_video_t *self, int count);
+void plm_video_stop_workers(plm_video_t *self);
 void plm_video_decode_macroblock(plm_video_t *self);
+void plm_video_skip_macroblocks(plm_video_t *self, int count);
+plm_frame_t *plm_video_zero_motion_source(plm_video_t *self);
+void plm_video_copy_macroblock_run(plm_video_t *self, uint8_t *s, uint8_t *d, int address, int count, int block_size);
+void plm_video_convert_macroblocks(plm_video_t *self, int address, int count);
 void plm_video_decode_motion_vectors(plm_video_t *self);
 int plm_video_decode_motion_vector(plm_video_t *self, int r_size, int motion);
 void plm_video_predict_macroblock(plm_video_t *self);
@@ -2693,7 +4656,16 @@ void plm_video_copy_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h,
 void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v);
 void plm_video_process_macroblock(plm_video_t *self, uint8_t *s, uint8_t *d, int mh, int mb, int bs, int interp);
 void plm_video_decode_block(plm_video_t *self, int block);
+void plm_video_init_dct_coeff_fast(plm_video_t *self);
+void plm_video_init_quant_tables(plm_video_t *self);
+void plm_video_set_quantizer_scale(plm_video_t *self, int quantizer_scale);
+int plm_video_decode_dct_coeff(plm_video_t *self, int n, int *run, int *level);
 void plm_video_idct(int *block);
+void plm_video_idct_4x4(const int *block, int *out);
+void plm_video_idct_row(const int *block, int *out);
+void plm_video_idct_column(const int *block, int *out);
+void plm_video_idct_scaled_4(const int *block, int *out);
+void plm_video_idct_scaled_2(const int *block, int *out);
 
 plm_video_t * plm_video_create_with_buffer(plm_buffer_t *buffer, int destroy_when_done) {
 	plm_video_t *self = (plm_video_t *)PLM_MALLOC(sizeof(plm_video_t));
@@ -2701,6 +4673,23 @@ plm_video_t * plm_video_create_with_buffer(plm_buffer_t *buffer, int destroy_whe
 	
 	self->buffer = buffer;
 	self->destroy_buffer_when_done = destroy_when_done;
+	self->premultiplier_matrix = PLM_VIDEO_PREMULTIPLIER_MATRIX;
+
+	// Index picture start codes as data arrives, so that checking for a fully
+	// buffered picture in plm_video_decode() does not rescan the buffer.
+	plm_buffer_index_start_code(self->buffer, PLM_START_PICTURE);
+
+	// Build the VLC lookup tables from the decoding trees
+	self->macroblock_address_increment_lookup = plm_vlc_lookup_create(PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+	for (int i = 1; i < 4; i++) {
+		self->macroblock_type_lookup[i] = plm_vlc_lookup_create(PLM_VIDEO_MACROBLOCK_TYPE[i]);
+	}
+	self->code_block_pattern_lookup = plm_vlc_lookup_create(PLM_VIDEO_CODE_BLOCK_PATTERN);
+	self->motion_lookup = plm_vlc_lookup_create(PLM_VIDEO_MOTION);
+	self->dct_size_lookup[0] = plm_vlc_lookup_create(PLM_VIDEO_DCT_SIZE_LUMINANCE);
+	self->dct_size_lookup[1] = plm_vlc_lookup_create(PLM_VIDEO_DCT_SIZE_CHROMINANCE);
+	self->dct_coeff_lookup = plm_vlc_lookup_create((const plm_vlc_t *)PLM_VIDEO_DCT_COEFF);
+	plm_video_init_dct_coeff_fast(self);
 
 	// Attempt to decode the sequence header
 	self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_SEQUENCE);
@@ -2717,6 +4706,25 @@ void plm_video_destroy(plm_video_t *self) {
 
 	if (self->has_sequence_header) {
 		PLM_FREE(self->frames_data);
+		PLM_FREE(self->origins_data);
+	}
+
+	plm_vlc_lookup_destroy(self->macroblock_address_increment_lookup);
+	for (int i = 1; i < 4; i++) {
+		plm_vlc_lookup_destroy(self->macroblock_type_lookup[i]);
+	}
+	plm_vlc_lookup_destroy(self->code_block_pattern_lookup);
+	plm_vlc_lookup_destroy(self->motion_lookup);
+	plm_vlc_lookup_destroy(self->dct_size_lookup[0]);
+	plm_vlc_lookup_destroy(self->dct_size_lookup[1]);
+	plm_vlc_lookup_destroy(self->dct_coeff_lookup);
+
+	plm_video_stop_workers(self);
+	if (self->slices) {
+		PLM_FREE(self->slices);
+	}
+	if (self->slice_data) {
+		PLM_FREE(self->slice_data);
 	}
 
 	PLM_FREE(self);
@@ -2730,13 +4738,13 @@ double plm_video_get_framerate(plm_video_t *self) {
 
 int plm_video_get_width(plm_video_t *self) {
 	return plm_video_has_header(self)
-		? self->width
+		? self->frame_current.width
 		: 0;
 }
 
 int plm_video_get_height(plm_video_t *self) {
 	return plm_video_has_header(self)
-		? self->height
+		? self->frame_current.height
 		: 0;
 }
 
@@ -2744,20 +4752,134 @@ void plm_video_set_no_delay(plm_video_t *self, int no_delay) {
 	self->assume_no_b_frames = no_delay;
 }
 
-double plm_video_get_time(plm_video_t *self) {
-	return self->time;
+int plm_video_set_thread_count(plm_video_t *self, int count) {
+	plm_video_stop_workers(self);
+	if (count > 1) {
+		plm_video_start_workers(self, count);
+	}
+	return self->thread_count;
 }
 
-void plm_video_set_time(plm_video_t *self, double time) {
-	self->frames_decoded = self->framerate * time;
-	self->time = time;
+void plm_video_start_workers(plm_video_t *self, int count) {
+	// Worker 0 is the calling thread; stop at the first one that fails to start
+	if (!plm_semaphore_init(&self->workers_done, 0, count)) {
+		return;
+	}
+	self->workers = (plm_video_worker_t *)PLM_MALLOC(sizeof(plm_video_worker_t) * count);
+	self->workers_stop = FALSE;
+	for (int i = 0; i < count; i++) {
+		plm_video_worker_t *worker = &self->workers[i];
+		worker->parent = self;
+		if (i > 0) {
+			if (!plm_semaphore_init(&worker->start, 0, 1)) {
+				break;
+			}
+			if (!plm_thread_create(&worker->thread, "plm_video_slices", i, plm_video_worker_thread, worker)) {
+				plm_semaphore_destroy(&worker->start);
+				break;
+			}
+		}
+		worker->state = (plm_video_t *)PLM_MALLOC(sizeof(plm_video_t));
+		worker->buffer = plm_buffer_create_with_memory(NULL, 0, FALSE);
+		self->thread_count = i + 1;
+	}
+
+	if (self->thread_count < 2) {
+		plm_video_stop_workers(self);
+	}
 }
 
-void plm_video_rewind(plm_video_t *self) {
-	plm_buffer_rewind(self->buffer);
-	self->time = 0;
-	self->frames_decoded = 0;
-	self->has_reference_frame = FALSE;
+void plm_video_stop_workers(plm_video_t *self) {
+	if (self->workers) {
+		PLM_ATOMIC_STORE(&self->workers_stop, TRUE);
+		for (int i = 0; i < self->thread_count; i++) {
+			plm_video_worker_t *worker = &self->workers[i];
+			if (i > 0) {
+				plm_semaphore_post(&worker->start);
+				plm_thread_join(&worker->thread);
+				plm_semaphore_destroy(&worker->start);
+			}
+			plm_buffer_destroy(worker->buffer);
+			PLM_FREE(worker->state);
+		}
+		plm_semaphore_destroy(&self->workers_done);
+		PLM_FREE(self->workers);
+		self->workers = NULL;
+	}
+	self->thread_count = 1;
+}
+
+int plm_video_set_downscale(plm_video_t *self, int factor) {
+	int shift;
+	switch (factor) {
+		case 1: shift = 0; break;
+		case 2: shift = 1; break;
+		case 4: shift = 2; break;
+		case 8: shift = 3; break;
+		default: return FALSE;
+	}
+	if (shift == self->scale_shift) {
+		return TRUE;
+	}
+
+	self->scale_shift = shift;
+	self->premultiplier_matrix = shift
+		? PLM_VIDEO_UNIT_MATRIX
+		: PLM_VIDEO_PREMULTIPLIER_MATRIX;
+	plm_video_realloc_frames(self);
+	return TRUE;
+}
+
+void plm_video_set_grayscale(plm_video_t *self, int enabled) {
+	enabled = (enabled != 0);
+	if (enabled == self->grayscale) {
+		return;
+	}
+	self->grayscale = enabled;
+	plm_video_realloc_frames(self);
+}
+
+void plm_video_set_rgb565_target(plm_video_t *self, uint16_t *dest, int stride, int big_endian) {
+	self->rgb565_target = dest;
+	self->rgb565_stride = stride;
+	self->rgb565_big_endian = big_endian;
+}
+
+void plm_video_set_b_picture_rect(plm_video_t *self, int x, int y, int width, int height) {
+	self->visible_x = x;
+	self->visible_y = y;
+	self->visible_width = width;
+	self->visible_height = height;
+}
+
+double plm_video_get_hidden_b_fraction(plm_video_t *self) {
+	return self->b_macroblocks
+		? (double)self->hidden_macroblocks / self->b_macroblocks
+		: 0;
+}
+
+void plm_video_set_drop_time(plm_video_t *self, double time) {
+	self->drop_time = time;
+}
+
+int plm_video_get_dropped_frames(plm_video_t *self) {
+	return self->frames_dropped;
+}
+
+double plm_video_get_time(plm_video_t *self) {
+	return self->time;
+}
+
+void plm_video_set_time(plm_video_t *self, double time) {
+	self->frames_decoded = self->framerate * time;
+	self->time = time;
+}
+
+void plm_video_rewind(plm_video_t *self) {
+	plm_buffer_rewind(self->buffer);
+	self->time = 0;
+	self->frames_decoded = 0;
+	self->has_reference_frame = FALSE;
 	self->start_code = -1;
 }
 
@@ -2806,8 +4928,16 @@ plm_frame_t *plm_video_decode(plm_video_t *self) {
 		) {
 			return NULL;
 		}
-		plm_buffer_discard_read_bytes(self->buffer);
 		
+		if (plm_video_is_late_b_picture(self)) {
+			// Count the frame so the time stays right, but don't decode it
+			plm_video_skip_picture(self);
+			self->frames_dropped++;
+			self->frames_decoded++;
+			self->time = (double)self->frames_decoded / self->framerate;
+			continue;
+		}
+
 		plm_video_decode_picture(self);
 
 		if (self->assume_no_b_frames) {
@@ -2827,7 +4957,8 @@ plm_frame_t *plm_video_decode(plm_video_t *self) {
 	frame->time = self->time;
 	self->frames_decoded++;
 	self->time = (double)self->frames_decoded / self->framerate;
-	
+
+	plm_video_update_dirty(self, frame);
 	return frame;
 }
 
@@ -2893,16 +5024,28 @@ int plm_video_decode_sequence_header(plm_video_t *self) {
 		memcpy(self->non_intra_quant_matrix, PLM_VIDEO_NON_INTRA_QUANT_MATRIX, 64);
 	}
 
+	plm_video_init_quant_tables(self);
+
 	self->mb_width = (self->width + 15) >> 4;
 	self->mb_height = (self->height + 15) >> 4;
 	self->mb_size = self->mb_width * self->mb_height;
 
-	self->luma_width = self->mb_width << 4;
-	self->luma_height = self->mb_height << 4;
+	plm_video_init_frames(self);
+
+	self->has_sequence_header = TRUE;
+	return TRUE;
+}
 
-	self->chroma_width = self->mb_width << 3;
-	self->chroma_height = self->mb_height << 3;
+void plm_video_init_frames(plm_video_t *self) {
+	self->luma_width = (self->mb_width << 4) >> self->scale_shift;
+	self->luma_height = (self->mb_height << 4) >> self->scale_shift;
 
+	self->chroma_width = (self->mb_width << 3) >> self->scale_shift;
+	self->chroma_height = (self->mb_height << 3) >> self->scale_shift;
+	if (self->grayscale) {
+		self->chroma_width = 0;
+		self->chroma_height = 0;
+	}
 
 	// Allocate one big chunk of data for all 3 frames = 9 planes
 	uint32_t luma_plane_size = self->luma_width * self->luma_height;
@@ -2914,16 +5057,35 @@ int plm_video_decode_sequence_header(plm_video_t *self) {
 	plm_video_init_frame(self, &self->frame_forward, self->frames_data + frame_data_size * 1);
 	plm_video_init_frame(self, &self->frame_backward, self->frames_data + frame_data_size * 2);
 
-	self->has_sequence_header = TRUE;
-	return TRUE;
+	// Nothing was returned yet, so the first frame is dirty everywhere
+	self->origins_data = (uint32_t *)PLM_MALLOC(self->mb_size * (4 * sizeof(uint32_t) + 1));
+	self->origins_current = self->origins_data;
+	self->origins_forward = self->origins_current + self->mb_size;
+	self->origins_backward = self->origins_forward + self->mb_size;
+	self->origins_returned = self->origins_backward + self->mb_size;
+	self->dirty = (uint8_t *)(self->origins_returned + self->mb_size);
+	memset(self->origins_data, 0, self->mb_size * 3 * sizeof(uint32_t));
+	memset(self->origins_returned, 0xff, self->mb_size * sizeof(uint32_t));
+}
+
+void plm_video_realloc_frames(plm_video_t *self) {
+	// Frames exist once the sequence header is known; the reference frames
+	// are lost with them
+	if (self->has_sequence_header) {
+		PLM_FREE(self->frames_data);
+		PLM_FREE(self->origins_data);
+		plm_video_init_frames(self);
+		self->has_reference_frame = FALSE;
+	}
 }
 
 void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base) {
 	uint32_t luma_plane_size = self->luma_width * self->luma_height;
 	uint32_t chroma_plane_size = self->chroma_width * self->chroma_height;
+	int round = (1 << self->scale_shift) - 1;
 
-	frame->width = self->width;
-	frame->height = self->height;
+	frame->width = (self->width + round) >> self->scale_shift;
+	frame->height = (self->height + round) >> self->scale_shift;
 	frame->y.width = self->luma_width;
 	frame->y.height = self->luma_height;
 	frame->y.data = base;
@@ -2935,6 +5097,64 @@ void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base)
 	frame->cb.width = self->chroma_width;
 	frame->cb.height = self->chroma_height;
 	frame->cb.data = base + luma_plane_size + chroma_plane_size;
+	if (self->grayscale) {
+		frame->cr.data = NULL;
+		frame->cb.data = NULL;
+	}
+	frame->rgb565 = NULL;
+	frame->dirty = NULL;
+	frame->dirty_macroblocks = 0;
+	frame->macroblock_size = 16 >> self->scale_shift;
+}
+
+uint32_t *plm_video_origins(plm_video_t *self, plm_frame_t *frame) {
+	if (frame == &self->frame_forward) {
+		return self->origins_forward;
+	}
+	else if (frame == &self->frame_backward) {
+		return self->origins_backward;
+	}
+	return self->origins_current;
+}
+
+void plm_video_update_dirty(plm_video_t *self, plm_frame_t *frame) {
+	// A macroblock is clean if it still holds the pixels of the same picture
+	// as in the frame returned before
+	uint32_t *origins = plm_video_origins(self, frame);
+	unsigned int count = 0;
+	for (int i = 0; i < self->mb_size; i++) {
+		self->dirty[i] = origins[i] != self->origins_returned[i];
+		count += self->dirty[i];
+	}
+	memcpy(self->origins_returned, origins, self->mb_size * sizeof(uint32_t));
+	frame->dirty = self->dirty;
+	frame->dirty_macroblocks = count;
+}
+
+int plm_video_is_late_b_picture(plm_video_t *self) {
+	// B-pictures are shown right away, at the current time
+	if (
+		self->assume_no_b_frames ||
+		self->time + 1.0 / self->framerate >= self->drop_time ||
+		!plm_buffer_has(self->buffer, 13)
+	) {
+		return FALSE;
+	}
+
+	// Peek past temporal_reference at picture_coding_type
+	return (plm_buffer_peek(self->buffer, 13) & 0x07) == PLM_VIDEO_PICTURE_TYPE_B;
+}
+
+void plm_video_skip_picture(plm_video_t *self) {
+	// Jump over the slices, extension and user data of the picture without
+	// parsing them
+	do {
+		self->start_code = plm_buffer_next_start_code(self->buffer);
+	} while (
+		PLM_START_IS_SLICE(self->start_code) ||
+		self->start_code == PLM_START_EXTENSION ||
+		self->start_code == PLM_START_USER_DATA
+	);
 }
 
 void plm_video_decode_picture(plm_video_t *self) {
@@ -2973,12 +5193,15 @@ void plm_video_decode_picture(plm_video_t *self) {
 	}
 
 	plm_frame_t frame_temp = self->frame_forward;
+	uint32_t *origins_temp = self->origins_forward;
 	if (
 		self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA ||
 		self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE
 	) {
 		self->frame_forward = self->frame_backward;
+		self->origins_forward = self->origins_backward;
 	}
+	self->picture_serial++;
 
 
 	// Find first slice start code; skip extension and user data
@@ -2989,8 +5212,27 @@ void plm_video_decode_picture(plm_video_t *self) {
 		self->start_code == PLM_START_USER_DATA
 	);
 
+	self->frame_current.skipped_macroblocks = 0;
+	plm_video_init_window(self);
+
+	// B-pictures can go straight to RGB565; reference pictures are converted
+	// by the caller once they are returned
+	self->frame_current.rgb565 = NULL;
+	if (
+		self->picture_type == PLM_VIDEO_PICTURE_TYPE_B &&
+		self->rgb565_target && !self->grayscale
+	) {
+		self->frame_current.rgb565 = self->rgb565_target;
+	}
+
 	// Decode all slices
+	if (self->workers) {
+		plm_video_decode_slices_threaded(self);
+	}
 	while (PLM_START_IS_SLICE(self->start_code)) {
+		if (plm_video_skip_hidden_slice(self)) {
+			continue;
+		}
 		plm_video_decode_slice(self, self->start_code & 0x000000FF);
 		if (self->macroblock_address >= self->mb_size - 2) {
 			break;
@@ -3005,7 +5247,83 @@ void plm_video_decode_picture(plm_video_t *self) {
 	) {
 		self->frame_backward = self->frame_current;
 		self->frame_current = frame_temp;
+		self->origins_backward = self->origins_current;
+		self->origins_current = origins_temp;
+	}
+}
+
+void plm_video_init_window(plm_video_t *self) {
+	// A reference picture can supply pixels to any part of the pictures that
+	// follow up to the next intra picture: vectors reach up to 1024 pixels per
+	// step, with no limit on the steps. A margin of the vector range of the
+	// picture (r_size) would not do, since every P-picture after it adds its
+	// own. Only B-pictures, which nothing is predicted from, can safely be
+	// clipped to the visible rect.
+	self->window_x0 = 0;
+	self->window_y0 = 0;
+	self->window_x1 = self->mb_width;
+	self->window_y1 = self->mb_height;
+	if (
+		self->visible_width > 0 && self->visible_height > 0 &&
+		self->picture_type == PLM_VIDEO_PICTURE_TYPE_B
+	) {
+		int size = 16 >> self->scale_shift;
+		int x0 = self->visible_x / size;
+		int y0 = self->visible_y / size;
+		int x1 = (self->visible_x + self->visible_width + size - 1) / size;
+		int y1 = (self->visible_y + self->visible_height + size - 1) / size;
+		self->window_x0 = x0 > 0 ? x0 : 0;
+		self->window_y0 = y0 > 0 ? y0 : 0;
+		self->window_x1 = x1 < self->mb_width ? x1 : self->mb_width;
+		self->window_y1 = y1 < self->mb_height ? y1 : self->mb_height;
+		if (self->window_x1 < self->window_x0 || self->window_y1 < self->window_y0) {
+			self->window_x1 = self->window_x0;
+			self->window_y1 = self->window_y0;
+		}
+	}
+
+	int decoded = (self->window_x1 - self->window_x0) * (self->window_y1 - self->window_y0);
+	self->frame_current.hidden_macroblocks = self->mb_size - decoded;
+	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B) {
+		self->hidden_macroblocks += self->mb_size - decoded;
+		self->b_macroblocks += self->mb_size;
+	}
+}
+
+int plm_video_skip_hidden_slice(plm_video_t *self) {
+	// Slices decode independently, so one that lies completely outside the
+	// window is not parsed at all. Returns TRUE with the start code after it
+	// read if so.
+	int slice = self->start_code & 0x000000FF;
+	if (slice - 1 < self->window_y0) {
+		// Look ahead to the row the next slice starts in
+		if (!plm_video_slice_is_hidden(self, slice, plm_buffer_peek_start_code(self->buffer))) {
+			return FALSE;
+		}
+	}
+	else if (slice - 1 < self->window_y1) {
+		return FALSE;
+	}
+	self->start_code = plm_buffer_next_start_code(self->buffer);
+	return TRUE;
+}
+
+int plm_video_slice_is_hidden(plm_video_t *self, int slice, int next_start_code) {
+	// A slice covers the rows from its own to the one the next slice starts
+	// in, or to the end of the picture
+	if (slice - 1 >= self->window_y1) {
+		return TRUE;
+	}
+	if (!PLM_START_IS_SLICE(next_start_code)) {
+		return FALSE;
 	}
+	return (next_start_code & 0x000000FF) - 1 < self->window_y0;
+}
+
+int plm_video_macroblock_is_hidden(plm_video_t *self) {
+	int col = self->mb_col;
+	int row = self->mb_row;
+	return (col < self->window_x0 || col >= self->window_x1 || row < self->window_y0 || row >= self->window_y1);
 }
 
 void plm_video_decode_slice(plm_video_t *self, int slice) {
@@ -3019,7 +5337,7 @@ void plm_video_decode_slice(plm_video_t *self, int slice) {
 	self->dc_predictor[1] = 128;
 	self->dc_predictor[2] = 128;
 
-	self->quantizer_scale = plm_buffer_read(self->buffer, 5);
+	plm_video_set_quantizer_scale(self, plm_buffer_read(self->buffer, 5));
 
 	// Skip extra
 	while (plm_buffer_read(self->buffer, 1)) {
@@ -3034,19 +5352,85 @@ void plm_video_decode_slice(plm_video_t *self, int slice) {
 	);
 }
 
+void plm_video_decode_slices_threaded(plm_video_t *self) {
+	// Collect all slices of the picture
+	self->slice_count = 0;
+	self->slice_data_length = 0;
+	while (PLM_START_IS_SLICE(self->start_code)) {
+		if (self->slice_count == self->slice_capacity) {
+			self->slice_capacity = self->slice_capacity ? self->slice_capacity * 2 : self->mb_height;
+			self->slices = (plm_video_slice_t *)PLM_REALLOC(self->slices, sizeof(plm_video_slice_t) * self->slice_capacity);
+		}
+		plm_video_slice_t *slice = &self->slices[self->slice_count++];
+		slice->slice = self->start_code & 0x000000FF;
+		slice->offset = self->slice_data_length;
+		self->start_code = plm_buffer_next_start_code_append(
+			self->buffer, &self->slice_data, &self->slice_data_length, &self->slice_data_capacity);
+		slice->length = self->slice_data_length - slice->offset;
+
+		// Drop it again if it need not be decoded
+		if (plm_video_slice_is_hidden(self, slice->slice, self->start_code)) {
+			self->slice_data_length = slice->offset;
+			self->slice_count--;
+		}
+	}
+
+	// Hand each worker a copy of the decoder state and decode them together
+	for (int i = 0; i < self->thread_count; i++) {
+		plm_video_worker_t *worker = &self->workers[i];
+		*worker->state = *self;
+		worker->state->buffer = worker->buffer;
+	}
+	self->next_slice = 0;
+	for (int i = 1; i < self->thread_count; i++) {
+		plm_semaphore_post(&self->workers[i].start);
+	}
+	plm_video_decode_worker_slices(&self->workers[0]);
+	for (int i = 1; i < self->thread_count; i++) {
+		plm_semaphore_wait(&self->workers_done);
+	}
+
+	for (int i = 0; i < self->thread_count; i++) {
+		self->frame_current.skipped_macroblocks += self->workers[i].state->frame_current.skipped_macroblocks;
+	}
+}
+
+void plm_video_decode_worker_slices(plm_video_worker_t *worker) {
+	plm_video_t *parent = worker->parent;
+	int i;
+	while ((i = PLM_ATOMIC_FETCH_ADD(&parent->next_slice, 1)) < parent->slice_count) {
+		plm_video_slice_t *slice = &parent->slices[i];
+		plm_buffer_reset_memory(worker->buffer, parent->slice_data + slice->offset, slice->length);
+		plm_video_decode_slice(worker->state, slice->slice);
+	}
+}
+
+void plm_video_worker_thread(void *arg) {
+	plm_video_worker_t *worker = (plm_video_worker_t *)arg;
+	plm_video_t *parent = worker->parent;
+	while (TRUE) {
+		plm_semaphore_wait(&worker->start);
+		if (PLM_ATOMIC_LOAD(&parent->workers_stop)) {
+			break;
+		}
+		plm_video_decode_worker_slices(worker);
+		plm_semaphore_post(&parent->workers_done);
+	}
+}
+
 void plm_video_decode_macroblock(plm_video_t *self) {
 	// Decode increment
 	int increment = 0;
-	int t = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+	int t = plm_buffer_read_vlc_lookup(self->buffer, self->macroblock_address_increment_lookup);
 
 	while (t == 34) {
 		// macroblock_stuffing
-		t = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+		t = plm_buffer_read_vlc_lookup(self->buffer, self->macroblock_address_increment_lookup);
 	}
 	while (t == 35) {
 		// macroblock_escape
 		increment += 33;
-		t = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+		t = plm_buffer_read_vlc_lookup(self->buffer, self->macroblock_address_increment_lookup);
 	}
 	increment += t;
 
@@ -3075,13 +5459,8 @@ void plm_video_decode_macroblock(plm_video_t *self) {
 		}
 
 		// Predict skipped macroblocks
-		while (increment > 1) {
-			self->macroblock_address++;
-			self->mb_row = self->macroblock_address / self->mb_width;
-			self->mb_col = self->macroblock_address % self->mb_width;
-
-			plm_video_predict_macroblock(self);
-			increment--;
+		if (increment > 1) {
+			plm_video_skip_macroblocks(self, increment - 1);
 		}
 		self->macroblock_address++;
 	}
@@ -3092,10 +5471,11 @@ void plm_video_decode_macroblock(plm_video_t *self) {
 	if (self->mb_col >= self->mb_width || self->mb_row >= self->mb_height) {
 		return; // corrupt stream;
 	}
+	self->macroblock_hidden = plm_video_macroblock_is_hidden(self);
 
 	// Process the current macroblock
-	const plm_vlc_t *table = PLM_VIDEO_MACROBLOCK_TYPE[self->picture_type];
-	self->macroblock_type = plm_buffer_read_vlc(self->buffer, table);
+	const plm_vlc_lookup_t *lookup = self->macroblock_type_lookup[self->picture_type];
+	self->macroblock_type = plm_buffer_read_vlc_lookup(self->buffer, lookup);
 
 	self->macroblock_intra = (self->macroblock_type & 0x01);
 	self->motion_forward.is_set = (self->macroblock_type & 0x08);
@@ -3103,7 +5483,7 @@ void plm_video_decode_macroblock(plm_video_t *self) {
 
 	// Quantizer scale
 	if ((self->macroblock_type & 0x10) != 0) {
-		self->quantizer_scale = plm_buffer_read(self->buffer, 5);
+		plm_video_set_quantizer_scale(self, plm_buffer_read(self->buffer, 5));
 	}
 
 	if (self->macroblock_intra) {
@@ -3118,12 +5498,14 @@ void plm_video_decode_macroblock(plm_video_t *self) {
 		self->dc_predictor[2] = 128;
 
 		plm_video_decode_motion_vectors(self);
-		plm_video_predict_macroblock(self);
+		if (!self->macroblock_hidden) {
+			plm_video_predict_macroblock(self);
+		}
 	}
 
 	// Decode blocks
 	int cbp = ((self->macroblock_type & 0x02) != 0)
-		? plm_buffer_read_vlc(self->buffer, PLM_VIDEO_CODE_BLOCK_PATTERN)
+		? plm_buffer_read_vlc_lookup(self->buffer, self->code_block_pattern_lookup)
 		: (self->macroblock_intra ? 0x3f : 0);
 
 	for (int block = 0, mask = 0x20; block < 6; block++) {
@@ -3132,6 +5514,149 @@ void plm_video_decode_macroblock(plm_video_t *self) {
 		}
 		mask >>= 1;
 	}
+
+	// Without coded blocks a prediction with zero motion leaves the pixels of
+	// the reference frame as they were
+	if (!self->macroblock_hidden) {
+		plm_frame_t *s = cbp == 0 ? plm_video_zero_motion_source(self) : NULL;
+		self->origins_current[self->macroblock_address] = s
+			? plm_video_origins(self, s)[self->macroblock_address]
+			: self->picture_serial;
+	}
+
+	if (self->frame_current.rgb565) {
+		plm_video_convert_macroblocks(self, self->macroblock_address, 1);
+	}
+}
+
+void plm_video_skip_macroblocks(plm_video_t *self, int count) {
+	// Skipped macroblocks repeat the prediction of the one before them. When
+	// that is a copy from a single reference frame with zero motion - always
+	// the case in P-pictures - the whole run is copied plane by plane.
+	plm_frame_t *s = plm_video_zero_motion_source(self);
+	if (!s) {
+		while (count > 0) {
+			self->macroblock_address++;
+			self->mb_row = self->macroblock_address / self->mb_width;
+			self->mb_col = self->macroblock_address % self->mb_width;
+
+			if (!plm_video_macroblock_is_hidden(self)) {
+				plm_video_predict_macroblock(self);
+				self->origins_current[self->macroblock_address] = self->picture_serial;
+				if (self->frame_current.rgb565) {
+					plm_video_convert_macroblocks(self, self->macroblock_address, 1);
+				}
+			}
+			count--;
+		}
+		return;
+	}
+
+	plm_frame_t *d = &self->frame_current;
+	int address = self->macroblock_address + 1;
+	int shift = self->scale_shift;
+	plm_video_copy_macroblock_run(self, s->y.data, d->y.data, address, count, 16 >> shift);
+	if (!self->grayscale) {
+		plm_video_copy_macroblock_run(self, s->cr.data, d->cr.data, address, count, 8 >> shift);
+		plm_video_copy_macroblock_run(self, s->cb.data, d->cb.data, address, count, 8 >> shift);
+	}
+	memcpy(self->origins_current + address, plm_video_origins(self, s) + address, count * sizeof(uint32_t));
+	d->skipped_macroblocks += count;
+	if (d->rgb565) {
+		plm_video_convert_macroblocks(self, address, count);
+	}
+
+	self->macroblock_address += count;
+	self->mb_row = self->macroblock_address / self->mb_width;
+	self->mb_col = self->macroblock_address % self->mb_width;
+}
+
+plm_frame_t *plm_video_zero_motion_source(plm_video_t *self) {
+	// The reference frame the current macroblock is predicted from with zero
+	// motion, or NULL if it is predicted otherwise
+	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE) {
+		if (self->motion_forward.h == 0 && self->motion_forward.v == 0) {
+			return &self->frame_forward;
+		}
+	}
+	else if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B) {
+		if (self->motion_forward.is_set) {
+			if (
+				!self->motion_backward.is_set &&
+				self->motion_forward.h == 0 && self->motion_forward.v == 0
+			) {
+				return &self->frame_forward;
+			}
+		}
+		else if (self->motion_backward.h == 0 && self->motion_backward.v == 0) {
+			return &self->frame_backward;
+		}
+	}
+	return NULL;
+}
+
+void plm_video_convert_macroblocks(plm_video_t *self, int address, int count) {
+	// Convert the run one macroblock row at a time, clipped to the window and
+	// to the size of the frame
+	plm_frame_t *frame = &self->frame_current;
+	int size = 16 >> self->scale_shift;
+	while (count > 0) {
+		int row = address / self->mb_width;
+		int col = address % self->mb_width;
+		int cols = self->mb_width - col;
+		if (cols > count) {
+			cols = count;
+		}
+		address += cols;
+		count -= cols;
+
+		int x0 = col > self->window_x0 ? col : self->window_x0;
+		int x1 = col + cols < self->window_x1 ? col + cols : self->window_x1;
+		if (row < self->window_y0 || row >= self->window_y1 || x0 >= x1) {
+			continue;
+		}
+		int x = x0 * size;
+		int y = row * size;
+		int width = x1 * size > (int)frame->width ? (int)frame->width - x : (x1 - x0) * size;
+		int height = y + size > (int)frame->height ? (int)frame->height - y : size;
+		if (width <= 0 || height <= 0) {
+			continue;
+		}
+		if (self->rgb565_big_endian) {
+			plm_frame_rect_to_rgb565_be(frame, x, y, width, height, frame->rgb565, self->rgb565_stride);
+		}
+		else {
+			plm_frame_rect_to_rgb565(frame, x, y, width, height, frame->rgb565, self->rgb565_stride);
+		}
+	}
+}
+
+void plm_video_copy_macroblock_run(plm_video_t *self, uint8_t *s, uint8_t *d, int address, int count, int block_size) {
+	int dw = self->mb_width * block_size;
+	while (count > 0) {
+		int row = address / self->mb_width;
+		int col = address % self->mb_width;
+		unsigned int di = (row * dw + col) * block_size;
+
+		if (col == 0 && count >= self->mb_width) {
+			// Whole macroblock rows are contiguous in the plane
+			int rows = count / self->mb_width;
+			memcpy(d + di, s + di, rows * block_size * dw);
+			address += rows * self->mb_width;
+			count -= rows * self->mb_width;
+			continue;
+		}
+
+		int cols = self->mb_width - col;
+		if (cols > count) {
+			cols = count;
+		}
+		for (int y = 0; y < block_size; y++, di += dw) {
+			memcpy(d + di, s + di, cols * block_size);
+		}
+		address += cols;
+		count -= cols;
+	}
 }
 
 void plm_video_decode_motion_vectors(plm_video_t *self) {
@@ -3157,7 +5682,7 @@ void plm_video_decode_motion_vectors(plm_video_t *self) {
 
 int plm_video_decode_motion_vector(plm_video_t *self, int r_size, int motion) {
 	int fscale = 1 << r_size;
-	int m_code = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MOTION);
+	int m_code = plm_buffer_read_vlc_lookup(self->buffer, self->motion_lookup);
 	int r = 0;
 	int d;
 
@@ -3216,18 +5741,35 @@ void plm_video_predict_macroblock(plm_video_t *self) {
 	}
 }
 
+// Motion vectors are in half pixels of the coded size; downscaled decoding
+// divides them like the chroma vectors, rounding towards zero.
+
 void plm_video_copy_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v) {
 	plm_frame_t *d = &self->frame_current;
-	plm_video_process_macroblock(self, s->y.data, d->y.data, motion_h, motion_v, 16, FALSE);
-	plm_video_process_macroblock(self, s->cr.data, d->cr.data, motion_h / 2, motion_v / 2, 8, FALSE);
-	plm_video_process_macroblock(self, s->cb.data, d->cb.data, motion_h / 2, motion_v / 2, 8, FALSE);
+	int shift = self->scale_shift;
+	int luma_h = motion_h / (1 << shift);
+	int luma_v = motion_v / (1 << shift);
+	int chroma_h = motion_h / (2 << shift);
+	int chroma_v = motion_v / (2 << shift);
+	plm_video_process_macroblock(self, s->y.data, d->y.data, luma_h, luma_v, 16 >> shift, FALSE);
+	if (!self->grayscale) {
+		plm_video_process_macroblock(self, s->cr.data, d->cr.data, chroma_h, chroma_v, 8 >> shift, FALSE);
+		plm_video_process_macroblock(self, s->cb.data, d->cb.data, chroma_h, chroma_v, 8 >> shift, FALSE);
+	}
 }
 
 void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v) {
 	plm_frame_t *d = &self->frame_current;
-	plm_video_process_macroblock(self, s->y.data, d->y.data, motion_h, motion_v, 16, TRUE);
-	plm_video_process_macroblock(self, s->cr.data, d->cr.data, motion_h / 2, motion_v / 2, 8, TRUE);
-	plm_video_process_macroblock(self, s->cb.data, d->cb.data, motion_h / 2, motion_v / 2, 8, TRUE);
+	int shift = self->scale_shift;
+	int luma_h = motion_h / (1 << shift);
+	int luma_v = motion_v / (1 << shift);
+	int chroma_h = motion_h / (2 << shift);
+	int chroma_v = motion_v / (2 << shift);
+	plm_video_process_macroblock(self, s->y.data, d->y.data, luma_h, luma_v, 16 >> shift, TRUE);
+	if (!self->grayscale) {
+		plm_video_process_macroblock(self, s->cr.data, d->cr.data, chroma_h, chroma_v, 8 >> shift, TRUE);
+		plm_video_process_macroblock(self, s->cb.data, d->cb.data, chroma_h, chroma_v, 8 >> shift, TRUE);
+	}
 }
 
 #define PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SOURCE_WIDTH, BLOCK_SIZE, OP) do { \
@@ -3242,6 +5784,145 @@ void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int mot
 		DEST_INDEX += dest_scan; \
 	}} while(FALSE)
 
+// Write a SIZE x SIZE block to DEST. VALUE is evaluated for each pixel with
+// SOURCE_INDEX running over the block; intra blocks replace the pixel,
+// others add to the prediction.
+#define PLM_BLOCK_PUT(INTRA, DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SIZE, VALUE) do { \
+	if (INTRA) { \
+		PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SIZE, SIZE, plm_clamp(VALUE)); \
+	} \
+	else { \
+		PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SIZE, SIZE, plm_clamp(DEST[DEST_INDEX] + (VALUE))); \
+	}} while(FALSE)
+
+// Motion compensation kernels. Each predicts a block_size square of d from s,
+// both dw bytes per row, a vector of WIDTH pixels at a time. mode holds the
+// interpolate, odd_h and odd_v bits of plm_video_process_macroblock(). AVG is
+// the rounded average of two vectors of pixels and AVG4 that of four, both
+// exact, so the result is the same as averaging pixel by pixel.
+
+#define PLM_MB_CASE(INTERPOLATE, ODD_H, ODD_V, WIDTH, STORE, OP) \
+	case ((INTERPOLATE << 2) | (ODD_H << 1) | (ODD_V)): \
+		for (int y = 0; y < block_size; y++, s += dw, d += dw) { \
+			for (int x = 0; x < block_size; x += WIDTH) { \
+				STORE(d + x, OP); \
+			} \
+		} \
+		break
+
+#define PLM_DEFINE_MB_PREDICT(NAME, WIDTH, LOAD, STORE, AVG, AVG4) \
+	static void NAME(const uint8_t *s, uint8_t *d, int dw, int block_size, int mode) { \
+		switch (mode) { \
+			PLM_MB_CASE(0, 0, 0, WIDTH, STORE, LOAD(s + x)); \
+			PLM_MB_CASE(0, 0, 1, WIDTH, STORE, AVG(LOAD(s + x), LOAD(s + x + dw))); \
+			PLM_MB_CASE(0, 1, 0, WIDTH, STORE, AVG(LOAD(s + x), LOAD(s + x + 1))); \
+			PLM_MB_CASE(0, 1, 1, WIDTH, STORE, AVG4(LOAD(s + x), LOAD(s + x + 1), LOAD(s + x + dw), LOAD(s + x + dw + 1))); \
+			PLM_MB_CASE(1, 0, 0, WIDTH, STORE, AVG(LOAD(d + x), LOAD(s + x))); \
+			PLM_MB_CASE(1, 0, 1, WIDTH, STORE, AVG(LOAD(d + x), AVG(LOAD(s + x), LOAD(s + x + dw)))); \
+			PLM_MB_CASE(1, 1, 0, WIDTH, STORE, AVG(LOAD(d + x), AVG(LOAD(s + x), LOAD(s + x + 1)))); \
+			PLM_MB_CASE(1, 1, 1, WIDTH, STORE, AVG(LOAD(d + x), AVG4(LOAD(s + x), LOAD(s + x + 1), LOAD(s + x + dw), LOAD(s + x + dw + 1)))); \
+		} \
+	}
+
+// Blocks narrower than a vector, in downscaled decoding, go pixel by pixel
+#define PLM_SCALAR_LOAD(P) (*(P))
+#define PLM_SCALAR_STORE(P, V) (*(P) = (uint8_t)(V))
+#define PLM_SCALAR_AVG(A, B) (((A) + (B) + 1) >> 1)
+#define PLM_SCALAR_AVG4(A, B, C, D) (((A) + (B) + (C) + (D) + 2) >> 2)
+
+PLM_DEFINE_MB_PREDICT(plm_video_predict_scalar, 1, PLM_SCALAR_LOAD, PLM_SCALAR_STORE, PLM_SCALAR_AVG, PLM_SCALAR_AVG4)
+
+#if defined(__SSE2__)
+
+static inline __m128i plm_mm_avg4_epu8(__m128i a, __m128i b, __m128i c, __m128i d) {
+	// Sum in 16 bit lanes; pavgb of pavgb results can be off by one
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(2);
+	__m128i lo = _mm_add_epi16(
+		_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+		_mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)));
+	__m128i hi = _mm_add_epi16(
+		_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+		_mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)));
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+	return _mm_packus_epi16(lo, hi);
+}
+
+#define PLM_MM_LOAD_16(P) _mm_loadu_si128((const __m128i *)(P))
+#define PLM_MM_STORE_16(P, V) _mm_storeu_si128((__m128i *)(P), V)
+#define PLM_MM_LOAD_8(P) _mm_loadl_epi64((const __m128i *)(P))
+#define PLM_MM_STORE_8(P, V) _mm_storel_epi64((__m128i *)(P), V)
+
+PLM_DEFINE_MB_PREDICT(plm_video_predict_sse2_16, 16, PLM_MM_LOAD_16, PLM_MM_STORE_16, _mm_avg_epu8, plm_mm_avg4_epu8)
+PLM_DEFINE_MB_PREDICT(plm_video_predict_sse2_8, 8, PLM_MM_LOAD_8, PLM_MM_STORE_8, _mm_avg_epu8, plm_mm_avg4_epu8)
+
+#else
+
+// Whether 32-bit words may be loaded from and stored to any address. If not,
+// unaligned source words are put together from the two aligned words around
+// them. Destination blocks are always word aligned.
+#ifndef PLM_UNALIGNED_ACCESS
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64) || defined(__ARM_FEATURE_UNALIGNED)
+#define PLM_UNALIGNED_ACCESS 1
+#else
+#define PLM_UNALIGNED_ACCESS 0
+#endif
+#endif
+
+static inline uint32_t plm_swar_load(const uint8_t *p) {
+#if PLM_UNALIGNED_ACCESS
+	uint32_t word;
+	memcpy(&word, p, 4);
+	return word;
+#else
+	const uint32_t *words = (const uint32_t *)((uintptr_t)p & ~(uintptr_t)3);
+	unsigned int shift = ((uintptr_t)p & 3) * 8;
+	if (shift == 0) {
+		return words[0];
+	}
+	// Written as a 64-bit shift, which compilers turn into a funnel shift
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (uint32_t)((((uint64_t)words[0] << 32) | words[1]) >> (32 - shift));
+#else
+	return (uint32_t)((((uint64_t)words[1] << 32) | words[0]) >> shift);
+#endif
+#endif
+}
+
+static inline void plm_swar_store(uint8_t *p, uint32_t word) {
+#if PLM_UNALIGNED_ACCESS
+	memcpy(p, &word, 4);
+#else
+	*(uint32_t *)p = word;
+#endif
+}
+
+static inline uint32_t plm_swar_avg(uint32_t a, uint32_t b) {
+	// (a + b + 1) >> 1 for each byte, without carries between them
+	return (a | b) - (((a ^ b) >> 1) & 0x7f7f7f7f);
+}
+
+static inline uint32_t plm_swar_avg4(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+	// (a + b + c + d + 2) >> 2 for each byte: the upper 6 bits of each byte
+	// are added on their own, the lower 2 bits and the rounding add up to at
+	// most 14 and contribute their carry.
+	uint32_t lo =
+		(a & 0x03030303) + (b & 0x03030303) + (c & 0x03030303) + (d & 0x03030303) +
+		0x02020202;
+	uint32_t hi =
+		((a >> 2) & 0x3f3f3f3f) + ((b >> 2) & 0x3f3f3f3f) +
+		((c >> 2) & 0x3f3f3f3f) + ((d >> 2) & 0x3f3f3f3f);
+	return hi + ((lo >> 2) & 0x03030303);
+}
+
+PLM_DEFINE_MB_PREDICT(plm_video_predict_swar, 4, plm_swar_load, plm_swar_store, plm_swar_avg, plm_swar_avg4)
+
+#endif
+
+#undef PLM_DEFINE_MB_PREDICT
+#undef PLM_MB_CASE
+
 void plm_video_process_macroblock(
 	plm_video_t *self, uint8_t *s, uint8_t *d,
 	int motion_h, int motion_v, int block_size, int interpolate
@@ -3261,30 +5942,31 @@ void plm_video_process_macroblock(
 		return; // corrupt video
 	}
 
-	#define PLM_MB_CASE(INTERPOLATE, ODD_H, ODD_V, OP) \
-		case ((INTERPOLATE << 2) | (ODD_H << 1) | (ODD_V)): \
-			PLM_BLOCK_SET(d, di, dw, si, dw, block_size, OP); \
-			break
-
-	switch ((interpolate << 2) | (odd_h << 1) | (odd_v)) {
-		PLM_MB_CASE(0, 0, 0, (s[si]));
-		PLM_MB_CASE(0, 0, 1, (s[si] + s[si + dw] + 1) >> 1);
-		PLM_MB_CASE(0, 1, 0, (s[si] + s[si + 1] + 1) >> 1);
-		PLM_MB_CASE(0, 1, 1, (s[si] + s[si + 1] + s[si + dw] + s[si + dw + 1] + 2) >> 2);
-
-		PLM_MB_CASE(1, 0, 0, (d[di] + (s[si]) + 1) >> 1);
-		PLM_MB_CASE(1, 0, 1, (d[di] + ((s[si] + s[si + dw] + 1) >> 1) + 1) >> 1);
-		PLM_MB_CASE(1, 1, 0, (d[di] + ((s[si] + s[si + 1] + 1) >> 1) + 1) >> 1);
-		PLM_MB_CASE(1, 1, 1, (d[di] + ((s[si] + s[si + 1] + s[si + dw] + s[si + dw + 1] + 2) >> 2) + 1) >> 1);
+	int mode = (interpolate << 2) | (odd_h << 1) | (odd_v);
+#if defined(__SSE2__)
+	if (block_size == 16) {
+		plm_video_predict_sse2_16(s + si, d + di, dw, block_size, mode);
+	}
+	else if (block_size == 8) {
+		plm_video_predict_sse2_8(s + si, d + di, dw, block_size, mode);
+	}
+#else
+	if (block_size >= 4) {
+		plm_video_predict_swar(s + si, d + di, dw, block_size, mode);
+	}
+#endif
+	else {
+		plm_video_predict_scalar(s + si, d + di, dw, block_size, mode);
 	}
-
-	#undef PLM_MB_CASE
 }
 
 void plm_video_decode_block(plm_video_t *self, int block) {
 
 	int n = 0;
-	uint8_t *quant_matrix;
+	int rows = 0; // Bit mask of the rows holding nonzero coefficients
+	int cols = 0; // and of the columns
+	int *quant_table;
+	const uint8_t *premultiplier = self->premultiplier_matrix;
 
 	// Decode DC coefficient of intra-coded blocks
 	if (self->macroblock_intra) {
@@ -3294,7 +5976,7 @@ void plm_video_decode_block(plm_video_t *self, int block) {
 		// DC prediction
 		int plane_index = block > 3 ? block - 3 : 0;
 		predictor = self->dc_predictor[plane_index];
-		dct_size = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_DCT_SIZE[plane_index]);
+		dct_size = plm_buffer_read_vlc_lookup(self->buffer, self->dct_size_lookup[plane_index ? 1 : 0]);
 
 		// Read DC coeff
 		if (dct_size > 0) {
@@ -3314,45 +5996,42 @@ void plm_video_decode_block(plm_video_t *self, int block) {
 		self->dc_predictor[plane_index] = self->block_data[0];
 
 		// Dequantize + premultiply
-		self->block_data[0] <<= (3 + 5);
+		self->block_data[0] *= 8 * premultiplier[0];
 
-		quant_matrix = self->intra_quant_matrix;
+		quant_table = self->intra_quant_table;
 		n = 1;
+		rows = 1;
+		cols = 1;
 	}
 	else {
-		quant_matrix = self->non_intra_quant_matrix;
+		quant_table = self->non_intra_quant_table;
 	}
 
 	// Decode AC coefficients (+DC for non-intra)
-	int level = 0;
+	plm_buffer_t *buffer = self->buffer;
 	while (TRUE) {
-		int run = 0;
-		uint16_t coeff = plm_buffer_read_vlc_uint(self->buffer, PLM_VIDEO_DCT_COEFF);
-
-		if ((coeff == 0x0001) && (n > 0) && (plm_buffer_read(self->buffer, 1) == 0)) {
-			// end_of_block
-			break;
+		int run;
+		int level;
+
+		// Short codes resolve run, level, sign and end_of_block with a single
+		// peek; everything else takes the general path.
+		plm_video_dct_coeff_t coeff = {0, 0, 0};
+		if (n > 0 && plm_buffer_fill_cache(buffer, PLM_VIDEO_DCT_COEFF_LOOKUP_BITS)) {
+			coeff = self->dct_coeff_fast[plm_buffer_peek(buffer, PLM_VIDEO_DCT_COEFF_LOOKUP_BITS)];
 		}
-		if (coeff == 0xffff) {
-			// escape
-			run = plm_buffer_read(self->buffer, 6);
-			level = plm_buffer_read(self->buffer, 8);
-			if (level == 0) {
-				level = plm_buffer_read(self->buffer, 8);
-			}
-			else if (level == 128) {
-				level = plm_buffer_read(self->buffer, 8) - 256;
-			}
-			else if (level > 128) {
-				level = level - 256;
+
+		if (coeff.length) {
+			buffer->bit_index += coeff.length;
+			if (coeff.level == 0) {
+				// end_of_block
+				break;
 			}
+			run = coeff.run;
+			level = coeff.level;
 		}
-		else {
-			run = coeff >> 8;
-			level = coeff & 0xff;
-			if (plm_buffer_read(self->buffer, 1)) {
-				level = -level;
-			}
+		else if (!plm_video_decode_dct_coeff(self, n, &run, &level)) {
+			// end_of_block
+			break;
 		}
 
 		n += run;
@@ -3361,14 +6040,17 @@ void plm_video_decode_block(plm_video_t *self, int block) {
 		}
 
 		int de_zig_zagged = PLM_VIDEO_ZIG_ZAG[n];
+		int quant = quant_table[n];
 		n++;
+		rows |= 1 << (de_zig_zagged >> 3);
+		cols |= 1 << (de_zig_zagged & 7);
 
 		// Dequantize, oddify, clip
 		level <<= 1;
 		if (!self->macroblock_intra) {
 			level += (level < 0 ? -1 : 1);
 		}
-		level = (level * self->quantizer_scale * quant_matrix[de_zig_zagged]) >> 4;
+		level = (level * quant) >> 4;
 		if ((level & 1) == 0) {
 			level -= level > 0 ? 1 : -1;
 		}
@@ -3380,64 +6062,406 @@ void plm_video_decode_block(plm_video_t *self, int block) {
 		}
 
 		// Save premultiplied coefficient
-		self->block_data[de_zig_zagged] = level * PLM_VIDEO_PREMULTIPLIER_MATRIX[de_zig_zagged];
+		self->block_data[de_zig_zagged] = level * premultiplier[de_zig_zagged];
+	}
+
+	// Blocks outside the window, and chroma in grayscale mode, are only parsed
+	if (self->macroblock_hidden || (block >= 4 && self->grayscale)) {
+		memset(self->block_data, 0, sizeof(self->block_data));
+		return;
 	}
 
 	// Move block to its place
 	uint8_t *d;
 	int dw;
 	int di;
+	int shift = self->scale_shift;
+	int size = 8 >> shift;
 
 	if (block < 4) {
 		d = self->frame_current.y.data;
 		dw = self->luma_width;
-		di = (self->mb_row * self->luma_width + self->mb_col) << 4;
+		di = (self->mb_row * self->luma_width + self->mb_col) << (4 - shift);
 		if ((block & 1) != 0) {
-			di += 8;
+			di += size;
 		}
 		if ((block & 2) != 0) {
-			di += self->luma_width << 3;
+			di += self->luma_width << (3 - shift);
 		}
 	}
 	else {
 		d = (block == 4) ? self->frame_current.cb.data : self->frame_current.cr.data;
 		dw = self->chroma_width;
-		di = ((self->mb_row * self->luma_width) << 2) + (self->mb_col << 3);
+		di = (self->mb_row * self->chroma_width + self->mb_col) << (3 - shift);
 	}
 
+	// Use the smallest transform that covers the nonzero coefficients. The
+	// reduced ones write to a separate buffer, so only the coefficients that
+	// were set have to be cleared again.
 	int *s = self->block_data;
 	int si = 0;
-	if (self->macroblock_intra) {
-		// Overwrite (no prediction)
-		if (n == 1) {
-			int clamped = plm_clamp((s[0] + 128) >> 8);
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, clamped);
-			s[0] = 0;
+	int intra = self->macroblock_intra;
+	int out[64];
+	if (shift) {
+		// Downscaled: the size x size transform of the top left coefficients,
+		// which are not premultiplied. The DC alone gives the block average.
+		if (n == 1 || shift == 3) {
+			int value = (s[0] + 4) >> 3;
+			PLM_BLOCK_PUT(intra, d, di, dw, si, size, value);
+		}
+		else if (shift == 2) {
+			plm_video_idct_scaled_2(s, out);
+			PLM_BLOCK_PUT(intra, d, di, dw, si, 2, out[si]);
 		}
 		else {
-			plm_video_idct(s);
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, plm_clamp(s[si]));
-			memset(self->block_data, 0, sizeof(self->block_data));
+			plm_video_idct_scaled_4(s, out);
+			PLM_BLOCK_PUT(intra, d, di, dw, si, 4, out[si]);
 		}
-	}
-	else {
-		// Add data to the predicted macroblock
-		if (n == 1) {
-			int value = (s[0] + 128) >> 8;
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, plm_clamp(d[di] + value));
-			s[0] = 0;
+		memset(self->block_data, 0, sizeof(self->block_data));
+	}
+	else if (n == 1) {
+		// DC only
+		int value = (s[0] + 128) >> 8;
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, value);
+		s[0] = 0;
+	}
+	else if (rows == 1) {
+		// First row only; all rows of the result are the same
+		plm_video_idct_row(s, out);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, out[si & 7]);
+		memset(s, 0, 8 * sizeof(int));
+	}
+	else if (cols == 1) {
+		// First column only; each row of the result is flat
+		plm_video_idct_column(s, out);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, out[si >> 3]);
+		for (int i = 0; i < 64; i += 8) {
+			s[i] = 0;
 		}
-		else {
-			plm_video_idct(s);
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, plm_clamp(d[di] + s[si]));
-			memset(self->block_data, 0, sizeof(self->block_data));
+	}
+	else if (PLM_VIDEO_IDCT_4X4 && (rows | cols) < 16) {
+		// Top left 4x4 only
+		plm_video_idct_4x4(s, out);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, out[si]);
+		for (int i = 0; i < 32; i += 8) {
+			memset(s + i, 0, 4 * sizeof(int));
 		}
 	}
+	else {
+		plm_video_idct(s);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, s[si]);
+		memset(self->block_data, 0, sizeof(self->block_data));
+	}
 }
 
-void plm_video_idct(int *block) {
-	int
-		b1, b3, b4, b6, b7, tmp1, tmp2, m0,
+void plm_video_init_quant_tables(plm_video_t *self) {
+	for (int i = 0; i < 64; i++) {
+		int idx = PLM_VIDEO_ZIG_ZAG[i];
+		self->intra_quant_table[i] = self->quantizer_scale * self->intra_quant_matrix[idx];
+		self->non_intra_quant_table[i] = self->quantizer_scale * self->non_intra_quant_matrix[idx];
+	}
+}
+
+void plm_video_set_quantizer_scale(plm_video_t *self, int quantizer_scale) {
+	// Slices mostly repeat the scale of the previous one
+	if (quantizer_scale != self->quantizer_scale) {
+		self->quantizer_scale = quantizer_scale;
+		plm_video_init_quant_tables(self);
+	}
+}
+
+void plm_video_init_dct_coeff_fast(plm_video_t *self) {
+	const int bits = PLM_VIDEO_DCT_COEFF_LOOKUP_BITS;
+	const plm_vlc_t *table = (const plm_vlc_t *)PLM_VIDEO_DCT_COEFF;
+
+	for (uint32_t i = 0; i < (1u << bits); i++) {
+		int index = 0;
+		plm_vlc_lookup_entry_t entry = plm_vlc_walk(table, &index, i, bits);
+		uint16_t value = (uint16_t)entry.value;
+		plm_video_dct_coeff_t coeff = {0, 0, 0};
+
+		if (entry.length == 1 && value == 0x0001) {
+			// "10" is end_of_block, "11s" is run 0, level 1
+			if (((i >> (bits - 2)) & 1) == 0) {
+				coeff.length = 2;
+			}
+			else {
+				coeff.level = ((i >> (bits - 3)) & 1) ? -1 : 1;
+				coeff.length = 3;
+			}
+		}
+		else if (entry.length != 0 && value != 0xffff && entry.length < bits) {
+			int level = value & 0xff;
+			coeff.run = value >> 8;
+			coeff.level = ((i >> (bits - entry.length - 1)) & 1) ? -level : level;
+			coeff.length = entry.length + 1;
+		}
+
+		self->dct_coeff_fast[i] = coeff;
+	}
+}
+
+int plm_video_decode_dct_coeff(plm_video_t *self, int n, int *run, int *level) {
+	// General dct_coeff decoding, including escapes. Returns FALSE on
+	// end_of_block.
+	uint16_t coeff = (uint16_t)plm_buffer_read_vlc_lookup(self->buffer, self->dct_coeff_lookup);
+
+	if ((coeff == 0x0001) && (n > 0) && (plm_buffer_read(self->buffer, 1) == 0)) {
+		// end_of_block
+		return FALSE;
+	}
+	if (coeff == 0xffff) {
+		// escape
+		*run = plm_buffer_read(self->buffer, 6);
+		*level = plm_buffer_read(self->buffer, 8);
+		if (*level == 0) {
+			*level = plm_buffer_read(self->buffer, 8);
+		}
+		else if (*level == 128) {
+			*level = plm_buffer_read(self->buffer, 8) - 256;
+		}
+		else if (*level > 128) {
+			*level = *level - 256;
+		}
+	}
+	else {
+		*run = coeff >> 8;
+		*level = coeff & 0xff;
+		if (plm_buffer_read(self->buffer, 1)) {
+			*level = -*level;
+		}
+	}
+	return TRUE;
+}
+
+#if PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2 || PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2
+
+// One pass of the scalar transform below on vectors of 32-bit lanes: v[k] holds
+// coefficient k of as many rows or columns as the vector has lanes. MUL
+// multiplies by a constant, SRAI is an arithmetic shift right. The operations
+// are the same as in the scalar code, so the results are bit-exact.
+#define PLM_DEFINE_IDCT_PASS(NAME, TYPE, ADD, SUB, MUL, SRAI, SET1) \
+	static inline void NAME(TYPE *v) { \
+		TYPE round = SET1(128); \
+		TYPE b1 = v[4]; \
+		TYPE b3 = ADD(v[2], v[6]); \
+		TYPE b4 = SUB(v[5], v[3]); \
+		TYPE tmp1 = ADD(v[1], v[7]); \
+		TYPE tmp2 = ADD(v[3], v[5]); \
+		TYPE b6 = SUB(v[1], v[7]); \
+		TYPE b7 = ADD(tmp1, tmp2); \
+		TYPE m0 = v[0]; \
+		TYPE x4 = SUB(SRAI(ADD(SUB(MUL(b6, 473), MUL(b4, 196)), round), 8), b7); \
+		TYPE x0 = SUB(x4, SRAI(ADD(MUL(SUB(tmp1, tmp2), 362), round), 8)); \
+		TYPE x1 = SUB(m0, b1); \
+		TYPE x2 = SUB(SRAI(ADD(MUL(SUB(v[2], v[6]), 362), round), 8), b3); \
+		TYPE x3 = ADD(m0, b1); \
+		TYPE y3 = ADD(x1, x2); \
+		TYPE y4 = ADD(x3, b3); \
+		TYPE y5 = SUB(x1, x2); \
+		TYPE y6 = SUB(x3, b3); \
+		TYPE y7 = SUB(SUB(SET1(0), x0), SRAI(ADD(ADD(MUL(b4, 473), MUL(b6, 196)), round), 8)); \
+		v[0] = ADD(b7, y4); \
+		v[1] = ADD(x4, y3); \
+		v[2] = SUB(y5, x0); \
+		v[3] = SUB(y6, y7); \
+		v[4] = ADD(y6, y7); \
+		v[5] = ADD(x0, y5); \
+		v[6] = SUB(y3, x4); \
+		v[7] = SUB(y4, b7); \
+	}
+
+#endif
+
+#if PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2
+
+#define PLM_MM256_MUL(A, C) _mm256_mullo_epi32(A, _mm256_set1_epi32(C))
+
+PLM_DEFINE_IDCT_PASS(plm_video_idct_pass_avx2, __m256i, _mm256_add_epi32, _mm256_sub_epi32, PLM_MM256_MUL, _mm256_srai_epi32, _mm256_set1_epi32)
+
+static inline void plm_video_idct_transpose_avx2(__m256i *v) {
+	__m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+	__m256i s0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i s1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i s2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i s3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i s4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i s5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i s6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i s7 = _mm256_unpackhi_epi64(t5, t7);
+	v[0] = _mm256_permute2x128_si256(s0, s4, 0x20);
+	v[1] = _mm256_permute2x128_si256(s1, s5, 0x20);
+	v[2] = _mm256_permute2x128_si256(s2, s6, 0x20);
+	v[3] = _mm256_permute2x128_si256(s3, s7, 0x20);
+	v[4] = _mm256_permute2x128_si256(s0, s4, 0x31);
+	v[5] = _mm256_permute2x128_si256(s1, s5, 0x31);
+	v[6] = _mm256_permute2x128_si256(s2, s6, 0x31);
+	v[7] = _mm256_permute2x128_si256(s3, s7, 0x31);
+}
+
+void plm_video_idct(int *block) {
+	// Spelled out, as the loops are not unrolled at -O2 and keep v[] on the stack
+	__m256i v[8];
+	v[0] = _mm256_loadu_si256((__m256i *)(block + 0 * 8));
+	v[1] = _mm256_loadu_si256((__m256i *)(block + 1 * 8));
+	v[2] = _mm256_loadu_si256((__m256i *)(block + 2 * 8));
+	v[3] = _mm256_loadu_si256((__m256i *)(block + 3 * 8));
+	v[4] = _mm256_loadu_si256((__m256i *)(block + 4 * 8));
+	v[5] = _mm256_loadu_si256((__m256i *)(block + 5 * 8));
+	v[6] = _mm256_loadu_si256((__m256i *)(block + 6 * 8));
+	v[7] = _mm256_loadu_si256((__m256i *)(block + 7 * 8));
+
+	// Transform columns, with one row per vector
+	plm_video_idct_pass_avx2(v);
+
+	// Transform rows
+	plm_video_idct_transpose_avx2(v);
+	plm_video_idct_pass_avx2(v);
+	__m256i round = _mm256_set1_epi32(128);
+	v[0] = _mm256_srai_epi32(_mm256_add_epi32(v[0], round), 8);
+	v[1] = _mm256_srai_epi32(_mm256_add_epi32(v[1], round), 8);
+	v[2] = _mm256_srai_epi32(_mm256_add_epi32(v[2], round), 8);
+	v[3] = _mm256_srai_epi32(_mm256_add_epi32(v[3], round), 8);
+	v[4] = _mm256_srai_epi32(_mm256_add_epi32(v[4], round), 8);
+	v[5] = _mm256_srai_epi32(_mm256_add_epi32(v[5], round), 8);
+	v[6] = _mm256_srai_epi32(_mm256_add_epi32(v[6], round), 8);
+	v[7] = _mm256_srai_epi32(_mm256_add_epi32(v[7], round), 8);
+	plm_video_idct_transpose_avx2(v);
+
+	_mm256_storeu_si256((__m256i *)(block + 0 * 8), v[0]);
+	_mm256_storeu_si256((__m256i *)(block + 1 * 8), v[1]);
+	_mm256_storeu_si256((__m256i *)(block + 2 * 8), v[2]);
+	_mm256_storeu_si256((__m256i *)(block + 3 * 8), v[3]);
+	_mm256_storeu_si256((__m256i *)(block + 4 * 8), v[4]);
+	_mm256_storeu_si256((__m256i *)(block + 5 * 8), v[5]);
+	_mm256_storeu_si256((__m256i *)(block + 6 * 8), v[6]);
+	_mm256_storeu_si256((__m256i *)(block + 7 * 8), v[7]);
+}
+
+#elif PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2
+
+static inline __m128i plm_mm_mullo_epi32(__m128i a, __m128i b) {
+#if defined(__SSE4_1__)
+	return _mm_mullo_epi32(a, b);
+#else
+	// The low 32 bits of the unsigned and signed products are the same
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+}
+
+#define PLM_MM_MUL(A, C) plm_mm_mullo_epi32(A, _mm_set1_epi32(C))
+
+PLM_DEFINE_IDCT_PASS(plm_video_idct_pass_sse2, __m128i, _mm_add_epi32, _mm_sub_epi32, PLM_MM_MUL, _mm_srai_epi32, _mm_set1_epi32)
+
+static inline void plm_video_idct_transpose_4x4_sse2(__m128i *v) {
+	__m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+	__m128i t1 = _mm_unpacklo_epi32(v[2], v[3]);
+	__m128i t2 = _mm_unpackhi_epi32(v[0], v[1]);
+	__m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+	v[0] = _mm_unpacklo_epi64(t0, t1);
+	v[1] = _mm_unpackhi_epi64(t0, t1);
+	v[2] = _mm_unpacklo_epi64(t2, t3);
+	v[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static inline void plm_video_idct_transpose_sse2(__m128i *left, __m128i *right) {
+	// Transpose the four 4x4 quadrants, then swap the off-diagonal ones
+	plm_video_idct_transpose_4x4_sse2(left);
+	plm_video_idct_transpose_4x4_sse2(left + 4);
+	plm_video_idct_transpose_4x4_sse2(right);
+	plm_video_idct_transpose_4x4_sse2(right + 4);
+	__m128i t0 = right[0], t1 = right[1], t2 = right[2], t3 = right[3];
+	right[0] = left[4];
+	right[1] = left[5];
+	right[2] = left[6];
+	right[3] = left[7];
+	left[4] = t0;
+	left[5] = t1;
+	left[6] = t2;
+	left[7] = t3;
+}
+
+void plm_video_idct(int *block) {
+	// Columns 0-3 and 4-7 of each row
+	__m128i left[8], right[8];
+	left[0] = _mm_loadu_si128((__m128i *)(block + 0 * 8));
+	right[0] = _mm_loadu_si128((__m128i *)(block + 0 * 8 + 4));
+	left[1] = _mm_loadu_si128((__m128i *)(block + 1 * 8));
+	right[1] = _mm_loadu_si128((__m128i *)(block + 1 * 8 + 4));
+	left[2] = _mm_loadu_si128((__m128i *)(block + 2 * 8));
+	right[2] = _mm_loadu_si128((__m128i *)(block + 2 * 8 + 4));
+	left[3] = _mm_loadu_si128((__m128i *)(block + 3 * 8));
+	right[3] = _mm_loadu_si128((__m128i *)(block + 3 * 8 + 4));
+	left[4] = _mm_loadu_si128((__m128i *)(block + 4 * 8));
+	right[4] = _mm_loadu_si128((__m128i *)(block + 4 * 8 + 4));
+	left[5] = _mm_loadu_si128((__m128i *)(block + 5 * 8));
+	right[5] = _mm_loadu_si128((__m128i *)(block + 5 * 8 + 4));
+	left[6] = _mm_loadu_si128((__m128i *)(block + 6 * 8));
+	right[6] = _mm_loadu_si128((__m128i *)(block + 6 * 8 + 4));
+	left[7] = _mm_loadu_si128((__m128i *)(block + 7 * 8));
+	right[7] = _mm_loadu_si128((__m128i *)(block + 7 * 8 + 4));
+
+	// Transform columns
+	plm_video_idct_pass_sse2(left);
+	plm_video_idct_pass_sse2(right);
+
+	// Transform rows
+	plm_video_idct_transpose_sse2(left, right);
+	plm_video_idct_pass_sse2(left);
+	plm_video_idct_pass_sse2(right);
+	__m128i round = _mm_set1_epi32(128);
+	left[0] = _mm_srai_epi32(_mm_add_epi32(left[0], round), 8);
+	right[0] = _mm_srai_epi32(_mm_add_epi32(right[0], round), 8);
+	left[1] = _mm_srai_epi32(_mm_add_epi32(left[1], round), 8);
+	right[1] = _mm_srai_epi32(_mm_add_epi32(right[1], round), 8);
+	left[2] = _mm_srai_epi32(_mm_add_epi32(left[2], round), 8);
+	right[2] = _mm_srai_epi32(_mm_add_epi32(right[2], round), 8);
+	left[3] = _mm_srai_epi32(_mm_add_epi32(left[3], round), 8);
+	right[3] = _mm_srai_epi32(_mm_add_epi32(right[3], round), 8);
+	left[4] = _mm_srai_epi32(_mm_add_epi32(left[4], round), 8);
+	right[4] = _mm_srai_epi32(_mm_add_epi32(right[4], round), 8);
+	left[5] = _mm_srai_epi32(_mm_add_epi32(left[5], round), 8);
+	right[5] = _mm_srai_epi32(_mm_add_epi32(right[5], round), 8);
+	left[6] = _mm_srai_epi32(_mm_add_epi32(left[6], round), 8);
+	right[6] = _mm_srai_epi32(_mm_add_epi32(right[6], round), 8);
+	left[7] = _mm_srai_epi32(_mm_add_epi32(left[7], round), 8);
+	right[7] = _mm_srai_epi32(_mm_add_epi32(right[7], round), 8);
+	plm_video_idct_transpose_sse2(left, right);
+
+	_mm_storeu_si128((__m128i *)(block + 0 * 8), left[0]);
+	_mm_storeu_si128((__m128i *)(block + 0 * 8 + 4), right[0]);
+	_mm_storeu_si128((__m128i *)(block + 1 * 8), left[1]);
+	_mm_storeu_si128((__m128i *)(block + 1 * 8 + 4), right[1]);
+	_mm_storeu_si128((__m128i *)(block + 2 * 8), left[2]);
+	_mm_storeu_si128((__m128i *)(block + 2 * 8 + 4), right[2]);
+	_mm_storeu_si128((__m128i *)(block + 3 * 8), left[3]);
+	_mm_storeu_si128((__m128i *)(block + 3 * 8 + 4), right[3]);
+	_mm_storeu_si128((__m128i *)(block + 4 * 8), left[4]);
+	_mm_storeu_si128((__m128i *)(block + 4 * 8 + 4), right[4]);
+	_mm_storeu_si128((__m128i *)(block + 5 * 8), left[5]);
+	_mm_storeu_si128((__m128i *)(block + 5 * 8 + 4), right[5]);
+	_mm_storeu_si128((__m128i *)(block + 6 * 8), left[6]);
+	_mm_storeu_si128((__m128i *)(block + 6 * 8 + 4), right[6]);
+	_mm_storeu_si128((__m128i *)(block + 7 * 8), left[7]);
+	_mm_storeu_si128((__m128i *)(block + 7 * 8 + 4), right[7]);
+}
+
+#else
+
+void plm_video_idct(int *block) {
+	int
+		b1, b3, b4, b6, b7, tmp1, tmp2, m0,
 		x0, x1, x2, x3, x4, y3, y4, y5, y6, y7;
 
 	// Transform columns
@@ -3501,6 +6525,126 @@ void plm_video_idct(int *block) {
 	}
 }
 
+#endif // PLM_VIDEO_IDCT
+
+// One pass of the transform in plm_video_idct() on the coefficients v0-v7,
+// written to out[0], out[stride], ... out[7 * stride]. With descale set, the
+// results are rounded off by 8 bits like those of the row pass.
+static inline void plm_video_idct_1d(
+	int v0, int v1, int v2, int v3, int v4, int v5, int v6, int v7,
+	int *out, int stride, int descale
+) {
+	int b1 = v4;
+	int b3 = v2 + v6;
+	int b4 = v5 - v3;
+	int tmp1 = v1 + v7;
+	int tmp2 = v3 + v5;
+	int b6 = v1 - v7;
+	int b7 = tmp1 + tmp2;
+	int m0 = v0;
+	int x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
+	int x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
+	int x1 = m0 - b1;
+	int x2 = (((v2 - v6) * 362 + 128) >> 8) - b3;
+	int x3 = m0 + b1;
+	int y3 = x1 + x2;
+	int y4 = x3 + b3;
+	int y5 = x1 - x2;
+	int y6 = x3 - b3;
+	int y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
+	int round = descale ? 128 : 0;
+	int shift = descale ? 8 : 0;
+	out[0 * stride] = (b7 + y4 + round) >> shift;
+	out[1 * stride] = (x4 + y3 + round) >> shift;
+	out[2 * stride] = (y5 - x0 + round) >> shift;
+	out[3 * stride] = (y6 - y7 + round) >> shift;
+	out[4 * stride] = (y6 + y7 + round) >> shift;
+	out[5 * stride] = (x0 + y5 + round) >> shift;
+	out[6 * stride] = (y3 - x4 + round) >> shift;
+	out[7 * stride] = (y4 - b7 + round) >> shift;
+}
+
+// Reduced forms of plm_video_idct() for blocks with all nonzero coefficients
+// in the top left 4x4, in the first row or in the first column. They give the
+// same result as the full transform, but leave block unchanged and write to
+// out instead: 64 values for the 4x4 form, the one row all rows share for the
+// row form and the one value per row for the column form.
+
+void plm_video_idct_4x4(const int *block, int *out) {
+	// Transform the 4 columns, then all 8 rows of them
+	int tmp[8 * 4];
+	for (int i = 0; i < 4; i++) {
+		plm_video_idct_1d(
+			block[0 * 8 + i], block[1 * 8 + i], block[2 * 8 + i], block[3 * 8 + i], 0, 0, 0, 0,
+			tmp + i, 4, FALSE);
+	}
+	for (int i = 0; i < 8; i++) {
+		plm_video_idct_1d(
+			tmp[i * 4 + 0], tmp[i * 4 + 1], tmp[i * 4 + 2], tmp[i * 4 + 3], 0, 0, 0, 0,
+			out + i * 8, 1, TRUE);
+	}
+}
+
+void plm_video_idct_row(const int *block, int *out) {
+	// The column pass passes a lone first coefficient through unchanged
+	plm_video_idct_1d(
+		block[0], block[1], block[2], block[3], block[4], block[5], block[6], block[7],
+		out, 1, TRUE);
+}
+
+void plm_video_idct_column(const int *block, int *out) {
+	// Likewise the row pass, so only the rounding remains of it
+	plm_video_idct_1d(
+		block[0 * 8], block[1 * 8], block[2 * 8], block[3 * 8],
+		block[4 * 8], block[5 * 8], block[6 * 8], block[7 * 8],
+		out, 1, TRUE);
+}
+
+// Transforms for downscaled decoding. The 4 or 2 point inverse DCT of the top
+// left coefficients of a block, scaled by 4 / 8 or 2 / 8 in each direction,
+// gives the averages of its 2x2 or 4x4 pixel squares. The coefficients are
+// plain, not premultiplied; out holds the 4x4 or 2x2 result.
+
+static inline void plm_video_idct_scaled_4_1d(
+	int v0, int v1, int v2, int v3, int *out, int stride, int descale
+) {
+	// cos(k * pi / 8) / 2 and 1 / (2 * sqrt(2)) in 10 bit fixed point
+	int e0 = (v0 + v2) * 362;
+	int e1 = (v0 - v2) * 362;
+	int o0 = v1 * 473 + v3 * 196;
+	int o1 = v1 * 196 - v3 * 473;
+	int round = 1 << (descale - 1);
+	out[0 * stride] = (e0 + o0 + round) >> descale;
+	out[1 * stride] = (e1 + o1 + round) >> descale;
+	out[2 * stride] = (e1 - o1 + round) >> descale;
+	out[3 * stride] = (e0 - o0 + round) >> descale;
+}
+
+void plm_video_idct_scaled_4(const int *block, int *out) {
+	// The columns keep 6 fraction bits for the rows
+	int tmp[4 * 4];
+	for (int i = 0; i < 4; i++) {
+		plm_video_idct_scaled_4_1d(
+			block[i], block[i + 8], block[i + 16], block[i + 24],
+			tmp + i, 4, 4);
+	}
+	for (int i = 0; i < 4; i++) {
+		const int *v = tmp + i * 4;
+		plm_video_idct_scaled_4_1d(v[0], v[1], v[2], v[3], out + i * 4, 1, 16);
+	}
+}
+
+void plm_video_idct_scaled_2(const int *block, int *out) {
+	int a = block[0] + block[8];
+	int b = block[0] - block[8];
+	int c = block[1] + block[9];
+	int d = block[1] - block[9];
+	out[0] = (a + c + 4) >> 3;
+	out[1] = (a - c + 4) >> 3;
+	out[2] = (b + d + 4) >> 3;
+	out[3] = (b - d + 4) >> 3;
+}
+
 // YCbCr conversion following the BT.601 standard:
 // https://infogalactic.com/info/YCbCr#ITU-R_BT.601_conversion
 
@@ -3549,6 +6693,821 @@ PLM_DEFINE_FRAME_CONVERT_FUNCTION(plm_frame_to_abgr, 4, 3, 2, 1)
 #undef PLM_PUT_PIXEL
 #undef PLM_DEFINE_FRAME_CONVERT_FUNCTION
 
+// RGB565 conversion with the same BT.601 coefficients as above, but with each
+// chroma term rounded down on its own. The scalar code looks everything up in
+// tables laid out like those of Arduino_GFX: the luma, the red, green and blue
+// terms of the chroma and, indexed by the sum of luma and term, the bits of
+// each channel in the pixel. The pixel bits are byte swapped as for the _be
+// variants; the others swap them back. Each 2x2 quad of pixels shares one
+// chroma sample. Runs of 16 or 8 quads are converted with AVX2 or SSE2,
+// giving the same result as the tables.
+
+// Whether the pixels are dithered instead of truncated to RGB565, which shows
+// as banding in smooth gradients. The entry of a 4x4 Bayer matrix, aligned to
+// the frame so that separately converted rects line up, is added below the
+// dropped bits: 0 to 7 for red and blue, 0 to 3 for green. The scalar loops
+// come in one variant per phase of the matrix at the start of a pair of quads,
+// so the entries are constants in the table offsets and cost nothing per
+// pixel. SIMD code adds them, two additions per vector.
+#ifndef PLM_RGB565_DITHER
+#define PLM_RGB565_DITHER 0
+#endif
+
+static const uint8_t PLM_RGB565_BAYER[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 }
+};
+
+// Define PLM_RGB565_ARDUINO_GFX_TABLES to 1 to use the tables of Arduino_GFX
+// (Y2I16, CR2R16, CB2G16, CR2G16, CB2B16, CLIPRBE, CLIPGBE and CLIPBBE) in
+// place of the built-in ones, so that the colours match its drawYCbCrBitmap().
+// They must be declared before the implementation. Their clip tables have no
+// room for the dither bias and AVX2 and SSE2 do not compute their values.
+#ifndef PLM_RGB565_ARDUINO_GFX_TABLES
+#define PLM_RGB565_ARDUINO_GFX_TABLES 0
+#endif
+
+#if PLM_RGB565_ARDUINO_GFX_TABLES && PLM_RGB565_DITHER
+#error "PLM_RGB565_DITHER needs the built-in RGB565 tables"
+#endif
+
+#if PLM_RGB565_ARDUINO_GFX_TABLES
+
+#define PLM_RGB565_Y Y2I16
+#define PLM_RGB565_CR_R CR2R16
+#define PLM_RGB565_CB_G CB2G16
+#define PLM_RGB565_CR_G CR2G16
+#define PLM_RGB565_CB_B CB2B16
+#define PLM_RGB565_CLIP_R CLIPRBE
+#define PLM_RGB565_CLIP_G CLIPGBE
+#define PLM_RGB565_CLIP_B CLIPBBE
+
+#else
+
+// The built-in tables are generated by the preprocessor: PLM_REPEAT_256 calls
+// ENTRY with the 256 hex numbers that start with P, e.g. 0x00 to 0xFF for 0x.
+// Luma plus a chroma term and the dither bias range from -278 to 541; the clip
+// tables cover -384 to 639.
+#define PLM_REPEAT_16(ENTRY, P) \
+	ENTRY(P##0) ENTRY(P##1) ENTRY(P##2) ENTRY(P##3) ENTRY(P##4) ENTRY(P##5) ENTRY(P##6) ENTRY(P##7) \
+	ENTRY(P##8) ENTRY(P##9) ENTRY(P##A) ENTRY(P##B) ENTRY(P##C) ENTRY(P##D) ENTRY(P##E) ENTRY(P##F)
+#define PLM_REPEAT_256(ENTRY, P) \
+	PLM_REPEAT_16(ENTRY, P##0) PLM_REPEAT_16(ENTRY, P##1) PLM_REPEAT_16(ENTRY, P##2) PLM_REPEAT_16(ENTRY, P##3) \
+	PLM_REPEAT_16(ENTRY, P##4) PLM_REPEAT_16(ENTRY, P##5) PLM_REPEAT_16(ENTRY, P##6) PLM_REPEAT_16(ENTRY, P##7) \
+	PLM_REPEAT_16(ENTRY, P##8) PLM_REPEAT_16(ENTRY, P##9) PLM_REPEAT_16(ENTRY, P##A) PLM_REPEAT_16(ENTRY, P##B) \
+	PLM_REPEAT_16(ENTRY, P##C) PLM_REPEAT_16(ENTRY, P##D) PLM_REPEAT_16(ENTRY, P##E) PLM_REPEAT_16(ENTRY, P##F)
+#define PLM_REPEAT_1024(ENTRY) \
+	PLM_REPEAT_256(ENTRY, 0x0) PLM_REPEAT_256(ENTRY, 0x1) PLM_REPEAT_256(ENTRY, 0x2) PLM_REPEAT_256(ENTRY, 0x3)
+
+#define PLM_RGB565_Y_ENTRY(I) (int16_t)((((I) - 16) * 76309) >> 16),
+#define PLM_RGB565_CR_R_ENTRY(I) (int16_t)((((I) - 128) * 104597) >> 16),
+#define PLM_RGB565_CB_G_ENTRY(I) (int16_t)((((I) - 128) * 25674) >> 16),
+#define PLM_RGB565_CR_G_ENTRY(I) (int16_t)((((I) - 128) * 53278) >> 16),
+#define PLM_RGB565_CB_B_ENTRY(I) (int16_t)((((I) - 128) * 132201) >> 16),
+
+#define PLM_RGB565_CLAMP(I) ((I) < 384 ? 0 : (I) > 639 ? 255 : (I) - 384)
+#define PLM_RGB565_CLIP_R_ENTRY(I) (uint16_t)(PLM_RGB565_CLAMP(I) & 0xf8),
+#define PLM_RGB565_CLIP_G_ENTRY(I) (uint16_t)((PLM_RGB565_CLAMP(I) >> 5) | ((PLM_RGB565_CLAMP(I) & 0x1c) << 11)),
+#define PLM_RGB565_CLIP_B_ENTRY(I) (uint16_t)((PLM_RGB565_CLAMP(I) & 0xf8) << 5),
+
+static const int16_t PLM_RGB565_Y[256] = { PLM_REPEAT_256(PLM_RGB565_Y_ENTRY, 0x) };
+static const int16_t PLM_RGB565_CR_R[256] = { PLM_REPEAT_256(PLM_RGB565_CR_R_ENTRY, 0x) };
+static const int16_t PLM_RGB565_CB_G[256] = { PLM_REPEAT_256(PLM_RGB565_CB_G_ENTRY, 0x) };
+static const int16_t PLM_RGB565_CR_G[256] = { PLM_REPEAT_256(PLM_RGB565_CR_G_ENTRY, 0x) };
+static const int16_t PLM_RGB565_CB_B[256] = { PLM_REPEAT_256(PLM_RGB565_CB_B_ENTRY, 0x) };
+static const uint16_t PLM_RGB565_CLIP_TABLES[3][1024] = {
+	{ PLM_REPEAT_1024(PLM_RGB565_CLIP_R_ENTRY) },
+	{ PLM_REPEAT_1024(PLM_RGB565_CLIP_G_ENTRY) },
+	{ PLM_REPEAT_1024(PLM_RGB565_CLIP_B_ENTRY) }
+};
+
+#define PLM_RGB565_CLIP_R (PLM_RGB565_CLIP_TABLES[0] + 384)
+#define PLM_RGB565_CLIP_G (PLM_RGB565_CLIP_TABLES[1] + 384)
+#define PLM_RGB565_CLIP_B (PLM_RGB565_CLIP_TABLES[2] + 384)
+
+#undef PLM_REPEAT_16
+#undef PLM_REPEAT_256
+#undef PLM_REPEAT_1024
+#undef PLM_RGB565_Y_ENTRY
+#undef PLM_RGB565_CR_R_ENTRY
+#undef PLM_RGB565_CB_G_ENTRY
+#undef PLM_RGB565_CR_G_ENTRY
+#undef PLM_RGB565_CB_B_ENTRY
+#undef PLM_RGB565_CLAMP
+#undef PLM_RGB565_CLIP_R_ENTRY
+#undef PLM_RGB565_CLIP_G_ENTRY
+#undef PLM_RGB565_CLIP_B_ENTRY
+
+#endif
+
+static inline uint64_t plm_rgb565_bias_lanes(const uint8_t *bias, int phase) {
+	// Four 16 bit lanes of a matrix row, starting at column phase; zero without
+	// dithering, so that the additions fold away
+	uint64_t lanes = 0;
+	if (PLM_RGB565_DITHER) {
+		for (int i = 3; i >= 0; i--) {
+			lanes = (lanes << 16) | bias[(phase + i) & 3];
+		}
+	}
+	return lanes;
+}
+
+#if defined(__SSE2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+
+static inline __m128i plm_mm_rgb565(__m128i y, __m128i r, __m128i g, __m128i b, __m128i rb_bias, __m128i g_bias, int swap) {
+	// ((y - 16) * 76309) >> 16 with 76309 = 65536 + 10773
+	__m128i zero = _mm_setzero_si128();
+	__m128i max = _mm_set1_epi16(255);
+	y = _mm_sub_epi16(y, _mm_set1_epi16(16));
+	y = _mm_add_epi16(y, _mm_mulhi_epi16(y, _mm_set1_epi16(10773)));
+	__m128i y_rb = _mm_add_epi16(y, rb_bias);
+	__m128i y_g = _mm_add_epi16(y, g_bias);
+	r = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(y_rb, r), zero), max);
+	g = _mm_min_epi16(_mm_max_epi16(_mm_sub_epi16(y_g, g), zero), max);
+	b = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(y_rb, b), zero), max);
+	__m128i pixel = _mm_or_si128(
+		_mm_or_si128(_mm_slli_epi16(_mm_srli_epi16(r, 3), 11), _mm_slli_epi16(_mm_srli_epi16(g, 2), 5)),
+		_mm_srli_epi16(b, 3));
+	if (swap) {
+		pixel = _mm_or_si128(_mm_slli_epi16(pixel, 8), _mm_srli_epi16(pixel, 8));
+	}
+	return pixel;
+}
+
+static inline int plm_rgb565_quads_sse2(
+	const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw,
+	uint16_t *dest, int stride, int quads, const uint64_t *bias, int swap
+) {
+	// The factors above 2^15 are split into multiples of 2^16 and a 16 bit
+	// rest: 104597 = 2 * 65536 - 26475, 132201 = 2 * 65536 + 1129 and
+	// 53278 = 65536 - 12258.
+	__m128i zero = _mm_setzero_si128();
+	__m128i offset = _mm_set1_epi16(128);
+	__m128i rb_bias[2], g_bias[2];
+	for (int row = 0; row < 2; row++) {
+		__m128i lanes = _mm_set1_epi64x((long long)bias[row]);
+		rb_bias[row] = _mm_srli_epi16(lanes, 1);
+		g_bias[row] = _mm_srli_epi16(lanes, 2);
+	}
+	int done = 0;
+	for (; done + 8 <= quads; done += 8) {
+		__m128i vcr = _mm_sub_epi16(_mm_unpacklo_epi8(PLM_MM_LOAD_8(cr + done), zero), offset);
+		__m128i vcb = _mm_sub_epi16(_mm_unpacklo_epi8(PLM_MM_LOAD_8(cb + done), zero), offset);
+		__m128i r = _mm_add_epi16(_mm_add_epi16(vcr, vcr), _mm_mulhi_epi16(vcr, _mm_set1_epi16(-26475)));
+		__m128i b = _mm_add_epi16(_mm_add_epi16(vcb, vcb), _mm_mulhi_epi16(vcb, _mm_set1_epi16(1129)));
+		__m128i g = _mm_add_epi16(
+			_mm_mulhi_epi16(vcb, _mm_set1_epi16(25674)),
+			_mm_add_epi16(vcr, _mm_mulhi_epi16(vcr, _mm_set1_epi16(-12258))));
+
+		// Each chroma term covers two pixels of both rows
+		__m128i r_lo = _mm_unpacklo_epi16(r, r);
+		__m128i r_hi = _mm_unpackhi_epi16(r, r);
+		__m128i g_lo = _mm_unpacklo_epi16(g, g);
+		__m128i g_hi = _mm_unpackhi_epi16(g, g);
+		__m128i b_lo = _mm_unpacklo_epi16(b, b);
+		__m128i b_hi = _mm_unpackhi_epi16(b, b);
+		for (int row = 0; row < 2; row++) {
+			__m128i luma = PLM_MM_LOAD_16(y + row * yw + done * 2);
+			uint16_t *d = dest + row * stride + done * 2;
+			PLM_MM_STORE_16(d, plm_mm_rgb565(
+				_mm_unpacklo_epi8(luma, zero), r_lo, g_lo, b_lo, rb_bias[row], g_bias[row], swap));
+			PLM_MM_STORE_16(d + 8, plm_mm_rgb565(
+				_mm_unpackhi_epi8(luma, zero), r_hi, g_hi, b_hi, rb_bias[row], g_bias[row], swap));
+		}
+	}
+	return done;
+}
+
+#endif
+
+#if defined(__AVX2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+
+// The same 16 quads at a time
+
+static inline __m256i plm_mm256_rgb565(__m256i y, __m256i r, __m256i g, __m256i b, __m256i rb_bias, __m256i g_bias, int swap) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i max = _mm256_set1_epi16(255);
+	y = _mm256_sub_epi16(y, _mm256_set1_epi16(16));
+	y = _mm256_add_epi16(y, _mm256_mulhi_epi16(y, _mm256_set1_epi16(10773)));
+	__m256i y_rb = _mm256_add_epi16(y, rb_bias);
+	__m256i y_g = _mm256_add_epi16(y, g_bias);
+	r = _mm256_min_epi16(_mm256_max_epi16(_mm256_add_epi16(y_rb, r), zero), max);
+	g = _mm256_min_epi16(_mm256_max_epi16(_mm256_sub_epi16(y_g, g), zero), max);
+	b = _mm256_min_epi16(_mm256_max_epi16(_mm256_add_epi16(y_rb, b), zero), max);
+	__m256i pixel = _mm256_or_si256(
+		_mm256_or_si256(_mm256_slli_epi16(_mm256_srli_epi16(r, 3), 11), _mm256_slli_epi16(_mm256_srli_epi16(g, 2), 5)),
+		_mm256_srli_epi16(b, 3));
+	if (swap) {
+		pixel = _mm256_or_si256(_mm256_slli_epi16(pixel, 8), _mm256_srli_epi16(pixel, 8));
+	}
+	return pixel;
+}
+
+static inline int plm_rgb565_quads_avx2(
+	const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw,
+	uint16_t *dest, int stride, int quads, const uint64_t *bias, int swap
+) {
+	__m256i offset = _mm256_set1_epi16(128);
+	__m256i rb_bias[2], g_bias[2];
+	for (int row = 0; row < 2; row++) {
+		__m256i lanes = _mm256_set1_epi64x((long long)bias[row]);
+		rb_bias[row] = _mm256_srli_epi16(lanes, 1);
+		g_bias[row] = _mm256_srli_epi16(lanes, 2);
+	}
+	int done = 0;
+	for (; done + 16 <= quads; done += 16) {
+		__m256i vcr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(cr + done))), offset);
+		__m256i vcb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(cb + done))), offset);
+		__m256i r = _mm256_add_epi16(_mm256_add_epi16(vcr, vcr), _mm256_mulhi_epi16(vcr, _mm256_set1_epi16(-26475)));
+		__m256i b = _mm256_add_epi16(_mm256_add_epi16(vcb, vcb), _mm256_mulhi_epi16(vcb, _mm256_set1_epi16(1129)));
+		__m256i g = _mm256_add_epi16(
+			_mm256_mulhi_epi16(vcb, _mm256_set1_epi16(25674)),
+			_mm256_add_epi16(vcr, _mm256_mulhi_epi16(vcr, _mm256_set1_epi16(-12258))));
+
+		// Unpacking works within 128 bit lanes; put the quads back in order
+		__m256i r_lo = _mm256_unpacklo_epi16(r, r);
+		__m256i r_hi = _mm256_unpackhi_epi16(r, r);
+		__m256i g_lo = _mm256_unpacklo_epi16(g, g);
+		__m256i g_hi = _mm256_unpackhi_epi16(g, g);
+		__m256i b_lo = _mm256_unpacklo_epi16(b, b);
+		__m256i b_hi = _mm256_unpackhi_epi16(b, b);
+		__m256i r0 = _mm256_permute2x128_si256(r_lo, r_hi, 0x20);
+		__m256i r1 = _mm256_permute2x128_si256(r_lo, r_hi, 0x31);
+		__m256i g0 = _mm256_permute2x128_si256(g_lo, g_hi, 0x20);
+		__m256i g1 = _mm256_permute2x128_si256(g_lo, g_hi, 0x31);
+		__m256i b0 = _mm256_permute2x128_si256(b_lo, b_hi, 0x20);
+		__m256i b1 = _mm256_permute2x128_si256(b_lo, b_hi, 0x31);
+		for (int row = 0; row < 2; row++) {
+			const uint8_t *luma = y + row * yw + done * 2;
+			__m256i *d = (__m256i *)(dest + row * stride + done * 2);
+			__m256i y0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)luma));
+			__m256i y1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(luma + 16)));
+			_mm256_storeu_si256(d, plm_mm256_rgb565(y0, r0, g0, b0, rb_bias[row], g_bias[row], swap));
+			_mm256_storeu_si256(d + 1, plm_mm256_rgb565(y1, r1, g1, b1, rb_bias[row], g_bias[row], swap));
+		}
+	}
+	return done;
+}
+
+#endif
+
+// The per pixel steps are macros, like the motion compensation kernels: as
+// inline functions, compilers left them as calls at -Os and a quad of them at
+// -O2, which made the conversion slower than YCbCr2RGB565Be() of the
+// Arduino_GFX examples.
+
+// Set R, G and B to the chroma terms of the CR and CB sample
+
+#define PLM_RGB565_CHROMA(CR, CB, R, G, B) do { \
+	int chroma_cr = (CR); \
+	int chroma_cb = (CB); \
+	R = PLM_RGB565_CR_R[chroma_cr]; \
+	G = -PLM_RGB565_CB_G[chroma_cb] - PLM_RGB565_CR_G[chroma_cr]; \
+	B = PLM_RGB565_CB_B[chroma_cb]; \
+} while (FALSE)
+
+// Set DEST to the pixel of luma sample Y with these chroma terms, dithered
+// with the PLM_RGB565_BAYER entry ENTRY. SWAP is known at compile time in
+// loops, and so is ENTRY in those of the quads.
+
+#define PLM_RGB565_PIXEL(DEST, Y, R, G, B, ENTRY, SWAP) do { \
+	int entry = PLM_RGB565_DITHER ? (ENTRY) : 0; \
+	int luma = PLM_RGB565_Y[Y]; \
+	int pixel = \
+		PLM_RGB565_CLIP_R[luma + (R) + (entry >> 1)] | \
+		PLM_RGB565_CLIP_G[luma + (G) + (entry >> 2)] | \
+		PLM_RGB565_CLIP_B[luma + (B) + (entry >> 1)]; \
+	DEST = (SWAP) ? (uint16_t)pixel : (uint16_t)((pixel << 8) | (pixel >> 8)); \
+} while (FALSE)
+
+// The next quad of the two rows, whose top left pixel is dithered with the
+// matrix entry in ROW and COL
+
+#define PLM_RGB565_QUAD(ROW, COL, SWAP) do { \
+	int r, g, b; \
+	PLM_RGB565_CHROMA(*cr++, *cb++, r, g, b); \
+	PLM_RGB565_PIXEL(*dest++, *y++, r, g, b, PLM_RGB565_BAYER[ROW][COL], SWAP); \
+	PLM_RGB565_PIXEL(*dest++, *y++, r, g, b, PLM_RGB565_BAYER[ROW][(COL) + 1], SWAP); \
+	PLM_RGB565_PIXEL(*dest2++, *y2++, r, g, b, PLM_RGB565_BAYER[(ROW) + 1][COL], SWAP); \
+	PLM_RGB565_PIXEL(*dest2++, *y2++, r, g, b, PLM_RGB565_BAYER[(ROW) + 1][(COL) + 1], SWAP); \
+} while (FALSE)
+
+// One function per byte order and, when dithering, per matrix row and column
+// of the first pixel (both 0 or 2), so that the loop tests neither and the
+// entries of the quads are constants
+
+#define PLM_DEFINE_RGB565_QUADS_FUNCTION(NAME, SWAP, ROW, COL) \
+	static void NAME( \
+		const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw, \
+		uint16_t *dest, int stride, int quads \
+	) { \
+		const uint8_t *y2 = y + yw; \
+		uint16_t *dest2 = dest + stride; \
+		for (int i = 0; i + 2 <= quads; i += 2) { \
+			PLM_RGB565_QUAD(ROW, COL, SWAP); \
+			PLM_RGB565_QUAD(ROW, (COL) ^ 2, SWAP); \
+		} \
+		if (quads & 1) { \
+			PLM_RGB565_QUAD(ROW, COL, SWAP); \
+		} \
+	}
+
+typedef void (*plm_rgb565_quads_t)(
+	const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw,
+	uint16_t *dest, int stride, int quads
+);
+
+#if PLM_RGB565_DITHER
+
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_00, FALSE, 0, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_02, FALSE, 0, 2)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_20, FALSE, 2, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_22, FALSE, 2, 2)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_00, TRUE, 0, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_02, TRUE, 0, 2)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_20, TRUE, 2, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_22, TRUE, 2, 2)
+
+// Indexed by byte order and by the matrix row and column of the first pixel,
+// halved
+static const plm_rgb565_quads_t PLM_RGB565_QUADS_SCALAR[2][4] = {
+	{ plm_rgb565_quads_scalar_00, plm_rgb565_quads_scalar_02, plm_rgb565_quads_scalar_20, plm_rgb565_quads_scalar_22 },
+	{ plm_rgb565_quads_scalar_swap_00, plm_rgb565_quads_scalar_swap_02, plm_rgb565_quads_scalar_swap_20, plm_rgb565_quads_scalar_swap_22 }
+};
+
+#else
+
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar, FALSE, 0, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap, TRUE, 0, 0)
+
+static const plm_rgb565_quads_t PLM_RGB565_QUADS_SCALAR[2][4] = {
+	{ plm_rgb565_quads_scalar, plm_rgb565_quads_scalar, plm_rgb565_quads_scalar, plm_rgb565_quads_scalar },
+	{ plm_rgb565_quads_scalar_swap, plm_rgb565_quads_scalar_swap, plm_rgb565_quads_scalar_swap, plm_rgb565_quads_scalar_swap }
+};
+
+#endif
+
+#undef PLM_RGB565_QUAD
+#undef PLM_DEFINE_RGB565_QUADS_FUNCTION
+
+// dest points to the top left pixel of the rect
+
+static inline void plm_frame_rect_convert_rgb565(
+	plm_frame_t *frame, int x, int y, int width, int height,
+	uint16_t *dest, int stride, int swap
+) {
+	int quads = width >> 1;
+	int yw = frame->y.width;
+	int cw = frame->cb.width;
+
+#if defined(__SSE2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+	// The matrix rows, starting at the column of the first pixel. Runs start at
+	// multiples of 16 pixels, so that column stays the same.
+	uint64_t bias[4];
+	for (int i = 0; i < 4; i++) {
+		bias[i] = plm_rgb565_bias_lanes(PLM_RGB565_BAYER[i], x & 3);
+	}
+#endif
+	const plm_rgb565_quads_t *scalar = PLM_RGB565_QUADS_SCALAR[swap ? 1 : 0];
+	for (int row = y >> 1; row < (y + height) >> 1; row++) {
+		const uint8_t *y_row = frame->y.data + row * 2 * yw + x;
+		const uint8_t *cr_row = frame->cr.data + row * cw + (x >> 1);
+		const uint8_t *cb_row = frame->cb.data + row * cw + (x >> 1);
+		uint16_t *d = dest + (row * 2 - y) * stride;
+		int done = 0;
+#if defined(__AVX2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+		done = plm_rgb565_quads_avx2(y_row, cr_row, cb_row, yw, d, stride, quads, bias + ((row * 2) & 3), swap);
+#endif
+#if defined(__SSE2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+		done += plm_rgb565_quads_sse2(
+			y_row + done * 2, cr_row + done, cb_row + done, yw,
+			d + done * 2, stride, quads - done, bias + ((row * 2) & 3), swap);
+#endif
+		scalar[(row & 1) * 2 + ((x >> 1) & 1)](
+			y_row + done * 2, cr_row + done, cb_row + done, yw,
+			d + done * 2, stride, quads - done);
+	}
+}
+
+void plm_frame_rect_to_rgb565(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride) {
+	plm_frame_rect_convert_rgb565(frame, x, y, width, height, dest + y * stride + x, stride, FALSE);
+}
+
+void plm_frame_rect_to_rgb565_be(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride) {
+	plm_frame_rect_convert_rgb565(frame, x, y, width, height, dest + y * stride + x, stride, TRUE);
+}
+
+void plm_frame_to_rgb565(plm_frame_t *frame, uint16_t *dest, int stride) {
+	plm_frame_rect_to_rgb565(frame, 0, 0, frame->width, frame->height, dest, stride);
+}
+
+void plm_frame_to_rgb565_be(plm_frame_t *frame, uint16_t *dest, int stride) {
+	plm_frame_rect_to_rgb565_be(frame, 0, 0, frame->width, frame->height, dest, stride);
+}
+
+int plm_frame_get_dirty_rects(plm_frame_t *frame, plm_rect_t *rects, int max_rects) {
+	if (max_rects < 1) {
+		return 0;
+	}
+	if (!frame->dirty) {
+		rects[0].x = 0;
+		rects[0].y = 0;
+		rects[0].width = frame->width;
+		rects[0].height = frame->height;
+		return 1;
+	}
+
+	// Join the dirty macroblocks of each row into runs, and a run into the rect
+	// of the same columns that ends right above it. Coordinates are in
+	// macroblocks until the end.
+	int size = frame->macroblock_size;
+	int mb_width = (frame->width + size - 1) / size;
+	int mb_height = (frame->height + size - 1) / size;
+	int count = 0;
+	int overflow = FALSE;
+	int x0 = mb_width, y0 = mb_height, x1 = 0, y1 = 0;
+	for (int row = 0; row < mb_height; row++) {
+		const uint8_t *dirty = frame->dirty + row * mb_width;
+		int col = 0;
+		while (col < mb_width) {
+			if (!dirty[col]) {
+				col++;
+				continue;
+			}
+			int end = col + 1;
+			while (end < mb_width && dirty[end]) {
+				end++;
+			}
+			x0 = col < x0 ? col : x0;
+			x1 = end > x1 ? end : x1;
+			y0 = row < y0 ? row : y0;
+			y1 = row + 1;
+
+			int i = 0;
+			while (
+				i < count &&
+				(rects[i].x != col || rects[i].width != end - col || rects[i].y + rects[i].height != row)
+			) {
+				i++;
+			}
+			if (i < count) {
+				rects[i].height++;
+			}
+			else if (count < max_rects) {
+				rects[count].x = col;
+				rects[count].y = row;
+				rects[count].width = end - col;
+				rects[count].height = 1;
+				count++;
+			}
+			else {
+				overflow = TRUE;
+			}
+			col = end;
+		}
+	}
+
+	// Too many rects; fall back to one around all dirty macroblocks
+	if (overflow) {
+		rects[0].x = x0;
+		rects[0].y = y0;
+		rects[0].width = x1 - x0;
+		rects[0].height = y1 - y0;
+		count = 1;
+	}
+
+	// In pixels, clipped to the frame
+	for (int i = 0; i < count; i++) {
+		plm_rect_t *rect = &rects[i];
+		rect->x *= size;
+		rect->y *= size;
+		rect->width *= size;
+		rect->height *= size;
+		if (rect->x + rect->width > (int)frame->width) {
+			rect->width = frame->width - rect->x;
+		}
+		if (rect->y + rect->height > (int)frame->height) {
+			rect->height = frame->height - rect->y;
+		}
+	}
+	return count;
+}
+
+
+
+// -----------------------------------------------------------------------------
+// plm_scaler implementation
+
+// Every destination column and row has a step that names the source luma and
+// chroma sample it starts from and, for bilinear scaling, the weight of the
+// next sample in 1/256. The tables are built once in plm_scaler_create(), so
+// a frame is scaled and converted in one pass, without a scaled YCrCb copy.
+
+typedef struct {
+	uint16_t luma;
+	uint16_t luma_weight;
+	uint16_t chroma;
+	uint16_t chroma_weight;
+} plm_scaler_step_t;
+
+struct plm_scaler_t {
+	plm_scale_mode_t mode;
+	int src_width;
+	int src_height;
+	int dest_width;
+	int dest_height;
+	plm_scaler_step_t *cols;
+	plm_scaler_step_t *rows;
+	uint16_t *lines;
+};
+
+static void plm_scaler_tap(int pos, int size, uint16_t *index, uint16_t *weight) {
+	// Clamp at the edges, so that index + 1 is always a valid sample
+	if (pos < 0) {
+		pos = 0;
+	}
+	else if (pos > (size - 1) * 256) {
+		pos = (size - 1) * 256;
+	}
+	if (pos >> 8 == size - 1) {
+		*index = (uint16_t)(size - 2);
+		*weight = 256;
+	}
+	else {
+		*index = (uint16_t)(pos >> 8);
+		*weight = (uint16_t)(pos & 255);
+	}
+}
+
+static void plm_scaler_init_steps(plm_scaler_step_t *steps, int src, int dest, plm_scale_mode_t mode) {
+	for (int i = 0; i < dest; i++) {
+		plm_scaler_step_t *step = &steps[i];
+		if (mode == PLM_SCALE_BILINEAR) {
+			// Center of the destination pixel in 1/256 source pixels. Chroma
+			// samples sit between two luma samples.
+			int pos = (int)(((int64_t)(i * 2 + 1) * src * 128) / dest) - 128;
+			plm_scaler_tap(pos, src, &step->luma, &step->luma_weight);
+			plm_scaler_tap((pos - 128) >> 1, (src + 1) >> 1, &step->chroma, &step->chroma_weight);
+		}
+		else {
+			step->luma = (uint16_t)(((int64_t)(i * 2 + 1) * src) / (dest * 2));
+			step->luma_weight = 0;
+			step->chroma = step->luma >> 1;
+			step->chroma_weight = 0;
+		}
+	}
+}
+
+plm_scaler_t *plm_scaler_create(int src_width, int src_height, int dest_width, int dest_height, plm_scale_mode_t mode) {
+	if (
+		src_width < 4 || src_height < 4 || dest_width < 1 || dest_height < 1 ||
+		src_width > 0xffff || src_height > 0xffff
+	) {
+		return NULL;
+	}
+	if (
+		mode == PLM_SCALE_DOUBLE &&
+		(dest_width != src_width * 2 || dest_height != src_height * 2)
+	) {
+		return NULL;
+	}
+
+	// The steps and the blended source lines for bilinear scaling are kept in
+	// the same allocation
+	int line_size = src_width + ((src_width + 1) >> 1) * 2;
+	size_t size =
+		sizeof(plm_scaler_t) +
+		(dest_width + dest_height) * sizeof(plm_scaler_step_t) +
+		line_size * sizeof(uint16_t);
+	plm_scaler_t *self = (plm_scaler_t *)PLM_MALLOC(size);
+	memset(self, 0, sizeof(plm_scaler_t));
+
+	self->mode = mode;
+	self->src_width = src_width;
+	self->src_height = src_height;
+	self->dest_width = dest_width;
+	self->dest_height = dest_height;
+	self->cols = (plm_scaler_step_t *)(self + 1);
+	self->rows = self->cols + dest_width;
+	self->lines = (uint16_t *)(self->rows + dest_height);
+
+	plm_scaler_init_steps(self->cols, src_width, dest_width, mode);
+	plm_scaler_init_steps(self->rows, src_height, dest_height, mode);
+	return self;
+}
+
+void plm_scaler_destroy(plm_scaler_t *self) {
+	PLM_FREE(self);
+}
+
+static inline void plm_scaler_double(
+	plm_scaler_t *self, plm_frame_t *frame, int x, int y, int width, int height,
+	uint16_t *dest, int stride, int swap
+) {
+	// Each pair of source rows is converted into every other destination row,
+	// then stretched in place from the right and copied to the row below. A
+	// last single row of an odd height is converted with the padding row of the
+	// planes, into the destination row that its own copy then overwrites.
+	int src_x = x >> 1;
+	int src_width = width >> 1;
+	for (int row = y >> 1; row < self->src_height && row * 2 < y + height; row += 2) {
+		uint16_t *rows = dest + (row * 2 - y) * stride;
+		int count = row + 1 < self->src_height ? 2 : 1;
+		plm_frame_rect_convert_rgb565(frame, src_x, row, src_width, 2, rows, stride * count, swap);
+		for (int i = 0; i < count * 2; i += 2) {
+			uint16_t *d = rows + i * stride;
+			for (int col = src_width - 1; col >= 0; col--) {
+				d[col * 2 + 1] = d[col * 2] = d[col];
+			}
+			memcpy(d + stride, d, src_width * 2 * sizeof(uint16_t));
+		}
+	}
+}
+
+static inline void plm_scaler_nearest_row(
+	plm_scaler_t *self, plm_frame_t *frame, const plm_scaler_step_t *row,
+	int x, int width, uint16_t *dest, const uint8_t *bias, int swap
+) {
+	const uint8_t *y_row = frame->y.data + row->luma * frame->y.width;
+	const uint8_t *cr_row = frame->cr.data + row->chroma * frame->cr.width;
+	const uint8_t *cb_row = frame->cb.data + row->chroma * frame->cb.width;
+	int chroma = -1;
+	int r = 0, g = 0, b = 0;
+	for (int i = 0; i < width; i++) {
+		const plm_scaler_step_t *col = &self->cols[x + i];
+		if (col->chroma != chroma) {
+			chroma = col->chroma;
+			PLM_RGB565_CHROMA(cr_row[chroma], cb_row[chroma], r, g, b);
+		}
+		PLM_RGB565_PIXEL(dest[i], y_row[col->luma], r, g, b, bias[(x + i) & 3], swap);
+	}
+}
+
+static inline void plm_scaler_blend_line(const uint8_t *src, int stride, int weight, uint16_t *dest, int count) {
+	const uint8_t *next = src + stride;
+	for (int i = 0; i < count; i++) {
+		dest[i] = (uint16_t)(src[i] * (256 - weight) + next[i] * weight);
+	}
+}
+
+static inline int plm_scaler_lerp(const uint16_t *line, int index, int weight) {
+	return (line[index] * (256 - weight) + line[index + 1] * weight + 32768) >> 16;
+}
+
+static inline void plm_scaler_bilinear_row(
+	plm_scaler_t *self, plm_frame_t *frame, const plm_scaler_step_t *row,
+	int x, int width, uint16_t *dest, const uint8_t *bias, int swap
+) {
+	// Blend the two source rows first, the columns per pixel after that. Only
+	// the source samples of the columns x to x + width are needed.
+	const plm_scaler_step_t *cols = self->cols + x;
+	int luma = cols[0].luma;
+	int luma_count = cols[width - 1].luma + 2 - luma;
+	int chroma = cols[0].chroma;
+	int chroma_count = cols[width - 1].chroma + 2 - chroma;
+	uint16_t *y_line = self->lines;
+	uint16_t *cr_line = y_line + self->src_width;
+	uint16_t *cb_line = cr_line + ((self->src_width + 1) >> 1);
+	plm_scaler_blend_line(
+		frame->y.data + row->luma * frame->y.width + luma, frame->y.width,
+		row->luma_weight, y_line + luma, luma_count);
+	plm_scaler_blend_line(
+		frame->cr.data + row->chroma * frame->cr.width + chroma, frame->cr.width,
+		row->chroma_weight, cr_line + chroma, chroma_count);
+	plm_scaler_blend_line(
+		frame->cb.data + row->chroma * frame->cb.width + chroma, frame->cb.width,
+		row->chroma_weight, cb_line + chroma, chroma_count);
+
+	for (int i = 0; i < width; i++) {
+		const plm_scaler_step_t *col = &cols[i];
+		int r, g, b;
+		PLM_RGB565_CHROMA(
+			plm_scaler_lerp(cr_line, col->chroma, col->chroma_weight),
+			plm_scaler_lerp(cb_line, col->chroma, col->chroma_weight),
+			r, g, b);
+		int y = plm_scaler_lerp(y_line, col->luma, col->luma_weight);
+		PLM_RGB565_PIXEL(dest[i], y, r, g, b, bias[(x + i) & 3], swap);
+	}
+}
+
+#undef PLM_RGB565_CHROMA
+#undef PLM_RGB565_PIXEL
+
+// Convert the destination rect of width x height pixels at x, y. dest points
+// to its top left pixel. For PLM_SCALE_DOUBLE, x and y must be multiples of 4.
+
+static inline void plm_scaler_convert_rect(
+	plm_scaler_t *self, plm_frame_t *frame, int x, int y, int width, int height,
+	uint16_t *dest, int stride, int swap
+) {
+	if (self->mode == PLM_SCALE_DOUBLE) {
+		plm_scaler_double(self, frame, x, y, width, height, dest, stride, swap);
+		return;
+	}
+
+	// Repeated rows are dithered with the matrix row of the first row of their
+	// run, so that they look the same whether copied or converted at the top of
+	// a rect
+	int run = y;
+	while (run > 0 && memcmp(&self->rows[run], &self->rows[run - 1], sizeof(plm_scaler_step_t)) == 0) {
+		run--;
+	}
+	for (int j = y; j < y + height; j++) {
+		const plm_scaler_step_t *row = &self->rows[j];
+		uint16_t *d = dest + (j - y) * stride;
+
+		// Upscaling repeats rows, which only need to be copied
+		if (j > y && memcmp(row, row - 1, sizeof(plm_scaler_step_t)) == 0) {
+			memcpy(d, d - stride, width * sizeof(uint16_t));
+			continue;
+		}
+		if (j > y) {
+			run = j;
+		}
+		if (self->mode == PLM_SCALE_BILINEAR) {
+			plm_scaler_bilinear_row(self, frame, row, x, width, d, PLM_RGB565_BAYER[run & 3], swap);
+		}
+		else {
+			plm_scaler_nearest_row(self, frame, row, x, width, d, PLM_RGB565_BAYER[run & 3], swap);
+		}
+	}
+}
+
+// Find the destination rows or columns that read any of the luma samples
+// start to end (exclusive) or the chroma samples next to them
+
+static void plm_scaler_map_range(const plm_scaler_step_t *steps, int count, int start, int end, int *first, int *last) {
+	*first = 0;
+	*last = 0;
+	for (int i = 0; i < count; i++) {
+		const plm_scaler_step_t *step = &steps[i];
+		int luma_last = step->luma + (step->luma_weight ? 1 : 0);
+		int chroma_last = step->chroma + (step->chroma_weight ? 1 : 0);
+		if (
+			(step->luma < end && luma_last >= start) ||
+			(step->chroma < (end + 1) >> 1 && chroma_last >= start >> 1)
+		) {
+			if (*last == 0) {
+				*first = i;
+			}
+			*last = i + 1;
+		}
+	}
+}
+
+void plm_scaler_to_rgb565(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride) {
+	plm_scaler_convert_rect(self, frame, 0, 0, self->dest_width, self->dest_height, dest, stride, FALSE);
+}
+
+void plm_scaler_to_rgb565_be(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride) {
+	plm_scaler_convert_rect(self, frame, 0, 0, self->dest_width, self->dest_height, dest, stride, TRUE);
+}
+
+void plm_frame_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink) {
+	plm_rect_t rect = {0, 0, (int)frame->width, (int)frame->height};
+	plm_frame_rects_to_rgb565_strips(frame, scaler, &rect, 1, buffers, strip_height, big_endian, sink);
+}
+
+void plm_frame_rects_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, const plm_rect_t *rects, int count, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink) {
+	int buffer_size = (scaler ? scaler->dest_width : (int)frame->width) * strip_height;
+	int strip = 0;
+	for (int i = 0; i < count; i++) {
+		// The part of the destination that shows the rect
+		plm_rect_t rect = rects[i];
+		if (scaler) {
+			int x1, y1;
+			plm_scaler_map_range(scaler->cols, scaler->dest_width, rect.x, rect.x + rect.width, &rect.x, &x1);
+			plm_scaler_map_range(scaler->rows, scaler->dest_height, rect.y, rect.y + rect.height, &rect.y, &y1);
+			rect.width = x1 - rect.x;
+			rect.height = y1 - rect.y;
+		}
+		if (rect.width <= 0) {
+			continue;
+		}
+
+		// Strips are packed at the width of the rect
+		for (int y = rect.y; y < rect.y + rect.height; y += strip_height) {
+			// Alternate between the two buffers, so that one can be converted
+			// into while the sink is still busy with the other
+			uint16_t *pixels = buffers + strip * buffer_size;
+			int rows = rect.y + rect.height - y < strip_height ? rect.y + rect.height - y : strip_height;
+			if (sink->wait) {
+				sink->wait(pixels, sink->user);
+			}
+			if (scaler) {
+				plm_scaler_convert_rect(scaler, frame, rect.x, y, rect.width, rows, pixels, rect.width, big_endian);
+			}
+			else {
+				plm_frame_rect_convert_rgb565(frame, rect.x, y, rect.width, rows, pixels, rect.width, big_endian);
+			}
+			sink->push(rect.x, y, rect.width, rows, pixels, sink->user);
+			strip ^= 1;
+		}
+	}
+}
+
 
 
 // -----------------------------------------------------------------------------
@@ -3883,8 +7842,8 @@ int plm_audio_find_frame_sync(plm_audio_t *self) {
 	uint32_t i;
 	for (i = self->buffer->bit_index >> 3; i < self->buffer->length-1; i++) {
 		if (
-			self->buffer->bytes[i] == 0xFF &&
-			(self->buffer->bytes[i+1] & 0xFE) == 0xFC
+			plm_buffer_get_byte(self->buffer, i) == 0xFF &&
+			(plm_buffer_get_byte(self->buffer, i+1) & 0xFE) == 0xFC
 		) {
 			self->buffer->bit_index = ((i+1) << 3) + 3;
 			return TRUE;
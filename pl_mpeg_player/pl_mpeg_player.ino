@@ -10,6 +10,11 @@ const char *mpeg_file = "/root/AVSEQ02.DAT";
 // #include "PINS_T-DECK.h"
 #include "PINS_JC1060P470.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
 #include <FFat.h>
 #include <LittleFS.h>
 #include <SPIFFS.h>
@@ -18,6 +23,12 @@ const char *mpeg_file = "/root/AVSEQ02.DAT";
 
 #include "esp32_audio.h"
 
+// Convert to RGB565 with the tables of Arduino_GFX, giving the colours of its
+// drawYCbCrBitmap(); off by default, as it changes the colours of the player
+// #define PLM_RGB565_ARDUINO_GFX_TABLES 1
+// Or dither to RGB565 instead of truncating, against banding in gradients;
+// this needs the built-in tables
+// #define PLM_RGB565_DITHER 1
 #define PL_MPEG_IMPLEMENTATION
 #include "pl_mpeg.h"
 plm_t *plm;
@@ -26,8 +37,38 @@ double plm_frame_interval;
 uint16_t frame_interval_ms;
 int plm_w;
 int plm_h;
-uint16_t *plm_buffer;
+plm_scaler_t *plm_scaler = NULL;
+int out_x;
+int out_y;
+int out_w;
+int out_h;
+
+// Frames are converted one strip at a time into one of two strip buffers,
+// while the display task draws the other one
+#define STRIP_HEIGHT 16
+uint16_t *strip_buffers;
+plm_rgb565_sink_t strip_sink;
+TaskHandle_t display_task_handle;
+QueueHandle_t strip_queue_handle;
+SemaphoreHandle_t strip_free_handle[2];
+
+typedef struct
+{
+  int16_t x;
+  int16_t y;
+  int16_t w;
+  int16_t h;
+  uint16_t *pixels;
+} strip_t;
 
+// Only the parts of a frame that changed since the one before are drawn
+#define MAX_DIRTY_RECTS 32
+plm_rect_t dirty_rects[MAX_DIRTY_RECTS];
+unsigned long frame_macroblocks;
+unsigned long dirty_macroblock_count = 0;
+
+const char *input_mode_names[] = {"buffer", "file", "read-ahead", "memory", "preloaded", "mapped"};
+unsigned long open_ms;
 unsigned long next_frame_ms;
 unsigned long cur_ms;
 unsigned long remain_ms = 0;
@@ -36,51 +77,63 @@ int decode_video_count = 0;
 int display_video_count = 0;
 int decode_audio_count = 0;
 
-void YCbCr2RGB565Be(uint8_t *yData, uint8_t *cbData, uint8_t *crData, uint16_t w, uint16_t h, uint16_t *dest)
+static int strip_index(uint16_t *pixels)
+{
+  return (pixels == strip_buffers) ? 0 : 1;
+}
+
+static void draw_strip(strip_t *strip)
+{
+#if defined(SPI_SCK) && defined(SD_CS)
+  // explicit disable SD before use display
+  digitalWrite(SD_CS, HIGH);
+#endif
+  gfx->draw16bitBeRGBBitmap(out_x + strip->x, out_y + strip->y, strip->pixels, strip->w, strip->h);
+}
+
+static void display_task(void *arg)
 {
-  int cols = w >> 1;
-  int rows = h >> 1;
-  uint8_t *yData2 = yData + w;
-  uint16_t *dest2 = dest + w;
-  for (int row = 0; row < rows; ++row)
+  strip_t strip;
+
+  while (xQueueReceive(strip_queue_handle, &strip, portMAX_DELAY))
   {
-    for (int col = 0; col < cols; ++col)
-    {
-      uint8_t cr = *crData++;
-      uint8_t cb = *cbData++;
-      int16_t r = CR2R16[cr];
-      int16_t g = -CB2G16[cb] - CR2G16[cr];
-      int16_t b = CB2B16[cb];
-      int16_t y;
-
-      y = Y2I16[*yData++];
-      *dest++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
-      y = Y2I16[*yData++];
-      *dest++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
-      y = Y2I16[*yData2++];
-      *dest2++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
-      y = Y2I16[*yData2++];
-      *dest2++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
-    }
-    yData += w;
-    yData2 += w;
-    dest += w;
-    dest2 += w;
+    draw_strip(&strip);
+    xSemaphoreGive(strip_free_handle[strip_index(strip.pixels)]);
   }
 }
 
+static void strip_push(int x, int y, int width, int height, uint16_t *pixels, void *user)
+{
+  strip_t strip = {(int16_t)x, (int16_t)y, (int16_t)width, (int16_t)height, pixels};
+#if defined(SPI_SCK) && defined(SD_CS)
+  // Display and SD share the bus, draw right away
+  draw_strip(&strip);
+#else
+  xQueueSend(strip_queue_handle, &strip, portMAX_DELAY);
+#endif
+}
+
+static void strip_wait(uint16_t *pixels, void *user)
+{
+  xSemaphoreTake(strip_free_handle[strip_index(pixels)], portMAX_DELAY);
+}
+
 // This function gets called for each decoded video frame
 void my_video_callback(plm_t *plm, plm_frame_t *frame, void *user)
 {
+  if (decode_video_count == 0)
+  {
+    Serial.printf("Time to first frame: %lu ms (input mode: %s)\n", millis() - open_ms, input_mode_names[plm_get_input_mode(plm)]);
+  }
+
   // if (cur_ms < next_frame_ms)
   // if (decode_video_count % 2)
   {
-    YCbCr2RGB565Be(frame->y.data, frame->cb.data, frame->cr.data, frame->width, frame->height, plm_buffer);
-#if defined(SPI_SCK) && defined(SD_CS)
-    // explicit disable SD before use display
-    digitalWrite(SD_CS, HIGH);
-#endif
-    gfx->draw16bitBeRGBBitmap(0, 0, plm_buffer, plm_w, plm_h);
+    // The dirty rects expect the previous frame on the display; a skipped frame
+    // would need plm_frame_to_rgb565_strips() for the next one
+    int rect_count = plm_frame_get_dirty_rects(frame, dirty_rects, MAX_DIRTY_RECTS);
+    plm_frame_rects_to_rgb565_strips(frame, plm_scaler, dirty_rects, rect_count, strip_buffers, STRIP_HEIGHT, true, &strip_sink);
+    dirty_macroblock_count += frame->dirty_macroblocks;
     ++display_video_count;
   }
   // else
@@ -167,7 +220,14 @@ void setup(void)
   }
   else
   {
+    open_ms = millis();
+#if defined(SPI_SCK) && defined(SD_CS)
+    // Display and SD share the bus, so the file is not read ahead on another
+    // task while a frame is drawn
     plm = plm_create_with_filename(mpeg_file);
+#else
+    plm = plm_create_with_filename_async(mpeg_file);
+#endif
     if (!plm)
     {
       printf("Couldn't open file %s\n", mpeg_file);
@@ -188,7 +248,52 @@ void setup(void)
     frame_interval_ms = (uint16_t)(plm_frame_interval * 1000);
     plm_w = plm_get_width(plm);
     plm_h = plm_get_height(plm);
-    plm_buffer = (uint16_t *)malloc(plm_w * plm_h * 2);
+    frame_macroblocks = ((plm_w + 15) / 16) * ((plm_h + 15) / 16);
+
+    // Fit the video to the display: double it if that fits, otherwise scale it
+    // to the largest size that keeps the aspect ratio
+    out_w = gfx->width();
+    out_h = plm_h * gfx->width() / plm_w;
+    if (out_h > gfx->height())
+    {
+      out_w = plm_w * gfx->height() / plm_h;
+      out_h = gfx->height();
+    }
+    if ((plm_w * 2 <= out_w) && (plm_h * 2 <= out_h))
+    {
+      out_w = plm_w * 2;
+      out_h = plm_h * 2;
+      plm_scaler = plm_scaler_create(plm_w, plm_h, out_w, out_h, PLM_SCALE_DOUBLE);
+    }
+    else if ((out_w != plm_w) || (out_h != plm_h))
+    {
+      plm_scaler = plm_scaler_create(plm_w, plm_h, out_w, out_h, PLM_SCALE_BILINEAR);
+    }
+    if (!plm_scaler)
+    {
+      out_w = plm_w;
+      out_h = plm_h;
+    }
+    out_x = (gfx->width() - out_w) / 2;
+    out_y = (gfx->height() - out_h) / 2;
+    Serial.printf("Video: %dx%d, output: %dx%d at (%d, %d)\n", plm_w, plm_h, out_w, out_h, out_x, out_y);
+
+    strip_buffers = (uint16_t *)malloc(2 * out_w * STRIP_HEIGHT * 2);
+    strip_sink.push = strip_push;
+    strip_sink.user = NULL;
+#if defined(SPI_SCK) && defined(SD_CS)
+    strip_sink.wait = NULL;
+#else
+    strip_sink.wait = strip_wait;
+    for (int i = 0; i < 2; i++)
+    {
+      strip_free_handle[i] = xSemaphoreCreateBinary();
+      xSemaphoreGive(strip_free_handle[i]);
+    }
+    strip_queue_handle = xQueueCreate(2, sizeof(strip_t));
+
+    xTaskCreatePinnedToCore(display_task, "display_task", 1600, NULL, 1, &display_task_handle, 0);
+#endif
   }
 }
 
@@ -221,5 +326,9 @@ void loop()
   } while (!plm_has_ended(plm));
 
   Serial.printf("Time used: %lu, decode_video_count: %d, display_video_count: %d, decode_audio_count: %d, remain: %lu\n", millis() - start_ms, decode_video_count, display_video_count, decode_audio_count, total_remain_ms);
+  if (display_video_count > 0)
+  {
+    Serial.printf("Redrawn macroblocks: %lu%%\n", dirty_macroblock_count * 100 / (frame_macroblocks * display_video_count));
+  }
   delay(LONG_MAX);
 }
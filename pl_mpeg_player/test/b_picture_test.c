@@ -0,0 +1,738 @@
+// Checks the B-picture paths of the decoder on a synthetic stream, as the
+// sample files have no B-pictures. The stream is written twice from the same
+// random macroblocks: once with runs of skipped macroblocks, and once with
+// every skipped macroblock coded as the not coded macroblock it stands for,
+// which the decoder predicts one at a time. Decoding the second one is the
+// reference for:
+//
+// - the skipped runs of the first one, which in B-pictures that repeat a
+//   zero-motion copy from one reference are copied in bulk;
+// - B-pictures converted into plm_set_video_rgb565_target(), in both byte
+//   orders, also with plm_set_video_b_picture_rect();
+// - the rect of plm_set_video_b_picture_rect();
+// - the dirty rects: a display that only redraws them must equal the frame;
+// - plm_decode() with PLM_DROP_LATE_B_FRAMES, which may only drop B-pictures
+//   and must deliver the others unchanged.
+//
+// Each check runs with 1 and 3 slice threads:
+//
+//   cc -O2 -o b_picture_test b_picture_test.c -lm -lpthread
+//   ./b_picture_test [seed]
+//
+// Prints the number of failed checks and exits with 1 if there are any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+#define WIDTH 120
+#define HEIGHT 88
+#define MB_WIDTH ((WIDTH + 15) / 16)
+#define MB_HEIGHT ((HEIGHT + 15) / 16)
+#define FRAMES 24
+#define FRAMERATE 25.0
+#define FRAMERATE_CODE 3
+#define F_CODE 2
+#define MAX_SKIPPED 12
+
+static uint32_t random_state;
+
+static int random_int(int n) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state % n;
+}
+
+
+// Bitstream writer
+
+typedef struct {
+	uint8_t *bytes;
+	uint32_t capacity;
+	uint32_t bits;
+} writer_t;
+
+static void put_bits(writer_t *w, uint32_t value, int count) {
+	while (count--) {
+		if ((w->bits >> 3) == w->capacity) {
+			w->capacity = w->capacity ? w->capacity * 2 : 4096;
+			w->bytes = (uint8_t *)realloc(w->bytes, w->capacity);
+		}
+		uint32_t byte = w->bits >> 3;
+		if ((w->bits & 7) == 0) {
+			w->bytes[byte] = 0;
+		}
+		if ((value >> count) & 1) {
+			w->bytes[byte] |= 0x80 >> (w->bits & 7);
+		}
+		w->bits++;
+	}
+}
+
+static void put_start_code(writer_t *w, int code) {
+	while (w->bits & 7) {
+		put_bits(w, 0, 1);
+	}
+	put_bits(w, 0x000001, 24);
+	put_bits(w, code, 8);
+}
+
+// Write the code of value in one of the decoder's VLC trees, found by walking
+// the tree, so that the stream is coded exactly as the decoder reads it
+
+static int find_code(const plm_vlc_t *table, int index, int16_t value, uint32_t code, int length, writer_t *w) {
+	for (int bit = 0; bit < 2; bit++) {
+		plm_vlc_t entry = table[index + bit];
+		if (entry.index > 0) {
+			if (find_code(table, entry.index, value, (code << 1) | bit, length + 1, w)) {
+				return TRUE;
+			}
+		}
+		else if (entry.index == 0 && entry.value == value) {
+			if (w) {
+				put_bits(w, (code << 1) | bit, length + 1);
+			}
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static int put_vlc(writer_t *w, const void *table, int value) {
+	return find_code((const plm_vlc_t *)table, 0, (int16_t)value, 0, 0, w);
+}
+
+
+// Macroblocks, chosen once and written into both streams
+
+typedef struct {
+	int run[8];
+	int level[8];
+	int count;
+	int dc;
+} block_t;
+
+typedef struct {
+	int skipped;
+	int type;
+	int quantizer_scale;
+	int forward[2];
+	int backward[2];
+	int cbp;
+	block_t blocks[6];
+} macroblock_t;
+
+// Decoder state the writer has to follow to code differences
+typedef struct {
+	writer_t w;
+	int expand_skipped;
+	int pending_skipped;
+	int forward[2];
+	int backward[2];
+	int dc_predictor[3];
+} stream_t;
+
+static int vector_fits(int col, int row, const int *vector) {
+	// Keep the referenced luma block, with its half pixel, 2 pixels inside the
+	// planes; the chroma blocks then fit as well
+	int x = col * 16 + (vector[0] >> 1);
+	int y = row * 16 + (vector[1] >> 1);
+	return x >= 2 && y >= 2 && x + 17 <= MB_WIDTH * 16 - 2 && y + 17 <= MB_HEIGHT * 16 - 2;
+}
+
+static void random_vector(int col, int row, int zero, int *vector) {
+	vector[0] = 0;
+	vector[1] = 0;
+	if (zero) {
+		return;
+	}
+	for (int i = 0; i < 8; i++) {
+		int v[2] = {random_int(25) - 12, random_int(25) - 12};
+		if (vector_fits(col, row, v)) {
+			vector[0] = v[0];
+			vector[1] = v[1];
+			return;
+		}
+	}
+}
+
+static void random_block(block_t *block, int intra) {
+	block->dc = 16 + random_int(225);
+	block->count = random_int(4) + (intra ? 0 : 1);
+	int n = intra ? 1 : 0;
+	for (int i = 0; i < block->count; i++) {
+		block->run[i] = random_int(6);
+		block->level[i] = (random_int(2) ? 1 : -1) * (1 + (random_int(4) ? random_int(6) : random_int(40)));
+		n += block->run[i] + 1;
+		if (n > 64) {
+			block->count = i;
+			break;
+		}
+	}
+}
+
+static void random_macroblock(macroblock_t *mb, int picture_type, int col, int row) {
+	static const int p_types[] = {0x01, 0x08, 0x08, 0x0a, 0x0a, 0x02, 0x1a, 0x12, 0x11};
+	static const int b_types[] = {0x0c, 0x0e, 0x04, 0x04, 0x06, 0x08, 0x08, 0x0a, 0x1e, 0x16, 0x1a, 0x01};
+
+	memset(mb, 0, sizeof(*mb));
+	if (picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA) {
+		mb->type = random_int(8) ? 0x01 : 0x11;
+	}
+	else if (picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE) {
+		mb->type = p_types[random_int(sizeof(p_types) / sizeof(p_types[0]))];
+	}
+	else {
+		mb->type = b_types[random_int(sizeof(b_types) / sizeof(b_types[0]))];
+	}
+	mb->quantizer_scale = 1 + random_int(31);
+
+	// Single direction B-macroblocks often copy with zero motion, which skipped
+	// macroblocks after them repeat in bulk
+	int single = (mb->type & 0x0c) != 0x0c;
+	if (mb->type & 0x08) {
+		random_vector(col, row, single && random_int(2), mb->forward);
+	}
+	if (mb->type & 0x04) {
+		random_vector(col, row, single && random_int(2), mb->backward);
+	}
+
+	int intra = mb->type & 0x01;
+	mb->cbp = intra ? 0x3f : (mb->type & 0x02) ? 1 + random_int(63) : 0;
+	for (int i = 0; i < 6; i++) {
+		random_block(&mb->blocks[i], intra);
+	}
+}
+
+// The macroblock a skipped one stands for, after prev at col, row. Returns
+// FALSE if there is none: skipped macroblocks in B-pictures repeat the
+// prediction before them, so its vectors have to fit here as well.
+
+static int skipped_macroblock(macroblock_t *mb, const macroblock_t *prev, int picture_type, int col, int row) {
+	memset(mb, 0, sizeof(*mb));
+	mb->skipped = TRUE;
+	if (picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE) {
+		mb->type = 0x08;
+		return TRUE;
+	}
+	if (prev->type & 0x01) {
+		return FALSE;
+	}
+	mb->type = prev->type & 0x0c;
+	memcpy(mb->forward, prev->forward, sizeof(mb->forward));
+	memcpy(mb->backward, prev->backward, sizeof(mb->backward));
+	return (
+		(!(mb->type & 0x08) || vector_fits(col, row, mb->forward)) &&
+		(!(mb->type & 0x04) || vector_fits(col, row, mb->backward))
+	);
+}
+
+static void put_motion(stream_t *s, int *predictor, int target) {
+	int d = target - *predictor;
+	*predictor = target;
+	if (d == 0) {
+		put_vlc(&s->w, PLM_VIDEO_MOTION, 0);
+		return;
+	}
+	int r_size = F_CODE - 1;
+	int a = d < 0 ? -d : d;
+	int m = ((a - 1) >> r_size) + 1;
+	put_vlc(&s->w, PLM_VIDEO_MOTION, d < 0 ? -m : m);
+	put_bits(&s->w, (a - 1) & ((1 << r_size) - 1), r_size);
+}
+
+static void put_block(stream_t *s, const block_t *block, int index, int intra) {
+	int n = 0;
+	if (intra) {
+		int plane = index > 3 ? index - 3 : 0;
+		int diff = block->dc - s->dc_predictor[plane];
+		s->dc_predictor[plane] = block->dc;
+		int size = 0;
+		while ((diff < 0 ? -diff : diff) >> size) {
+			size++;
+		}
+		put_vlc(&s->w, plane ? PLM_VIDEO_DCT_SIZE_CHROMINANCE : PLM_VIDEO_DCT_SIZE_LUMINANCE, size);
+		if (size) {
+			put_bits(&s->w, diff < 0 ? diff + (1 << size) - 1 : diff, size);
+		}
+		n = 1;
+	}
+	for (int i = 0; i < block->count; i++) {
+		int run = block->run[i];
+		int level = block->level[i];
+		int magnitude = level < 0 ? -level : level;
+		int value = (run << 8) | magnitude;
+		if (value == 0x0001) {
+			// "1s" as the first coefficient of a non-intra block, else "11s"
+			put_bits(&s->w, n == 0 ? 1 : 3, n == 0 ? 1 : 2);
+			put_bits(&s->w, level < 0, 1);
+		}
+		else if (put_vlc(NULL, PLM_VIDEO_DCT_COEFF, value)) {
+			put_vlc(&s->w, PLM_VIDEO_DCT_COEFF, value);
+			put_bits(&s->w, level < 0, 1);
+		}
+		else {
+			put_vlc(&s->w, PLM_VIDEO_DCT_COEFF, 0xffff);
+			put_bits(&s->w, run, 6);
+			put_bits(&s->w, level & 0xff, 8);
+		}
+		n += run + 1;
+	}
+	put_bits(&s->w, 2, 2); // end_of_block
+}
+
+static void put_macroblock(stream_t *s, const macroblock_t *mb, int picture_type) {
+	if (mb->skipped && !s->expand_skipped) {
+		s->pending_skipped++;
+		return;
+	}
+
+	int increment = s->pending_skipped + 1;
+	s->pending_skipped = 0;
+	put_vlc(&s->w, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT, increment);
+	if (increment > 1) {
+		s->dc_predictor[0] = s->dc_predictor[1] = s->dc_predictor[2] = 128;
+		if (picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE) {
+			s->forward[0] = s->forward[1] = 0;
+		}
+	}
+
+	put_vlc(&s->w, PLM_VIDEO_MACROBLOCK_TYPE[picture_type], mb->type);
+	if (mb->type & 0x10) {
+		put_bits(&s->w, mb->quantizer_scale, 5);
+	}
+
+	int intra = mb->type & 0x01;
+	if (intra) {
+		s->forward[0] = s->forward[1] = s->backward[0] = s->backward[1] = 0;
+	}
+	else {
+		s->dc_predictor[0] = s->dc_predictor[1] = s->dc_predictor[2] = 128;
+		if (mb->type & 0x08) {
+			put_motion(s, &s->forward[0], mb->forward[0]);
+			put_motion(s, &s->forward[1], mb->forward[1]);
+		}
+		else if (picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE) {
+			s->forward[0] = s->forward[1] = 0;
+		}
+		if (mb->type & 0x04) {
+			put_motion(s, &s->backward[0], mb->backward[0]);
+			put_motion(s, &s->backward[1], mb->backward[1]);
+		}
+	}
+
+	if (mb->type & 0x02) {
+		put_vlc(&s->w, PLM_VIDEO_CODE_BLOCK_PATTERN, mb->cbp);
+	}
+	for (int i = 0; i < 6; i++) {
+		if (mb->cbp & (0x20 >> i)) {
+			put_block(s, &mb->blocks[i], i, intra);
+		}
+	}
+}
+
+static void put_picture(stream_t *streams, int picture_type, int temporal_reference) {
+	for (int k = 0; k < 2; k++) {
+		writer_t *w = &streams[k].w;
+		put_start_code(w, 0x00);
+		put_bits(w, temporal_reference, 10);
+		put_bits(w, picture_type, 3);
+		put_bits(w, 0xffff, 16); // vbv_delay
+		if (picture_type != PLM_VIDEO_PICTURE_TYPE_INTRA) {
+			put_bits(w, 0, 1);
+			put_bits(w, F_CODE, 3);
+		}
+		if (picture_type == PLM_VIDEO_PICTURE_TYPE_B) {
+			put_bits(w, 0, 1);
+			put_bits(w, F_CODE, 3);
+		}
+		put_bits(w, 0, 1); // extra_bit_picture
+	}
+
+	// Slices of 1 to 3 whole macroblock rows; skipped runs may cross rows
+	// but a slice neither starts nor ends with a skipped macroblock
+	int row = 0;
+	while (row < MB_HEIGHT) {
+		int rows = 1 + random_int(3);
+		rows = row + rows > MB_HEIGHT ? MB_HEIGHT - row : rows;
+		int quantizer_scale = 1 + random_int(31);
+		for (int k = 0; k < 2; k++) {
+			stream_t *s = &streams[k];
+			put_start_code(&s->w, row + 1);
+			put_bits(&s->w, quantizer_scale, 5);
+			put_bits(&s->w, 0, 1); // extra_bit_slice
+			s->forward[0] = s->forward[1] = s->backward[0] = s->backward[1] = 0;
+			s->dc_predictor[0] = s->dc_predictor[1] = s->dc_predictor[2] = 128;
+			s->pending_skipped = 0;
+		}
+
+		int first = row * MB_WIDTH;
+		int last = (row + rows) * MB_WIDTH - 1;
+		macroblock_t prev;
+		macroblock_t mb;
+		for (int address = first; address <= last; address++) {
+			int col = address % MB_WIDTH;
+			int r = address / MB_WIDTH;
+			random_macroblock(&mb, picture_type, col, r);
+			for (int k = 0; k < 2; k++) {
+				put_macroblock(&streams[k], &mb, picture_type);
+			}
+			prev = mb;
+
+			// A run of skipped macroblocks, longer in B-pictures
+			int skip = 0;
+			if (picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE && random_int(3) == 0) {
+				skip = 1 + random_int(4);
+			}
+			else if (picture_type == PLM_VIDEO_PICTURE_TYPE_B && random_int(2) == 0) {
+				skip = 1 + random_int(MAX_SKIPPED);
+			}
+			while (skip-- > 0 && address + 1 < last) {
+				macroblock_t skipped;
+				int next = address + 1;
+				if (!skipped_macroblock(&skipped, &prev, picture_type, next % MB_WIDTH, next / MB_WIDTH)) {
+					break;
+				}
+				for (int k = 0; k < 2; k++) {
+					put_macroblock(&streams[k], &skipped, picture_type);
+				}
+				address = next;
+			}
+		}
+		row += rows;
+	}
+}
+
+// Wrap a video elementary stream into a system stream of packs with one
+// packet each, as plm_create_with_memory() expects
+
+static void put_system_stream(writer_t *out, const writer_t *video) {
+	uint32_t length = (video->bits + 7) >> 3;
+	for (uint32_t pos = 0; pos < length; pos += 2048) {
+		uint32_t size = length - pos < 2048 ? length - pos : 2048;
+		put_start_code(out, 0xBA);
+		put_bits(out, 0x2100010001ULL >> 8, 32); // '0010', SCR 0, markers
+		put_bits(out, 0x01, 8);
+		put_bits(out, 0x800003, 24); // mux_rate 1, markers
+		if (pos == 0) {
+			put_start_code(out, 0xBB);
+			put_bits(out, 9, 16); // header_length
+			put_bits(out, 0x800003, 24); // rate_bound
+			put_bits(out, 0x00, 8); // audio_bound 0, flags
+			put_bits(out, 0x21, 8); // flags, marker, video_bound 1
+			put_bits(out, 0xff, 8); // reserved
+			put_bits(out, 0xe0e02e, 24); // stream 0xE0, buffer bound
+		}
+		put_start_code(out, 0xE0);
+		put_bits(out, size + 1, 16);
+		put_bits(out, 0x0f, 8); // no timestamps
+		for (uint32_t i = 0; i < size; i++) {
+			put_bits(out, video->bytes[pos + i], 8);
+		}
+	}
+	put_start_code(out, 0xB9); // end of stream
+}
+
+// Both streams, with and without skipped macroblocks; types holds the type of
+// each picture in display order
+
+static void write_streams(writer_t *system, int *types) {
+	stream_t streams[2];
+	memset(streams, 0, sizeof(streams));
+	streams[1].expand_skipped = TRUE;
+
+	for (int k = 0; k < 2; k++) {
+		writer_t *w = &streams[k].w;
+		put_start_code(w, 0xB3);
+		put_bits(w, WIDTH, 12);
+		put_bits(w, HEIGHT, 12);
+		put_bits(w, 1, 4); // pixel aspect ratio
+		put_bits(w, FRAMERATE_CODE, 4);
+		put_bits(w, 0x3ffff, 18); // bit_rate
+		put_bits(w, 1, 1); // marker
+		put_bits(w, 20, 10); // vbv_buffer_size
+		put_bits(w, 0, 1); // constrained
+		put_bits(w, 0, 2); // default quant matrices
+	}
+
+	// Reference pictures every 3 frames, I-pictures every 9, each followed by
+	// the 2 B-pictures before it in display order. As the last picture is a
+	// B-picture, the decoder doesn't return the reference picture at FRAMES.
+	int gop_start = 0;
+	for (int display = 0; display <= FRAMES; display += 3) {
+		int type = display % 9 == 0 ? PLM_VIDEO_PICTURE_TYPE_INTRA : PLM_VIDEO_PICTURE_TYPE_PREDICTIVE;
+		if (type == PLM_VIDEO_PICTURE_TYPE_INTRA) {
+			gop_start = display > 0 ? display - 2 : 0;
+			for (int k = 0; k < 2; k++) {
+				put_start_code(&streams[k].w, 0xB8);
+				put_bits(&streams[k].w, 0, 25); // time_code
+				put_bits(&streams[k].w, display == 0, 1); // closed_gop
+				put_bits(&streams[k].w, 0, 6); // broken_link, padding
+			}
+		}
+		put_picture(streams, type, display - gop_start);
+		types[display] = type;
+		for (int b = display - 2; b > 0 && b < display; b++) {
+			put_picture(streams, PLM_VIDEO_PICTURE_TYPE_B, b - gop_start);
+			types[b] = PLM_VIDEO_PICTURE_TYPE_B;
+		}
+	}
+	for (int k = 0; k < 2; k++) {
+		put_start_code(&streams[k].w, 0xB7); // sequence end
+		put_system_stream(&system[k], &streams[k].w);
+		free(streams[k].w.bytes);
+	}
+}
+
+
+// Decoded frames in display order: the visible pixels of the planes and both
+// RGB565 conversions
+
+typedef struct {
+	uint8_t y[WIDTH * HEIGHT];
+	uint8_t cb[(WIDTH / 2) * (HEIGHT / 2)];
+	uint8_t cr[(WIDTH / 2) * (HEIGHT / 2)];
+	uint16_t rgb565[WIDTH * HEIGHT];
+	uint16_t rgb565_be[WIDTH * HEIGHT];
+} picture_t;
+
+static void store_frame(picture_t *picture, plm_frame_t *frame) {
+	for (int row = 0; row < HEIGHT; row++) {
+		memcpy(picture->y + row * WIDTH, frame->y.data + row * frame->y.width, WIDTH);
+	}
+	for (int row = 0; row < HEIGHT / 2; row++) {
+		memcpy(picture->cb + row * (WIDTH / 2), frame->cb.data + row * frame->cb.width, WIDTH / 2);
+		memcpy(picture->cr + row * (WIDTH / 2), frame->cr.data + row * frame->cr.width, WIDTH / 2);
+	}
+	plm_frame_to_rgb565(frame, picture->rgb565, WIDTH);
+	plm_frame_to_rgb565_be(frame, picture->rgb565_be, WIDTH);
+}
+
+// Count the pixels of the planes and of RGB565 that differ inside the rect,
+// in luma pixels; a NULL rgb565 is not compared
+
+static long compare_pictures(const picture_t *a, const picture_t *b, const uint16_t *rgb565, const plm_rect_t *rect) {
+	long mismatches = 0;
+	for (int y = rect->y; y < rect->y + rect->height; y++) {
+		for (int x = rect->x; x < rect->x + rect->width; x++) {
+			mismatches += a->y[y * WIDTH + x] != b->y[y * WIDTH + x];
+			if (rgb565) {
+				mismatches += rgb565[y * WIDTH + x] != b->rgb565[y * WIDTH + x];
+			}
+		}
+	}
+	for (int y = rect->y / 2; y < (rect->y + rect->height) / 2; y++) {
+		for (int x = rect->x / 2; x < (rect->x + rect->width) / 2; x++) {
+			mismatches += a->cb[y * (WIDTH / 2) + x] != b->cb[y * (WIDTH / 2) + x];
+			mismatches += a->cr[y * (WIDTH / 2) + x] != b->cr[y * (WIDTH / 2) + x];
+		}
+	}
+	return mismatches;
+}
+
+static picture_t expect[FRAMES];
+static int types[FRAMES + 1];
+static int failed = 0;
+
+static void check(int ok, const char *what, int threads) {
+	if (!ok) {
+		printf("FAILED: %s, %d threads\n", what, threads);
+		failed++;
+	}
+}
+
+// Decode the stream with skipped runs and compare every frame with the
+// reference; with rect, B-pictures are only compared inside it, with target
+// their RGB565 is taken from the target
+
+static void check_decode(writer_t *stream, int threads, plm_rect_t *rect, int target, int big_endian) {
+	static picture_t picture;
+	static uint16_t rgb565[WIDTH * HEIGHT];
+	plm_rect_t all = {0, 0, WIDTH, HEIGHT};
+
+	plm_t *plm = plm_create_with_memory(stream->bytes, (stream->bits + 7) >> 3, FALSE);
+	plm_set_video_thread_count(plm, threads);
+	if (target) {
+		plm_set_video_rgb565_target(plm, rgb565, WIDTH, big_endian);
+	}
+	if (rect) {
+		plm_set_video_b_picture_rect(plm, rect->x, rect->y, rect->width, rect->height);
+	}
+
+	// A display that only redraws the dirty rects of each frame
+	static uint16_t display[WIDTH * HEIGHT];
+	plm_rect_t rects[16];
+	long dirty_mismatches = 0;
+	int clean_b_macroblocks = 0;
+
+	long mismatches = 0;
+	int frames = 0;
+	int skipped_b = 0;
+	int targeted = 0;
+	int hidden_b = 0;
+	plm_frame_t *frame;
+	while ((frame = plm_decode_video(plm)) && frames < FRAMES) {
+		int b = types[frames] == PLM_VIDEO_PICTURE_TYPE_B;
+		store_frame(&picture, frame);
+		const uint16_t *converted = NULL;
+		if (frame->rgb565) {
+			converted = rgb565;
+			if (big_endian) {
+				for (int i = 0; i < WIDTH * HEIGHT; i++) {
+					rgb565[i] = (uint16_t)((rgb565[i] << 8) | (rgb565[i] >> 8));
+				}
+			}
+			targeted++;
+		}
+		mismatches += compare_pictures(&picture, &expect[frames], converted, b && rect ? rect : &all);
+		if (b) {
+			skipped_b += frame->skipped_macroblocks;
+			hidden_b += frame->hidden_macroblocks;
+		}
+
+		if (!rect) {
+			int count = plm_frame_get_dirty_rects(frame, rects, 16);
+			for (int i = 0; i < count; i++) {
+				plm_frame_rect_to_rgb565(frame, rects[i].x, rects[i].y, rects[i].width, rects[i].height, display, WIDTH);
+			}
+			for (int i = 0; i < WIDTH * HEIGHT; i++) {
+				dirty_mismatches += display[i] != picture.rgb565[i];
+			}
+			if (b) {
+				clean_b_macroblocks += MB_WIDTH * MB_HEIGHT - frame->dirty_macroblocks;
+			}
+		}
+		frames++;
+	}
+	plm_destroy(plm);
+
+	int b_pictures = 0;
+	for (int i = 0; i < FRAMES; i++) {
+		b_pictures += types[i] == PLM_VIDEO_PICTURE_TYPE_B;
+	}
+	check(frames == FRAMES, "frame count", threads);
+	check(mismatches == 0, rect ? "B-picture rect against the reference" : "frames against the reference", threads);
+	check(skipped_b > 0, "skipped B-macroblocks copied in bulk", threads);
+	check(targeted == (target ? b_pictures : 0), "B-pictures converted into the target", threads);
+	check(!rect || hidden_b > 0, "B-macroblocks outside the rect", threads);
+	if (!rect) {
+		check(dirty_mismatches == 0, "display redrawn from the dirty rects", threads);
+		check(clean_b_macroblocks > 0, "clean B-macroblocks", threads);
+	}
+	if (mismatches || dirty_mismatches) {
+		printf("  %ld mismatching pixels, %ld in the display\n", mismatches, dirty_mismatches);
+	}
+	if (!rect && !target) {
+		printf(
+			"%d threads: %d B-pictures, %d skipped macroblocks copied in bulk, %d clean\n",
+			threads, b_pictures, skipped_b, clean_b_macroblocks
+		);
+	}
+}
+
+// plm_decode() in ticks of several frames, with or without dropping late
+// B-pictures; each delivered frame must equal the reference of its time
+
+typedef struct {
+	int delivered[FRAMES];
+	long mismatches;
+	int count;
+} delivery_t;
+
+static void on_frame(plm_t *plm, plm_frame_t *frame, void *user) {
+	(void)plm;
+	static picture_t picture;
+	delivery_t *d = (delivery_t *)user;
+	int index = (int)(frame->time * FRAMERATE + 0.5);
+	if (index < 0 || index >= FRAMES) {
+		d->mismatches++;
+		return;
+	}
+	store_frame(&picture, frame);
+	plm_rect_t all = {0, 0, WIDTH, HEIGHT};
+	d->mismatches += compare_pictures(&picture, &expect[index], NULL, &all);
+	d->delivered[index]++;
+	d->count++;
+}
+
+static void check_drop(writer_t *stream, int threads, plm_drop_policy_t policy) {
+	delivery_t d;
+	memset(&d, 0, sizeof(d));
+	plm_t *plm = plm_create_with_memory(stream->bytes, (stream->bits + 7) >> 3, FALSE);
+	plm_set_video_thread_count(plm, threads);
+	plm_set_video_decode_callback(plm, on_frame, &d);
+	plm_set_drop_policy(plm, policy);
+	for (int i = 0; i < 100 && !plm_has_ended(plm); i++) {
+		plm_decode(plm, 3 / FRAMERATE);
+	}
+	int dropped = plm_get_dropped_frames(plm);
+	plm_destroy(plm);
+
+	int references = TRUE;
+	int dropped_b = 0;
+	for (int i = 0; i < FRAMES; i++) {
+		if (types[i] != PLM_VIDEO_PICTURE_TYPE_B) {
+			references &= d.delivered[i] == 1;
+		}
+		else {
+			dropped_b += d.delivered[i] == 0;
+		}
+	}
+	if (policy == PLM_DROP_LATE_B_FRAMES) {
+		check(dropped > 0 && dropped == dropped_b, "dropped late B-pictures", threads);
+	}
+	else {
+		check(dropped == 0 && dropped_b == 0, "no frames dropped without a policy", threads);
+	}
+	check(references, "reference pictures delivered once", threads);
+	check(d.count + dropped == FRAMES, "delivered and dropped frames", threads);
+	check(d.mismatches == 0, "delivered frames against the reference", threads);
+}
+
+int main(int argc, char *argv[]) {
+	random_state = argc > 1 ? (uint32_t)atoi(argv[1]) : 1;
+	if (!random_state) {
+		random_state = 1;
+	}
+
+	writer_t streams[2];
+	memset(streams, 0, sizeof(streams));
+	write_streams(streams, types);
+
+	// The reference, without skipped macroblocks or any of the options
+	plm_t *plm = plm_create_with_memory(streams[1].bytes, (streams[1].bits + 7) >> 3, FALSE);
+	int frames = 0;
+	int skipped = 0;
+	plm_frame_t *frame;
+	while ((frame = plm_decode_video(plm)) && frames < FRAMES) {
+		skipped += types[frames] == PLM_VIDEO_PICTURE_TYPE_B ? frame->skipped_macroblocks : 0;
+		store_frame(&expect[frames++], frame);
+	}
+	plm_destroy(plm);
+	if (frames != FRAMES || skipped) {
+		printf("The reference stream decodes to %d frames, expected %d\n", frames, FRAMES);
+		return 1;
+	}
+
+	plm_rect_t rect = {24, 18, 50, 36};
+	int thread_counts[] = {1, 3};
+	for (int i = 0; i < 2; i++) {
+		int threads = thread_counts[i];
+		check_decode(&streams[0], threads, NULL, FALSE, FALSE);
+		check_decode(&streams[0], threads, NULL, TRUE, FALSE);
+		check_decode(&streams[0], threads, NULL, TRUE, TRUE);
+		check_decode(&streams[0], threads, &rect, FALSE, FALSE);
+		check_decode(&streams[0], threads, &rect, TRUE, FALSE);
+		check_drop(&streams[0], threads, PLM_DROP_NONE);
+		check_drop(&streams[0], threads, PLM_DROP_LATE_B_FRAMES);
+	}
+
+	printf("%d failed checks\n", failed);
+	free(streams[0].bytes);
+	free(streams[1].bytes);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+// Times the decode of every picture of a file, keeping each picture's
+// fastest of a number of decodes, and prints the mean per picture type. The
+// time includes demuxing the picture's packets, which is small against the
+// decode. To compare versions of the decoder, build against their pl_mpeg.h,
+// e.g. before and with the dequantization tables:
+//
+//   cc -O2 -o decode_bench decode_bench.c -lm
+//
+//   git show 6b6ca00^:pl_mpeg_player/pl_mpeg.h > /tmp/before.h
+//   git show 6b6ca00:pl_mpeg_player/pl_mpeg.h > /tmp/with.h
+//   cc -O2 -DPL_MPEG_HEADER='"/tmp/before.h"' -o decode_before decode_bench.c -lm
+//   cc -O2 -DPL_MPEG_HEADER='"/tmp/with.h"' -o decode_with decode_bench.c -lm
+//
+//   ./decode_bench [file.mpg] [decodes]
+//
+// Medians of 9 interleaved runs of the fastest of 60 decodes at -O2 on x86,
+// mean per picture, in us:
+//
+//                                      before tables   with tables
+//   ../data/272x152.mpg            I       262.5          252.8
+//                                  P        80.1           79.8
+//   ../../vcd_player/data/VCD.DAT  I       466.0          452.3
+//                                  P       354.3          352.5
+//
+// I pictures decode 3 to 4% faster, P pictures, with fewer coefficients,
+// the same within noise.
+//
+// Also prints a hash of the decoded pictures, which must be the same for
+// both builds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef PL_MPEG_HEADER
+#define PL_MPEG_HEADER "../pl_mpeg.h"
+#endif
+
+#define PL_MPEG_IMPLEMENTATION
+#include PL_MPEG_HEADER
+
+#define MAX_PICTURES 4096
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint64_t hash_plane(uint64_t hash, plm_plane_t *plane) {
+	for (unsigned int i = 0; i < plane->width * plane->height; i++) {
+		hash = (hash ^ plane->data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+int main(int argc, char *argv[]) {
+	const char *file = argc > 1 ? argv[1] : "../data/272x152.mpg";
+	int decodes = argc > 2 ? atoi(argv[2]) : 60;
+
+	static double fastest[MAX_PICTURES];
+	static int types[MAX_PICTURES];
+	int pictures = 0;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (int d = 0; d < decodes; d++) {
+		plm_t *plm = plm_create_with_filename(file);
+		if (!plm) {
+			printf("Couldn't open %s\n", file);
+			return 1;
+		}
+		plm_set_audio_enabled(plm, FALSE);
+
+		int i = 0;
+		for (;;) {
+			double start = now();
+			plm_frame_t *frame = plm_decode_video(plm);
+			double t = now() - start;
+			if (!frame || i == MAX_PICTURES) {
+				break;
+			}
+			if (d == 0) {
+				fastest[i] = t;
+				types[i] = plm->video_decoder->picture_type;
+				hash = hash_plane(hash, &frame->y);
+				hash = hash_plane(hash, &frame->cb);
+				hash = hash_plane(hash, &frame->cr);
+			}
+			else if (t < fastest[i]) {
+				fastest[i] = t;
+			}
+			i++;
+		}
+		pictures = i;
+		plm_destroy(plm);
+	}
+
+	// Indexed by picture type, I = 1, P = 2, B = 3
+	double sum[4] = {0};
+	int count[4] = {0};
+	for (int i = 0; i < pictures; i++) {
+		sum[types[i] & 3] += fastest[i];
+		count[types[i] & 3]++;
+	}
+	printf("%d pictures, hash %016llx\n", pictures, (unsigned long long)hash);
+	const char *names = " IPB";
+	for (int type = 1; type < 4; type++) {
+		if (count[type]) {
+			printf("%c %4d pictures %8.1f us\n", names[type], count[type], sum[type] / count[type] * 1e6);
+		}
+	}
+	return 0;
+}
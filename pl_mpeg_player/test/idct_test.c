@@ -0,0 +1,198 @@
+// Checks plm_video_idct() and its reduced forms against the plain scalar
+// transform the decoder started out with, on random blocks of premultiplied
+// coefficients, and times plm_video_idct(). Build once per implementation:
+//
+//   cc -O2 -DPLM_VIDEO_IDCT=PLM_VIDEO_IDCT_SCALAR -o idct_test idct_test.c
+//   cc -O2 -msse2 -o idct_test idct_test.c      (SSE2)
+//   cc -O2 -msse4.1 -o idct_test idct_test.c    (SSE2 with SSE4.1 multiplies)
+//   cc -O2 -mavx2 -o idct_test idct_test.c      (AVX2)
+//
+//   ./idct_test [blocks] [seed]
+//
+// Prints the number of mismatching blocks and exits with 1 if there are any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+static void reference_idct(int *block) {
+	int
+		b1, b3, b4, b6, b7, tmp1, tmp2, m0,
+		x0, x1, x2, x3, x4, y3, y4, y5, y6, y7;
+
+	// Transform columns
+	for (int i = 0; i < 8; ++i) {
+		b1 = block[4 * 8 + i];
+		b3 = block[2 * 8 + i] + block[6 * 8 + i];
+		b4 = block[5 * 8 + i] - block[3 * 8 + i];
+		tmp1 = block[1 * 8 + i] + block[7 * 8 + i];
+		tmp2 = block[3 * 8 + i] + block[5 * 8 + i];
+		b6 = block[1 * 8 + i] - block[7 * 8 + i];
+		b7 = tmp1 + tmp2;
+		m0 = block[0 * 8 + i];
+		x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
+		x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
+		x1 = m0 - b1;
+		x2 = (((block[2 * 8 + i] - block[6 * 8 + i]) * 362 + 128) >> 8) - b3;
+		x3 = m0 + b1;
+		y3 = x1 + x2;
+		y4 = x3 + b3;
+		y5 = x1 - x2;
+		y6 = x3 - b3;
+		y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
+		block[0 * 8 + i] = b7 + y4;
+		block[1 * 8 + i] = x4 + y3;
+		block[2 * 8 + i] = y5 - x0;
+		block[3 * 8 + i] = y6 - y7;
+		block[4 * 8 + i] = y6 + y7;
+		block[5 * 8 + i] = x0 + y5;
+		block[6 * 8 + i] = y3 - x4;
+		block[7 * 8 + i] = y4 - b7;
+	}
+
+	// Transform rows
+	for (int i = 0; i < 64; i += 8) {
+		b1 = block[4 + i];
+		b3 = block[2 + i] + block[6 + i];
+		b4 = block[5 + i] - block[3 + i];
+		tmp1 = block[1 + i] + block[7 + i];
+		tmp2 = block[3 + i] + block[5 + i];
+		b6 = block[1 + i] - block[7 + i];
+		b7 = tmp1 + tmp2;
+		m0 = block[0 + i];
+		x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
+		x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
+		x1 = m0 - b1;
+		x2 = (((block[2 + i] - block[6 + i]) * 362 + 128) >> 8) - b3;
+		x3 = m0 + b1;
+		y3 = x1 + x2;
+		y4 = x3 + b3;
+		y5 = x1 - x2;
+		y6 = x3 - b3;
+		y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
+		block[0 + i] = (b7 + y4 + 128) >> 8;
+		block[1 + i] = (x4 + y3 + 128) >> 8;
+		block[2 + i] = (y5 - x0 + 128) >> 8;
+		block[3 + i] = (y6 - y7 + 128) >> 8;
+		block[4 + i] = (y6 + y7 + 128) >> 8;
+		block[5 + i] = (x0 + y5 + 128) >> 8;
+		block[6 + i] = (y3 - x4 + 128) >> 8;
+		block[7 + i] = (y4 - b7 + 128) >> 8;
+	}
+}
+
+static uint64_t rng_state;
+
+static uint32_t rng(void) {
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static int random_level(void) {
+	// Mostly small levels as in real streams, sometimes anything the
+	// decoder's clamp lets through
+	uint32_t r = rng();
+	if ((r & 15) == 0) {
+		return (int)((r >> 4) % 4096) - 2048;
+	}
+	return (int)((r >> 4) % 64) - 32;
+}
+
+// Fills a block like plm_video_decode_block() leaves it: dequantized levels
+// times the premultiplier. Only the top left mask_rows x mask_cols
+// coefficients are set, usually just a few of them.
+static void random_block(int *block, int mask_rows, int mask_cols) {
+	memset(block, 0, 64 * sizeof(int));
+	int n = 1 + (int)(rng() % 64);
+	if (rng() & 1) {
+		n = 1 + (int)(rng() % 6);
+	}
+	for (int i = 0; i < n; i++) {
+		int row = (int)(rng() % mask_rows);
+		int col = (int)(rng() % mask_cols);
+		int at = row * 8 + col;
+		block[at] = random_level() * PLM_VIDEO_PREMULTIPLIER_MATRIX[at];
+	}
+}
+
+static int check_reduced(
+	const char *name, void (*idct)(const int *, int *),
+	int rows, int cols, int count
+) {
+	int bad = 0;
+	for (int k = 0; k < count; k++) {
+		int block[64], expect[64], out[64];
+		random_block(block, rows, cols);
+		memcpy(expect, block, sizeof(block));
+		reference_idct(expect);
+		idct(block, out);
+		for (int i = 0; i < 64; i++) {
+			// The row form writes one row, the column form one value per row
+			int got =
+				rows == 1 ? out[i & 7] :
+				cols == 1 ? out[i >> 3] :
+				out[i];
+			if (got != expect[i]) {
+				bad++;
+				break;
+			}
+		}
+	}
+	printf("%-8s %d blocks, %d mismatches\n", name, count, bad);
+	return bad;
+}
+
+int main(int argc, char *argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 4000000;
+	rng_state = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+	if (rng_state == 0) {
+		rng_state = 1;
+	}
+
+	const char *impl =
+		PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2 ? "AVX2" :
+		PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2 ? "SSE2" : "scalar";
+
+	// The full transform, in batches so the timing does not include the
+	// reference
+	enum { BATCH = 4096 };
+	static int blocks[BATCH][64], expect[BATCH][64];
+	int bad = 0;
+	double seconds = 0;
+	for (int done = 0; done < count; done += BATCH) {
+		int n = count - done < BATCH ? count - done : BATCH;
+		for (int k = 0; k < n; k++) {
+			random_block(blocks[k], 8, 8);
+			memcpy(expect[k], blocks[k], sizeof(blocks[k]));
+			reference_idct(expect[k]);
+		}
+		clock_t start = clock();
+		for (int k = 0; k < n; k++) {
+			plm_video_idct(blocks[k]);
+		}
+		seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+		for (int k = 0; k < n; k++) {
+			if (memcmp(blocks[k], expect[k], sizeof(blocks[k])) != 0) {
+				bad++;
+			}
+		}
+	}
+	printf(
+		"%-8s %d blocks, %d mismatches, %.1f ns/block\n",
+		impl, count, bad, count ? seconds * 1e9 / count : 0.0
+	);
+
+	int reduced = count / 4;
+	bad += check_reduced("4x4", plm_video_idct_4x4, 4, 4, reduced);
+	bad += check_reduced("row", plm_video_idct_row, 1, 8, reduced);
+	bad += check_reduced("column", plm_video_idct_column, 8, 1, reduced);
+
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+// Checks plm_video_process_macroblock() against the original pixel by pixel
+// prediction and times both, per call, for each of the eight prediction
+// cases on 16x16 luma and 8x8 chroma blocks. The kernel follows the build:
+//
+//   cc -O2 -o predict_bench predict_bench.c                     (SSE2)
+//   cc -O2 -U__SSE2__ -o predict_bench predict_bench.c          (SWAR)
+//   cc -O2 -U__SSE2__ -DPLM_UNALIGNED_ACCESS=0 -o predict_bench predict_bench.c
+//                                                               (aligned SWAR)
+//
+//   ./predict_bench [repetitions]
+//
+// Exits with 1 if any block differs from the original prediction.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+static void reference_process_macroblock(
+	plm_video_t *self, uint8_t *s, uint8_t *d,
+	int motion_h, int motion_v, int block_size, int interpolate
+) {
+	int dw = self->mb_width * block_size;
+
+	int hp = motion_h >> 1;
+	int vp = motion_v >> 1;
+	int odd_h = (motion_h & 1) == 1;
+	int odd_v = (motion_v & 1) == 1;
+
+	unsigned int si = ((self->mb_row * block_size) + vp) * dw + (self->mb_col * block_size) + hp;
+	unsigned int di = (self->mb_row * dw + self->mb_col) * block_size;
+	
+	unsigned int max_address = (dw * (self->mb_height * block_size - block_size + 1) - block_size);
+	if (si > max_address || di > max_address) {
+		return; // corrupt video
+	}
+
+	#define PLM_MB_CASE(INTERPOLATE, ODD_H, ODD_V, OP) \
+		case ((INTERPOLATE << 2) | (ODD_H << 1) | (ODD_V)): \
+			PLM_BLOCK_SET(d, di, dw, si, dw, block_size, OP); \
+			break
+
+	switch ((interpolate << 2) | (odd_h << 1) | (odd_v)) {
+		PLM_MB_CASE(0, 0, 0, (s[si]));
+		PLM_MB_CASE(0, 0, 1, (s[si] + s[si + dw] + 1) >> 1);
+		PLM_MB_CASE(0, 1, 0, (s[si] + s[si + 1] + 1) >> 1);
+		PLM_MB_CASE(0, 1, 1, (s[si] + s[si + 1] + s[si + dw] + s[si + dw + 1] + 2) >> 2);
+
+		PLM_MB_CASE(1, 0, 0, (d[di] + (s[si]) + 1) >> 1);
+		PLM_MB_CASE(1, 0, 1, (d[di] + ((s[si] + s[si + dw] + 1) >> 1) + 1) >> 1);
+		PLM_MB_CASE(1, 1, 0, (d[di] + ((s[si] + s[si + 1] + 1) >> 1) + 1) >> 1);
+		PLM_MB_CASE(1, 1, 1, (d[di] + ((s[si] + s[si + 1] + s[si + dw] + s[si + dw + 1] + 2) >> 2) + 1) >> 1);
+	}
+
+	#undef PLM_MB_CASE
+}
+
+typedef void (*process_macroblock_t)(
+	plm_video_t *self, uint8_t *s, uint8_t *d,
+	int motion_h, int motion_v, int block_size, int interpolate
+);
+
+static double now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+// Predicts every inner macroblock of a CIF frame, repetitions times, with
+// vectors of a few pixels that keep the given half-pel bits. Returns the
+// time per call.
+static double run(
+	process_macroblock_t process, plm_video_t *video, uint8_t *s, uint8_t *d,
+	int block_size, int mode, int repetitions
+) {
+	int interpolate = mode >> 2;
+	int odd_h = (mode >> 1) & 1;
+	int odd_v = mode & 1;
+	long calls = 0;
+	double start = now_ns();
+	for (int r = 0; r < repetitions; r++) {
+		for (int row = 1; row < video->mb_height - 1; row++) {
+			for (int col = 1; col < video->mb_width - 1; col++) {
+				video->mb_row = row;
+				video->mb_col = col;
+				int motion_h = ((r % 5) - 2) * 2 + odd_h;
+				int motion_v = ((r % 3) - 1) * 2 + odd_v;
+				process(video, s, d, motion_h, motion_v, block_size, interpolate);
+				calls++;
+			}
+		}
+	}
+	return (now_ns() - start) / calls;
+}
+
+int main(int argc, char *argv[]) {
+	int repetitions = argc > 1 ? atoi(argv[1]) : 200;
+
+	plm_video_t video;
+	memset(&video, 0, sizeof(video));
+	video.mb_width = 22;
+	video.mb_height = 18;
+
+	int size = 352 * 288;
+	uint8_t *s = (uint8_t *)malloc(size);
+	uint8_t *d = (uint8_t *)malloc(size);
+	uint8_t *expect = (uint8_t *)malloc(size);
+	uint32_t state = 1;
+	for (int i = 0; i < size; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		s[i] = (uint8_t)state;
+		d[i] = (uint8_t)(state >> 8);
+	}
+	memcpy(expect, d, size);
+
+	const char *kernel =
+#if defined(__SSE2__)
+		"SSE2";
+#elif PLM_UNALIGNED_ACCESS
+		"SWAR";
+#else
+		"aligned SWAR";
+#endif
+	printf("%s, ns per call (original -> now)\n", kernel);
+
+	int bad = 0;
+	for (int block_size = 16; block_size >= 8; block_size -= 8) {
+		for (int mode = 0; mode < 8; mode++) {
+			// Same calls on both, so interpolated predictions build on the
+			// same destination
+			double before = run(reference_process_macroblock, &video, s, expect, block_size, mode, repetitions);
+			double after = run(plm_video_process_macroblock, &video, s, d, block_size, mode, repetitions);
+			int same = memcmp(d, expect, size) == 0;
+			printf(
+				"%2dx%-2d %-12s %-7s %6.1f -> %5.1f%s\n",
+				block_size, block_size,
+				mode & 4 ? "interpolated" : "",
+				(const char *[]){"copy", "v", "h", "hv"}[mode & 3],
+				before, after, same ? "" : "  MISMATCH"
+			);
+			if (!same) {
+				bad++;
+				memcpy(d, expect, size);
+			}
+		}
+	}
+
+	free(s);
+	free(d);
+	free(expect);
+	return bad ? 1 : 0;
+}
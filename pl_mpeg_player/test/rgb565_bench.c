@@ -0,0 +1,187 @@
+// Times plm_frame_to_rgb565_be() against YCbCr2RGB565Be(), the converter the
+// player used before, with tables laid out as those of Arduino_GFX, and checks
+// that both give the same pixels. Without SIMD and auto-vectorization the
+// library runs the same table lookups as on the ESP32, whose Arduino builds
+// default to -Os:
+//
+//   cc -O2 -o rgb565_bench rgb565_bench.c -lm                   (SSE2)
+//   cc -O2 -mavx2 -o rgb565_bench rgb565_bench.c -lm            (AVX2)
+//   cc -O2 -U__SSE2__ -fno-tree-vectorize -o rgb565_bench rgb565_bench.c -lm
+//   cc -Os -U__SSE2__ -fno-tree-vectorize -o rgb565_bench rgb565_bench.c -lm
+//
+// Add -DPLM_RGB565_ARDUINO_GFX_TABLES=1 to convert with the tables below
+// instead of the built-in ones, as the player does with those of Arduino_GFX,
+// or -DPLM_RGB565_DITHER=1 to time dithering; its pixels differ from
+// YCbCr2RGB565Be() by design.
+//
+//   ./rgb565_bench [file.mpg] [repetitions]
+//
+// The speed is also given relative to YCbCr2RGB565Be(), which is the same in
+// every build, so that builds can be compared on a machine whose clock
+// varies. Dithered against plain, medians of 21 runs of each build with 60
+// repetitions on x86, as times the speed of YCbCr2RGB565Be():
+//
+//                                              plain   dithered
+//   -O2 -U__SSE2__ -fno-tree-vectorize         1.020   1.013
+//   -Ofast -U__SSE2__ -fno-tree-vectorize      1.024   1.017
+//   -Os -U__SSE2__ -fno-tree-vectorize         1.153   1.150
+//   -O2 (SSE2)                                 2.51    2.49
+//   -O2 -mavx2                                 3.99    4.31
+//
+// Scalar dithering costs under 1%; the AVX2 difference is noise.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+// Tables in the layout of Arduino_GFX, with the BT.601 values of pl_mpeg.
+// Luma is offset so that all clip table indices are positive.
+#define CLIP_OFFSET 384
+
+static int16_t Y2I16[256];
+static int16_t CR2R16[256];
+static int16_t CB2G16[256];
+static int16_t CR2G16[256];
+static int16_t CB2B16[256];
+static uint16_t CLIPRBE[1024];
+static uint16_t CLIPGBE[1024];
+static uint16_t CLIPBBE[1024];
+
+static void init_tables(void) {
+	for (int i = 0; i < 256; i++) {
+		Y2I16[i] = (int16_t)((((i - 16) * 76309) >> 16) + CLIP_OFFSET);
+		CR2R16[i] = (int16_t)(((i - 128) * 104597) >> 16);
+		CB2G16[i] = (int16_t)(((i - 128) * 25674) >> 16);
+		CR2G16[i] = (int16_t)(((i - 128) * 53278) >> 16);
+		CB2B16[i] = (int16_t)(((i - 128) * 132201) >> 16);
+	}
+	for (int i = 0; i < 1024; i++) {
+		int c = i - CLIP_OFFSET;
+		c = c < 0 ? 0 : c > 255 ? 255 : c;
+		uint16_t r = (uint16_t)((c & 0xf8) << 8);
+		uint16_t g = (uint16_t)((c & 0xfc) << 3);
+		uint16_t b = (uint16_t)(c >> 3);
+		CLIPRBE[i] = (uint16_t)((r << 8) | (r >> 8));
+		CLIPGBE[i] = (uint16_t)((g << 8) | (g >> 8));
+		CLIPBBE[i] = (uint16_t)((b << 8) | (b >> 8));
+	}
+}
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+// As in pl_mpeg_player.ino before the decoder converted to RGB565 itself
+void YCbCr2RGB565Be(uint8_t *yData, uint8_t *cbData, uint8_t *crData, uint16_t w, uint16_t h, uint16_t *dest)
+{
+  int cols = w >> 1;
+  int rows = h >> 1;
+  uint8_t *yData2 = yData + w;
+  uint16_t *dest2 = dest + w;
+  for (int row = 0; row < rows; ++row)
+  {
+    for (int col = 0; col < cols; ++col)
+    {
+      uint8_t cr = *crData++;
+      uint8_t cb = *cbData++;
+      int16_t r = CR2R16[cr];
+      int16_t g = -CB2G16[cb] - CR2G16[cr];
+      int16_t b = CB2B16[cb];
+      int16_t y;
+
+      y = Y2I16[*yData++];
+      *dest++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
+      y = Y2I16[*yData++];
+      *dest++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
+      y = Y2I16[*yData2++];
+      *dest2++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
+      y = Y2I16[*yData2++];
+      *dest2++ = CLIPRBE[y + r] | CLIPGBE[y + g] | CLIPBBE[y + b];
+    }
+    yData += w;
+    yData2 += w;
+    dest += w;
+    dest2 += w;
+  }
+}
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+	const char *file = argc > 1 ? argv[1] : "../data/272x152.mpg";
+	int repetitions = argc > 2 ? atoi(argv[2]) : 200;
+	init_tables();
+
+	plm_t *plm = plm_create_with_filename(file);
+	if (!plm) {
+		printf("Couldn't open %s\n", file);
+		return 1;
+	}
+	plm_set_audio_enabled(plm, FALSE);
+
+	// YCbCr2RGB565Be() takes the planes as wide as the frame
+	int width = plm_get_width(plm) & ~15;
+	int height = plm_get_height(plm) & ~15;
+	uint16_t *expect = (uint16_t *)malloc(width * height * sizeof(uint16_t));
+	uint16_t *dest = (uint16_t *)malloc(width * height * sizeof(uint16_t));
+
+	// Check every frame, time on one from the middle of the first GOP
+	long mismatches = 0;
+	int frames = 0;
+	plm_frame_t *frame;
+	plm_frame_t *timed = NULL;
+	while ((frame = plm_decode_video(plm))) {
+		if (frame->y.width != (unsigned int)width || frame->height < (unsigned int)height) {
+			printf("frames must be a multiple of 16 pixels wide\n");
+			return 1;
+		}
+		frame->width = width;
+		frame->height = height;
+		YCbCr2RGB565Be(frame->y.data, frame->cb.data, frame->cr.data, width, height, expect);
+		plm_frame_to_rgb565_be(frame, dest, width);
+		for (int i = 0; i < width * height; i++) {
+			mismatches += dest[i] != expect[i];
+		}
+		if (++frames == 8) {
+			break;
+		}
+	}
+	timed = frame ? frame : plm_decode_video(plm);
+
+	double best[2] = {1e9, 1e9};
+	for (int round = 0; round < 15; round++) {
+		for (int k = 0; k < 2; k++) {
+			double start = now();
+			for (int i = 0; i < repetitions; i++) {
+				if (k == 0) {
+					YCbCr2RGB565Be(timed->y.data, timed->cb.data, timed->cr.data, width, height, expect);
+				}
+				else {
+					plm_frame_to_rgb565_be(timed, dest, width);
+				}
+			}
+			double t = now() - start;
+			if (t < best[k]) {
+				best[k] = t;
+			}
+		}
+	}
+
+	double pixels = (double)width * height * repetitions;
+	printf(
+		"%d frames, %ld mismatching pixels%s\n"
+		"YCbCr2RGB565Be()         %6.1f Mpix/s\n"
+		"plm_frame_to_rgb565_be() %6.1f Mpix/s, %.3f times as fast\n",
+		frames, mismatches, PLM_RGB565_DITHER ? " (dithered)" : "",
+		pixels / best[0] / 1e6, pixels / best[1] / 1e6, best[0] / best[1]
+	);
+	plm_destroy(plm);
+	free(expect);
+	free(dest);
+	return mismatches && !PLM_RGB565_DITHER ? 1 : 0;
+}
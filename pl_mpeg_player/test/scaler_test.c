@@ -0,0 +1,124 @@
+// Checks plm_scaler_to_rgb565() against plm_frame_to_rgb565(): doubling must
+// repeat each converted pixel twice in both directions and nearest scaling
+// must pick the pixel under the center of each destination pixel. Each source
+// size is also tried with an odd height. No scaling, bilinear included, may
+// write a pixel outside the destination. Dithering repeats the matrix per
+// destination row, so build without PLM_RGB565_DITHER:
+//
+//   cc -O2 -o scaler_test scaler_test.c -lm
+//   ./scaler_test [file.mpg] [frames]
+//
+// Prints the number of mismatching pixels and exits with 1 if there are any.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+#define GUARD 4
+#define GUARD_PIXEL 0x5a5a
+
+// Scale the top left src_width x src_height pixels of frame, converted into
+// full with a stride of frame_width, to dest_width x dest_height and count
+// the pixels that differ from the expected ones, or that were written
+// outside the destination
+
+static long check_scaler(
+	plm_frame_t *frame, const uint16_t *full, int frame_width,
+	int src_width, int src_height, int dest_width, int dest_height, plm_scale_mode_t mode
+) {
+	plm_scaler_t *scaler = plm_scaler_create(src_width, src_height, dest_width, dest_height, mode);
+	if (!scaler) {
+		printf("plm_scaler_create() failed for %dx%d to %dx%d\n", src_width, src_height, dest_width, dest_height);
+		return 1;
+	}
+
+	// Guard pixels to the right of each row and below the last one
+	int stride = dest_width + GUARD;
+	int rows = dest_height + GUARD;
+	uint16_t *dest = (uint16_t *)malloc(stride * rows * sizeof(uint16_t));
+	for (int i = 0; i < stride * rows; i++) {
+		dest[i] = GUARD_PIXEL;
+	}
+	plm_scaler_to_rgb565(scaler, frame, dest, stride);
+
+	long mismatches = 0;
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < stride; x++) {
+			int expect = GUARD_PIXEL;
+			if (x < dest_width && y < dest_height) {
+				if (mode == PLM_SCALE_BILINEAR) {
+					continue;
+				}
+				int src_x = mode == PLM_SCALE_DOUBLE ? x >> 1 : (2 * x + 1) * src_width / (2 * dest_width);
+				int src_y = mode == PLM_SCALE_DOUBLE ? y >> 1 : (2 * y + 1) * src_height / (2 * dest_height);
+				expect = full[src_y * frame_width + src_x];
+			}
+			mismatches += dest[y * stride + x] != expect;
+		}
+	}
+	if (mismatches) {
+		printf(
+			"%s %dx%d to %dx%d: %ld mismatching pixels\n",
+			mode == PLM_SCALE_DOUBLE ? "double" : mode == PLM_SCALE_NEAREST ? "nearest" : "bilinear",
+			src_width, src_height, dest_width, dest_height, mismatches
+		);
+	}
+	plm_scaler_destroy(scaler);
+	free(dest);
+	return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+	const char *file = argc > 1 ? argv[1] : "../data/272x152.mpg";
+	int frames = argc > 2 ? atoi(argv[2]) : 10;
+
+	plm_t *plm = plm_create_with_filename(file);
+	if (!plm) {
+		printf("Couldn't open %s\n", file);
+		return 1;
+	}
+	plm_set_audio_enabled(plm, FALSE);
+	int width = plm_get_width(plm);
+	int height = plm_get_height(plm);
+
+	// Source sizes, the top left of the frame; the second of each pair has an
+	// odd height
+	struct { int width, height; } sources[] = {
+		{width, height},
+		{width, height - 1},
+		{width - 4, height - 8},
+		{width - 4, height - 3},
+	};
+	int count = sizeof(sources) / sizeof(sources[0]);
+
+	uint16_t *full = (uint16_t *)malloc(width * height * sizeof(uint16_t));
+	long mismatches = 0;
+	int checks = 0;
+	int decoded = 0;
+	plm_frame_t *frame;
+	while (decoded < frames && (frame = plm_decode_video(plm))) {
+		plm_frame_to_rgb565(frame, full, width);
+		for (int i = 0; i < count; i++) {
+			int sw = sources[i].width;
+			int sh = sources[i].height;
+			mismatches += check_scaler(frame, full, width, sw, sh, sw * 2, sh * 2, PLM_SCALE_DOUBLE);
+			mismatches += check_scaler(frame, full, width, sw, sh, sw * 2, sh * 2, PLM_SCALE_NEAREST);
+			mismatches += check_scaler(frame, full, width, sw, sh, sw * 3, sh * 3, PLM_SCALE_NEAREST);
+			mismatches += check_scaler(frame, full, width, sw, sh, sw / 2, sh / 2, PLM_SCALE_NEAREST);
+			mismatches += check_scaler(frame, full, width, sw, sh, 101, 77, PLM_SCALE_NEAREST);
+			mismatches += check_scaler(frame, full, width, sw, sh, sw * 3, sh * 3, PLM_SCALE_BILINEAR);
+			mismatches += check_scaler(frame, full, width, sw, sh, 101, 77, PLM_SCALE_BILINEAR);
+			checks += 7;
+		}
+		decoded++;
+	}
+
+	printf("%d frames, %d scalings: %ld mismatching pixels\n", decoded, checks, mismatches);
+
+	plm_destroy(plm);
+	free(full);
+	return mismatches ? 1 : 0;
+}
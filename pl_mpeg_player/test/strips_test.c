@@ -0,0 +1,232 @@
+// Runs plm_frame_to_rgb565_strips() against a mock display that draws each
+// strip on a thread after a delay, the way a DMA transfer would, and checks
+// that the assembled picture equals plm_frame_to_rgb565_be() or
+// plm_scaler_to_rgb565_be() in every scale mode. Also fails if a buffer is
+// converted into while its transfer is still pending.
+//
+//   cc -O2 -o strips_test strips_test.c -lm -lpthread
+//   ./strips_test [file.mpg] [frames] [delay in us per strip]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+#define PANEL_WIDTH 1100
+#define PANEL_HEIGHT 700
+#define STRIP_HEIGHT 16
+
+typedef struct {
+	int x, y, width, height;
+	uint16_t *pixels;
+} transfer_t;
+
+typedef struct {
+	uint16_t *panel;
+	int delay_us;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	transfer_t queue[2];
+	int pending;
+	int done;
+
+	// Checked pixels must not change while they are in the queue
+	uint16_t *copy[2];
+	int overwritten;
+
+	long pushes;
+	double push_time;
+	double wait_time;
+	double transfer_time;
+} mock_display_t;
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *display_task(void *user) {
+	mock_display_t *m = (mock_display_t *)user;
+	for (;;) {
+		pthread_mutex_lock(&m->mutex);
+		while (!m->pending && !m->done) {
+			pthread_cond_wait(&m->cond, &m->mutex);
+		}
+		if (!m->pending) {
+			pthread_mutex_unlock(&m->mutex);
+			return NULL;
+		}
+		transfer_t t = m->queue[0];
+		pthread_mutex_unlock(&m->mutex);
+
+		double start = now();
+		usleep(m->delay_us);
+		size_t bytes = (size_t)t.width * t.height * sizeof(uint16_t);
+		if (memcmp(t.pixels, m->copy[0], bytes) != 0) {
+			m->overwritten++;
+		}
+		for (int row = 0; row < t.height; row++) {
+			memcpy(
+				m->panel + (t.y + row) * PANEL_WIDTH + t.x,
+				t.pixels + row * t.width, t.width * sizeof(uint16_t)
+			);
+		}
+		m->transfer_time += now() - start;
+
+		pthread_mutex_lock(&m->mutex);
+		m->queue[0] = m->queue[1];
+		uint16_t *copy = m->copy[0];
+		m->copy[0] = m->copy[1];
+		m->copy[1] = copy;
+		m->pending--;
+		pthread_cond_broadcast(&m->cond);
+		pthread_mutex_unlock(&m->mutex);
+	}
+}
+
+static void mock_push(int x, int y, int width, int height, uint16_t *pixels, void *user) {
+	mock_display_t *m = (mock_display_t *)user;
+	double start = now();
+	pthread_mutex_lock(&m->mutex);
+	if (m->pending == 2) {
+		printf("strip pushed while two are pending\n");
+		exit(1);
+	}
+	transfer_t t = {x, y, width, height, pixels};
+	m->queue[m->pending] = t;
+	memcpy(m->copy[m->pending], pixels, (size_t)width * height * sizeof(uint16_t));
+	m->pending++;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+	m->push_time += now() - start;
+	m->pushes++;
+}
+
+static int is_pending(mock_display_t *m, uint16_t *pixels) {
+	for (int i = 0; i < m->pending; i++) {
+		if (m->queue[i].pixels == pixels) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void mock_wait(uint16_t *pixels, void *user) {
+	mock_display_t *m = (mock_display_t *)user;
+	double start = now();
+	pthread_mutex_lock(&m->mutex);
+	while (is_pending(m, pixels)) {
+		pthread_cond_wait(&m->cond, &m->mutex);
+	}
+	pthread_mutex_unlock(&m->mutex);
+	m->wait_time += now() - start;
+}
+
+static void mock_drain(mock_display_t *m) {
+	pthread_mutex_lock(&m->mutex);
+	while (m->pending) {
+		pthread_cond_wait(&m->cond, &m->mutex);
+	}
+	pthread_mutex_unlock(&m->mutex);
+}
+
+int main(int argc, char *argv[]) {
+	const char *file = argc > 1 ? argv[1] : "../data/272x152.mpg";
+	int frames = argc > 2 ? atoi(argv[2]) : 20;
+
+	plm_t *plm = plm_create_with_filename(file);
+	if (!plm) {
+		printf("Couldn't open %s\n", file);
+		return 1;
+	}
+	plm_set_audio_enabled(plm, FALSE);
+	int width = plm_get_width(plm);
+	int height = plm_get_height(plm);
+
+	mock_display_t m;
+	memset(&m, 0, sizeof(m));
+	m.delay_us = argc > 3 ? atoi(argv[3]) : 200;
+	m.panel = (uint16_t *)malloc(PANEL_WIDTH * PANEL_HEIGHT * sizeof(uint16_t));
+	m.copy[0] = (uint16_t *)malloc(PANEL_WIDTH * STRIP_HEIGHT * sizeof(uint16_t));
+	m.copy[1] = (uint16_t *)malloc(PANEL_WIDTH * STRIP_HEIGHT * sizeof(uint16_t));
+	pthread_mutex_init(&m.mutex, NULL);
+	pthread_cond_init(&m.cond, NULL);
+	pthread_t thread;
+	pthread_create(&thread, NULL, display_task, &m);
+	plm_rgb565_sink_t sink = {mock_push, mock_wait, &m};
+
+	// Destination sizes; mode -1 converts at frame size without a scaler
+	struct { int width, height, mode; } sizes[] = {
+		{width, height, -1},
+		{width * 2, height * 2, PLM_SCALE_DOUBLE},
+		{width * 3 / 2, height * 3 / 2, PLM_SCALE_NEAREST},
+		{1024, 600, PLM_SCALE_BILINEAR},
+		{width / 2, height / 2, PLM_SCALE_BILINEAR},
+	};
+	int modes = sizeof(sizes) / sizeof(sizes[0]);
+
+	uint16_t *expect = (uint16_t *)malloc(PANEL_WIDTH * PANEL_HEIGHT * sizeof(uint16_t));
+	uint16_t *buffers = (uint16_t *)malloc(2 * PANEL_WIDTH * STRIP_HEIGHT * sizeof(uint16_t));
+	long mismatches = 0;
+	double convert_time = 0;
+	int decoded = 0;
+	plm_frame_t *frame;
+	while (decoded < frames && (frame = plm_decode_video(plm))) {
+		for (int i = 0; i < modes; i++) {
+			int dw = sizes[i].width;
+			int dh = sizes[i].height;
+			plm_scaler_t *scaler = sizes[i].mode < 0
+				? NULL
+				: plm_scaler_create(width, height, dw, dh, (plm_scale_mode_t)sizes[i].mode);
+			if (scaler) {
+				plm_scaler_to_rgb565_be(scaler, frame, expect, dw);
+			}
+			else {
+				plm_frame_to_rgb565_be(frame, expect, dw);
+			}
+
+			double start = now();
+			plm_frame_to_rgb565_strips(frame, scaler, buffers, STRIP_HEIGHT, TRUE, &sink);
+			convert_time += now() - start;
+			mock_drain(&m);
+
+			for (int y = 0; y < dh; y++) {
+				for (int x = 0; x < dw; x++) {
+					mismatches += expect[y * dw + x] != m.panel[y * PANEL_WIDTH + x];
+				}
+			}
+			if (scaler) {
+				plm_scaler_destroy(scaler);
+			}
+		}
+		decoded++;
+	}
+
+	pthread_mutex_lock(&m.mutex);
+	m.done = TRUE;
+	pthread_cond_broadcast(&m.cond);
+	pthread_mutex_unlock(&m.mutex);
+	pthread_join(thread, NULL);
+
+	printf(
+		"%d frames, %d sizes: %ld mismatching pixels, %d overwritten strips\n"
+		"%ld strips, convert %.1f ms, of it waiting %.1f ms and pushing %.2f ms, transfers %.1f ms\n",
+		decoded, modes, mismatches, m.overwritten,
+		m.pushes, convert_time * 1e3, m.wait_time * 1e3, m.push_time * 1e3, m.transfer_time * 1e3
+	);
+
+	plm_destroy(plm);
+	free(m.panel);
+	free(m.copy[0]);
+	free(m.copy[1]);
+	free(expect);
+	free(buffers);
+	return mismatches || m.overwritten ? 1 : 0;
+}
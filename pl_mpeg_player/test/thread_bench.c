@@ -0,0 +1,113 @@
+// Decodes the video of a file with 1 to n slice threads, see
+// plm_set_video_thread_count(), and prints the best time of a number of runs
+// for each thread count with its speedup over 1 thread. Fails if any thread
+// count decodes other pictures than 1 thread:
+//
+//   cc -O2 -o thread_bench thread_bench.c -lm -lpthread
+//   ./thread_bench [file.mpg] [runs] [thread counts...]
+//
+// The default thread counts are 1, 2, 3, 4 and 8. Medians of 5 runs of the
+// best of 15, in ms, on a host with one CPU, where extra threads can only
+// add switching between them:
+//
+//                                    1      2      3      4      8
+//   ../data/272x152.mpg            27.3   29.4   30.7   32.3   38.0
+//   ../../vcd_player/data/VCD.DAT  15.3   15.6   16.1   16.1   16.8
+//
+// Every thread beyond the first costs 2 to 7% here; the scaling curve has to
+// be taken on a multi-core host or the ESP32.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PL_MPEG_IMPLEMENTATION
+#include "../pl_mpeg.h"
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint64_t hash_plane(uint64_t hash, plm_plane_t *plane) {
+	for (unsigned int i = 0; i < plane->width * plane->height; i++) {
+		hash = (hash ^ plane->data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// Decode all pictures with the given number of threads; returns the decode
+// time, not counting the hashing, and the hash of the pictures in hash
+
+static double decode(const char *file, int threads, uint64_t *hash) {
+	plm_t *plm = plm_create_with_filename(file);
+	if (!plm) {
+		return -1;
+	}
+	plm_set_audio_enabled(plm, FALSE);
+	plm_set_video_thread_count(plm, threads);
+
+	double time = 0;
+	*hash = 0xcbf29ce484222325ULL;
+	for (;;) {
+		double start = now();
+		plm_frame_t *frame = plm_decode_video(plm);
+		time += now() - start;
+		if (!frame) {
+			break;
+		}
+		*hash = hash_plane(*hash, &frame->y);
+		*hash = hash_plane(*hash, &frame->cb);
+		*hash = hash_plane(*hash, &frame->cr);
+	}
+	plm_destroy(plm);
+	return time;
+}
+
+int main(int argc, char *argv[]) {
+	const char *file = argc > 1 ? argv[1] : "../data/272x152.mpg";
+	int runs = argc > 2 ? atoi(argv[2]) : 15;
+
+	int defaults[] = {1, 2, 3, 4, 8};
+	int counts[64];
+	int count = 0;
+	for (int i = 3; i < argc && count < 64; i++) {
+		counts[count++] = atoi(argv[i]);
+	}
+	if (!count) {
+		count = sizeof(defaults) / sizeof(defaults[0]);
+		memcpy(counts, defaults, sizeof(defaults));
+	}
+
+	uint64_t expect;
+	if (decode(file, 1, &expect) < 0) {
+		printf("Couldn't open %s\n", file);
+		return 1;
+	}
+
+	int failed = 0;
+	double single = 0;
+	for (int i = 0; i < count; i++) {
+		double best = 1e9;
+		uint64_t hash = expect;
+		for (int run = 0; run < runs; run++) {
+			double t = decode(file, counts[i], &hash);
+			if (t < best) {
+				best = t;
+			}
+		}
+		if (counts[i] == 1) {
+			single = best;
+		}
+		int differs = hash != expect;
+		printf("%2d threads %8.1f ms", counts[i], best * 1e3);
+		if (single) {
+			printf(", %.2f times as fast as 1 thread", single / best);
+		}
+		printf("%s\n", differs ? ", other pictures than 1 thread" : "");
+		failed |= differs;
+	}
+	return failed;
+}
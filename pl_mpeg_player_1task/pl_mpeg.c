@@ -2,8 +2,38 @@
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION
 
+// fileno() is POSIX, not C99; ask for it before any system header
+#if !defined(PLM_NO_MMAP) && !defined(ESP_PLATFORM) && (defined(__unix__) || defined(__APPLE__))
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include <string.h>
 #include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#if !defined(PLM_NO_THREADS)
+#if defined(ESP_PLATFORM)
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#define PLM_THREADS_FREERTOS
+#elif defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define PLM_THREADS_PTHREAD
+#endif
+#endif
+
+#if !defined(PLM_NO_MMAP) && !defined(ESP_PLATFORM) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define PLM_HAVE_MMAP
+#endif
 
 #include "pl_mpeg.h"
 
@@ -13,6 +43,7 @@
 struct plm_t
 {
 	plm_demux_t *demux;
+	plm_buffer_t *demux_buffer; // Source of the video and audio packet chains
 	double time;
 	int has_ended;
 	int loop;
@@ -20,6 +51,18 @@ struct plm_t
 
 	int video_enabled;
 	int video_packet_type;
+	int video_thread_count;
+	int video_downscale;
+	int video_visible_x;
+	int video_visible_y;
+	int video_visible_width;
+	int video_visible_height;
+	int video_grayscale;
+	uint16_t *video_rgb565_target;
+	int video_rgb565_stride;
+	int video_rgb565_big_endian;
+	plm_drop_policy_t drop_policy;
+	int late_frames;
 	plm_buffer_t *video_buffer;
 	plm_video_t *video_decoder;
 
@@ -33,11 +76,15 @@ struct plm_t
 	plm_video_decode_callback video_decode_callback;
 	void *video_decode_callback_user_data;
 
+	plm_video_luma_callback video_luma_callback;
+	void *video_luma_callback_user_data;
+
 	plm_audio_decode_callback audio_decode_callback;
 	void *audio_decode_callback_user_data;
 };
 
 int plm_init_decoders(plm_t *self);
+void plm_video_callback(plm_t *self, plm_frame_t *frame);
 void plm_handle_end(plm_t *self);
 void plm_read_video_packet(plm_buffer_t *buffer, void *user);
 void plm_read_audio_packet(plm_buffer_t *buffer, void *user);
@@ -61,6 +108,24 @@ plm_t *plm_create_with_file(FILE *fh, int close_when_done)
 	return plm_create_with_buffer(buffer, TRUE);
 }
 
+plm_t *plm_create_with_filename_async(const char *filename)
+{
+// printf("plm_create_with_filename_async\n");
+	plm_buffer_t *buffer = plm_buffer_create_with_filename_async(filename);
+	if (!buffer)
+	{
+		return NULL;
+	}
+	return plm_create_with_buffer(buffer, TRUE);
+}
+
+plm_t *plm_create_with_file_async(FILE *fh, int close_when_done)
+{
+// printf("plm_create_with_file_async\n");
+	plm_buffer_t *buffer = plm_buffer_create_with_file_async(fh, close_when_done);
+	return plm_create_with_buffer(buffer, TRUE);
+}
+
 plm_t *plm_create_with_memory(uint8_t *bytes, uint32_t length, int free_when_done)
 {
 // printf("plm_create_with_memory\n");
@@ -75,6 +140,7 @@ plm_t *plm_create_with_buffer(plm_buffer_t *buffer, int destroy_when_done)
 	memset(self, 0, sizeof(plm_t));
 
 	self->demux = plm_demux_create(buffer, destroy_when_done);
+	self->demux_buffer = buffer;
 	self->video_enabled = TRUE;
 	self->audio_enabled = TRUE;
 	plm_init_decoders(self);
@@ -103,9 +169,33 @@ int plm_init_decoders(plm_t *self)
 		}
 		if (!self->video_decoder)
 		{
-			self->video_buffer = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
+			self->video_buffer = plm_buffer_create_for_packets(self->demux_buffer);
 			plm_buffer_set_load_callback(self->video_buffer, plm_read_video_packet, self);
 			self->video_decoder = plm_video_create_with_buffer(self->video_buffer, TRUE);
+			if (self->video_thread_count > 1)
+			{
+				plm_video_set_thread_count(self->video_decoder, self->video_thread_count);
+			}
+			if (self->video_downscale > 1)
+			{
+				plm_video_set_downscale(self->video_decoder, self->video_downscale);
+			}
+			if (self->video_grayscale)
+			{
+				plm_video_set_grayscale(self->video_decoder, TRUE);
+			}
+			if (self->video_rgb565_target)
+			{
+				plm_video_set_rgb565_target(
+						self->video_decoder, self->video_rgb565_target,
+						self->video_rgb565_stride, self->video_rgb565_big_endian);
+			}
+			if (self->video_visible_width > 0)
+			{
+				plm_video_set_b_picture_rect(
+						self->video_decoder, self->video_visible_x, self->video_visible_y,
+						self->video_visible_width, self->video_visible_height);
+			}
 		}
 	}
 
@@ -117,7 +207,7 @@ int plm_init_decoders(plm_t *self)
 		}
 		if (!self->audio_decoder)
 		{
-			self->audio_buffer = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
+			self->audio_buffer = plm_buffer_create_for_packets(self->demux_buffer);
 			plm_buffer_set_load_callback(self->audio_buffer, plm_read_audio_packet, self);
 			self->audio_decoder = plm_audio_create_with_buffer(self->audio_buffer, TRUE);
 		}
@@ -195,7 +285,12 @@ void plm_set_audio_enabled(plm_t *self, int enabled)
 
 	if (!enabled)
 	{
+		// Pending packets must not hold on to demux data while disabled
 		self->audio_packet_type = 0;
+		if (self->audio_buffer)
+		{
+			plm_buffer_detach(self->audio_buffer);
+		}
 		return;
 	}
 
@@ -230,7 +325,12 @@ void plm_set_video_enabled(plm_t *self, int enabled)
 
 	if (!enabled)
 	{
+		// Pending packets must not hold on to demux data while disabled
 		self->video_packet_type = 0;
+		if (self->video_buffer)
+		{
+			plm_buffer_detach(self->video_buffer);
+		}
 		return;
 	}
 
@@ -239,6 +339,77 @@ void plm_set_video_enabled(plm_t *self, int enabled)
 																: 0;
 }
 
+void plm_set_video_thread_count(plm_t *self, int count)
+{
+// printf("plm_set_video_thread_count\n");
+	self->video_thread_count = count;
+	if (self->video_decoder)
+	{
+		plm_video_set_thread_count(self->video_decoder, count);
+	}
+}
+
+void plm_set_video_grayscale(plm_t *self, int enabled)
+{
+// printf("plm_set_video_grayscale\n");
+	self->video_grayscale = enabled;
+	if (self->video_decoder)
+	{
+		plm_video_set_grayscale(self->video_decoder, enabled);
+	}
+}
+
+void plm_set_video_rgb565_target(plm_t *self, uint16_t *dest, int stride, int big_endian)
+{
+// printf("plm_set_video_rgb565_target\n");
+	self->video_rgb565_target = dest;
+	self->video_rgb565_stride = stride;
+	self->video_rgb565_big_endian = big_endian;
+	if (self->video_decoder)
+	{
+		plm_video_set_rgb565_target(self->video_decoder, dest, stride, big_endian);
+	}
+}
+
+int plm_set_video_downscale(plm_t *self, int factor)
+{
+// printf("plm_set_video_downscale\n");
+	if (self->video_decoder)
+	{
+		if (!plm_video_set_downscale(self->video_decoder, factor))
+		{
+			return FALSE;
+		}
+	}
+	else if (factor != 1 && factor != 2 && factor != 4 && factor != 8)
+	{
+		return FALSE;
+	}
+	self->video_downscale = factor;
+	return TRUE;
+}
+
+void plm_set_video_b_picture_rect(plm_t *self, int x, int y, int width, int height)
+{
+// printf("plm_set_video_b_picture_rect\n");
+	self->video_visible_x = x;
+	self->video_visible_y = y;
+	self->video_visible_width = width;
+	self->video_visible_height = height;
+	if (self->video_decoder)
+	{
+		plm_video_set_b_picture_rect(self->video_decoder, x, y, width, height);
+	}
+}
+
+double plm_get_video_hidden_b_fraction(plm_t *self)
+{
+// printf("plm_get_video_hidden_b_fraction\n");
+	return self->video_decoder
+		? plm_video_get_hidden_b_fraction(self->video_decoder)
+		: 0;
+}
+
 int plm_get_num_video_streams(plm_t *self)
 {
 // printf("plm_get_num_video_streams\n");
@@ -301,6 +472,12 @@ double plm_get_time(plm_t *self)
 	return self->time;
 }
 
+plm_input_mode_t plm_get_input_mode(plm_t *self)
+{
+// printf("plm_get_input_mode\n");
+	return plm_buffer_get_input_mode(self->demux_buffer);
+}
+
 double plm_get_duration(plm_t *self)
 {
 // printf("plm_get_duration\n");
@@ -349,6 +526,13 @@ void plm_set_video_decode_callback(plm_t *self, plm_video_decode_callback fp, vo
 	self->video_decode_callback_user_data = user;
 }
 
+void plm_set_video_luma_callback(plm_t *self, plm_video_luma_callback fp, void *user)
+{
+// printf("plm_set_video_luma_callback\n");
+	self->video_luma_callback = fp;
+	self->video_luma_callback_user_data = user;
+}
+
 void plm_set_audio_decode_callback(plm_t *self, plm_audio_decode_callback fp, void *user)
 {
 // printf("plm_set_audio_decode_callback\n");
@@ -364,7 +548,9 @@ void plm_decode(plm_t *self, double tick)
 		return;
 	}
 
-	int decode_video = (self->video_decode_callback && self->video_packet_type);
+	int decode_video = (
+			(self->video_decode_callback || self->video_luma_callback) &&
+			self->video_packet_type);
 	int decode_audio = (self->audio_decode_callback && self->audio_packet_type);
 
 	if (!decode_video && !decode_audio)
@@ -380,6 +566,12 @@ void plm_decode(plm_t *self, double tick)
 	double video_target_time = self->time + tick;
 	double audio_target_time = self->time + tick + self->audio_lead_time;
 
+	int drop = decode_video && self->drop_policy == PLM_DROP_LATE_B_FRAMES;
+	if (drop)
+	{
+		plm_video_set_drop_time(self->video_decoder, video_target_time);
+	}
+
 	do
 	{
 		did_decode = FALSE;
@@ -389,7 +581,12 @@ void plm_decode(plm_t *self, double tick)
 			plm_frame_t *frame = plm_video_decode(self->video_decoder);
 			if (frame)
 			{
-				self->video_decode_callback(self, frame, self->video_decode_callback_user_data);
+				// The next frame is due within this call as well
+				if (plm_video_get_time(self->video_decoder) < video_target_time)
+				{
+					self->late_frames++;
+				}
+				plm_video_callback(self, frame);
 				did_decode = TRUE;
 			}
 			else
@@ -413,6 +610,11 @@ void plm_decode(plm_t *self, double tick)
 		}
 	} while (did_decode);
 
+	if (drop)
+	{
+		plm_video_set_drop_time(self->video_decoder, 0);
+	}
+
 	// Did all sources we wanted to decode fail and the demuxer is at the end?
 	if (
 			(!decode_video || decode_video_failed) &&
@@ -426,6 +628,39 @@ void plm_decode(plm_t *self, double tick)
 	self->time += tick;
 }
 
+void plm_set_drop_policy(plm_t *self, plm_drop_policy_t policy)
+{
+// printf("plm_set_drop_policy\n");
+	self->drop_policy = policy;
+}
+
+int plm_get_dropped_frames(plm_t *self)
+{
+// printf("plm_get_dropped_frames\n");
+	return self->video_decoder
+		? plm_video_get_dropped_frames(self->video_decoder)
+		: 0;
+}
+
+int plm_get_late_frames(plm_t *self)
+{
+// printf("plm_get_late_frames\n");
+	return self->late_frames;
+}
+
+void plm_video_callback(plm_t *self, plm_frame_t *frame)
+{
+// printf("plm_video_callback\n");
+	if (self->video_decode_callback)
+	{
+		self->video_decode_callback(self, frame, self->video_decode_callback_user_data);
+	}
+	if (self->video_luma_callback)
+	{
+		self->video_luma_callback(self, &frame->y, self->video_luma_callback_user_data);
+	}
+}
+
 plm_frame_t *plm_decode_video(plm_t *self)
 {
 // printf("plm_decode_video\n");
@@ -597,6 +832,11 @@ plm_frame_t *plm_seek_frame(plm_t *self, double time, int seek_exact)
 
 	if (frame)
 	{
+		// Frames decoded on the way were never shown, so the whole frame is
+		// dirty
+		unsigned int size = frame->macroblock_size;
+		frame->dirty_macroblocks = ((frame->width + size - 1) / size) * ((frame->height + size - 1) / size);
+		memset(frame->dirty, 1, frame->dirty_macroblocks);
 		self->time = frame->time;
 	}
 
@@ -614,10 +854,7 @@ int plm_seek(plm_t *self, double time, int seek_exact)
 		return FALSE;
 	}
 
-	if (self->video_decode_callback)
-	{
-		self->video_decode_callback(self, frame, self->video_decode_callback_user_data);
-	}
+	plm_video_callback(self, frame);
 
 	// If audio is not enabled we are done here.
 	if (!self->audio_packet_type)
@@ -654,1464 +891,2827 @@ int plm_seek(plm_t *self, double time, int seek_exact)
 }
 
 // -----------------------------------------------------------------------------
-// plm_buffer implementation
+// plm_read_ahead implementation
 
-plm_buffer_t *plm_buffer_create_with_filename(const char *filename)
+// A reader thread reads chunks of a file ahead of the decoder. free_chunks
+// counts the chunks the reader may fill, filled_chunks the ones the decoder
+// may take; a chunk of length 0 marks the end of the file. Threads are
+// FreeRTOS tasks on ESP32 and pthreads elsewhere; without either, creating a
+// read-ahead fails and file buffers read synchronously. The core given to
+// plm_thread_create() counts from the core of the calling task, -1 for any;
+// it only applies to FreeRTOS.
+
+#if defined(PLM_THREADS_FREERTOS)
+
+#ifndef PLM_THREAD_STACK_SIZE
+#define PLM_THREAD_STACK_SIZE 4096
+#endif
+
+#ifndef PLM_THREAD_PRIORITY
+#define PLM_THREAD_PRIORITY (tskIDLE_PRIORITY + 2)
+#endif
+
+#define PLM_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PLM_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define PLM_ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
+
+typedef struct
 {
-// printf("plm_buffer_create_with_filename\n");
-	FILE *fh = fopen(filename, "rb");
-	if (!fh)
-	{
-		return NULL;
-	}
-	return plm_buffer_create_with_file(fh, TRUE);
-}
+	SemaphoreHandle_t handle;
+} plm_semaphore_t;
 
-plm_buffer_t *plm_buffer_create_with_file(FILE *fh, int close_when_done)
+typedef struct
 {
-// printf("plm_buffer_create_with_file\n");
-	plm_buffer_t *self = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
-	self->fh = fh;
-	self->close_when_done = close_when_done;
-	self->mode = PLM_BUFFER_MODE_FILE;
-	self->discard_read_bytes = TRUE;
+	TaskHandle_t task;
+	SemaphoreHandle_t done;
+	void (*entry)(void *arg);
+	void *arg;
+} plm_thread_t;
 
-	fseek(self->fh, 0, SEEK_END);
-	self->total_size = ftell(self->fh);
-	fseek(self->fh, 0, SEEK_SET);
+#elif defined(PLM_THREADS_PTHREAD)
 
-	plm_buffer_set_load_callback(self, plm_buffer_load_file_callback, NULL);
-	return self;
-}
+#define PLM_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PLM_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define PLM_ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
 
-plm_buffer_t *plm_buffer_create_with_memory(uint8_t *bytes, uint32_t length, int free_when_done)
+typedef struct
 {
-// printf("plm_buffer_create_with_memory\n");
-	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
-	memset(self, 0, sizeof(plm_buffer_t));
-	self->capacity = length;
-	self->length = length;
-	self->total_size = length;
-	self->free_when_done = free_when_done;
-	self->bytes = bytes;
-	self->mode = PLM_BUFFER_MODE_FIXED_MEM;
-	self->discard_read_bytes = FALSE;
-	return self;
-}
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;
+} plm_semaphore_t;
 
-plm_buffer_t *plm_buffer_create_with_capacity(uint32_t capacity)
+typedef struct
 {
-// printf("plm_buffer_create_with_capacity\n");
-	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
-	memset(self, 0, sizeof(plm_buffer_t));
-	self->capacity = capacity;
-	self->free_when_done = TRUE;
-	self->bytes = (uint8_t *)PLM_MALLOC(capacity);
-	self->mode = PLM_BUFFER_MODE_RING;
-	self->discard_read_bytes = TRUE;
-	return self;
-}
+	pthread_t thread;
+	void (*entry)(void *arg);
+	void *arg;
+} plm_thread_t;
 
-plm_buffer_t *plm_buffer_create_for_appending(uint32_t initial_capacity)
+#else
+
+#define PLM_ATOMIC_LOAD(p) (*(p))
+#define PLM_ATOMIC_STORE(p, v) (*(p) = (v))
+#define PLM_ATOMIC_FETCH_ADD(p, v) ((*(p) += (v)) - (v))
+
+typedef struct
 {
-// printf("plm_buffer_create_for_appending\n");
-	plm_buffer_t *self = plm_buffer_create_with_capacity(initial_capacity);
-	self->mode = PLM_BUFFER_MODE_APPEND;
-	self->discard_read_bytes = FALSE;
-	return self;
+	int count;
+} plm_semaphore_t;
+
+typedef struct
+{
+	void (*entry)(void *arg);
+	void *arg;
+} plm_thread_t;
+
+#endif
+
+struct plm_read_ahead_t
+{
+	FILE *fh;
+	uint8_t *chunks;
+	uint32_t *chunk_lengths;
+	uint32_t chunk_size;
+	int chunk_count;
+	plm_semaphore_t free_chunks;
+	plm_semaphore_t filled_chunks;
+	plm_thread_t thread;
+	int is_running;
+	int stop;
+
+	// Reader side: the next chunk to fill and the file offset it is read from
+	int write_index;
+	uint32_t read_pos;
+
+	// Decoder side: the chunk being taken, how much of it has been taken, and
+	// the file offset of the next byte handed out
+	int read_index;
+	int has_chunk;
+	uint32_t chunk_offset;
+	int has_ended;
+	uint32_t position;
+};
+
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg);
+void plm_thread_join(plm_thread_t *self);
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count);
+void plm_semaphore_destroy(plm_semaphore_t *self);
+void plm_semaphore_wait(plm_semaphore_t *self);
+int plm_semaphore_try_wait(plm_semaphore_t *self);
+void plm_semaphore_post(plm_semaphore_t *self);
+
+int plm_read_ahead_start(plm_read_ahead_t *self);
+void plm_read_ahead_stop(plm_read_ahead_t *self);
+void plm_read_ahead_thread(void *arg);
+
+#if defined(PLM_THREADS_FREERTOS)
+
+void plm_thread_main(void *arg)
+{
+	plm_thread_t *self = (plm_thread_t *)arg;
+	self->entry(self->arg);
+	xSemaphoreGive(self->done);
+	vTaskDelete(NULL);
 }
 
-void plm_buffer_destroy(plm_buffer_t *self)
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg)
 {
-// printf("plm_buffer_destroy\n");
-	if (self->fh && self->close_when_done)
+	self->entry = entry;
+	self->arg = arg;
+	self->done = xSemaphoreCreateBinary();
+	if (!self->done)
 	{
-		fclose(self->fh);
+		return FALSE;
 	}
-	if (self->free_when_done)
+	BaseType_t core_id = core < 0
+		? tskNO_AFFINITY
+		: (BaseType_t)((xPortGetCoreID() + core) % portNUM_PROCESSORS);
+	if (xTaskCreatePinnedToCore(plm_thread_main, name, PLM_THREAD_STACK_SIZE, self, PLM_THREAD_PRIORITY, &self->task, core_id) != pdPASS)
 	{
-		PLM_FREE(self->bytes);
+		vSemaphoreDelete(self->done);
+		return FALSE;
 	}
-	PLM_FREE(self);
+	return TRUE;
 }
 
-uint32_t plm_buffer_get_size(plm_buffer_t *self)
+void plm_thread_join(plm_thread_t *self)
 {
-// printf("plm_buffer_get_size\n");
-	return (self->mode == PLM_BUFFER_MODE_FILE)
-						 ? self->total_size
-						 : self->length;
+	xSemaphoreTake(self->done, portMAX_DELAY);
+	vSemaphoreDelete(self->done);
 }
 
-uint32_t plm_buffer_get_remaining(plm_buffer_t *self)
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count)
 {
-// printf("plm_buffer_get_remaining\n");
-	return self->length - (self->bit_index >> 3);
+	self->handle = xSemaphoreCreateCounting(max_count, count);
+	return self->handle != NULL;
 }
 
-uint32_t plm_buffer_write(plm_buffer_t *self, uint8_t *bytes, uint32_t length)
+void plm_semaphore_destroy(plm_semaphore_t *self)
 {
-// printf("plm_buffer_write\n");
-	if (self->mode == PLM_BUFFER_MODE_FIXED_MEM)
-	{
-		return 0;
-	}
-
-	if (self->discard_read_bytes)
-	{
-		// This should be a ring buffer, but instead it just shifts all unread
-		// data to the beginning of the buffer and appends new data at the end.
-		// Seems to be good enough.
-
-		plm_buffer_discard_read_bytes(self);
-		if (self->mode == PLM_BUFFER_MODE_RING)
-		{
-			self->total_size = 0;
-		}
-	}
+	vSemaphoreDelete(self->handle);
+}
 
-	// Do we have to resize to fit the new data?
-	uint32_t bytes_available = self->capacity - self->length;
-	if (bytes_available < length)
-	{
-		uint32_t new_size = self->capacity;
-		do
-		{
-			new_size *= 2;
-		} while (new_size - self->length < length);
-		self->bytes = (uint8_t *)PLM_REALLOC(self->bytes, new_size);
-		self->capacity = new_size;
-	}
+void plm_semaphore_wait(plm_semaphore_t *self)
+{
+	xSemaphoreTake(self->handle, portMAX_DELAY);
+}
 
-	memcpy(self->bytes + self->length, bytes, length);
-	self->length += length;
-	self->has_ended = FALSE;
-	return length;
+int plm_semaphore_try_wait(plm_semaphore_t *self)
+{
+	return xSemaphoreTake(self->handle, 0) == pdTRUE;
 }
 
-void plm_buffer_signal_end(plm_buffer_t *self)
+void plm_semaphore_post(plm_semaphore_t *self)
 {
-// printf("plm_buffer_signal_end\n");
-	self->total_size = self->length;
+	xSemaphoreGive(self->handle);
 }
 
-void plm_buffer_set_load_callback(plm_buffer_t *self, plm_buffer_load_callback fp, void *user)
+#elif defined(PLM_THREADS_PTHREAD)
+
+void *plm_thread_main(void *arg)
 {
-// printf("plm_buffer_set_load_callback\n");
-	self->load_callback = fp;
-	self->load_callback_user_data = user;
+	plm_thread_t *self = (plm_thread_t *)arg;
+	self->entry(self->arg);
+	return NULL;
 }
 
-void plm_buffer_rewind(plm_buffer_t *self)
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg)
 {
-// printf("plm_buffer_rewind\n");
-	plm_buffer_seek(self, 0);
+	PLM_UNUSED(name);
+	PLM_UNUSED(core);
+	self->entry = entry;
+	self->arg = arg;
+	return pthread_create(&self->thread, NULL, plm_thread_main, self) == 0;
 }
 
-void plm_buffer_seek(plm_buffer_t *self, uint32_t pos)
+void plm_thread_join(plm_thread_t *self)
 {
-// printf("plm_buffer_seek\n");
-	self->has_ended = FALSE;
+	pthread_join(self->thread, NULL);
+}
 
-	if (self->mode == PLM_BUFFER_MODE_FILE)
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count)
+{
+	PLM_UNUSED(max_count);
+	self->count = count;
+	if (pthread_mutex_init(&self->mutex, NULL) != 0)
 	{
-		fseek(self->fh, pos, SEEK_SET);
-		self->bit_index = 0;
-		self->length = 0;
-	}
-	else if (self->mode == PLM_BUFFER_MODE_RING)
-	{
-		if (pos != 0)
-		{
-			// Seeking to non-0 is forbidden for dynamic-mem buffers
-			return;
-		}
-		self->bit_index = 0;
-		self->length = 0;
-		self->total_size = 0;
+		return FALSE;
 	}
-	else if (pos < self->length)
+	if (pthread_cond_init(&self->cond, NULL) != 0)
 	{
-		self->bit_index = pos << 3;
+		pthread_mutex_destroy(&self->mutex);
+		return FALSE;
 	}
+	return TRUE;
 }
 
-uint32_t plm_buffer_tell(plm_buffer_t *self)
+void plm_semaphore_destroy(plm_semaphore_t *self)
 {
-// printf("plm_buffer_tell\n");
-	return self->mode == PLM_BUFFER_MODE_FILE
-						 ? ftell(self->fh) + (self->bit_index >> 3) - self->length
-						 : self->bit_index >> 3;
+	pthread_cond_destroy(&self->cond);
+	pthread_mutex_destroy(&self->mutex);
 }
 
-void plm_buffer_discard_read_bytes(plm_buffer_t *self)
+void plm_semaphore_wait(plm_semaphore_t *self)
 {
-// printf("plm_buffer_discard_read_bytes\n");
-	uint32_t byte_pos = self->bit_index >> 3;
-	if (byte_pos == self->length)
+	pthread_mutex_lock(&self->mutex);
+	while (self->count == 0)
 	{
-		self->bit_index = 0;
-		self->length = 0;
+		pthread_cond_wait(&self->cond, &self->mutex);
 	}
-	else if (byte_pos > 0)
+	self->count--;
+	pthread_mutex_unlock(&self->mutex);
+}
+
+int plm_semaphore_try_wait(plm_semaphore_t *self)
+{
+	pthread_mutex_lock(&self->mutex);
+	int taken = self->count > 0;
+	if (taken)
 	{
-		memmove(self->bytes, self->bytes + byte_pos, self->length - byte_pos);
-		self->bit_index -= byte_pos << 3;
-		self->length -= byte_pos;
+		self->count--;
 	}
+	pthread_mutex_unlock(&self->mutex);
+	return taken;
 }
 
-void plm_buffer_load_file_callback(plm_buffer_t *self, void *user)
+void plm_semaphore_post(plm_semaphore_t *self)
 {
-// printf("plm_buffer_load_file_callback\n");
-	PLM_UNUSED(user);
+	pthread_mutex_lock(&self->mutex);
+	self->count++;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->mutex);
+}
 
-	if (self->discard_read_bytes)
+#else
+
+int plm_thread_create(plm_thread_t *self, const char *name, int core, void (*entry)(void *arg), void *arg)
+{
+	PLM_UNUSED(self);
+	PLM_UNUSED(name);
+	PLM_UNUSED(core);
+	PLM_UNUSED(entry);
+	PLM_UNUSED(arg);
+	return FALSE;
+}
+
+void plm_thread_join(plm_thread_t *self)
+{
+	PLM_UNUSED(self);
+}
+
+int plm_semaphore_init(plm_semaphore_t *self, int count, int max_count)
+{
+	PLM_UNUSED(max_count);
+	self->count = count;
+	return TRUE;
+}
+
+void plm_semaphore_destroy(plm_semaphore_t *self)
+{
+	PLM_UNUSED(self);
+}
+
+void plm_semaphore_wait(plm_semaphore_t *self)
+{
+	self->count--;
+}
+
+int plm_semaphore_try_wait(plm_semaphore_t *self)
+{
+	if (self->count == 0)
 	{
-		plm_buffer_discard_read_bytes(self);
+		return FALSE;
 	}
+	self->count--;
+	return TRUE;
+}
 
-	uint32_t bytes_available = self->capacity - self->length;
-	uint32_t bytes_read = fread(self->bytes + self->length, 1, bytes_available, self->fh);
-	self->length += bytes_read;
+void plm_semaphore_post(plm_semaphore_t *self)
+{
+	self->count++;
+}
 
-	if (bytes_read == 0)
+#endif
+
+plm_read_ahead_t *plm_read_ahead_create(FILE *fh)
+{
+// printf("plm_read_ahead_create\n");
+	plm_read_ahead_t *self = (plm_read_ahead_t *)PLM_MALLOC(sizeof(plm_read_ahead_t));
+	memset(self, 0, sizeof(plm_read_ahead_t));
+	self->fh = fh;
+	self->chunk_size = PLM_READ_AHEAD_CHUNK_SIZE;
+	self->chunk_count = PLM_READ_AHEAD_CHUNKS;
+	self->chunks = (uint8_t *)PLM_MALLOC(self->chunk_size * self->chunk_count);
+	self->chunk_lengths = (uint32_t *)PLM_MALLOC(sizeof(uint32_t) * self->chunk_count);
+	self->read_pos = ftell(fh);
+	self->position = self->read_pos;
+
+	if (!plm_read_ahead_start(self))
 	{
-		self->has_ended = TRUE;
+		plm_read_ahead_destroy(self);
+		return NULL;
 	}
+	return self;
 }
 
-int plm_buffer_has_ended(plm_buffer_t *self)
+void plm_read_ahead_destroy(plm_read_ahead_t *self)
 {
-// printf("plm_buffer_has_ended\n");
-	return self->has_ended;
+// printf("plm_read_ahead_destroy\n");
+	plm_read_ahead_stop(self);
+	PLM_FREE(self->chunk_lengths);
+	PLM_FREE(self->chunks);
+	PLM_FREE(self);
 }
 
-int plm_buffer_has(plm_buffer_t *self, uint32_t count)
+int plm_read_ahead_start(plm_read_ahead_t *self)
 {
-// // printf("plm_buffer_has\n");
-	if (((self->length << 3) - self->bit_index) >= count)
+// printf("plm_read_ahead_start\n");
+	self->write_index = 0;
+	self->read_index = 0;
+	self->has_chunk = FALSE;
+	self->chunk_offset = 0;
+	self->has_ended = FALSE;
+	self->stop = FALSE;
+
+	if (!plm_semaphore_init(&self->free_chunks, self->chunk_count, self->chunk_count))
 	{
-		return TRUE;
+		return FALSE;
 	}
-
-	if (self->load_callback)
+	if (!plm_semaphore_init(&self->filled_chunks, 0, self->chunk_count))
 	{
-		self->load_callback(self, self->load_callback_user_data);
-
-		if (((self->length << 3) - self->bit_index) >= count)
-		{
-			return TRUE;
-		}
+		plm_semaphore_destroy(&self->free_chunks);
+		return FALSE;
 	}
-
-	if (self->total_size != 0 && self->length == self->total_size)
+	if (!plm_thread_create(&self->thread, "plm_read_ahead", -1, plm_read_ahead_thread, self))
 	{
-		self->has_ended = TRUE;
+		plm_semaphore_destroy(&self->filled_chunks);
+		plm_semaphore_destroy(&self->free_chunks);
+		return FALSE;
 	}
-	return FALSE;
+	self->is_running = TRUE;
+	return TRUE;
 }
 
-int plm_buffer_read(plm_buffer_t *self, int count)
+void plm_read_ahead_stop(plm_read_ahead_t *self)
 {
-// // printf("plm_buffer_read\n");
-	if (!plm_buffer_has(self, count))
+// printf("plm_read_ahead_stop\n");
+	if (!self->is_running)
 	{
-		return 0;
+		return;
 	}
 
-	int value = 0;
-	while (count)
-	{
-		int current_byte = self->bytes[self->bit_index >> 3];
+	// Wake the reader if it waits for a free chunk; a read in progress is
+	// finished first.
+	PLM_ATOMIC_STORE(&self->stop, TRUE);
+	plm_semaphore_post(&self->free_chunks);
+	plm_thread_join(&self->thread);
 
-		int remaining = 8 - (self->bit_index & 7);				// Remaining bits in byte
-		int read = remaining < count ? remaining : count; // Bits in self run
-		int shift = remaining - read;
-		int mask = (0xff >> (8 - read));
+	plm_semaphore_destroy(&self->filled_chunks);
+	plm_semaphore_destroy(&self->free_chunks);
+	self->is_running = FALSE;
+}
 
-		value = (value << read) | ((current_byte & (mask << shift)) >> shift);
+void plm_read_ahead_seek(plm_read_ahead_t *self, uint32_t pos)
+{
+// printf("plm_read_ahead_seek\n");
+	plm_read_ahead_stop(self);
+	fseek(self->fh, pos, SEEK_SET);
+	self->read_pos = pos;
+	self->position = pos;
+
+	// If the reader can't be restarted, plm_read_ahead_read() reads directly
+	plm_read_ahead_start(self);
+}
 
-		self->bit_index += read;
-		count -= read;
-	}
+void plm_read_ahead_thread(void *arg)
+{
+	plm_read_ahead_t *self = (plm_read_ahead_t *)arg;
+	for (;;)
+	{
+		plm_semaphore_wait(&self->free_chunks);
+		if (PLM_ATOMIC_LOAD(&self->stop))
+		{
+			break;
+		}
 
-	return value;
+		// Read up to the next chunk_size boundary of the file, so that reads stay
+		// aligned after seeking to an arbitrary position.
+		uint32_t requested = self->chunk_size - self->read_pos % self->chunk_size;
+		uint8_t *chunk = self->chunks + self->write_index * self->chunk_size;
+		uint32_t bytes_read = fread(chunk, 1, requested, self->fh);
+		self->read_pos += bytes_read;
+		self->chunk_lengths[self->write_index] = bytes_read;
+		self->write_index = (self->write_index + 1) % self->chunk_count;
+		plm_semaphore_post(&self->filled_chunks);
+
+		if (bytes_read == 0)
+		{
+			break;
+		}
+	}
 }
 
-void plm_buffer_align(plm_buffer_t *self)
+uint32_t plm_read_ahead_read(plm_read_ahead_t *self, uint8_t *dest, uint32_t length)
 {
-// printf("plm_buffer_align\n");
-	if (self->bit_index & 0b111)
+// printf("plm_read_ahead_read\n");
+	if (!self->is_running)
 	{
-		self->bit_index = ((self->bit_index + 7) >> 3) << 3; // Align to next byte
+		uint32_t bytes_read = fread(dest, 1, length, self->fh);
+		self->position += bytes_read;
+		return bytes_read;
+	}
+
+	uint32_t total = 0;
+	while (total < length && !self->has_ended)
+	{
+		if (!self->has_chunk)
+		{
+			// Only wait for the reader while there is nothing to hand out yet
+			if (total == 0)
+			{
+				plm_semaphore_wait(&self->filled_chunks);
+			}
+			else if (!plm_semaphore_try_wait(&self->filled_chunks))
+			{
+				break;
+			}
+			self->has_chunk = TRUE;
+			self->chunk_offset = 0;
+		}
+
+		uint32_t chunk_length = self->chunk_lengths[self->read_index];
+		if (chunk_length == 0)
+		{
+			self->has_ended = TRUE;
+			break;
+		}
+
+		uint32_t count = chunk_length - self->chunk_offset;
+		if (count > length - total)
+		{
+			count = length - total;
+		}
+		uint8_t *chunk = self->chunks + self->read_index * self->chunk_size;
+		memcpy(dest + total, chunk + self->chunk_offset, count);
+		total += count;
+		self->chunk_offset += count;
+		self->position += count;
+
+		if (self->chunk_offset == chunk_length)
+		{
+			self->has_chunk = FALSE;
+			self->read_index = (self->read_index + 1) % self->chunk_count;
+			plm_semaphore_post(&self->free_chunks);
+		}
 	}
+	return total;
 }
 
-void plm_buffer_skip(plm_buffer_t *self, uint32_t count)
+// -----------------------------------------------------------------------------
+// plm_buffer implementation
+
+plm_buffer_t *plm_buffer_create_with_filename(const char *filename)
 {
-// printf("plm_buffer_skip(%d)\n", count);
-	if (plm_buffer_has(self, count))
+// printf("plm_buffer_create_with_filename\n");
+	FILE *fh = fopen(filename, "rb");
+	if (!fh)
 	{
-		self->bit_index += count;
+		return NULL;
 	}
+	return plm_buffer_create_with_file(fh, TRUE);
 }
 
-int plm_buffer_skip_bytes(plm_buffer_t *self, uint8_t v)
+plm_buffer_t *plm_buffer_create_with_filename_async(const char *filename)
 {
-	plm_buffer_align(self);
-	if ((((self->length << 3) - self->bit_index) >= 8) && (self->bytes[self->bit_index >> 3] != v))
+// printf("plm_buffer_create_with_filename_async\n");
+	FILE *fh = fopen(filename, "rb");
+	if (!fh)
 	{
-// printf("plm_buffer_skip_bytes(%d) = 0\n", v);
-		return 0;
+		return NULL;
 	}
-	else
+	plm_buffer_t *self = plm_buffer_create_with_whole_file(fh);
+	if (self)
 	{
-		int skipped = 0;
-		while (plm_buffer_has(self, 8) && self->bytes[self->bit_index >> 3] == v)
-		{
-			self->bit_index += 8;
-			skipped++;
-		}
-// printf("plm_buffer_skip_bytes(%d) = %d\n", v, skipped);
-		return skipped;
+		fclose(fh);
+		return self;
 	}
+	return plm_buffer_create_with_file_async(fh, TRUE);
 }
 
-int plm_buffer_next_start_code(plm_buffer_t *self)
+plm_buffer_t *plm_buffer_create_with_whole_file(FILE *fh)
 {
-// printf("plm_buffer_next_start_code\n");
-	plm_buffer_align(self);
+// printf("plm_buffer_create_with_whole_file\n");
+	fseek(fh, 0, SEEK_END);
+	long size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	if (size <= 0)
+	{
+		return NULL;
+	}
 
-	while (plm_buffer_has(self, (5 << 3)))
+#if defined(PLM_HAVE_MMAP)
+	if ((unsigned long)size <= PLM_MMAP_MAX_SIZE)
 	{
-		uint32_t byte_index = self->bit_index >> 3;
-		if (
-				self->bytes[byte_index] == 0x00 &&
-				self->bytes[byte_index + 1] == 0x00 &&
-				self->bytes[byte_index + 2] == 0x01)
+		void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+		if (bytes != MAP_FAILED)
 		{
-			self->bit_index = (byte_index + 4) << 3;
-			return self->bytes[byte_index + 3];
+			plm_buffer_t *self = plm_buffer_create_with_memory((uint8_t *)bytes, size, FALSE);
+			self->input_mode = PLM_INPUT_MAPPED;
+			return self;
 		}
-		self->bit_index += 8;
 	}
-	return -1;
-}
+#endif
 
-int plm_buffer_find_start_code(plm_buffer_t *self, int code)
-{
-// printf("plm_buffer_find_start_code\n");
-	int current = 0;
-	while (TRUE)
+	if ((unsigned long)size > PLM_PRELOAD_MAX_SIZE)
 	{
-		current = plm_buffer_next_start_code(self);
-		if (current == code || current == -1)
-		{
-			return current;
-		}
+		return NULL;
 	}
-	return -1;
+	uint8_t *bytes = (uint8_t *)PLM_MALLOC(size);
+	if (!bytes)
+	{
+		return NULL;
+	}
+	if (fread(bytes, 1, size, fh) != (size_t)size)
+	{
+		PLM_FREE(bytes);
+		return NULL;
+	}
+	plm_buffer_t *self = plm_buffer_create_with_memory(bytes, size, TRUE);
+	self->input_mode = PLM_INPUT_PRELOADED;
+	return self;
 }
 
-int plm_buffer_has_start_code(plm_buffer_t *self, int code)
+plm_buffer_t *plm_buffer_create_with_file(FILE *fh, int close_when_done)
 {
-// printf("plm_buffer_has_start_code\n");
-	uint32_t previous_bit_index = self->bit_index;
-	int previous_discard_read_bytes = self->discard_read_bytes;
+// printf("plm_buffer_create_with_file\n");
+	plm_buffer_t *self = plm_buffer_create_with_capacity(PLM_BUFFER_DEFAULT_SIZE);
+	self->fh = fh;
+	self->close_when_done = close_when_done;
+	self->mode = PLM_BUFFER_MODE_FILE;
+	self->input_mode = PLM_INPUT_FILE;
+	self->discard_read_bytes = TRUE;
 
-	self->discard_read_bytes = FALSE;
-	int current = plm_buffer_find_start_code(self, code);
+	fseek(self->fh, 0, SEEK_END);
+	self->total_size = ftell(self->fh);
+	fseek(self->fh, 0, SEEK_SET);
 
-	self->bit_index = previous_bit_index;
-	self->discard_read_bytes = previous_discard_read_bytes;
-	return current;
+	plm_buffer_set_load_callback(self, plm_buffer_load_file_callback, NULL);
+	return self;
 }
 
-int plm_buffer_peek_non_zero(plm_buffer_t *self, int bit_count)
+plm_buffer_t *plm_buffer_create_with_file_async(FILE *fh, int close_when_done)
 {
-// printf("plm_buffer_peek_non_zero\n");
-	if (!plm_buffer_has(self, bit_count))
+// printf("plm_buffer_create_with_file_async\n");
+	plm_buffer_t *self = plm_buffer_create_with_file(fh, close_when_done);
+	self->read_ahead = plm_read_ahead_create(fh);
+	if (self->read_ahead)
 	{
-		return FALSE;
+		self->input_mode = PLM_INPUT_READ_AHEAD;
 	}
-
-	int val = plm_buffer_read(self, bit_count);
-	self->bit_index -= bit_count;
-	return val != 0;
+	return self;
 }
 
-int16_t plm_buffer_read_vlc(plm_buffer_t *self, const plm_vlc_t *table)
+plm_buffer_t *plm_buffer_create_with_memory(uint8_t *bytes, uint32_t length, int free_when_done)
 {
-// printf("plm_buffer_read_vlc\n");
-	plm_vlc_t state = {0, 0};
-	do
-	{
-		state = table[state.index + plm_buffer_read(self, 1)];
-	} while (state.index > 0);
-	return state.value;
+// printf("plm_buffer_create_with_memory\n");
+	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
+	memset(self, 0, sizeof(plm_buffer_t));
+	self->capacity = length;
+	self->length = length;
+	self->total_size = length;
+	self->free_when_done = free_when_done;
+	self->bytes = bytes;
+	self->mode = PLM_BUFFER_MODE_FIXED_MEM;
+	self->input_mode = PLM_INPUT_MEMORY;
+	self->discard_read_bytes = FALSE;
+	self->index_code = -1;
+	self->index_last = -1;
+	return self;
 }
 
-uint16_t plm_buffer_read_vlc_uint(plm_buffer_t *self, const plm_vlc_uint_t *table)
+plm_buffer_t *plm_buffer_create_with_capacity(uint32_t capacity)
 {
-// printf("plm_buffer_read_vlc_uint\n");
-	return (uint16_t)plm_buffer_read_vlc(self, (const plm_vlc_t *)table);
+// printf("plm_buffer_create_with_capacity\n");
+	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
+	memset(self, 0, sizeof(plm_buffer_t));
+	self->capacity = capacity;
+	self->free_when_done = TRUE;
+	self->bytes = (uint8_t *)PLM_MALLOC(capacity);
+	self->mode = PLM_BUFFER_MODE_RING;
+	self->discard_read_bytes = TRUE;
+	self->index_code = -1;
+	self->index_last = -1;
+	return self;
 }
 
-// ----------------------------------------------------------------------------
-// plm_demux implementation
-
-#define PLM_START_PACK 0xBA
-#define PLM_START_END 0xB9
-#define PLM_START_SYSTEM 0xBB
-
-struct plm_demux_t
+plm_buffer_t *plm_buffer_create_for_appending(uint32_t initial_capacity)
 {
-	plm_buffer_t *buffer;
-	int destroy_buffer_when_done;
-	double system_clock_ref;
-
-	uint32_t last_file_size;
-	double last_decoded_pts;
-	double start_time;
-	double duration;
-
-	int start_code;
-	int has_pack_header;
-	int has_system_header;
-	int has_headers;
-
-	int num_audio_streams;
-	int num_video_streams;
-	plm_packet_t current_packet;
-	plm_packet_t next_packet;
-};
-
-void plm_demux_buffer_seek(plm_demux_t *self, uint32_t pos);
-double plm_demux_decode_time(plm_demux_t *self);
-plm_packet_t *plm_demux_decode_packet(plm_demux_t *self, int type);
-plm_packet_t *plm_demux_get_packet(plm_demux_t *self);
+// printf("plm_buffer_create_for_appending\n");
+	plm_buffer_t *self = plm_buffer_create_with_capacity(initial_capacity);
+	self->mode = PLM_BUFFER_MODE_APPEND;
+	self->discard_read_bytes = FALSE;
+	return self;
+}
 
-plm_demux_t *plm_demux_create(plm_buffer_t *buffer, int destroy_when_done)
+plm_buffer_t *plm_buffer_create_for_packets(plm_buffer_t *source)
 {
-// printf("plm_demux_create\n");
-	plm_demux_t *self = (plm_demux_t *)PLM_MALLOC(sizeof(plm_demux_t));
-	memset(self, 0, sizeof(plm_demux_t));
-
-	self->buffer = buffer;
-	self->destroy_buffer_when_done = destroy_when_done;
-
-	self->start_time = PLM_PACKET_INVALID_TS;
-	self->duration = PLM_PACKET_INVALID_TS;
-	self->start_code = -1;
+// printf("plm_buffer_create_for_packets\n");
+	plm_buffer_t *self = (plm_buffer_t *)PLM_MALLOC(sizeof(plm_buffer_t));
+	memset(self, 0, sizeof(plm_buffer_t));
+	self->span_capacity = PLM_BUFFER_INITIAL_SPANS;
+	self->spans = (plm_buffer_span_t *)PLM_MALLOC(sizeof(plm_buffer_span_t) * self->span_capacity);
+	self->mode = PLM_BUFFER_MODE_CHAIN;
+	self->discard_read_bytes = TRUE;
+	self->index_code = -1;
+	self->index_last = -1;
 
-	plm_demux_has_headers(self);
+	self->source = source;
+	self->next_consumer = source->consumers;
+	source->consumers = self;
 	return self;
 }
 
-void plm_demux_destroy(plm_demux_t *self)
+void plm_buffer_destroy(plm_buffer_t *self)
 {
-// printf("plm_demux_destroy\n");
-	if (self->destroy_buffer_when_done)
+// printf("plm_buffer_destroy\n");
+	if (self->read_ahead)
 	{
-		plm_buffer_destroy(self->buffer);
+		plm_read_ahead_destroy(self->read_ahead);
 	}
-	PLM_FREE(self);
-}
-
-int plm_demux_has_headers(plm_demux_t *self)
-{
-// printf("plm_demux_has_headers\n");
-	if (self->has_headers)
+	if (self->fh && self->close_when_done)
 	{
-		return TRUE;
+		fclose(self->fh);
 	}
-
-	// Decode pack header
-	if (!self->has_pack_header)
+	if (self->free_when_done)
 	{
-		if (
-				self->start_code != PLM_START_PACK &&
-				plm_buffer_find_start_code(self->buffer, PLM_START_PACK) == -1)
-		{
-			return FALSE;
-		}
-
-		self->start_code = PLM_START_PACK;
-		if (!plm_buffer_has(self->buffer, 64))
-		{
-			return FALSE;
-		}
-		self->start_code = -1;
-
-		if (plm_buffer_read(self->buffer, 4) != 0x02)
-		{
-			return FALSE;
-		}
-
-		self->system_clock_ref = plm_demux_decode_time(self);
-		plm_buffer_skip(self->buffer, 1);
-		plm_buffer_skip(self->buffer, 22); // mux_rate * 50
-		plm_buffer_skip(self->buffer, 1);
+		PLM_FREE(self->bytes);
+	}
+#if defined(PLM_HAVE_MMAP)
+	if (self->input_mode == PLM_INPUT_MAPPED)
+	{
+		munmap(self->bytes, self->capacity);
+	}
+#endif
 
-		self->has_pack_header = TRUE;
+	// Packet chains reading from this buffer keep copies of their data
+	plm_buffer_detach_consumers(self);
+	while (self->consumers)
+	{
+		plm_buffer_t *chain = self->consumers;
+		self->consumers = chain->next_consumer;
+		chain->source = NULL;
+		chain->next_consumer = NULL;
 	}
 
-	// Decode system header
-	if (!self->has_system_header)
+	if (self->mode == PLM_BUFFER_MODE_CHAIN)
 	{
-		if (
-				self->start_code != PLM_START_SYSTEM &&
-				plm_buffer_find_start_code(self->buffer, PLM_START_SYSTEM) == -1)
+		plm_buffer_clear_spans(self);
+		PLM_FREE(self->spans);
+		if (self->source)
 		{
-			return FALSE;
+			plm_buffer_t **link = &self->source->consumers;
+			while (*link != self)
+			{
+				link = &(*link)->next_consumer;
+			}
+			*link = self->next_consumer;
 		}
+	}
+	PLM_FREE(self);
+}
 
-		self->start_code = PLM_START_SYSTEM;
-		if (!plm_buffer_has(self->buffer, 56))
-		{
-			return FALSE;
-		}
-		self->start_code = -1;
+uint32_t plm_buffer_get_size(plm_buffer_t *self)
+{
+// printf("plm_buffer_get_size\n");
+	return (self->mode == PLM_BUFFER_MODE_FILE)
+						 ? self->total_size
+						 : self->length;
+}
 
-		plm_buffer_skip(self->buffer, 16); // header_length
-		plm_buffer_skip(self->buffer, 24); // rate bound
-		self->num_audio_streams = plm_buffer_read(self->buffer, 6);
-		plm_buffer_skip(self->buffer, 5); // misc flags
-		self->num_video_streams = plm_buffer_read(self->buffer, 5);
+plm_input_mode_t plm_buffer_get_input_mode(plm_buffer_t *self)
+{
+// printf("plm_buffer_get_input_mode\n");
+	return self->input_mode;
+}
 
-		self->has_system_header = TRUE;
-	}
+uint32_t plm_buffer_get_remaining(plm_buffer_t *self)
+{
+// printf("plm_buffer_get_remaining\n");
+	return self->length - (self->bit_index >> 3);
+}
 
-	self->has_headers = TRUE;
-	return TRUE;
+uint32_t plm_buffer_get_scanned_bytes(plm_buffer_t *self)
+{
+// printf("plm_buffer_get_scanned_bytes\n");
+	return self->scanned_bytes;
 }
 
-int plm_demux_probe(plm_demux_t *self, uint32_t probesize)
+uint32_t plm_buffer_write(plm_buffer_t *self, uint8_t *bytes, uint32_t length)
 {
-// printf("plm_demux_probe\n");
-	int previous_pos = plm_buffer_tell(self->buffer);
+// printf("plm_buffer_write\n");
+	if (self->mode == PLM_BUFFER_MODE_FIXED_MEM)
+	{
+		return 0;
+	}
+	if (self->mode == PLM_BUFFER_MODE_CHAIN)
+	{
+		return plm_buffer_write_span(self, bytes, length);
+	}
 
-	int video_stream = FALSE;
-	int audio_streams[4] = {FALSE, FALSE, FALSE, FALSE};
-	do
+	if (self->discard_read_bytes)
 	{
-		self->start_code = plm_buffer_next_start_code(self->buffer);
-		if (self->start_code == PLM_DEMUX_PACKET_VIDEO_1)
+		// The allocation is used like a ring that only wraps back to the front
+		// when the new data no longer fits behind the unread bytes, or when
+		// nothing is left unread. The unread tail is moved at most once per
+		// wrap instead of on every write.
+		if (
+				(self->bit_index >> 3) == self->length ||
+				self->capacity - self->length < length)
 		{
-			video_stream = TRUE;
+			plm_buffer_discard_read_bytes(self);
 		}
-		else if (
-				self->start_code >= PLM_DEMUX_PACKET_AUDIO_1 &&
-				self->start_code <= PLM_DEMUX_PACKET_AUDIO_4)
+		if (self->mode == PLM_BUFFER_MODE_RING)
 		{
-			audio_streams[self->start_code - PLM_DEMUX_PACKET_AUDIO_1] = TRUE;
+			self->total_size = 0;
 		}
-	} while (
-			self->start_code != -1 &&
-			plm_buffer_tell(self->buffer) - previous_pos < probesize);
+	}
 
-	self->num_video_streams = video_stream ? 1 : 0;
-	self->num_audio_streams = 0;
-	for (int i = 0; i < 4; i++)
+	// Do we have to resize to fit the new data?
+	uint32_t bytes_available = self->capacity - self->length;
+	if (bytes_available < length)
 	{
-		if (audio_streams[i])
+		uint32_t new_size = self->capacity;
+		do
 		{
-			self->num_audio_streams++;
-		}
+			new_size *= 2;
+		} while (new_size - self->length < length);
+		self->bytes = (uint8_t *)PLM_REALLOC(self->bytes, new_size);
+		self->capacity = new_size;
 	}
 
-	plm_demux_buffer_seek(self, previous_pos);
-	return (self->num_video_streams || self->num_audio_streams);
-}
-
-int plm_demux_get_num_video_streams(plm_demux_t *self)
-{
-// printf("plm_demux_get_num_video_streams\n");
-	return plm_demux_has_headers(self)
-						 ? self->num_video_streams
-						 : 0;
-}
+	memcpy(self->bytes + self->length, bytes, length);
+	self->length += length;
+	self->has_ended = FALSE;
 
-int plm_demux_get_num_audio_streams(plm_demux_t *self)
-{
-// printf("plm_demux_get_num_audio_streams\n");
-	return plm_demux_has_headers(self)
-						 ? self->num_audio_streams
-						 : 0;
+	if (self->index_code != -1)
+	{
+		plm_buffer_update_index(self);
+	}
+	return length;
 }
 
-void plm_demux_rewind(plm_demux_t *self)
+void plm_buffer_signal_end(plm_buffer_t *self)
 {
-// printf("plm_demux_rewind\n");
-	plm_buffer_rewind(self->buffer);
-	self->current_packet.length = 0;
-	self->next_packet.length = 0;
-	self->start_code = -1;
+// printf("plm_buffer_signal_end\n");
+	self->total_size = self->length;
 }
 
-int plm_demux_has_ended(plm_demux_t *self)
+void plm_buffer_set_load_callback(plm_buffer_t *self, plm_buffer_load_callback fp, void *user)
 {
-// printf("plm_demux_has_ended\n");
-	return plm_buffer_has_ended(self->buffer);
+// printf("plm_buffer_set_load_callback\n");
+	self->load_callback = fp;
+	self->load_callback_user_data = user;
 }
 
-void plm_demux_buffer_seek(plm_demux_t *self, uint32_t pos)
+void plm_buffer_rewind(plm_buffer_t *self)
 {
-// printf("plm_demux_buffer_seek\n");
-	plm_buffer_seek(self->buffer, pos);
-	self->current_packet.length = 0;
-	self->next_packet.length = 0;
-	self->start_code = -1;
+// printf("plm_buffer_rewind\n");
+	plm_buffer_seek(self, 0);
 }
 
-double plm_demux_get_start_time(plm_demux_t *self, int type)
+void plm_buffer_seek(plm_buffer_t *self, uint32_t pos)
 {
-// printf("plm_demux_get_start_time\n");
-	if (self->start_time != PLM_PACKET_INVALID_TS)
-	{
-		return self->start_time;
-	}
-
-	int previous_pos = plm_buffer_tell(self->buffer);
-	int previous_start_code = self->start_code;
+// printf("plm_buffer_seek\n");
+	self->has_ended = FALSE;
+	plm_buffer_invalidate_cache(self);
 
-	// Find first video PTS
-	plm_demux_rewind(self);
-	do
+	if (self->mode == PLM_BUFFER_MODE_FILE)
 	{
-		plm_packet_t *packet = plm_demux_decode(self);
-		if (!packet)
+		plm_buffer_detach_consumers(self);
+		if (self->read_ahead)
 		{
-			break;
+			plm_read_ahead_seek(self->read_ahead, pos);
 		}
-		if (packet->type == type)
+		else
 		{
-			self->start_time = packet->pts;
+			fseek(self->fh, pos, SEEK_SET);
 		}
-	} while (self->start_time == PLM_PACKET_INVALID_TS);
-
-	plm_demux_buffer_seek(self, previous_pos);
-	self->start_code = previous_start_code;
-	return self->start_time;
+		self->bit_index = 0;
+		self->length = 0;
+		self->base_offset = 0;
+		self->index_scanned = 0;
+		self->index_last = -1;
+	}
+	else if (
+			self->mode == PLM_BUFFER_MODE_RING ||
+			self->mode == PLM_BUFFER_MODE_CHAIN)
+	{
+		if (pos != 0)
+		{
+			// Seeking to non-0 is forbidden for dynamic-mem buffers
+			return;
+		}
+		plm_buffer_detach_consumers(self);
+		plm_buffer_clear_spans(self);
+		self->bit_index = 0;
+		self->length = 0;
+		self->total_size = 0;
+		self->base_offset = 0;
+		self->index_scanned = 0;
+		self->index_last = -1;
+	}
+	else if (pos < self->length)
+	{
+		self->bit_index = pos << 3;
+	}
 }
 
-double plm_demux_get_duration(plm_demux_t *self, int type)
+uint32_t plm_buffer_tell(plm_buffer_t *self)
 {
-// printf("plm_demux_get_duration\n");
-	uint32_t file_size = plm_buffer_get_size(self->buffer);
-
-	if (
-			self->duration != PLM_PACKET_INVALID_TS &&
-			self->last_file_size == file_size)
+// printf("plm_buffer_tell\n");
+	if (self->mode != PLM_BUFFER_MODE_FILE)
 	{
-		return self->duration;
+		return self->bit_index >> 3;
 	}
+	uint32_t file_pos = self->read_ahead ? self->read_ahead->position : ftell(self->fh);
+	return file_pos + (self->bit_index >> 3) - self->length;
+}
 
-	uint32_t previous_pos = plm_buffer_tell(self->buffer);
-	int previous_start_code = self->start_code;
+void plm_buffer_discard_read_bytes(plm_buffer_t *self)
+{
+// printf("plm_buffer_discard_read_bytes\n");
+	uint32_t byte_pos = self->bit_index >> 3;
+	if (self->mode == PLM_BUFFER_MODE_CHAIN)
+	{
+		byte_pos = plm_buffer_drop_spans(self, byte_pos);
+	}
+	else if (self->consumers)
+	{
+		byte_pos = plm_buffer_get_retained_offset(self, byte_pos);
+	}
+	if (byte_pos == 0)
+	{
+		return;
+	}
 
-	// Find last video PTS. Start searching 64kb from the end and go further
-	// back if needed.
-	long start_range = 64 * 1024;
-	long max_range = 4096 * 1024;
-	for (long range = start_range; range <= max_range; range *= 2)
+	if (self->mode != PLM_BUFFER_MODE_CHAIN && byte_pos < self->length)
 	{
-		long seek_pos = file_size - range;
-		if (seek_pos < 0)
-		{
-			seek_pos = 0;
-			range = max_range; // Make sure to bail after this round
-		}
-		plm_demux_buffer_seek(self, seek_pos);
-		self->current_packet.length = 0;
+		memmove(self->bytes, self->bytes + byte_pos, self->length - byte_pos);
+	}
+	self->bit_index -= byte_pos << 3;
+	self->length -= byte_pos;
+	self->base_offset += byte_pos;
+	plm_buffer_invalidate_cache(self);
+
+	// Keep the start code index relative to the moved data
+	self->index_scanned = self->index_scanned > byte_pos
+		? self->index_scanned - byte_pos
+		: 0;
+	self->index_last = self->index_last >= (int)byte_pos
+		? self->index_last - (int)byte_pos
+		: -1;
+}
 
-		double last_pts = PLM_PACKET_INVALID_TS;
-		plm_packet_t *packet = NULL;
-		while ((packet = plm_demux_decode(self)))
+void plm_buffer_index_start_code(plm_buffer_t *self, int code)
+{
+// printf("plm_buffer_index_start_code\n");
+	self->index_code = code;
+	self->index_scanned = self->bit_index >> 3;
+	self->index_last = -1;
+}
+
+void plm_buffer_update_index(plm_buffer_t *self)
+{
+// printf("plm_buffer_update_index\n");
+	// Scan the bytes that arrived since the last update. As in
+	// plm_buffer_next_start_code(), a start code only counts once one more
+	// byte behind it is buffered, so the last 4 bytes wait for more data.
+	uint32_t scan_start = self->index_scanned;
+	while (self->index_scanned + 5 <= self->length)
+	{
+		uint32_t positions = self->length - self->index_scanned - 4;
+		int offset = plm_buffer_scan_start_code(self, self->index_scanned, positions);
+		if (offset == -1)
 		{
-			if (packet->pts != PLM_PACKET_INVALID_TS && packet->type == type)
-			{
-				last_pts = packet->pts;
-			}
+			self->index_scanned += positions;
+			break;
 		}
-		if (last_pts != PLM_PACKET_INVALID_TS)
+		if (plm_buffer_get_byte(self, self->index_scanned + offset + 3) == self->index_code)
 		{
-			self->duration = last_pts - plm_demux_get_start_time(self, type);
-			break;
+			self->index_last = self->index_scanned + offset;
 		}
+		self->index_scanned += offset + 4;
 	}
-
-	plm_demux_buffer_seek(self, previous_pos);
-	self->start_code = previous_start_code;
-	self->last_file_size = file_size;
-	return self->duration;
+	self->scanned_bytes += self->index_scanned - scan_start;
 }
 
-plm_packet_t *plm_demux_seek(plm_demux_t *self, double seek_time, int type, int force_intra)
+uint32_t plm_buffer_write_span(plm_buffer_t *self, uint8_t *bytes, uint32_t length)
 {
-// printf("plm_demux_seek\n");
-	if (!plm_demux_has_headers(self))
+// printf("plm_buffer_write_span\n");
+	// The data must lie within the source buffer; it is referenced, not copied
+	plm_buffer_t *source = self->source;
+	if (
+			!source ||
+			bytes < source->bytes ||
+			bytes + length > source->bytes + source->length)
 	{
-		return NULL;
+		return 0;
 	}
 
-	// Using the current time, current byte position and the average bytes per
-	// second for this file, try to jump to a byte position that hopefully has
-	// packets containing timestamps within one second before to the desired
-	// seek_time.
-
-	// If we hit close to the seek_time scan through all packets to find the
-	// last one (just before the seek_time) containing an intra frame.
-	// Otherwise we should at least be closer than before. Calculate the bytes
-	// per second for the jumped range and jump again.
-
-	// The number of retries here is hard-limited to a generous amount. Usually
-	// the correct range is found after 1--5 jumps, even for files with very
-	// variable bitrates. If significantly more jumps are needed, there's
-	// probably something wrong with the file and we just avoid getting into an
-	// infinite loop. 32 retries should be enough for anybody.
-
-	double duration = plm_demux_get_duration(self, type);
-	long file_size = plm_buffer_get_size(self->buffer);
-	long byterate = file_size / duration;
-
-	double cur_time = self->last_decoded_pts;
-	double scan_span = 1;
+	plm_buffer_discard_read_bytes(self);
+	self->total_size = 0;
 
-	if (seek_time > duration)
+	uint32_t offset = source->base_offset + (uint32_t)(bytes - source->bytes);
+	plm_buffer_span_t *last = self->span_count ? &self->spans[self->span_count - 1] : NULL;
+	if (last && !last->data && last->offset + last->length == offset)
 	{
-		seek_time = duration;
+		last->length += length;
 	}
-	else if (seek_time < 0)
+	else
 	{
-		seek_time = 0;
+		if (self->span_count == self->span_capacity)
+		{
+			self->span_capacity *= 2;
+			self->spans = (plm_buffer_span_t *)PLM_REALLOC(self->spans, sizeof(plm_buffer_span_t) * self->span_capacity);
+		}
+		plm_buffer_span_t *span = &self->spans[self->span_count++];
+		span->offset = offset;
+		span->length = length;
+		span->data = NULL;
 	}
-	seek_time += self->start_time;
 
-	for (int retry = 0; retry < 32; retry++)
-	{
-		int found_packet_with_pts = FALSE;
-		int found_packet_in_range = FALSE;
-		long last_valid_packet_start = -1;
-		double first_packet_time = PLM_PACKET_INVALID_TS;
+	self->length += length;
+	self->has_ended = FALSE;
 
-		long cur_pos = plm_buffer_tell(self->buffer);
+	if (self->index_code != -1)
+	{
+		plm_buffer_update_index(self);
+	}
+	return length;
+}
 
-		// Estimate byte offset and jump to it.
-		long offset = (seek_time - cur_time - scan_span) * byterate;
-		long seek_pos = cur_pos + offset;
-		if (seek_pos < 0)
+uint32_t plm_buffer_drop_spans(plm_buffer_t *self, uint32_t byte_pos)
+{
+// printf("plm_buffer_drop_spans\n");
+	// Drop the spans that lie completely before byte_pos; returns the number
+	// of bytes dropped.
+	uint32_t dropped = 0;
+	uint32_t count = 0;
+	while (count < self->span_count && dropped + self->spans[count].length <= byte_pos)
+	{
+		dropped += self->spans[count].length;
+		if (self->spans[count].data)
 		{
-			seek_pos = 0;
+			PLM_FREE(self->spans[count].data);
 		}
-		else if (seek_pos > file_size - 256)
+		count++;
+	}
+	if (count > 0)
+	{
+		self->span_count -= count;
+		memmove(self->spans, self->spans + count, sizeof(plm_buffer_span_t) * self->span_count);
+		self->span_cursor = 0;
+		self->span_cursor_start = 0;
+	}
+	return dropped;
+}
+
+void plm_buffer_clear_spans(plm_buffer_t *self)
+{
+// printf("plm_buffer_clear_spans\n");
+	for (uint32_t i = 0; i < self->span_count; i++)
+	{
+		if (self->spans[i].data)
 		{
-			seek_pos = file_size - 256;
+			PLM_FREE(self->spans[i].data);
 		}
+	}
+	self->span_count = 0;
+	self->span_cursor = 0;
+	self->span_cursor_start = 0;
+}
 
-		plm_demux_buffer_seek(self, seek_pos);
+uint8_t *plm_buffer_get_span_bytes(plm_buffer_t *self, uint32_t pos, uint32_t *available)
+{
+	// Find the span holding byte pos (which must be below self->length) and
+	// return a pointer to it, with the number of contiguous bytes from there.
+	// Reads are mostly sequential, so the search starts at the span found
+	// last time.
+	uint32_t i = self->span_cursor;
+	uint32_t start = self->span_cursor_start;
+	if (pos < start)
+	{
+		i = 0;
+		start = 0;
+	}
+	while (pos - start >= self->spans[i].length)
+	{
+		start += self->spans[i].length;
+		i++;
+	}
+	self->span_cursor = i;
+	self->span_cursor_start = start;
+
+	plm_buffer_span_t *span = &self->spans[i];
+	*available = span->length - (pos - start);
+	return span->data
+		? span->data + (pos - start)
+		: self->source->bytes + (span->offset + (pos - start) - self->source->base_offset);
+}
 
-		// Scan through all packets up to the seek_time to find the last packet
-		// containing an intra frame.
-		while (plm_buffer_find_start_code(self->buffer, type) != -1)
-		{
-			long packet_start = plm_buffer_tell(self->buffer);
-			plm_packet_t *packet = plm_demux_decode_packet(self, type);
+uint8_t plm_buffer_get_byte(plm_buffer_t *self, uint32_t pos)
+{
+	if (self->mode != PLM_BUFFER_MODE_CHAIN)
+	{
+		return self->bytes[pos];
+	}
+	uint32_t available;
+	return *plm_buffer_get_span_bytes(self, pos, &available);
+}
 
-			// Skip packet if it has no PTS
-			if (!packet || packet->pts == PLM_PACKET_INVALID_TS)
-			{
-				continue;
-			}
+int plm_buffer_scan_start_code(plm_buffer_t *self, uint32_t pos, uint32_t positions)
+{
+	// Like plm_scan_start_code() for the prefixes starting at the given number
+	// of positions from pos; returns the offset from pos or -1. The 2 bytes
+	// following the last position must be buffered.
+	if (self->mode != PLM_BUFFER_MODE_CHAIN)
+	{
+		return plm_scan_start_code(self->bytes + pos, positions + 2);
+	}
 
-			// Bail scanning through packets if we hit one that is outside
-			// seek_time - scan_span.
-			// We also adjust the cur_time and byterate values here so the next
-			// iteration can be a bit more precise.
-			if (packet->pts > seek_time || packet->pts < seek_time - scan_span)
+	uint32_t done = 0;
+	while (done < positions)
+	{
+		uint32_t available;
+		uint8_t *bytes = plm_buffer_get_span_bytes(self, pos + done, &available);
+
+		// Prefixes that lie within this span
+		uint32_t inside = available > 2 ? available - 2 : 0;
+		if (inside > positions - done)
+		{
+			inside = positions - done;
+		}
+		if (inside > 0)
+		{
+			int offset = plm_scan_start_code(bytes, inside + 2);
+			if (offset != -1)
 			{
-				found_packet_with_pts = TRUE;
-				byterate = (seek_pos - cur_pos) / (packet->pts - cur_time);
-				cur_time = packet->pts;
-				break;
+				return done + offset;
 			}
+			done += inside;
+		}
 
-			// If we are still here, it means this packet is in close range to
-			// the seek_time. If this is the first packet for this jump position
-			// record the PTS. If we later have to back off, when there was no
-			// intra frame in this range, we can lower the seek_time to not scan
-			// this range again.
-			if (!found_packet_in_range)
+		// Prefixes that cross into the next span
+		for (uint32_t end = done + available - inside; done < end && done < positions; done++)
+		{
+			if (
+					plm_buffer_get_byte(self, pos + done) == 0x00 &&
+					plm_buffer_get_byte(self, pos + done + 1) == 0x00 &&
+					plm_buffer_get_byte(self, pos + done + 2) == 0x01)
 			{
-				found_packet_in_range = TRUE;
-				first_packet_time = packet->pts;
+				return done;
 			}
+		}
+	}
+	return -1;
+}
 
-			// Check if this is an intra frame packet. If so, record the buffer
-			// position of the start of this packet. We want to jump back to it
-			// later, when we know it's the last intra frame before desired
-			// seek time.
-			if (force_intra)
+uint32_t plm_buffer_get_retained_offset(plm_buffer_t *self, uint32_t byte_pos)
+{
+// printf("plm_buffer_get_retained_offset\n");
+	// Packet chains reading from this buffer may still need bytes before
+	// byte_pos; return the offset of the first such byte, or byte_pos.
+	for (plm_buffer_t *chain = self->consumers; chain; chain = chain->next_consumer)
+	{
+		uint32_t read_pos = chain->bit_index >> 3;
+		uint32_t start = 0;
+		for (uint32_t i = 0; i < chain->span_count; i++)
+		{
+			plm_buffer_span_t *span = &chain->spans[i];
+			if (!span->data && read_pos < start + span->length)
 			{
-				for (uint32_t i = 0; i < packet->length - 6; i++)
+				uint32_t offset = span->offset - self->base_offset;
+				if (read_pos > start)
 				{
-					// Find the START_PICTURE code
-					if (
-							packet->data[i] == 0x00 &&
-							packet->data[i + 1] == 0x00 &&
-							packet->data[i + 2] == 0x01 &&
-							packet->data[i + 3] == 0x00)
-					{
-						// Bits 11--13 in the picture header contain the frame
-						// type, where 1=Intra
-						if ((packet->data[i + 5] & 0x38) == 8)
-						{
-							last_valid_packet_start = packet_start;
-						}
-						break;
-					}
+					offset = span->offset + (read_pos - start) - self->base_offset;
 				}
+				if (offset < byte_pos)
+				{
+					byte_pos = offset;
+				}
+				break;
 			}
-
-			// If we don't want intra frames, just use the last PTS found.
-			else
-			{
-				last_valid_packet_start = packet_start;
-			}
+			start += span->length;
 		}
+	}
+	return byte_pos;
+}
 
-		// If there was at least one intra frame in the range scanned above,
-		// our search is over. Jump back to the packet and decode it again.
-		if (last_valid_packet_start != -1)
+void plm_buffer_detach(plm_buffer_t *self)
+{
+// printf("plm_buffer_detach\n");
+	// Give a packet chain its own copy of the spans it has not read yet, so
+	// that the source no longer has to keep them.
+	plm_buffer_t *source = self->source;
+	uint32_t read_pos = self->bit_index >> 3;
+	uint32_t start = 0;
+	for (uint32_t i = 0; i < self->span_count; i++)
+	{
+		plm_buffer_span_t *span = &self->spans[i];
+		if (!span->data && read_pos < start + span->length)
 		{
-			plm_demux_buffer_seek(self, last_valid_packet_start);
-			return plm_demux_decode_packet(self, type);
+			// Bytes before read_pos may already be gone; they are not read
+			// again, so only the rest is copied.
+			uint32_t skip = read_pos > start ? read_pos - start : 0;
+			span->data = (uint8_t *)PLM_MALLOC(span->length);
+			memcpy(
+					span->data + skip,
+					source->bytes + (span->offset + skip - source->base_offset),
+					span->length - skip);
 		}
+		start += span->length;
+	}
+}
 
-		// If we hit the right range, but still found no intra frame, we have
-		// to increases the scan_span. This is done exponentially to also handle
-		// video files with very few intra frames.
-		else if (found_packet_in_range)
-		{
-			scan_span *= 2;
-			seek_time = first_packet_time;
-		}
+void plm_buffer_detach_consumers(plm_buffer_t *self)
+{
+// printf("plm_buffer_detach_consumers\n");
+	// Called before this buffer drops or replaces its data
+	for (plm_buffer_t *chain = self->consumers; chain; chain = chain->next_consumer)
+	{
+		plm_buffer_detach(chain);
+	}
+}
 
-		// If we didn't find any packet with a PTS, it probably means we reached
-		// the end of the file. Estimate byterate and cur_time accordingly.
-		else if (!found_packet_with_pts)
+void plm_buffer_load_file_callback(plm_buffer_t *self, void *user)
+{
+// printf("plm_buffer_load_file_callback\n");
+	PLM_UNUSED(user);
+
+	if (self->discard_read_bytes)
+	{
+		plm_buffer_discard_read_bytes(self);
+
+		// If bytes retained for packet chains fill much of the buffer, give the
+		// chains their own copy rather than reading in small pieces.
+		if (self->consumers && self->length > self->capacity / 2)
 		{
-			byterate = (seek_pos - cur_pos) / (duration - cur_time);
-			cur_time = duration;
+			plm_buffer_detach_consumers(self);
+			plm_buffer_discard_read_bytes(self);
 		}
 	}
 
-	return NULL;
+	uint32_t bytes_available = self->capacity - self->length;
+	uint32_t bytes_read = self->read_ahead
+		? plm_read_ahead_read(self->read_ahead, self->bytes + self->length, bytes_available)
+		: fread(self->bytes + self->length, 1, bytes_available, self->fh);
+	self->length += bytes_read;
+
+	if (bytes_read == 0)
+	{
+		self->has_ended = TRUE;
+	}
 }
 
-plm_packet_t *plm_demux_decode(plm_demux_t *self)
+int plm_buffer_has_ended(plm_buffer_t *self)
 {
-// printf("plm_demux_decode\n");
-	if (!plm_demux_has_headers(self))
+// printf("plm_buffer_has_ended\n");
+	return self->has_ended;
+}
+
+int plm_buffer_has(plm_buffer_t *self, uint32_t count)
+{
+// // printf("plm_buffer_has\n");
+	if (((self->length << 3) - self->bit_index) >= count)
 	{
-		return NULL;
+		return TRUE;
 	}
 
-	if (self->current_packet.length)
+	if (self->load_callback)
 	{
-		uint32_t bits_till_next_packet = self->current_packet.length << 3;
-		if (!plm_buffer_has(self->buffer, bits_till_next_packet))
+		self->load_callback(self, self->load_callback_user_data);
+
+		if (((self->length << 3) - self->bit_index) >= count)
 		{
-			return NULL;
+			return TRUE;
 		}
-		plm_buffer_skip(self->buffer, bits_till_next_packet);
-		self->current_packet.length = 0;
 	}
 
-	// Pending packet waiting for data?
-	if (self->next_packet.length)
+	if (self->total_size != 0 && self->length == self->total_size)
 	{
-		return plm_demux_get_packet(self);
+		self->has_ended = TRUE;
 	}
+	return FALSE;
+}
 
-	// Pending packet waiting for header?
-	if (self->start_code != -1)
+void plm_buffer_refill(plm_buffer_t *self)
+{
+// // printf("plm_buffer_refill\n");
+	// Load the 8 bytes at the current byte position into the bit cache, MSB
+	// first. Only bytes below self->length are cached, so appending data never
+	// invalidates the cache - only moving or replacing existing bytes does.
+	uint32_t byte_index = self->bit_index >> 3;
+	uint32_t available = self->length - byte_index;
+	uint8_t *p;
+	uint8_t gathered[8];
+	uint64_t cache;
+
+	if (self->mode == PLM_BUFFER_MODE_CHAIN)
+	{
+		// Collect the bytes from the following spans if this one ends early
+		uint32_t contiguous;
+		p = plm_buffer_get_span_bytes(self, byte_index, &contiguous);
+		if (contiguous < 8 && contiguous < available)
+		{
+			for (uint32_t i = 0; i < 8 && i < available; i++)
+			{
+				gathered[i] = plm_buffer_get_byte(self, byte_index + i);
+			}
+			p = gathered;
+		}
+	}
+	else
 	{
-		return plm_demux_decode_packet(self, self->start_code);
+		p = self->bytes + byte_index;
 	}
 
-	do
+	if (available >= 8)
 	{
-		self->start_code = plm_buffer_next_start_code(self->buffer);
-		if (
-				self->start_code == PLM_DEMUX_PACKET_VIDEO_1 ||
-				self->start_code == PLM_DEMUX_PACKET_PRIVATE || (self->start_code >= PLM_DEMUX_PACKET_AUDIO_1 && self->start_code <= PLM_DEMUX_PACKET_AUDIO_4))
+		available = 8;
+		cache =
+				((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+				((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+				((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+				((uint64_t)p[6] << 8) | ((uint64_t)p[7]);
+	}
+	else
+	{
+		cache = 0;
+		for (uint32_t i = 0; i < 8; i++)
 		{
-			return plm_demux_decode_packet(self, self->start_code);
+			cache = (cache << 8) | (i < available ? p[i] : 0);
 		}
-	} while (self->start_code != -1);
+	}
 
-	return NULL;
+	self->bit_cache = cache;
+	self->bit_cache_start = byte_index << 3;
+	self->bit_cache_end = (byte_index + available) << 3;
 }
 
-double plm_demux_decode_time(plm_demux_t *self)
+void plm_buffer_invalidate_cache(plm_buffer_t *self)
 {
-// printf("plm_demux_decode_time\n");
-	int64_t clock = plm_buffer_read(self->buffer, 3) << 30;
-	plm_buffer_skip(self->buffer, 1);
-	clock |= plm_buffer_read(self->buffer, 15) << 15;
-	plm_buffer_skip(self->buffer, 1);
-	clock |= plm_buffer_read(self->buffer, 15);
-	plm_buffer_skip(self->buffer, 1);
-	return (double)clock / 90000.0;
+	self->bit_cache_start = 0;
+	self->bit_cache_end = 0;
 }
 
-plm_packet_t *plm_demux_decode_packet(plm_demux_t *self, int type)
+int plm_buffer_peek(plm_buffer_t *self, int count)
 {
-// printf("plm_demux_decode_packet\n");
-	if (!plm_buffer_has(self->buffer, 16 << 3))
+// // printf("plm_buffer_peek\n");
+	// Callers must have checked plm_buffer_has(); count is 1--32 bits
+	if (
+			self->bit_index < self->bit_cache_start ||
+			self->bit_index + count > self->bit_cache_end)
 	{
-		return NULL;
+		plm_buffer_refill(self);
 	}
 
-	self->start_code = -1;
+	uint32_t shift = self->bit_index - self->bit_cache_start;
+	return (int)((self->bit_cache << shift) >> (64 - count));
+}
 
-	self->next_packet.type = type;
-	self->next_packet.length = plm_buffer_read(self->buffer, 16);
-	self->next_packet.length -= plm_buffer_skip_bytes(self->buffer, 0xff); // stuffing
+int plm_buffer_fill_cache(plm_buffer_t *self, int count)
+{
+	// Make sure the next count bits are in the bit cache. Unlike
+	// plm_buffer_has() this never invokes the load callback; it returns FALSE
+	// if fewer bits are currently buffered.
+	if (
+			self->bit_index >= self->bit_cache_start &&
+			self->bit_index + count <= self->bit_cache_end)
+	{
+		return TRUE;
+	}
+	if (((self->length << 3) - self->bit_index) < (uint32_t)count)
+	{
+		return FALSE;
+	}
+	plm_buffer_refill(self);
+	return TRUE;
+}
 
-	// skip P-STD
-	if (plm_buffer_read(self->buffer, 2) == 0x01)
+int plm_buffer_read(plm_buffer_t *self, int count)
+{
+// // printf("plm_buffer_read\n");
+	if (count == 0)
 	{
-		plm_buffer_skip(self->buffer, 16);
-		self->next_packet.length -= 2;
+		return 0;
 	}
 
-	int pts_dts_marker = plm_buffer_read(self->buffer, 2);
-	if (pts_dts_marker == 0x03)
+	// Bits that are already in the cache are known to be below self->length,
+	// so the plm_buffer_has() check and any load callback can be skipped.
+	if (
+			self->bit_index < self->bit_cache_start ||
+			self->bit_index + count > self->bit_cache_end)
 	{
-		self->next_packet.pts = plm_demux_decode_time(self);
-		self->last_decoded_pts = self->next_packet.pts;
-		plm_buffer_skip(self->buffer, 40); // skip dts
-		self->next_packet.length -= 10;
+		if (!plm_buffer_has(self, count))
+		{
+			return 0;
+		}
+		plm_buffer_refill(self);
 	}
-	else if (pts_dts_marker == 0x02)
+
+	uint32_t shift = self->bit_index - self->bit_cache_start;
+	int value = (int)((self->bit_cache << shift) >> (64 - count));
+	self->bit_index += count;
+	return value;
+}
+
+void plm_buffer_align(plm_buffer_t *self)
+{
+// printf("plm_buffer_align\n");
+	if (self->bit_index & 0b111)
 	{
-		self->next_packet.pts = plm_demux_decode_time(self);
-		self->last_decoded_pts = self->next_packet.pts;
-		self->next_packet.length -= 5;
+		self->bit_index = ((self->bit_index + 7) >> 3) << 3; // Align to next byte
 	}
-	else if (pts_dts_marker == 0x00)
+}
+
+void plm_buffer_skip(plm_buffer_t *self, uint32_t count)
+{
+// printf("plm_buffer_skip(%d)\n", count);
+	if (plm_buffer_has(self, count))
 	{
-		self->next_packet.pts = PLM_PACKET_INVALID_TS;
-		plm_buffer_skip(self->buffer, 4);
-		self->next_packet.length -= 1;
+		self->bit_index += count;
+	}
+}
+
+int plm_buffer_skip_bytes(plm_buffer_t *self, uint8_t v)
+{
+	plm_buffer_align(self);
+	if ((((self->length << 3) - self->bit_index) >= 8) && (plm_buffer_get_byte(self, self->bit_index >> 3) != v))
+	{
+// printf("plm_buffer_skip_bytes(%d) = 0\n", v);
+		return 0;
 	}
 	else
 	{
-		return NULL; // invalid
+		int skipped = 0;
+		while (plm_buffer_has(self, 8) && plm_buffer_get_byte(self, self->bit_index >> 3) == v)
+		{
+			self->bit_index += 8;
+			skipped++;
+		}
+// printf("plm_buffer_skip_bytes(%d) = %d\n", v, skipped);
+		return skipped;
 	}
-
-	return plm_demux_get_packet(self);
 }
 
-plm_packet_t *plm_demux_get_packet(plm_demux_t *self)
+int plm_buffer_next_start_code(plm_buffer_t *self)
 {
-// printf("plm_demux_get_packet\n");
-	if (!plm_buffer_has(self->buffer, self->next_packet.length << 3))
+// printf("plm_buffer_next_start_code\n");
+	plm_buffer_align(self);
+
+	while (plm_buffer_has(self, (5 << 3)))
 	{
-		return NULL;
+		// Scan every position that still has 5 bytes buffered behind it; only
+		// then ask for more data.
+		uint32_t byte_index = self->bit_index >> 3;
+		uint32_t positions = self->length - byte_index - 4;
+		int offset = plm_buffer_scan_start_code(self, byte_index, positions);
+		if (offset != -1)
+		{
+			self->scanned_bytes += offset + 4;
+			byte_index += offset;
+			self->bit_index = (byte_index + 4) << 3;
+			return plm_buffer_get_byte(self, byte_index + 3);
+		}
+		self->scanned_bytes += positions;
+		self->bit_index = (byte_index + positions) << 3;
 	}
+	return -1;
+}
 
-	self->current_packet.data = self->buffer->bytes + (self->buffer->bit_index >> 3);
-	self->current_packet.length = self->next_packet.length;
-	self->current_packet.type = self->next_packet.type;
-	self->current_packet.pts = self->next_packet.pts;
+int plm_buffer_next_start_code_append(plm_buffer_t *self, uint8_t **bytes, uint32_t *length, uint32_t *capacity)
+{
+// printf("plm_buffer_next_start_code_append\n");
+	// Like plm_buffer_next_start_code(), but also append the bytes skipped and
+	// the start code to bytes, or the remaining bytes if no start code is found.
+	// Copying as we go keeps the bytes valid when loading more data discards
+	// the ones already read.
+	plm_buffer_align(self);
 
-	self->next_packet.length = 0;
-	return &self->current_packet;
+	while (plm_buffer_has(self, (5 << 3)))
+	{
+		uint32_t byte_index = self->bit_index >> 3;
+		uint32_t positions = self->length - byte_index - 4;
+		int offset = plm_buffer_scan_start_code(self, byte_index, positions);
+		if (offset != -1)
+		{
+			plm_buffer_append_bytes(self, byte_index, offset + 4, bytes, length, capacity);
+			self->scanned_bytes += offset + 4;
+			byte_index += offset;
+			self->bit_index = (byte_index + 4) << 3;
+			return plm_buffer_get_byte(self, byte_index + 3);
+		}
+		plm_buffer_append_bytes(self, byte_index, positions, bytes, length, capacity);
+		self->scanned_bytes += positions;
+		self->bit_index = (byte_index + positions) << 3;
+	}
+
+	uint32_t byte_index = self->bit_index >> 3;
+	plm_buffer_append_bytes(self, byte_index, self->length - byte_index, bytes, length, capacity);
+	return -1;
 }
 
-// -----------------------------------------------------------------------------
-// plm_video implementation
+void plm_buffer_append_bytes(plm_buffer_t *self, uint32_t pos, uint32_t count, uint8_t **bytes, uint32_t *length, uint32_t *capacity)
+{
+	// Copy count buffered bytes from pos to the end of bytes, growing it
+	if (*length + count > *capacity)
+	{
+		*capacity = (*length + count) * 2;
+		*bytes = (uint8_t *)PLM_REALLOC(*bytes, *capacity);
+	}
 
-// Inspired by Java MPEG-1 Video Decoder and Player by Zoltan Korandi
-// https://sourceforge.net/projects/javampeg1video/
+	uint8_t *dest = *bytes + *length;
+	*length += count;
+	while (count > 0)
+	{
+		uint32_t available = count;
+		uint8_t *source = self->mode == PLM_BUFFER_MODE_CHAIN
+			? plm_buffer_get_span_bytes(self, pos, &available)
+			: self->bytes + pos;
+		if (available > count)
+		{
+			available = count;
+		}
+		memcpy(dest, source, available);
+		dest += available;
+		pos += available;
+		count -= available;
+	}
+}
 
-#define PLM_VIDEO_PICTURE_TYPE_INTRA 1
-#define PLM_VIDEO_PICTURE_TYPE_PREDICTIVE 2
-#define PLM_VIDEO_PICTURE_TYPE_B 3
+void plm_buffer_reset_memory(plm_buffer_t *self, uint8_t *bytes, uint32_t length)
+{
+	// Point a buffer created with plm_buffer_create_with_memory() at other
+	// bytes and read them from the start
+	self->bytes = bytes;
+	self->capacity = length;
+	self->length = length;
+	self->total_size = length;
+	self->bit_index = 0;
+	self->has_ended = FALSE;
+	plm_buffer_invalidate_cache(self);
+}
 
-#define PLM_START_SEQUENCE 0xB3
-#define PLM_START_SLICE_FIRST 0x01
-#define PLM_START_SLICE_LAST 0xAF
-#define PLM_START_PICTURE 0x00
-#define PLM_START_EXTENSION 0xB5
-#define PLM_START_USER_DATA 0xB2
+int plm_scan_start_code(const uint8_t *bytes, uint32_t length)
+{
+	// Return the offset of the first 00 00 01 start code prefix that lies
+	// fully within bytes[0, length), or -1 if there is none. A prefix can only
+	// begin at a zero byte, so blocks without any zero byte are skipped whole:
+	// 16 bytes at a time with SSE2, otherwise one aligned 32 bit word at a time.
+	if (length < 3)
+	{
+		return -1;
+	}
+	uint32_t end = length - 2;
+	uint32_t i = 0;
 
-#define PLM_START_IS_SLICE(c) \
-	(c >= PLM_START_SLICE_FIRST && c <= PLM_START_SLICE_LAST)
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	while (i + 16 <= end)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) == 0)
+		{
+			i += 16;
+			continue;
+		}
+		for (uint32_t stop = i + 16; i < stop; i++)
+		{
+			if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+			{
+				return i;
+			}
+		}
+	}
+#else
+	while (i < end && ((uintptr_t)(bytes + i) & 3))
+	{
+		if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+		{
+			return i;
+		}
+		i++;
+	}
+	while (i + 4 <= end)
+	{
+		uint32_t word;
+		memcpy(&word, bytes + i, 4);
+		if (((word - 0x01010101) & ~word & 0x80808080) == 0)
+		{
+			i += 4;
+			continue;
+		}
+		for (uint32_t stop = i + 4; i < stop; i++)
+		{
+			if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+			{
+				return i;
+			}
+		}
+	}
+#endif
 
-static const double PLM_VIDEO_PICTURE_RATE[] = {
-		0.000, 23.976, 24.000, 25.000, 29.970, 30.000, 50.000, 59.940,
-		60.000, 0.000, 0.000, 0.000, 0.000, 0.000, 0.000, 0.000};
+	for (; i < end; i++)
+	{
+		if (bytes[i] == 0x00 && bytes[i + 1] == 0x00 && bytes[i + 2] == 0x01)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
 
-static const uint8_t PLM_VIDEO_ZIG_ZAG[] = {
-		0, 1, 8, 16, 9, 2, 3, 10,
-		17, 24, 32, 25, 18, 11, 4, 5,
-		12, 19, 26, 33, 40, 48, 41, 34,
-		27, 20, 13, 6, 7, 14, 21, 28,
-		35, 42, 49, 56, 57, 50, 43, 36,
-		29, 22, 15, 23, 30, 37, 44, 51,
-		58, 59, 52, 45, 38, 31, 39, 46,
-		53, 60, 61, 54, 47, 55, 62, 63};
+int plm_buffer_find_start_code(plm_buffer_t *self, int code)
+{
+// printf("plm_buffer_find_start_code\n");
+	int current = 0;
+	while (TRUE)
+	{
+		current = plm_buffer_next_start_code(self);
+		if (current == code || current == -1)
+		{
+			return current;
+		}
+	}
+	return -1;
+}
 
-static const uint8_t PLM_VIDEO_INTRA_QUANT_MATRIX[] = {
-		8, 16, 19, 22, 26, 27, 29, 34,
-		16, 16, 22, 24, 27, 29, 34, 37,
-		19, 22, 26, 27, 29, 34, 34, 38,
-		22, 22, 26, 27, 29, 34, 37, 40,
-		22, 26, 27, 29, 32, 35, 40, 48,
-		26, 27, 29, 32, 35, 40, 48, 58,
-		26, 27, 29, 34, 38, 46, 56, 69,
-		27, 29, 35, 38, 46, 56, 69, 83};
+int plm_buffer_peek_start_code(plm_buffer_t *self)
+{
+// printf("plm_buffer_peek_start_code\n");
+	// Like plm_buffer_next_start_code(), but the read position does not move
+	uint32_t previous_bit_index = self->bit_index;
+	int previous_discard_read_bytes = self->discard_read_bytes;
 
-static const uint8_t PLM_VIDEO_NON_INTRA_QUANT_MATRIX[] = {
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16,
-		16, 16, 16, 16, 16, 16, 16, 16};
+	self->discard_read_bytes = FALSE;
+	int code = plm_buffer_next_start_code(self);
 
-static const uint8_t PLM_VIDEO_PREMULTIPLIER_MATRIX[] = {
-		32, 44, 42, 38, 32, 25, 17, 9,
-		44, 62, 58, 52, 44, 35, 24, 12,
-		42, 58, 55, 49, 42, 33, 23, 12,
-		38, 52, 49, 44, 38, 30, 20, 10,
-		32, 44, 42, 38, 32, 25, 17, 9,
-		25, 35, 33, 30, 25, 20, 14, 7,
-		17, 24, 23, 20, 17, 14, 9, 5,
-		9, 12, 12, 10, 9, 7, 5, 2};
+	self->bit_index = previous_bit_index;
+	self->discard_read_bytes = previous_discard_read_bytes;
+	return code;
+}
 
-static const plm_vlc_t PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT[] = {
-		{1 << 1, 0}, {0, 1}, //   0: x
-		{2 << 1, 0},
-		{3 << 1, 0}, //   1: 0x
-		{4 << 1, 0},
-		{5 << 1, 0}, //   2: 00x
-		{0, 3},
-		{0, 2}, //   3: 01x
-		{6 << 1, 0},
-		{7 << 1, 0}, //   4: 000x
-		{0, 5},
-		{0, 4}, //   5: 001x
-		{8 << 1, 0},
-		{9 << 1, 0}, //   6: 0000x
-		{0, 7},
-		{0, 6}, //   7: 0001x
-		{10 << 1, 0},
-		{11 << 1, 0}, //   8: 0000 0x
-		{12 << 1, 0},
-		{13 << 1, 0}, //   9: 0000 1x
-		{14 << 1, 0},
-		{15 << 1, 0}, //  10: 0000 00x
-		{16 << 1, 0},
-		{17 << 1, 0}, //  11: 0000 01x
-		{18 << 1, 0},
-		{19 << 1, 0}, //  12: 0000 10x
-		{0, 9},
-		{0, 8}, //  13: 0000 11x
-		{-1, 0},
-		{20 << 1, 0}, //  14: 0000 000x
-		{-1, 0},
-		{21 << 1, 0}, //  15: 0000 001x
-		{22 << 1, 0},
-		{23 << 1, 0}, //  16: 0000 010x
-		{0, 15},
-		{0, 14}, //  17: 0000 011x
-		{0, 13},
-		{0, 12}, //  18: 0000 100x
-		{0, 11},
-		{0, 10}, //  19: 0000 101x
-		{24 << 1, 0},
-		{25 << 1, 0}, //  20: 0000 0001x
-		{26 << 1, 0},
-		{27 << 1, 0}, //  21: 0000 0011x
-		{28 << 1, 0},
-		{29 << 1, 0}, //  22: 0000 0100x
-		{30 << 1, 0},
-		{31 << 1, 0}, //  23: 0000 0101x
-		{32 << 1, 0},
-		{-1, 0}, //  24: 0000 0001 0x
-		{-1, 0},
-		{33 << 1, 0}, //  25: 0000 0001 1x
-		{34 << 1, 0},
-		{35 << 1, 0}, //  26: 0000 0011 0x
-		{36 << 1, 0},
-		{37 << 1, 0}, //  27: 0000 0011 1x
-		{38 << 1, 0},
-		{39 << 1, 0}, //  28: 0000 0100 0x
-		{0, 21},
-		{0, 20}, //  29: 0000 0100 1x
-		{0, 19},
-		{0, 18}, //  30: 0000 0101 0x
-		{0, 17},
-		{0, 16}, //  31: 0000 0101 1x
-		{0, 35},
-		{-1, 0}, //  32: 0000 0001 00x
-		{-1, 0},
-		{0, 34}, //  33: 0000 0001 11x
-		{0, 33},
-		{0, 32}, //  34: 0000 0011 00x
-		{0, 31},
-		{0, 30}, //  35: 0000 0011 01x
-		{0, 29},
-		{0, 28}, //  36: 0000 0011 10x
-		{0, 27},
-		{0, 26}, //  37: 0000 0011 11x
-		{0, 25},
-		{0, 24}, //  38: 0000 0100 00x
-		{0, 23},
-		{0, 22}, //  39: 0000 0100 01x
-};
+int plm_buffer_has_start_code(plm_buffer_t *self, int code)
+{
+// printf("plm_buffer_has_start_code\n");
+	if (code == self->index_code)
+	{
+		return plm_buffer_has_indexed_start_code(self);
+	}
 
-static const plm_vlc_t PLM_VIDEO_MACROBLOCK_TYPE_INTRA[] = {
-		{1 << 1, 0}, {0, 0x01}, //   0: x
-		{-1, 0},
-		{0, 0x11}, //   1: 0x
-};
+	uint32_t previous_bit_index = self->bit_index;
+	int previous_discard_read_bytes = self->discard_read_bytes;
 
-static const plm_vlc_t PLM_VIDEO_MACROBLOCK_TYPE_PREDICTIVE[] = {
-		{1 << 1, 0}, {0, 0x0a}, //   0: x
-		{2 << 1, 0},
-		{0, 0x02}, //   1: 0x
-		{3 << 1, 0},
-		{0, 0x08}, //   2: 00x
-		{4 << 1, 0},
-		{5 << 1, 0}, //   3: 000x
-		{6 << 1, 0},
-		{0, 0x12}, //   4: 0000x
-		{0, 0x1a},
-		{0, 0x01}, //   5: 0001x
-		{-1, 0},
-		{0, 0x11}, //   6: 0000 0x
-};
+	self->discard_read_bytes = FALSE;
+	int current = plm_buffer_find_start_code(self, code);
 
-static const plm_vlc_t PLM_VIDEO_MACROBLOCK_TYPE_B[] = {
-		{1 << 1, 0}, {2 << 1, 0}, //   0: x
-		{3 << 1, 0},
-		{4 << 1, 0}, //   1: 0x
-		{0, 0x0c},
-		{0, 0x0e}, //   2: 1x
-		{5 << 1, 0},
-		{6 << 1, 0}, //   3: 00x
-		{0, 0x04},
-		{0, 0x06}, //   4: 01x
-		{7 << 1, 0},
-		{8 << 1, 0}, //   5: 000x
-		{0, 0x08},
-		{0, 0x0a}, //   6: 001x
-		{9 << 1, 0},
-		{10 << 1, 0}, //   7: 0000x
-		{0, 0x1e},
-		{0, 0x01}, //   8: 0001x
-		{-1, 0},
-		{0, 0x11}, //   9: 0000 0x
-		{0, 0x16},
-		{0, 0x1a}, //  10: 0000 1x
-};
+	self->bit_index = previous_bit_index;
+	self->discard_read_bytes = previous_discard_read_bytes;
+	return current;
+}
 
-static const plm_vlc_t *PLM_VIDEO_MACROBLOCK_TYPE[] = {
-		NULL,
-		PLM_VIDEO_MACROBLOCK_TYPE_INTRA,
-		PLM_VIDEO_MACROBLOCK_TYPE_PREDICTIVE,
-		PLM_VIDEO_MACROBLOCK_TYPE_B};
+int plm_buffer_has_indexed_start_code(plm_buffer_t *self)
+{
+// printf("plm_buffer_has_indexed_start_code\n");
+	// Same result as plm_buffer_find_start_code() for the indexed code, but
+	// bytes that have been looked at before are not scanned again. The read
+	// position does not move, so loading more data may discard read bytes.
+	while (TRUE)
+	{
+		plm_buffer_update_index(self);
+		if (self->index_last >= (int)((self->bit_index + 7) >> 3))
+		{
+			return self->index_code;
+		}
 
-static const plm_vlc_t PLM_VIDEO_CODE_BLOCK_PATTERN[] = {
-		{1 << 1, 0}, {2 << 1, 0}, //   0: x
-		{3 << 1, 0},
-		{4 << 1, 0}, //   1: 0x
-		{5 << 1, 0},
-		{6 << 1, 0}, //   2: 1x
-		{7 << 1, 0},
-		{8 << 1, 0}, //   3: 00x
-		{9 << 1, 0},
-		{10 << 1, 0}, //   4: 01x
-		{11 << 1, 0},
-		{12 << 1, 0}, //   5: 10x
-		{13 << 1, 0},
-		{0, 60}, //   6: 11x
-		{14 << 1, 0},
-		{15 << 1, 0}, //   7: 000x
-		{16 << 1, 0},
-		{17 << 1, 0}, //   8: 001x
-		{18 << 1, 0},
-		{19 << 1, 0}, //   9: 010x
-		{20 << 1, 0},
-		{21 << 1, 0}, //  10: 011x
-		{22 << 1, 0},
-		{23 << 1, 0}, //  11: 100x
-		{0, 32},
-		{0, 16}, //  12: 101x
-		{0, 8},
-		{0, 4}, //  13: 110x
-		{24 << 1, 0},
-		{25 << 1, 0}, //  14: 0000x
-		{26 << 1, 0},
-		{27 << 1, 0}, //  15: 0001x
-		{28 << 1, 0},
-		{29 << 1, 0}, //  16: 0010x
-		{30 << 1, 0},
-		{31 << 1, 0}, //  17: 0011x
-		{0, 62},
-		{0, 2}, //  18: 0100x
-		{0, 61},
-		{0, 1}, //  19: 0101x
-		{0, 56},
-		{0, 52}, //  20: 0110x
-		{0, 44},
-		{0, 28}, //  21: 0111x
-		{0, 40},
-		{0, 20}, //  22: 1000x
-		{0, 48},
-		{0, 12}, //  23: 1001x
-		{32 << 1, 0},
-		{33 << 1, 0}, //  24: 0000 0x
-		{34 << 1, 0},
-		{35 << 1, 0}, //  25: 0000 1x
-		{36 << 1, 0},
-		{37 << 1, 0}, //  26: 0001 0x
-		{38 << 1, 0},
-		{39 << 1, 0}, //  27: 0001 1x
-		{40 << 1, 0},
-		{41 << 1, 0}, //  28: 0010 0x
-		{42 << 1, 0},
-		{43 << 1, 0}, //  29: 0010 1x
-		{0, 63},
-		{0, 3}, //  30: 0011 0x
-		{0, 36},
-		{0, 24}, //  31: 0011 1x
-		{44 << 1, 0},
-		{45 << 1, 0}, //  32: 0000 00x
-		{46 << 1, 0},
-		{47 << 1, 0}, //  33: 0000 01x
-		{48 << 1, 0},
-		{49 << 1, 0}, //  34: 0000 10x
-		{50 << 1, 0},
-		{51 << 1, 0}, //  35: 0000 11x
-		{52 << 1, 0},
-		{53 << 1, 0}, //  36: 0001 00x
-		{54 << 1, 0},
-		{55 << 1, 0}, //  37: 0001 01x
-		{56 << 1, 0},
-		{57 << 1, 0}, //  38: 0001 10x
-		{58 << 1, 0},
-		{59 << 1, 0}, //  39: 0001 11x
-		{0, 34},
-		{0, 18}, //  40: 0010 00x
-		{0, 10},
-		{0, 6}, //  41: 0010 01x
-		{0, 33},
-		{0, 17}, //  42: 0010 10x
-		{0, 9},
-		{0, 5}, //  43: 0010 11x
-		{-1, 0},
-		{60 << 1, 0}, //  44: 0000 000x
-		{61 << 1, 0},
-		{62 << 1, 0}, //  45: 0000 001x
-		{0, 58},
-		{0, 54}, //  46: 0000 010x
-		{0, 46},
-		{0, 30}, //  47: 0000 011x
-		{0, 57},
-		{0, 53}, //  48: 0000 100x
-		{0, 45},
-		{0, 29}, //  49: 0000 101x
-		{0, 38},
-		{0, 26}, //  50: 0000 110x
-		{0, 37},
-		{0, 25}, //  51: 0000 111x
-		{0, 43},
-		{0, 23}, //  52: 0001 000x
-		{0, 51},
-		{0, 15}, //  53: 0001 001x
-		{0, 42},
-		{0, 22}, //  54: 0001 010x
-		{0, 50},
-		{0, 14}, //  55: 0001 011x
-		{0, 41},
-		{0, 21}, //  56: 0001 100x
-		{0, 49},
-		{0, 13}, //  57: 0001 101x
-		{0, 35},
-		{0, 19}, //  58: 0001 110x
-		{0, 11},
-		{0, 7}, //  59: 0001 111x
-		{0, 39},
-		{0, 27}, //  60: 0000 0001x
-		{0, 59},
-		{0, 55}, //  61: 0000 0010x
-		{0, 47},
-		{0, 31}, //  62: 0000 0011x
-};
+		// Writing to a packet chain discards read bytes first, so the length
+		// alone does not tell whether anything arrived
+		uint32_t previous_end = self->base_offset + self->length;
+		if (self->load_callback)
+		{
+			self->load_callback(self, self->load_callback_user_data);
+		}
+		if (self->base_offset + self->length == previous_end)
+		{
+			break;
+		}
+	}
 
-static const plm_vlc_t PLM_VIDEO_MOTION[] = {
-		{1 << 1, 0}, {0, 0}, //   0: x
-		{2 << 1, 0},
-		{3 << 1, 0}, //   1: 0x
-		{4 << 1, 0},
-		{5 << 1, 0}, //   2: 00x
-		{0, 1},
-		{0, -1}, //   3: 01x
-		{6 << 1, 0},
-		{7 << 1, 0}, //   4: 000x
-		{0, 2},
-		{0, -2}, //   5: 001x
-		{8 << 1, 0},
-		{9 << 1, 0}, //   6: 0000x
-		{0, 3},
-		{0, -3}, //   7: 0001x
-		{10 << 1, 0},
-		{11 << 1, 0}, //   8: 0000 0x
-		{12 << 1, 0},
-		{13 << 1, 0}, //   9: 0000 1x
-		{-1, 0},
-		{14 << 1, 0}, //  10: 0000 00x
-		{15 << 1, 0},
-		{16 << 1, 0}, //  11: 0000 01x
-		{17 << 1, 0},
-		{18 << 1, 0}, //  12: 0000 10x
-		{0, 4},
-		{0, -4}, //  13: 0000 11x
-		{-1, 0},
-		{19 << 1, 0}, //  14: 0000 001x
-		{20 << 1, 0},
-		{21 << 1, 0}, //  15: 0000 010x
-		{0, 7},
-		{0, -7}, //  16: 0000 011x
-		{0, 6},
-		{0, -6}, //  17: 0000 100x
-		{0, 5},
-		{0, -5}, //  18: 0000 101x
-		{22 << 1, 0},
-		{23 << 1, 0}, //  19: 0000 0011x
-		{24 << 1, 0},
-		{25 << 1, 0}, //  20: 0000 0100x
-		{26 << 1, 0},
-		{27 << 1, 0}, //  21: 0000 0101x
-		{28 << 1, 0},
-		{29 << 1, 0}, //  22: 0000 0011 0x
-		{30 << 1, 0},
-		{31 << 1, 0}, //  23: 0000 0011 1x
-		{32 << 1, 0},
-		{33 << 1, 0}, //  24: 0000 0100 0x
-		{0, 10},
-		{0, -10}, //  25: 0000 0100 1x
-		{0, 9},
-		{0, -9}, //  26: 0000 0101 0x
-		{0, 8},
-		{0, -8}, //  27: 0000 0101 1x
-		{0, 16},
-		{0, -16}, //  28: 0000 0011 00x
-		{0, 15},
-		{0, -15}, //  29: 0000 0011 01x
-		{0, 14},
-		{0, -14}, //  30: 0000 0011 10x
-		{0, 13},
-		{0, -13}, //  31: 0000 0011 11x
-		{0, 12},
-		{0, -12}, //  32: 0000 0100 00x
-		{0, 11},
-		{0, -11}, //  33: 0000 0100 01x
-};
+	if (self->total_size != 0 && self->length == self->total_size)
+	{
+		self->has_ended = TRUE;
+	}
+	return -1;
+}
 
-static const plm_vlc_t PLM_VIDEO_DCT_SIZE_LUMINANCE[] = {
-		{1 << 1, 0}, {2 << 1, 0}, //   0: x
-		{0, 1},
-		{0, 2}, //   1: 0x
-		{3 << 1, 0},
-		{4 << 1, 0}, //   2: 1x
-		{0, 0},
-		{0, 3}, //   3: 10x
-		{0, 4},
-		{5 << 1, 0}, //   4: 11x
-		{0, 5},
-		{6 << 1, 0}, //   5: 111x
-		{0, 6},
-		{7 << 1, 0}, //   6: 1111x
-		{0, 7},
-		{8 << 1, 0}, //   7: 1111 1x
-		{0, 8},
-		{-1, 0}, //   8: 1111 11x
-};
+int plm_buffer_peek_non_zero(plm_buffer_t *self, int bit_count)
+{
+// printf("plm_buffer_peek_non_zero\n");
+	if (!plm_buffer_has(self, bit_count))
+	{
+		return FALSE;
+	}
 
-static const plm_vlc_t PLM_VIDEO_DCT_SIZE_CHROMINANCE[] = {
-		{1 << 1, 0}, {2 << 1, 0}, //   0: x
-		{0, 0},
-		{0, 1}, //   1: 0x
-		{0, 2},
-		{3 << 1, 0}, //   2: 1x
-		{0, 3},
-		{4 << 1, 0}, //   3: 11x
-		{0, 4},
-		{5 << 1, 0}, //   4: 111x
-		{0, 5},
-		{6 << 1, 0}, //   5: 1111x
-		{0, 6},
-		{7 << 1, 0}, //   6: 1111 1x
-		{0, 7},
-		{8 << 1, 0}, //   7: 1111 11x
-		{0, 8},
-		{-1, 0}, //   8: 1111 111x
-};
+	return plm_buffer_peek(self, bit_count) != 0;
+}
 
-static const plm_vlc_t *PLM_VIDEO_DCT_SIZE[] = {
-		PLM_VIDEO_DCT_SIZE_LUMINANCE,
-		PLM_VIDEO_DCT_SIZE_CHROMINANCE,
-		PLM_VIDEO_DCT_SIZE_CHROMINANCE};
+int16_t plm_buffer_read_vlc(plm_buffer_t *self, const plm_vlc_t *table)
+{
+// printf("plm_buffer_read_vlc\n");
+	plm_vlc_t state = {0, 0};
+	do
+	{
+		state = table[state.index + plm_buffer_read(self, 1)];
+	} while (state.index > 0);
+	return state.value;
+}
 
-//  dct_coeff bitmap:
-//    0xff00  run
-//    0x00ff  level
+uint16_t plm_buffer_read_vlc_uint(plm_buffer_t *self, const plm_vlc_uint_t *table)
+{
+// printf("plm_buffer_read_vlc_uint\n");
+	return (uint16_t)plm_buffer_read_vlc(self, (const plm_vlc_t *)table);
+}
 
-//  Decoded values are unsigned. Sign bit follows in the stream.
+int16_t plm_buffer_read_vlc_lookup(plm_buffer_t *self, const plm_vlc_lookup_t *lookup)
+{
+	// Near the end of the buffered data, walk the tree bit by bit so that the
+	// load callback is invoked exactly as before.
+	if (!plm_buffer_fill_cache(self, lookup->max_length))
+	{
+		return plm_buffer_read_vlc(self, lookup->table);
+	}
 
-static const plm_vlc_uint_t PLM_VIDEO_DCT_COEFF[] = {
-		{1 << 1, 0}, {0, 0x0001}, //   0: x
-		{2 << 1, 0},
-		{3 << 1, 0}, //   1: 0x
-		{4 << 1, 0},
-		{5 << 1, 0}, //   2: 00x
-		{6 << 1, 0},
-		{0, 0x0101}, //   3: 01x
-		{7 << 1, 0},
-		{8 << 1, 0}, //   4: 000x
-		{9 << 1, 0},
-		{10 << 1, 0}, //   5: 001x
-		{0, 0x0002},
-		{0, 0x0201}, //   6: 010x
-		{11 << 1, 0},
-		{12 << 1, 0}, //   7: 0000x
-		{13 << 1, 0},
-		{14 << 1, 0}, //   8: 0001x
-		{15 << 1, 0},
-		{0, 0x0003}, //   9: 0010x
-		{0, 0x0401},
-		{0, 0x0301}, //  10: 0011x
-		{16 << 1, 0},
-		{0, 0xffff}, //  11: 0000 0x
-		{17 << 1, 0},
-		{18 << 1, 0}, //  12: 0000 1x
-		{0, 0x0701},
-		{0, 0x0601}, //  13: 0001 0x
-		{0, 0x0102},
-		{0, 0x0501}, //  14: 0001 1x
-		{19 << 1, 0},
-		{20 << 1, 0}, //  15: 0010 0x
+	uint64_t window = self->bit_cache << (self->bit_index - self->bit_cache_start);
+	plm_vlc_lookup_entry_t entry = lookup->entries[window >> (64 - lookup->bits)];
+	if (entry.length == 0)
+	{
+		self->bit_index += lookup->bits;
+		window <<= lookup->bits;
+		entry = lookup->entries[entry.value + (window >> (64 - entry.bits))];
+	}
+	self->bit_index += entry.length;
+	return entry.value;
+}
+
+int plm_vlc_depth(const plm_vlc_t *table, int index)
+{
+	// Length of the longest code below the tree node at index
+	int depth = 0;
+	for (int bit = 0; bit < 2; bit++)
+	{
+		plm_vlc_t state = table[index + bit];
+		int d = 1 + ((state.index > 0) ? plm_vlc_depth(table, state.index) : 0);
+		if (d > depth)
+		{
+			depth = d;
+		}
+	}
+	return depth;
+}
+
+plm_vlc_lookup_entry_t plm_vlc_walk(const plm_vlc_t *table, int *index, uint32_t code, int bits)
+{
+	// Walk the tree from *index along the bits of code, MSB first. Returns the
+	// leaf and the number of bits used, or length 0 with *index set to the
+	// inner node reached if the code is longer than bits.
+	plm_vlc_lookup_entry_t entry = {0, 0, 0};
+	for (int i = bits - 1; i >= 0; i--)
+	{
+		plm_vlc_t state = table[*index + ((code >> i) & 1)];
+		entry.length++;
+		if (state.index <= 0)
+		{
+			entry.value = state.value;
+			return entry;
+		}
+		*index = state.index;
+	}
+	entry.length = 0;
+	return entry;
+}
+
+plm_vlc_lookup_t *plm_vlc_lookup_create(const plm_vlc_t *table)
+{
+	int max_length = plm_vlc_depth(table, 0);
+	int bits = max_length < PLM_VLC_LOOKUP_BITS ? max_length : PLM_VLC_LOOKUP_BITS;
+
+	// Count the primary entries plus one second-level table for each prefix
+	// that does not resolve to a leaf within bits
+	uint32_t size = 1 << bits;
+	for (uint32_t i = 0; i < (1u << bits); i++)
+	{
+		int index = 0;
+		if (plm_vlc_walk(table, &index, i, bits).length == 0)
+		{
+			size += 1 << plm_vlc_depth(table, index);
+		}
+	}
+
+	plm_vlc_lookup_t *self = (plm_vlc_lookup_t *)PLM_MALLOC(
+			sizeof(plm_vlc_lookup_t) + size * sizeof(plm_vlc_lookup_entry_t));
+	self->table = table;
+	self->bits = bits;
+	self->max_length = max_length;
+	self->entries = (plm_vlc_lookup_entry_t *)(self + 1);
+
+	uint32_t next = 1 << bits;
+	for (uint32_t i = 0; i < (1u << bits); i++)
+	{
+		int index = 0;
+		plm_vlc_lookup_entry_t entry = plm_vlc_walk(table, &index, i, bits);
+		if (entry.length == 0)
+		{
+			int sub_bits = plm_vlc_depth(table, index);
+			for (uint32_t j = 0; j < (1u << sub_bits); j++)
+			{
+				int sub_index = index;
+				self->entries[next + j] = plm_vlc_walk(table, &sub_index, j, sub_bits);
+			}
+			entry.value = next;
+			entry.bits = sub_bits;
+			next += 1 << sub_bits;
+		}
+		self->entries[i] = entry;
+	}
+	return self;
+}
+
+void plm_vlc_lookup_destroy(plm_vlc_lookup_t *self)
+{
+	PLM_FREE(self);
+}
+
+// ----------------------------------------------------------------------------
+// plm_demux implementation
+
+#define PLM_START_PACK 0xBA
+#define PLM_START_END 0xB9
+#define PLM_START_SYSTEM 0xBB
+
+struct plm_demux_t
+{
+	plm_buffer_t *buffer;
+	int destroy_buffer_when_done;
+	double system_clock_ref;
+
+	uint32_t last_file_size;
+	double last_decoded_pts;
+	double start_time;
+	double duration;
+
+	int start_code;
+	int has_pack_header;
+	int has_system_header;
+	int has_headers;
+
+	int num_audio_streams;
+	int num_video_streams;
+	plm_packet_t current_packet;
+	plm_packet_t next_packet;
+};
+
+void plm_demux_buffer_seek(plm_demux_t *self, uint32_t pos);
+double plm_demux_decode_time(plm_demux_t *self);
+plm_packet_t *plm_demux_decode_packet(plm_demux_t *self, int type);
+plm_packet_t *plm_demux_get_packet(plm_demux_t *self);
+
+plm_demux_t *plm_demux_create(plm_buffer_t *buffer, int destroy_when_done)
+{
+// printf("plm_demux_create\n");
+	plm_demux_t *self = (plm_demux_t *)PLM_MALLOC(sizeof(plm_demux_t));
+	memset(self, 0, sizeof(plm_demux_t));
+
+	self->buffer = buffer;
+	self->destroy_buffer_when_done = destroy_when_done;
+
+	self->start_time = PLM_PACKET_INVALID_TS;
+	self->duration = PLM_PACKET_INVALID_TS;
+	self->start_code = -1;
+
+	plm_demux_has_headers(self);
+	return self;
+}
+
+void plm_demux_destroy(plm_demux_t *self)
+{
+// printf("plm_demux_destroy\n");
+	if (self->destroy_buffer_when_done)
+	{
+		plm_buffer_destroy(self->buffer);
+	}
+	PLM_FREE(self);
+}
+
+int plm_demux_has_headers(plm_demux_t *self)
+{
+// printf("plm_demux_has_headers\n");
+	if (self->has_headers)
+	{
+		return TRUE;
+	}
+
+	// Decode pack header
+	if (!self->has_pack_header)
+	{
+		if (
+				self->start_code != PLM_START_PACK &&
+				plm_buffer_find_start_code(self->buffer, PLM_START_PACK) == -1)
+		{
+			return FALSE;
+		}
+
+		self->start_code = PLM_START_PACK;
+		if (!plm_buffer_has(self->buffer, 64))
+		{
+			return FALSE;
+		}
+		self->start_code = -1;
+
+		if (plm_buffer_read(self->buffer, 4) != 0x02)
+		{
+			return FALSE;
+		}
+
+		self->system_clock_ref = plm_demux_decode_time(self);
+		plm_buffer_skip(self->buffer, 1);
+		plm_buffer_skip(self->buffer, 22); // mux_rate * 50
+		plm_buffer_skip(self->buffer, 1);
+
+		self->has_pack_header = TRUE;
+	}
+
+	// Decode system header
+	if (!self->has_system_header)
+	{
+		if (
+				self->start_code != PLM_START_SYSTEM &&
+				plm_buffer_find_start_code(self->buffer, PLM_START_SYSTEM) == -1)
+		{
+			return FALSE;
+		}
+
+		self->start_code = PLM_START_SYSTEM;
+		if (!plm_buffer_has(self->buffer, 56))
+		{
+			return FALSE;
+		}
+		self->start_code = -1;
+
+		plm_buffer_skip(self->buffer, 16); // header_length
+		plm_buffer_skip(self->buffer, 24); // rate bound
+		self->num_audio_streams = plm_buffer_read(self->buffer, 6);
+		plm_buffer_skip(self->buffer, 5); // misc flags
+		self->num_video_streams = plm_buffer_read(self->buffer, 5);
+
+		self->has_system_header = TRUE;
+	}
+
+	self->has_headers = TRUE;
+	return TRUE;
+}
+
+int plm_demux_probe(plm_demux_t *self, uint32_t probesize)
+{
+// printf("plm_demux_probe\n");
+	int previous_pos = plm_buffer_tell(self->buffer);
+
+	int video_stream = FALSE;
+	int audio_streams[4] = {FALSE, FALSE, FALSE, FALSE};
+	do
+	{
+		self->start_code = plm_buffer_next_start_code(self->buffer);
+		if (self->start_code == PLM_DEMUX_PACKET_VIDEO_1)
+		{
+			video_stream = TRUE;
+		}
+		else if (
+				self->start_code >= PLM_DEMUX_PACKET_AUDIO_1 &&
+				self->start_code <= PLM_DEMUX_PACKET_AUDIO_4)
+		{
+			audio_streams[self->start_code - PLM_DEMUX_PACKET_AUDIO_1] = TRUE;
+		}
+	} while (
+			self->start_code != -1 &&
+			plm_buffer_tell(self->buffer) - previous_pos < probesize);
+
+	self->num_video_streams = video_stream ? 1 : 0;
+	self->num_audio_streams = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (audio_streams[i])
+		{
+			self->num_audio_streams++;
+		}
+	}
+
+	plm_demux_buffer_seek(self, previous_pos);
+	return (self->num_video_streams || self->num_audio_streams);
+}
+
+int plm_demux_get_num_video_streams(plm_demux_t *self)
+{
+// printf("plm_demux_get_num_video_streams\n");
+	return plm_demux_has_headers(self)
+						 ? self->num_video_streams
+						 : 0;
+}
+
+int plm_demux_get_num_audio_streams(plm_demux_t *self)
+{
+// printf("plm_demux_get_num_audio_streams\n");
+	return plm_demux_has_headers(self)
+						 ? self->num_audio_streams
+						 : 0;
+}
+
+void plm_demux_rewind(plm_demux_t *self)
+{
+// printf("plm_demux_rewind\n");
+	plm_buffer_rewind(self->buffer);
+	self->current_packet.length = 0;
+	self->next_packet.length = 0;
+	self->start_code = -1;
+}
+
+int plm_demux_has_ended(plm_demux_t *self)
+{
+// printf("plm_demux_has_ended\n");
+	return plm_buffer_has_ended(self->buffer);
+}
+
+void plm_demux_buffer_seek(plm_demux_t *self, uint32_t pos)
+{
+// printf("plm_demux_buffer_seek\n");
+	plm_buffer_seek(self->buffer, pos);
+	self->current_packet.length = 0;
+	self->next_packet.length = 0;
+	self->start_code = -1;
+}
+
+double plm_demux_get_start_time(plm_demux_t *self, int type)
+{
+// printf("plm_demux_get_start_time\n");
+	if (self->start_time != PLM_PACKET_INVALID_TS)
+	{
+		return self->start_time;
+	}
+
+	int previous_pos = plm_buffer_tell(self->buffer);
+	int previous_start_code = self->start_code;
+
+	// Find first video PTS
+	plm_demux_rewind(self);
+	do
+	{
+		plm_packet_t *packet = plm_demux_decode(self);
+		if (!packet)
+		{
+			break;
+		}
+		if (packet->type == type)
+		{
+			self->start_time = packet->pts;
+		}
+	} while (self->start_time == PLM_PACKET_INVALID_TS);
+
+	plm_demux_buffer_seek(self, previous_pos);
+	self->start_code = previous_start_code;
+	return self->start_time;
+}
+
+double plm_demux_get_duration(plm_demux_t *self, int type)
+{
+// printf("plm_demux_get_duration\n");
+	uint32_t file_size = plm_buffer_get_size(self->buffer);
+
+	if (
+			self->duration != PLM_PACKET_INVALID_TS &&
+			self->last_file_size == file_size)
+	{
+		return self->duration;
+	}
+
+	uint32_t previous_pos = plm_buffer_tell(self->buffer);
+	int previous_start_code = self->start_code;
+
+	// Find last video PTS. Start searching 64kb from the end and go further
+	// back if needed.
+	long start_range = 64 * 1024;
+	long max_range = 4096 * 1024;
+	for (long range = start_range; range <= max_range; range *= 2)
+	{
+		long seek_pos = file_size - range;
+		if (seek_pos < 0)
+		{
+			seek_pos = 0;
+			range = max_range; // Make sure to bail after this round
+		}
+		plm_demux_buffer_seek(self, seek_pos);
+		self->current_packet.length = 0;
+
+		double last_pts = PLM_PACKET_INVALID_TS;
+		plm_packet_t *packet = NULL;
+		while ((packet = plm_demux_decode(self)))
+		{
+			if (packet->pts != PLM_PACKET_INVALID_TS && packet->type == type)
+			{
+				last_pts = packet->pts;
+			}
+		}
+		if (last_pts != PLM_PACKET_INVALID_TS)
+		{
+			self->duration = last_pts - plm_demux_get_start_time(self, type);
+			break;
+		}
+	}
+
+	plm_demux_buffer_seek(self, previous_pos);
+	self->start_code = previous_start_code;
+	self->last_file_size = file_size;
+	return self->duration;
+}
+
+plm_packet_t *plm_demux_seek(plm_demux_t *self, double seek_time, int type, int force_intra)
+{
+// printf("plm_demux_seek\n");
+	if (!plm_demux_has_headers(self))
+	{
+		return NULL;
+	}
+
+	// Using the current time, current byte position and the average bytes per
+	// second for this file, try to jump to a byte position that hopefully has
+	// packets containing timestamps within one second before to the desired
+	// seek_time.
+
+	// If we hit close to the seek_time scan through all packets to find the
+	// last one (just before the seek_time) containing an intra frame.
+	// Otherwise we should at least be closer than before. Calculate the bytes
+	// per second for the jumped range and jump again.
+
+	// The number of retries here is hard-limited to a generous amount. Usually
+	// the correct range is found after 1--5 jumps, even for files with very
+	// variable bitrates. If significantly more jumps are needed, there's
+	// probably something wrong with the file and we just avoid getting into an
+	// infinite loop. 32 retries should be enough for anybody.
+
+	double duration = plm_demux_get_duration(self, type);
+	long file_size = plm_buffer_get_size(self->buffer);
+	long byterate = file_size / duration;
+
+	double cur_time = self->last_decoded_pts;
+	double scan_span = 1;
+
+	if (seek_time > duration)
+	{
+		seek_time = duration;
+	}
+	else if (seek_time < 0)
+	{
+		seek_time = 0;
+	}
+	seek_time += self->start_time;
+
+	for (int retry = 0; retry < 32; retry++)
+	{
+		int found_packet_with_pts = FALSE;
+		int found_packet_in_range = FALSE;
+		long last_valid_packet_start = -1;
+		double first_packet_time = PLM_PACKET_INVALID_TS;
+
+		long cur_pos = plm_buffer_tell(self->buffer);
+
+		// Estimate byte offset and jump to it.
+		long offset = (seek_time - cur_time - scan_span) * byterate;
+		long seek_pos = cur_pos + offset;
+		if (seek_pos < 0)
+		{
+			seek_pos = 0;
+		}
+		else if (seek_pos > file_size - 256)
+		{
+			seek_pos = file_size - 256;
+		}
+
+		plm_demux_buffer_seek(self, seek_pos);
+
+		// Scan through all packets up to the seek_time to find the last packet
+		// containing an intra frame.
+		while (plm_buffer_find_start_code(self->buffer, type) != -1)
+		{
+			long packet_start = plm_buffer_tell(self->buffer);
+			plm_packet_t *packet = plm_demux_decode_packet(self, type);
+
+			// Skip packet if it has no PTS
+			if (!packet || packet->pts == PLM_PACKET_INVALID_TS)
+			{
+				continue;
+			}
+
+			// Bail scanning through packets if we hit one that is outside
+			// seek_time - scan_span.
+			// We also adjust the cur_time and byterate values here so the next
+			// iteration can be a bit more precise.
+			if (packet->pts > seek_time || packet->pts < seek_time - scan_span)
+			{
+				found_packet_with_pts = TRUE;
+				byterate = (seek_pos - cur_pos) / (packet->pts - cur_time);
+				cur_time = packet->pts;
+				break;
+			}
+
+			// If we are still here, it means this packet is in close range to
+			// the seek_time. If this is the first packet for this jump position
+			// record the PTS. If we later have to back off, when there was no
+			// intra frame in this range, we can lower the seek_time to not scan
+			// this range again.
+			if (!found_packet_in_range)
+			{
+				found_packet_in_range = TRUE;
+				first_packet_time = packet->pts;
+			}
+
+			// Check if this is an intra frame packet. If so, record the buffer
+			// position of the start of this packet. We want to jump back to it
+			// later, when we know it's the last intra frame before desired
+			// seek time.
+			if (force_intra)
+			{
+				for (uint32_t i = 0; i < packet->length - 6; i++)
+				{
+					// Find the START_PICTURE code
+					if (
+							packet->data[i] == 0x00 &&
+							packet->data[i + 1] == 0x00 &&
+							packet->data[i + 2] == 0x01 &&
+							packet->data[i + 3] == 0x00)
+					{
+						// Bits 11--13 in the picture header contain the frame
+						// type, where 1=Intra
+						if ((packet->data[i + 5] & 0x38) == 8)
+						{
+							last_valid_packet_start = packet_start;
+						}
+						break;
+					}
+				}
+			}
+
+			// If we don't want intra frames, just use the last PTS found.
+			else
+			{
+				last_valid_packet_start = packet_start;
+			}
+		}
+
+		// If there was at least one intra frame in the range scanned above,
+		// our search is over. Jump back to the packet and decode it again.
+		if (last_valid_packet_start != -1)
+		{
+			plm_demux_buffer_seek(self, last_valid_packet_start);
+			return plm_demux_decode_packet(self, type);
+		}
+
+		// If we hit the right range, but still found no intra frame, we have
+		// to increases the scan_span. This is done exponentially to also handle
+		// video files with very few intra frames.
+		else if (found_packet_in_range)
+		{
+			scan_span *= 2;
+			seek_time = first_packet_time;
+		}
+
+		// If we didn't find any packet with a PTS, it probably means we reached
+		// the end of the file. Estimate byterate and cur_time accordingly.
+		else if (!found_packet_with_pts)
+		{
+			byterate = (seek_pos - cur_pos) / (duration - cur_time);
+			cur_time = duration;
+		}
+	}
+
+	return NULL;
+}
+
+plm_packet_t *plm_demux_decode(plm_demux_t *self)
+{
+// printf("plm_demux_decode\n");
+	if (!plm_demux_has_headers(self))
+	{
+		return NULL;
+	}
+
+	if (self->current_packet.length)
+	{
+		uint32_t bits_till_next_packet = self->current_packet.length << 3;
+		if (!plm_buffer_has(self->buffer, bits_till_next_packet))
+		{
+			return NULL;
+		}
+		plm_buffer_skip(self->buffer, bits_till_next_packet);
+		self->current_packet.length = 0;
+	}
+
+	// Pending packet waiting for data?
+	if (self->next_packet.length)
+	{
+		return plm_demux_get_packet(self);
+	}
+
+	// Pending packet waiting for header?
+	if (self->start_code != -1)
+	{
+		return plm_demux_decode_packet(self, self->start_code);
+	}
+
+	do
+	{
+		self->start_code = plm_buffer_next_start_code(self->buffer);
+		if (
+				self->start_code == PLM_DEMUX_PACKET_VIDEO_1 ||
+				self->start_code == PLM_DEMUX_PACKET_PRIVATE || (self->start_code >= PLM_DEMUX_PACKET_AUDIO_1 && self->start_code <= PLM_DEMUX_PACKET_AUDIO_4))
+		{
+			return plm_demux_decode_packet(self, self->start_code);
+		}
+	} while (self->start_code != -1);
+
+	return NULL;
+}
+
+double plm_demux_decode_time(plm_demux_t *self)
+{
+// printf("plm_demux_decode_time\n");
+	int64_t clock = plm_buffer_read(self->buffer, 3) << 30;
+	plm_buffer_skip(self->buffer, 1);
+	clock |= plm_buffer_read(self->buffer, 15) << 15;
+	plm_buffer_skip(self->buffer, 1);
+	clock |= plm_buffer_read(self->buffer, 15);
+	plm_buffer_skip(self->buffer, 1);
+	return (double)clock / 90000.0;
+}
+
+plm_packet_t *plm_demux_decode_packet(plm_demux_t *self, int type)
+{
+// printf("plm_demux_decode_packet\n");
+	if (!plm_buffer_has(self->buffer, 16 << 3))
+	{
+		return NULL;
+	}
+
+	self->start_code = -1;
+
+	self->next_packet.type = type;
+	self->next_packet.length = plm_buffer_read(self->buffer, 16);
+	self->next_packet.length -= plm_buffer_skip_bytes(self->buffer, 0xff); // stuffing
+
+	// skip P-STD
+	if (plm_buffer_read(self->buffer, 2) == 0x01)
+	{
+		plm_buffer_skip(self->buffer, 16);
+		self->next_packet.length -= 2;
+	}
+
+	int pts_dts_marker = plm_buffer_read(self->buffer, 2);
+	if (pts_dts_marker == 0x03)
+	{
+		self->next_packet.pts = plm_demux_decode_time(self);
+		self->last_decoded_pts = self->next_packet.pts;
+		plm_buffer_skip(self->buffer, 40); // skip dts
+		self->next_packet.length -= 10;
+	}
+	else if (pts_dts_marker == 0x02)
+	{
+		self->next_packet.pts = plm_demux_decode_time(self);
+		self->last_decoded_pts = self->next_packet.pts;
+		self->next_packet.length -= 5;
+	}
+	else if (pts_dts_marker == 0x00)
+	{
+		self->next_packet.pts = PLM_PACKET_INVALID_TS;
+		plm_buffer_skip(self->buffer, 4);
+		self->next_packet.length -= 1;
+	}
+	else
+	{
+		return NULL; // invalid
+	}
+
+	return plm_demux_get_packet(self);
+}
+
+plm_packet_t *plm_demux_get_packet(plm_demux_t *self)
+{
+// printf("plm_demux_get_packet\n");
+	if (!plm_buffer_has(self->buffer, self->next_packet.length << 3))
+	{
+		return NULL;
+	}
+
+	self->current_packet.data = self->buffer->bytes + (self->buffer->bit_index >> 3);
+	self->current_packet.length = self->next_packet.length;
+	self->current_packet.type = self->next_packet.type;
+	self->current_packet.pts = self->next_packet.pts;
+
+	self->next_packet.length = 0;
+	return &self->current_packet;
+}
+
+// -----------------------------------------------------------------------------
+// plm_video implementation
+
+// Inspired by Java MPEG-1 Video Decoder and Player by Zoltan Korandi
+// https://sourceforge.net/projects/javampeg1video/
+
+#define PLM_VIDEO_PICTURE_TYPE_INTRA 1
+#define PLM_VIDEO_PICTURE_TYPE_PREDICTIVE 2
+#define PLM_VIDEO_PICTURE_TYPE_B 3
+
+#define PLM_START_SEQUENCE 0xB3
+#define PLM_START_SLICE_FIRST 0x01
+#define PLM_START_SLICE_LAST 0xAF
+#define PLM_START_PICTURE 0x00
+#define PLM_START_EXTENSION 0xB5
+#define PLM_START_USER_DATA 0xB2
+
+#define PLM_START_IS_SLICE(c) \
+	(c >= PLM_START_SLICE_FIRST && c <= PLM_START_SLICE_LAST)
+
+static const double PLM_VIDEO_PICTURE_RATE[] = {
+		0.000, 23.976, 24.000, 25.000, 29.970, 30.000, 50.000, 59.940,
+		60.000, 0.000, 0.000, 0.000, 0.000, 0.000, 0.000, 0.000};
+
+static const uint8_t PLM_VIDEO_ZIG_ZAG[] = {
+		0, 1, 8, 16, 9, 2, 3, 10,
+		17, 24, 32, 25, 18, 11, 4, 5,
+		12, 19, 26, 33, 40, 48, 41, 34,
+		27, 20, 13, 6, 7, 14, 21, 28,
+		35, 42, 49, 56, 57, 50, 43, 36,
+		29, 22, 15, 23, 30, 37, 44, 51,
+		58, 59, 52, 45, 38, 31, 39, 46,
+		53, 60, 61, 54, 47, 55, 62, 63};
+
+static const uint8_t PLM_VIDEO_INTRA_QUANT_MATRIX[] = {
+		8, 16, 19, 22, 26, 27, 29, 34,
+		16, 16, 22, 24, 27, 29, 34, 37,
+		19, 22, 26, 27, 29, 34, 34, 38,
+		22, 22, 26, 27, 29, 34, 37, 40,
+		22, 26, 27, 29, 32, 35, 40, 48,
+		26, 27, 29, 32, 35, 40, 48, 58,
+		26, 27, 29, 34, 38, 46, 56, 69,
+		27, 29, 35, 38, 46, 56, 69, 83};
+
+static const uint8_t PLM_VIDEO_NON_INTRA_QUANT_MATRIX[] = {
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16,
+		16, 16, 16, 16, 16, 16, 16, 16};
+
+static const uint8_t PLM_VIDEO_PREMULTIPLIER_MATRIX[] = {
+		32, 44, 42, 38, 32, 25, 17, 9,
+		44, 62, 58, 52, 44, 35, 24, 12,
+		42, 58, 55, 49, 42, 33, 23, 12,
+		38, 52, 49, 44, 38, 30, 20, 10,
+		32, 44, 42, 38, 32, 25, 17, 9,
+		25, 35, 33, 30, 25, 20, 14, 7,
+		17, 24, 23, 20, 17, 14, 9, 5,
+		9, 12, 12, 10, 9, 7, 5, 2};
+
+// The reduced transforms of downscaled decoding take plain coefficients
+static const uint8_t PLM_VIDEO_UNIT_MATRIX[] = {
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1,
+		1, 1, 1, 1, 1, 1, 1, 1};
+
+static const plm_vlc_t PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT[] = {
+		{1 << 1, 0}, {0, 1}, //   0: x
+		{2 << 1, 0},
+		{3 << 1, 0}, //   1: 0x
+		{4 << 1, 0},
+		{5 << 1, 0}, //   2: 00x
+		{0, 3},
+		{0, 2}, //   3: 01x
+		{6 << 1, 0},
+		{7 << 1, 0}, //   4: 000x
+		{0, 5},
+		{0, 4}, //   5: 001x
+		{8 << 1, 0},
+		{9 << 1, 0}, //   6: 0000x
+		{0, 7},
+		{0, 6}, //   7: 0001x
+		{10 << 1, 0},
+		{11 << 1, 0}, //   8: 0000 0x
+		{12 << 1, 0},
+		{13 << 1, 0}, //   9: 0000 1x
+		{14 << 1, 0},
+		{15 << 1, 0}, //  10: 0000 00x
+		{16 << 1, 0},
+		{17 << 1, 0}, //  11: 0000 01x
+		{18 << 1, 0},
+		{19 << 1, 0}, //  12: 0000 10x
+		{0, 9},
+		{0, 8}, //  13: 0000 11x
+		{-1, 0},
+		{20 << 1, 0}, //  14: 0000 000x
+		{-1, 0},
+		{21 << 1, 0}, //  15: 0000 001x
+		{22 << 1, 0},
+		{23 << 1, 0}, //  16: 0000 010x
+		{0, 15},
+		{0, 14}, //  17: 0000 011x
+		{0, 13},
+		{0, 12}, //  18: 0000 100x
+		{0, 11},
+		{0, 10}, //  19: 0000 101x
+		{24 << 1, 0},
+		{25 << 1, 0}, //  20: 0000 0001x
+		{26 << 1, 0},
+		{27 << 1, 0}, //  21: 0000 0011x
+		{28 << 1, 0},
+		{29 << 1, 0}, //  22: 0000 0100x
+		{30 << 1, 0},
+		{31 << 1, 0}, //  23: 0000 0101x
+		{32 << 1, 0},
+		{-1, 0}, //  24: 0000 0001 0x
+		{-1, 0},
+		{33 << 1, 0}, //  25: 0000 0001 1x
+		{34 << 1, 0},
+		{35 << 1, 0}, //  26: 0000 0011 0x
+		{36 << 1, 0},
+		{37 << 1, 0}, //  27: 0000 0011 1x
+		{38 << 1, 0},
+		{39 << 1, 0}, //  28: 0000 0100 0x
+		{0, 21},
+		{0, 20}, //  29: 0000 0100 1x
+		{0, 19},
+		{0, 18}, //  30: 0000 0101 0x
+		{0, 17},
+		{0, 16}, //  31: 0000 0101 1x
+		{0, 35},
+		{-1, 0}, //  32: 0000 0001 00x
+		{-1, 0},
+		{0, 34}, //  33: 0000 0001 11x
+		{0, 33},
+		{0, 32}, //  34: 0000 0011 00x
+		{0, 31},
+		{0, 30}, //  35: 0000 0011 01x
+		{0, 29},
+		{0, 28}, //  36: 0000 0011 10x
+		{0, 27},
+		{0, 26}, //  37: 0000 0011 11x
+		{0, 25},
+		{0, 24}, //  38: 0000 0100 00x
+		{0, 23},
+		{0, 22}, //  39: 0000 0100 01x
+};
+
+static const plm_vlc_t PLM_VIDEO_MACROBLOCK_TYPE_INTRA[] = {
+		{1 << 1, 0}, {0, 0x01}, //   0: x
+		{-1, 0},
+		{0, 0x11}, //   1: 0x
+};
+
+static const plm_vlc_t PLM_VIDEO_MACROBLOCK_TYPE_PREDICTIVE[] = {
+		{1 << 1, 0}, {0, 0x0a}, //   0: x
+		{2 << 1, 0},
+		{0, 0x02}, //   1: 0x
+		{3 << 1, 0},
+		{0, 0x08}, //   2: 00x
+		{4 << 1, 0},
+		{5 << 1, 0}, //   3: 000x
+		{6 << 1, 0},
+		{0, 0x12}, //   4: 0000x
+		{0, 0x1a},
+		{0, 0x01}, //   5: 0001x
+		{-1, 0},
+		{0, 0x11}, //   6: 0000 0x
+};
+
+static const plm_vlc_t PLM_VIDEO_MACROBLOCK_TYPE_B[] = {
+		{1 << 1, 0}, {2 << 1, 0}, //   0: x
+		{3 << 1, 0},
+		{4 << 1, 0}, //   1: 0x
+		{0, 0x0c},
+		{0, 0x0e}, //   2: 1x
+		{5 << 1, 0},
+		{6 << 1, 0}, //   3: 00x
+		{0, 0x04},
+		{0, 0x06}, //   4: 01x
+		{7 << 1, 0},
+		{8 << 1, 0}, //   5: 000x
+		{0, 0x08},
+		{0, 0x0a}, //   6: 001x
+		{9 << 1, 0},
+		{10 << 1, 0}, //   7: 0000x
+		{0, 0x1e},
+		{0, 0x01}, //   8: 0001x
+		{-1, 0},
+		{0, 0x11}, //   9: 0000 0x
+		{0, 0x16},
+		{0, 0x1a}, //  10: 0000 1x
+};
+
+static const plm_vlc_t *PLM_VIDEO_MACROBLOCK_TYPE[] = {
+		NULL,
+		PLM_VIDEO_MACROBLOCK_TYPE_INTRA,
+		PLM_VIDEO_MACROBLOCK_TYPE_PREDICTIVE,
+		PLM_VIDEO_MACROBLOCK_TYPE_B};
+
+static const plm_vlc_t PLM_VIDEO_CODE_BLOCK_PATTERN[] = {
+		{1 << 1, 0}, {2 << 1, 0}, //   0: x
+		{3 << 1, 0},
+		{4 << 1, 0}, //   1: 0x
+		{5 << 1, 0},
+		{6 << 1, 0}, //   2: 1x
+		{7 << 1, 0},
+		{8 << 1, 0}, //   3: 00x
+		{9 << 1, 0},
+		{10 << 1, 0}, //   4: 01x
+		{11 << 1, 0},
+		{12 << 1, 0}, //   5: 10x
+		{13 << 1, 0},
+		{0, 60}, //   6: 11x
+		{14 << 1, 0},
+		{15 << 1, 0}, //   7: 000x
+		{16 << 1, 0},
+		{17 << 1, 0}, //   8: 001x
+		{18 << 1, 0},
+		{19 << 1, 0}, //   9: 010x
+		{20 << 1, 0},
+		{21 << 1, 0}, //  10: 011x
+		{22 << 1, 0},
+		{23 << 1, 0}, //  11: 100x
+		{0, 32},
+		{0, 16}, //  12: 101x
+		{0, 8},
+		{0, 4}, //  13: 110x
+		{24 << 1, 0},
+		{25 << 1, 0}, //  14: 0000x
+		{26 << 1, 0},
+		{27 << 1, 0}, //  15: 0001x
+		{28 << 1, 0},
+		{29 << 1, 0}, //  16: 0010x
+		{30 << 1, 0},
+		{31 << 1, 0}, //  17: 0011x
+		{0, 62},
+		{0, 2}, //  18: 0100x
+		{0, 61},
+		{0, 1}, //  19: 0101x
+		{0, 56},
+		{0, 52}, //  20: 0110x
+		{0, 44},
+		{0, 28}, //  21: 0111x
+		{0, 40},
+		{0, 20}, //  22: 1000x
+		{0, 48},
+		{0, 12}, //  23: 1001x
+		{32 << 1, 0},
+		{33 << 1, 0}, //  24: 0000 0x
+		{34 << 1, 0},
+		{35 << 1, 0}, //  25: 0000 1x
+		{36 << 1, 0},
+		{37 << 1, 0}, //  26: 0001 0x
+		{38 << 1, 0},
+		{39 << 1, 0}, //  27: 0001 1x
+		{40 << 1, 0},
+		{41 << 1, 0}, //  28: 0010 0x
+		{42 << 1, 0},
+		{43 << 1, 0}, //  29: 0010 1x
+		{0, 63},
+		{0, 3}, //  30: 0011 0x
+		{0, 36},
+		{0, 24}, //  31: 0011 1x
+		{44 << 1, 0},
+		{45 << 1, 0}, //  32: 0000 00x
+		{46 << 1, 0},
+		{47 << 1, 0}, //  33: 0000 01x
+		{48 << 1, 0},
+		{49 << 1, 0}, //  34: 0000 10x
+		{50 << 1, 0},
+		{51 << 1, 0}, //  35: 0000 11x
+		{52 << 1, 0},
+		{53 << 1, 0}, //  36: 0001 00x
+		{54 << 1, 0},
+		{55 << 1, 0}, //  37: 0001 01x
+		{56 << 1, 0},
+		{57 << 1, 0}, //  38: 0001 10x
+		{58 << 1, 0},
+		{59 << 1, 0}, //  39: 0001 11x
+		{0, 34},
+		{0, 18}, //  40: 0010 00x
+		{0, 10},
+		{0, 6}, //  41: 0010 01x
+		{0, 33},
+		{0, 17}, //  42: 0010 10x
+		{0, 9},
+		{0, 5}, //  43: 0010 11x
+		{-1, 0},
+		{60 << 1, 0}, //  44: 0000 000x
+		{61 << 1, 0},
+		{62 << 1, 0}, //  45: 0000 001x
+		{0, 58},
+		{0, 54}, //  46: 0000 010x
+		{0, 46},
+		{0, 30}, //  47: 0000 011x
+		{0, 57},
+		{0, 53}, //  48: 0000 100x
+		{0, 45},
+		{0, 29}, //  49: 0000 101x
+		{0, 38},
+		{0, 26}, //  50: 0000 110x
+		{0, 37},
+		{0, 25}, //  51: 0000 111x
+		{0, 43},
+		{0, 23}, //  52: 0001 000x
+		{0, 51},
+		{0, 15}, //  53: 0001 001x
+		{0, 42},
+		{0, 22}, //  54: 0001 010x
+		{0, 50},
+		{0, 14}, //  55: 0001 011x
+		{0, 41},
+		{0, 21}, //  56: 0001 100x
+		{0, 49},
+		{0, 13}, //  57: 0001 101x
+		{0, 35},
+		{0, 19}, //  58: 0001 110x
+		{0, 11},
+		{0, 7}, //  59: 0001 111x
+		{0, 39},
+		{0, 27}, //  60: 0000 0001x
+		{0, 59},
+		{0, 55}, //  61: 0000 0010x
+		{0, 47},
+		{0, 31}, //  62: 0000 0011x
+};
+
+static const plm_vlc_t PLM_VIDEO_MOTION[] = {
+		{1 << 1, 0}, {0, 0}, //   0: x
+		{2 << 1, 0},
+		{3 << 1, 0}, //   1: 0x
+		{4 << 1, 0},
+		{5 << 1, 0}, //   2: 00x
+		{0, 1},
+		{0, -1}, //   3: 01x
+		{6 << 1, 0},
+		{7 << 1, 0}, //   4: 000x
+		{0, 2},
+		{0, -2}, //   5: 001x
+		{8 << 1, 0},
+		{9 << 1, 0}, //   6: 0000x
+		{0, 3},
+		{0, -3}, //   7: 0001x
+		{10 << 1, 0},
+		{11 << 1, 0}, //   8: 0000 0x
+		{12 << 1, 0},
+		{13 << 1, 0}, //   9: 0000 1x
+		{-1, 0},
+		{14 << 1, 0}, //  10: 0000 00x
+		{15 << 1, 0},
+		{16 << 1, 0}, //  11: 0000 01x
+		{17 << 1, 0},
+		{18 << 1, 0}, //  12: 0000 10x
+		{0, 4},
+		{0, -4}, //  13: 0000 11x
+		{-1, 0},
+		{19 << 1, 0}, //  14: 0000 001x
+		{20 << 1, 0},
+		{21 << 1, 0}, //  15: 0000 010x
+		{0, 7},
+		{0, -7}, //  16: 0000 011x
+		{0, 6},
+		{0, -6}, //  17: 0000 100x
+		{0, 5},
+		{0, -5}, //  18: 0000 101x
+		{22 << 1, 0},
+		{23 << 1, 0}, //  19: 0000 0011x
+		{24 << 1, 0},
+		{25 << 1, 0}, //  20: 0000 0100x
+		{26 << 1, 0},
+		{27 << 1, 0}, //  21: 0000 0101x
+		{28 << 1, 0},
+		{29 << 1, 0}, //  22: 0000 0011 0x
+		{30 << 1, 0},
+		{31 << 1, 0}, //  23: 0000 0011 1x
+		{32 << 1, 0},
+		{33 << 1, 0}, //  24: 0000 0100 0x
+		{0, 10},
+		{0, -10}, //  25: 0000 0100 1x
+		{0, 9},
+		{0, -9}, //  26: 0000 0101 0x
+		{0, 8},
+		{0, -8}, //  27: 0000 0101 1x
+		{0, 16},
+		{0, -16}, //  28: 0000 0011 00x
+		{0, 15},
+		{0, -15}, //  29: 0000 0011 01x
+		{0, 14},
+		{0, -14}, //  30: 0000 0011 10x
+		{0, 13},
+		{0, -13}, //  31: 0000 0011 11x
+		{0, 12},
+		{0, -12}, //  32: 0000 0100 00x
+		{0, 11},
+		{0, -11}, //  33: 0000 0100 01x
+};
+
+static const plm_vlc_t PLM_VIDEO_DCT_SIZE_LUMINANCE[] = {
+		{1 << 1, 0}, {2 << 1, 0}, //   0: x
+		{0, 1},
+		{0, 2}, //   1: 0x
+		{3 << 1, 0},
+		{4 << 1, 0}, //   2: 1x
+		{0, 0},
+		{0, 3}, //   3: 10x
+		{0, 4},
+		{5 << 1, 0}, //   4: 11x
+		{0, 5},
+		{6 << 1, 0}, //   5: 111x
+		{0, 6},
+		{7 << 1, 0}, //   6: 1111x
+		{0, 7},
+		{8 << 1, 0}, //   7: 1111 1x
+		{0, 8},
+		{-1, 0}, //   8: 1111 11x
+};
+
+static const plm_vlc_t PLM_VIDEO_DCT_SIZE_CHROMINANCE[] = {
+		{1 << 1, 0}, {2 << 1, 0}, //   0: x
+		{0, 0},
+		{0, 1}, //   1: 0x
+		{0, 2},
+		{3 << 1, 0}, //   2: 1x
+		{0, 3},
+		{4 << 1, 0}, //   3: 11x
+		{0, 4},
+		{5 << 1, 0}, //   4: 111x
+		{0, 5},
+		{6 << 1, 0}, //   5: 1111x
+		{0, 6},
+		{7 << 1, 0}, //   6: 1111 1x
+		{0, 7},
+		{8 << 1, 0}, //   7: 1111 11x
+		{0, 8},
+		{-1, 0}, //   8: 1111 111x
+};
+
+//  dct_coeff bitmap:
+//    0xff00  run
+//    0x00ff  level
+
+//  Decoded values are unsigned. Sign bit follows in the stream.
+
+static const plm_vlc_uint_t PLM_VIDEO_DCT_COEFF[] = {
+		{1 << 1, 0}, {0, 0x0001}, //   0: x
+		{2 << 1, 0},
+		{3 << 1, 0}, //   1: 0x
+		{4 << 1, 0},
+		{5 << 1, 0}, //   2: 00x
+		{6 << 1, 0},
+		{0, 0x0101}, //   3: 01x
+		{7 << 1, 0},
+		{8 << 1, 0}, //   4: 000x
+		{9 << 1, 0},
+		{10 << 1, 0}, //   5: 001x
+		{0, 0x0002},
+		{0, 0x0201}, //   6: 010x
+		{11 << 1, 0},
+		{12 << 1, 0}, //   7: 0000x
+		{13 << 1, 0},
+		{14 << 1, 0}, //   8: 0001x
+		{15 << 1, 0},
+		{0, 0x0003}, //   9: 0010x
+		{0, 0x0401},
+		{0, 0x0301}, //  10: 0011x
+		{16 << 1, 0},
+		{0, 0xffff}, //  11: 0000 0x
+		{17 << 1, 0},
+		{18 << 1, 0}, //  12: 0000 1x
+		{0, 0x0701},
+		{0, 0x0601}, //  13: 0001 0x
+		{0, 0x0102},
+		{0, 0x0501}, //  14: 0001 1x
+		{19 << 1, 0},
+		{20 << 1, 0}, //  15: 0010 0x
 		{21 << 1, 0},
 		{22 << 1, 0}, //  16: 0000 00x
 		{0, 0x0202},
@@ -2306,1041 +3906,3464 @@ static const plm_vlc_uint_t PLM_VIDEO_DCT_COEFF[] = {
 		{0, 0x1b01}, // 111: 0000 0000 0001 111x
 };
 
-typedef struct
+typedef struct
+{
+	int full_px;
+	int is_set;
+	int r_size;
+	int h;
+	int v;
+} plm_video_motion_t;
+
+// Combined dct_coeff + sign lookup, indexed by the next
+// PLM_VIDEO_DCT_COEFF_LOOKUP_BITS bits. Only used after the first coefficient
+// of a block, where a leading "10" is end_of_block. A length of 0 means the
+// code (escape or long code) has to be decoded by plm_video_decode_dct_coeff().
+#ifndef PLM_VIDEO_DCT_COEFF_LOOKUP_BITS
+#define PLM_VIDEO_DCT_COEFF_LOOKUP_BITS 8
+#endif
+
+// Implementation of plm_video_idct(). Define PLM_VIDEO_IDCT as one of these
+// to choose; by default the widest one the compiler targets is used. All of
+// them give the same output.
+#define PLM_VIDEO_IDCT_SCALAR 0
+#define PLM_VIDEO_IDCT_SSE2 1
+#define PLM_VIDEO_IDCT_AVX2 2
+
+#ifndef PLM_VIDEO_IDCT
+#if defined(__AVX2__)
+#define PLM_VIDEO_IDCT PLM_VIDEO_IDCT_AVX2
+#elif defined(__SSE2__)
+#define PLM_VIDEO_IDCT PLM_VIDEO_IDCT_SSE2
+#else
+#define PLM_VIDEO_IDCT PLM_VIDEO_IDCT_SCALAR
+#endif
+#endif
+
+// Whether blocks with nonzero coefficients only in the top left 4x4 go through
+// the reduced scalar transform. Vectorized full transforms with a native 32-bit
+// multiply are faster than that.
+#ifndef PLM_VIDEO_IDCT_4X4
+#if PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2 || (PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2 && defined(__SSE4_1__))
+#define PLM_VIDEO_IDCT_4X4 0
+#else
+#define PLM_VIDEO_IDCT_4X4 1
+#endif
+#endif
+
+typedef struct
+{
+	uint8_t run;
+	int8_t level;		// Signed level; 0 marks end_of_block
+	uint8_t length; // Code length including the sign bit
+} plm_video_dct_coeff_t;
+
+// Slice-parallel decoding: the slices of a picture are collected into
+// slice_data, each followed by the start code after it, and taken in turn by
+// the calling thread and thread_count - 1 worker threads. Slices reset the
+// DC predictors, motion vectors and quantizer scale, so each worker decodes
+// them with its own copy of the decoder state, reading from its own buffer.
+
+typedef struct
+{
+	int slice;
+	uint32_t offset;
+	uint32_t length;
+} plm_video_slice_t;
+
+typedef struct plm_video_worker_t plm_video_worker_t;
+
+struct plm_video_t
+{
+	double framerate;
+	double time;
+	int frames_decoded;
+	int frames_dropped;
+	double drop_time;
+	int width;
+	int height;
+	int mb_width;
+	int mb_height;
+	int mb_size;
+
+	// Plane sizes; divided by 1 << scale_shift like all pixel coordinates
+	int luma_width;
+	int luma_height;
+
+	int chroma_width;
+	int chroma_height;
+
+	int scale_shift;
+	const uint8_t *premultiplier_matrix;
+	int grayscale;
+
+	uint16_t *rgb565_target;
+	int rgb565_stride;
+	int rgb565_big_endian;
+
+	// Visible rect in pixels of the frame, and the part of the current picture
+	// that is decoded in macroblocks (x0, y0 inclusive, x1, y1 exclusive)
+	int visible_x;
+	int visible_y;
+	int visible_width;
+	int visible_height;
+	int window_x0;
+	int window_y0;
+	int window_x1;
+	int window_y1;
+	int macroblock_hidden;
+
+	uint64_t hidden_macroblocks;
+	uint64_t b_macroblocks;
+
+	int start_code;
+	int picture_type;
+
+	plm_video_motion_t motion_forward;
+	plm_video_motion_t motion_backward;
+
+	int has_sequence_header;
+
+	int quantizer_scale;
+	int slice_begin;
+	int macroblock_address;
+
+	int mb_row;
+	int mb_col;
+
+	int macroblock_type;
+	int macroblock_intra;
+
+	int dc_predictor[3];
+
+	plm_buffer_t *buffer;
+	int destroy_buffer_when_done;
+
+	plm_frame_t frame_current;
+	plm_frame_t frame_forward;
+	plm_frame_t frame_backward;
+
+	uint8_t *frames_data;
+
+	// The picture that last changed each macroblock of the 3 frames and of the
+	// frame returned before; macroblocks where the returned frame differs from
+	// that one are dirty
+	uint32_t picture_serial;
+	uint32_t *origins_data;
+	uint32_t *origins_current;
+	uint32_t *origins_forward;
+	uint32_t *origins_backward;
+	uint32_t *origins_returned;
+	uint8_t *dirty;
+
+	int block_data[64];
+	uint8_t intra_quant_matrix[64];
+	uint8_t non_intra_quant_matrix[64];
+
+	// quantizer_scale * quant matrix, in zig-zag order
+	int intra_quant_table[64];
+	int non_intra_quant_table[64];
+
+	int has_reference_frame;
+	int assume_no_b_frames;
+
+	int thread_count;
+	plm_video_worker_t *workers;
+	plm_semaphore_t workers_done;
+	int workers_stop;
+	plm_video_slice_t *slices;
+	int slice_count;
+	int slice_capacity;
+	int next_slice;
+	uint8_t *slice_data;
+	uint32_t slice_data_length;
+	uint32_t slice_data_capacity;
+
+	plm_vlc_lookup_t *macroblock_address_increment_lookup;
+	plm_vlc_lookup_t *macroblock_type_lookup[4];
+	plm_vlc_lookup_t *code_block_pattern_lookup;
+	plm_vlc_lookup_t *motion_lookup;
+	plm_vlc_lookup_t *dct_size_lookup[2];
+	plm_vlc_lookup_t *dct_coeff_lookup;
+	plm_video_dct_coeff_t dct_coeff_fast[1 << PLM_VIDEO_DCT_COEFF_LOOKUP_BITS];
+};
+
+struct plm_video_worker_t
+{
+	plm_video_t *parent;
+	plm_video_t *state;
+	plm_buffer_t *buffer;
+	plm_thread_t thread;
+	plm_semaphore_t start;
+};
+
+static inline uint8_t plm_clamp(int n)
+{
+	if (n > 255)
+	{
+		n = 255;
+	}
+	else if (n < 0)
+	{
+		n = 0;
+	}
+	return n;
+}
+
+int plm_video_decode_sequence_header(plm_video_t *self);
+void plm_video_init_frames(plm_video_t *self);
+void plm_video_realloc_frames(plm_video_t *self);
+void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base);
+uint32_t *plm_video_origins(plm_video_t *self, plm_frame_t *frame);
+void plm_video_update_dirty(plm_video_t *self, plm_frame_t *frame);
+void plm_video_decode_picture(plm_video_t *self);
+int plm_video_is_late_b_picture(plm_video_t *self);
+void plm_video_skip_picture(plm_video_t *self);
+void plm_video_init_window(plm_video_t *self);
+int plm_video_skip_hidden_slice(plm_video_t *self);
+int plm_video_slice_is_hidden(plm_video_t *self, int slice, int next_start_code);
+int plm_video_macroblock_is_hidden(plm_video_t *self);
+void plm_video_decode_slice(plm_video_t *self, int slice);
+void plm_video_decode_slices_threaded(plm_video_t *self);
+void plm_video_decode_worker_slices(plm_video_worker_t *worker);
+void plm_video_worker_thread(void *arg);
+void plm_video_start_workers(plm_video_t *self, int count);
+void plm_video_stop_workers(plm_video_t *self);
+void plm_video_decode_macroblock(plm_video_t *self);
+void plm_video_skip_macroblocks(plm_video_t *self, int count);
+plm_frame_t *plm_video_zero_motion_source(plm_video_t *self);
+void plm_video_copy_macroblock_run(plm_video_t *self, uint8_t *s, uint8_t *d, int address, int count, int block_size);
+void plm_video_convert_macroblocks(plm_video_t *self, int address, int count);
+void plm_video_decode_motion_vectors(plm_video_t *self);
+int plm_video_decode_motion_vector(plm_video_t *self, int r_size, int motion);
+void plm_video_predict_macroblock(plm_video_t *self);
+void plm_video_copy_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v);
+void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v);
+void plm_video_process_macroblock(plm_video_t *self, uint8_t *s, uint8_t *d, int mh, int mb, int bs, int interp);
+void plm_video_decode_block(plm_video_t *self, int block);
+void plm_video_init_dct_coeff_fast(plm_video_t *self);
+void plm_video_init_quant_tables(plm_video_t *self);
+void plm_video_set_quantizer_scale(plm_video_t *self, int quantizer_scale);
+int plm_video_decode_dct_coeff(plm_video_t *self, int n, int *run, int *level);
+void plm_video_idct(int *block);
+void plm_video_idct_4x4(const int *block, int *out);
+void plm_video_idct_row(const int *block, int *out);
+void plm_video_idct_column(const int *block, int *out);
+void plm_video_idct_scaled_4(const int *block, int *out);
+void plm_video_idct_scaled_2(const int *block, int *out);
+
+plm_video_t *plm_video_create_with_buffer(plm_buffer_t *buffer, int destroy_when_done)
+{
+// printf("plm_video_create_with_buffer\n");
+	plm_video_t *self = (plm_video_t *)PLM_MALLOC(sizeof(plm_video_t));
+	memset(self, 0, sizeof(plm_video_t));
+
+	self->buffer = buffer;
+	self->destroy_buffer_when_done = destroy_when_done;
+	self->premultiplier_matrix = PLM_VIDEO_PREMULTIPLIER_MATRIX;
+
+	// Index picture start codes as data arrives, so that checking for a fully
+	// buffered picture in plm_video_decode() does not rescan the buffer.
+	plm_buffer_index_start_code(self->buffer, PLM_START_PICTURE);
+
+	// Build the VLC lookup tables from the decoding trees
+	self->macroblock_address_increment_lookup = plm_vlc_lookup_create(PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+	for (int i = 1; i < 4; i++)
+	{
+		self->macroblock_type_lookup[i] = plm_vlc_lookup_create(PLM_VIDEO_MACROBLOCK_TYPE[i]);
+	}
+	self->code_block_pattern_lookup = plm_vlc_lookup_create(PLM_VIDEO_CODE_BLOCK_PATTERN);
+	self->motion_lookup = plm_vlc_lookup_create(PLM_VIDEO_MOTION);
+	self->dct_size_lookup[0] = plm_vlc_lookup_create(PLM_VIDEO_DCT_SIZE_LUMINANCE);
+	self->dct_size_lookup[1] = plm_vlc_lookup_create(PLM_VIDEO_DCT_SIZE_CHROMINANCE);
+	self->dct_coeff_lookup = plm_vlc_lookup_create((const plm_vlc_t *)PLM_VIDEO_DCT_COEFF);
+	plm_video_init_dct_coeff_fast(self);
+
+	// Attempt to decode the sequence header
+	self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_SEQUENCE);
+	if (self->start_code != -1)
+	{
+		plm_video_decode_sequence_header(self);
+	}
+	return self;
+}
+
+void plm_video_destroy(plm_video_t *self)
+{
+// printf("plm_video_destroy\n");
+	if (self->destroy_buffer_when_done)
+	{
+		plm_buffer_destroy(self->buffer);
+	}
+
+	if (self->has_sequence_header)
+	{
+		PLM_FREE(self->frames_data);
+		PLM_FREE(self->origins_data);
+	}
+
+	plm_vlc_lookup_destroy(self->macroblock_address_increment_lookup);
+	for (int i = 1; i < 4; i++)
+	{
+		plm_vlc_lookup_destroy(self->macroblock_type_lookup[i]);
+	}
+	plm_vlc_lookup_destroy(self->code_block_pattern_lookup);
+	plm_vlc_lookup_destroy(self->motion_lookup);
+	plm_vlc_lookup_destroy(self->dct_size_lookup[0]);
+	plm_vlc_lookup_destroy(self->dct_size_lookup[1]);
+	plm_vlc_lookup_destroy(self->dct_coeff_lookup);
+
+	plm_video_stop_workers(self);
+	if (self->slices)
+	{
+		PLM_FREE(self->slices);
+	}
+	if (self->slice_data)
+	{
+		PLM_FREE(self->slice_data);
+	}
+
+	PLM_FREE(self);
+}
+
+double plm_video_get_framerate(plm_video_t *self)
+{
+// printf("plm_video_get_framerate\n");
+	return plm_video_has_header(self)
+						 ? self->framerate
+						 : 0;
+}
+
+int plm_video_get_width(plm_video_t *self)
+{
+// printf("plm_video_get_width\n");
+	return plm_video_has_header(self)
+						 ? self->frame_current.width
+						 : 0;
+}
+
+int plm_video_get_height(plm_video_t *self)
+{
+// printf("plm_video_get_height\n");
+	return plm_video_has_header(self)
+						 ? self->frame_current.height
+						 : 0;
+}
+
+void plm_video_set_no_delay(plm_video_t *self, int no_delay)
+{
+// printf("plm_video_set_no_delay\n");
+	self->assume_no_b_frames = no_delay;
+}
+
+int plm_video_set_thread_count(plm_video_t *self, int count)
+{
+// printf("plm_video_set_thread_count\n");
+	plm_video_stop_workers(self);
+	if (count > 1)
+	{
+		plm_video_start_workers(self, count);
+	}
+	return self->thread_count;
+}
+
+void plm_video_start_workers(plm_video_t *self, int count)
+{
+// printf("plm_video_start_workers\n");
+	// Worker 0 is the calling thread; stop at the first one that fails to start
+	if (!plm_semaphore_init(&self->workers_done, 0, count))
+	{
+		return;
+	}
+	self->workers = (plm_video_worker_t *)PLM_MALLOC(sizeof(plm_video_worker_t) * count);
+	self->workers_stop = FALSE;
+	for (int i = 0; i < count; i++)
+	{
+		plm_video_worker_t *worker = &self->workers[i];
+		worker->parent = self;
+		if (i > 0)
+		{
+			if (!plm_semaphore_init(&worker->start, 0, 1))
+			{
+				break;
+			}
+			if (!plm_thread_create(&worker->thread, "plm_video_slices", i, plm_video_worker_thread, worker))
+			{
+				plm_semaphore_destroy(&worker->start);
+				break;
+			}
+		}
+		worker->state = (plm_video_t *)PLM_MALLOC(sizeof(plm_video_t));
+		worker->buffer = plm_buffer_create_with_memory(NULL, 0, FALSE);
+		self->thread_count = i + 1;
+	}
+
+	if (self->thread_count < 2)
+	{
+		plm_video_stop_workers(self);
+	}
+}
+
+void plm_video_stop_workers(plm_video_t *self)
+{
+// printf("plm_video_stop_workers\n");
+	if (self->workers)
+	{
+		PLM_ATOMIC_STORE(&self->workers_stop, TRUE);
+		for (int i = 0; i < self->thread_count; i++)
+		{
+			plm_video_worker_t *worker = &self->workers[i];
+			if (i > 0)
+			{
+				plm_semaphore_post(&worker->start);
+				plm_thread_join(&worker->thread);
+				plm_semaphore_destroy(&worker->start);
+			}
+			plm_buffer_destroy(worker->buffer);
+			PLM_FREE(worker->state);
+		}
+		plm_semaphore_destroy(&self->workers_done);
+		PLM_FREE(self->workers);
+		self->workers = NULL;
+	}
+	self->thread_count = 1;
+}
+
+int plm_video_set_downscale(plm_video_t *self, int factor)
+{
+// printf("plm_video_set_downscale\n");
+	int shift;
+	switch (factor)
+	{
+		case 1: shift = 0; break;
+		case 2: shift = 1; break;
+		case 4: shift = 2; break;
+		case 8: shift = 3; break;
+		default: return FALSE;
+	}
+	if (shift == self->scale_shift)
+	{
+		return TRUE;
+	}
+
+	self->scale_shift = shift;
+	self->premultiplier_matrix = shift
+		? PLM_VIDEO_UNIT_MATRIX
+		: PLM_VIDEO_PREMULTIPLIER_MATRIX;
+	plm_video_realloc_frames(self);
+	return TRUE;
+}
+
+void plm_video_set_grayscale(plm_video_t *self, int enabled)
+{
+// printf("plm_video_set_grayscale\n");
+	enabled = (enabled != 0);
+	if (enabled == self->grayscale)
+	{
+		return;
+	}
+	self->grayscale = enabled;
+	plm_video_realloc_frames(self);
+}
+
+void plm_video_set_rgb565_target(plm_video_t *self, uint16_t *dest, int stride, int big_endian)
+{
+// printf("plm_video_set_rgb565_target\n");
+	self->rgb565_target = dest;
+	self->rgb565_stride = stride;
+	self->rgb565_big_endian = big_endian;
+}
+
+void plm_video_set_b_picture_rect(plm_video_t *self, int x, int y, int width, int height)
+{
+// printf("plm_video_set_b_picture_rect\n");
+	self->visible_x = x;
+	self->visible_y = y;
+	self->visible_width = width;
+	self->visible_height = height;
+}
+
+double plm_video_get_hidden_b_fraction(plm_video_t *self)
+{
+// printf("plm_video_get_hidden_b_fraction\n");
+	return self->b_macroblocks
+		? (double)self->hidden_macroblocks / self->b_macroblocks
+		: 0;
+}
+
+void plm_video_set_drop_time(plm_video_t *self, double time)
+{
+// printf("plm_video_set_drop_time\n");
+	self->drop_time = time;
+}
+
+int plm_video_get_dropped_frames(plm_video_t *self)
+{
+// printf("plm_video_get_dropped_frames\n");
+	return self->frames_dropped;
+}
+
+double plm_video_get_time(plm_video_t *self)
+{
+// printf("plm_video_get_time\n");
+	return self->time;
+}
+
+void plm_video_set_time(plm_video_t *self, double time)
+{
+// printf("plm_video_set_time\n");
+	self->frames_decoded = self->framerate * time;
+	self->time = time;
+}
+
+void plm_video_rewind(plm_video_t *self)
+{
+// printf("plm_video_rewind\n");
+	plm_buffer_rewind(self->buffer);
+	self->time = 0;
+	self->frames_decoded = 0;
+	self->has_reference_frame = FALSE;
+	self->start_code = -1;
+}
+
+int plm_video_has_ended(plm_video_t *self)
+{
+// printf("plm_video_has_ended\n");
+	return plm_buffer_has_ended(self->buffer);
+}
+
+plm_frame_t *plm_video_decode(plm_video_t *self)
+{
+// printf("plm_video_decode\n");
+	if (!plm_video_has_header(self))
+	{
+		return NULL;
+	}
+
+	plm_frame_t *frame = NULL;
+	do
+	{
+		if (self->start_code != PLM_START_PICTURE)
+		{
+			self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_PICTURE);
+
+			if (self->start_code == -1)
+			{
+				// If we reached the end of the file and the previously decoded
+				// frame was a reference frame, we still have to return it.
+				if (
+						self->has_reference_frame &&
+						!self->assume_no_b_frames &&
+						plm_buffer_has_ended(self->buffer) && (self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA || self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE))
+				{
+					self->has_reference_frame = FALSE;
+					frame = &self->frame_backward;
+					break;
+				}
+
+				return NULL;
+			}
+		}
+
+		// Make sure we have a full picture in the buffer before attempting to
+		// decode it. Sadly, this can only be done by seeking for the start code
+		// of the next picture. Also, if we didn't find the start code for the
+		// next picture, but the source has ended, we assume that this last
+		// picture is in the buffer.
+		if (
+				plm_buffer_has_start_code(self->buffer, PLM_START_PICTURE) == -1 &&
+				!plm_buffer_has_ended(self->buffer))
+		{
+			return NULL;
+		}
+
+		if (plm_video_is_late_b_picture(self))
+		{
+			// Count the frame so the time stays right, but don't decode it
+			plm_video_skip_picture(self);
+			self->frames_dropped++;
+			self->frames_decoded++;
+			self->time = (double)self->frames_decoded / self->framerate;
+			continue;
+		}
+
+		plm_video_decode_picture(self);
+
+		if (self->assume_no_b_frames)
+		{
+			frame = &self->frame_backward;
+		}
+		else if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+		{
+			frame = &self->frame_current;
+		}
+		else if (self->has_reference_frame)
+		{
+			frame = &self->frame_forward;
+		}
+		else
+		{
+			self->has_reference_frame = TRUE;
+		}
+	} while (!frame);
+
+	frame->time = self->time;
+	self->frames_decoded++;
+	self->time = (double)self->frames_decoded / self->framerate;
+
+	plm_video_update_dirty(self, frame);
+	return frame;
+}
+
+int plm_video_has_header(plm_video_t *self)
+{
+// printf("plm_video_has_header\n");
+	if (self->has_sequence_header)
+	{
+		return TRUE;
+	}
+
+	if (self->start_code != PLM_START_SEQUENCE)
+	{
+		self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_SEQUENCE);
+	}
+	if (self->start_code == -1)
+	{
+		return FALSE;
+	}
+
+	if (!plm_video_decode_sequence_header(self))
+	{
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int plm_video_decode_sequence_header(plm_video_t *self)
+{
+// printf("plm_video_decode_sequence_header\n");
+	int max_header_size = 64 + 2 * 64 * 8; // 64 bit header + 2x 64 byte matrix
+	if (!plm_buffer_has(self->buffer, max_header_size))
+	{
+		return FALSE;
+	}
+
+	self->width = plm_buffer_read(self->buffer, 12);
+	self->height = plm_buffer_read(self->buffer, 12);
+
+	if (self->width <= 0 || self->height <= 0)
+	{
+		return FALSE;
+	}
+
+	// Skip pixel aspect ratio
+	plm_buffer_skip(self->buffer, 4);
+
+	self->framerate = PLM_VIDEO_PICTURE_RATE[plm_buffer_read(self->buffer, 4)];
+
+	// Skip bit_rate, marker, buffer_size and constrained bit
+	plm_buffer_skip(self->buffer, 18 + 1 + 10 + 1);
+
+	// Load custom intra quant matrix?
+	if (plm_buffer_read(self->buffer, 1))
+	{
+		for (int i = 0; i < 64; i++)
+		{
+			int idx = PLM_VIDEO_ZIG_ZAG[i];
+			self->intra_quant_matrix[idx] = plm_buffer_read(self->buffer, 8);
+		}
+	}
+	else
+	{
+		memcpy(self->intra_quant_matrix, PLM_VIDEO_INTRA_QUANT_MATRIX, 64);
+	}
+
+	// Load custom non intra quant matrix?
+	if (plm_buffer_read(self->buffer, 1))
+	{
+		for (int i = 0; i < 64; i++)
+		{
+			int idx = PLM_VIDEO_ZIG_ZAG[i];
+			self->non_intra_quant_matrix[idx] = plm_buffer_read(self->buffer, 8);
+		}
+	}
+	else
+	{
+		memcpy(self->non_intra_quant_matrix, PLM_VIDEO_NON_INTRA_QUANT_MATRIX, 64);
+	}
+
+	plm_video_init_quant_tables(self);
+
+	self->mb_width = (self->width + 15) >> 4;
+	self->mb_height = (self->height + 15) >> 4;
+	self->mb_size = self->mb_width * self->mb_height;
+
+	plm_video_init_frames(self);
+
+	self->has_sequence_header = TRUE;
+	return TRUE;
+}
+
+void plm_video_init_frames(plm_video_t *self)
+{
+// printf("plm_video_init_frames\n");
+	self->luma_width = (self->mb_width << 4) >> self->scale_shift;
+	self->luma_height = (self->mb_height << 4) >> self->scale_shift;
+
+	self->chroma_width = (self->mb_width << 3) >> self->scale_shift;
+	self->chroma_height = (self->mb_height << 3) >> self->scale_shift;
+	if (self->grayscale)
+	{
+		self->chroma_width = 0;
+		self->chroma_height = 0;
+	}
+
+	// Allocate one big chunk of data for all 3 frames = 9 planes
+	uint32_t luma_plane_size = self->luma_width * self->luma_height;
+	uint32_t chroma_plane_size = self->chroma_width * self->chroma_height;
+	uint32_t frame_data_size = (luma_plane_size + 2 * chroma_plane_size);
+
+	self->frames_data = (uint8_t *)PLM_MALLOC(frame_data_size * 3);
+	plm_video_init_frame(self, &self->frame_current, self->frames_data + frame_data_size * 0);
+	plm_video_init_frame(self, &self->frame_forward, self->frames_data + frame_data_size * 1);
+	plm_video_init_frame(self, &self->frame_backward, self->frames_data + frame_data_size * 2);
+
+	// Nothing was returned yet, so the first frame is dirty everywhere
+	self->origins_data = (uint32_t *)PLM_MALLOC(self->mb_size * (4 * sizeof(uint32_t) + 1));
+	self->origins_current = self->origins_data;
+	self->origins_forward = self->origins_current + self->mb_size;
+	self->origins_backward = self->origins_forward + self->mb_size;
+	self->origins_returned = self->origins_backward + self->mb_size;
+	self->dirty = (uint8_t *)(self->origins_returned + self->mb_size);
+	memset(self->origins_data, 0, self->mb_size * 3 * sizeof(uint32_t));
+	memset(self->origins_returned, 0xff, self->mb_size * sizeof(uint32_t));
+}
+
+void plm_video_realloc_frames(plm_video_t *self)
+{
+// printf("plm_video_realloc_frames\n");
+	// Frames exist once the sequence header is known; the reference frames
+	// are lost with them
+	if (self->has_sequence_header)
+	{
+		PLM_FREE(self->frames_data);
+		PLM_FREE(self->origins_data);
+		plm_video_init_frames(self);
+		self->has_reference_frame = FALSE;
+	}
+}
+
+void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base)
+{
+// printf("plm_video_init_frame\n");
+	uint32_t luma_plane_size = self->luma_width * self->luma_height;
+	uint32_t chroma_plane_size = self->chroma_width * self->chroma_height;
+	int round = (1 << self->scale_shift) - 1;
+
+	frame->width = (self->width + round) >> self->scale_shift;
+	frame->height = (self->height + round) >> self->scale_shift;
+	frame->y.width = self->luma_width;
+	frame->y.height = self->luma_height;
+	frame->y.data = base;
+
+	frame->cr.width = self->chroma_width;
+	frame->cr.height = self->chroma_height;
+	frame->cr.data = base + luma_plane_size;
+
+	frame->cb.width = self->chroma_width;
+	frame->cb.height = self->chroma_height;
+	frame->cb.data = base + luma_plane_size + chroma_plane_size;
+	if (self->grayscale)
+	{
+		frame->cr.data = NULL;
+		frame->cb.data = NULL;
+	}
+	frame->rgb565 = NULL;
+	frame->dirty = NULL;
+	frame->dirty_macroblocks = 0;
+	frame->macroblock_size = 16 >> self->scale_shift;
+}
+
+uint32_t *plm_video_origins(plm_video_t *self, plm_frame_t *frame)
+{
+// printf("plm_video_origins\n");
+	if (frame == &self->frame_forward)
+	{
+		return self->origins_forward;
+	}
+	else if (frame == &self->frame_backward)
+	{
+		return self->origins_backward;
+	}
+	return self->origins_current;
+}
+
+void plm_video_update_dirty(plm_video_t *self, plm_frame_t *frame)
+{
+// printf("plm_video_update_dirty\n");
+	// A macroblock is clean if it still holds the pixels of the same picture
+	// as in the frame returned before
+	uint32_t *origins = plm_video_origins(self, frame);
+	unsigned int count = 0;
+	for (int i = 0; i < self->mb_size; i++)
+	{
+		self->dirty[i] = origins[i] != self->origins_returned[i];
+		count += self->dirty[i];
+	}
+	memcpy(self->origins_returned, origins, self->mb_size * sizeof(uint32_t));
+	frame->dirty = self->dirty;
+	frame->dirty_macroblocks = count;
+}
+
+int plm_video_is_late_b_picture(plm_video_t *self)
+{
+// printf("plm_video_is_late_b_picture\n");
+	// B-pictures are shown right away, at the current time
+	if (
+			self->assume_no_b_frames ||
+			self->time + 1.0 / self->framerate >= self->drop_time ||
+			!plm_buffer_has(self->buffer, 13))
+	{
+		return FALSE;
+	}
+
+	// Peek past temporal_reference at picture_coding_type
+	return (plm_buffer_peek(self->buffer, 13) & 0x07) == PLM_VIDEO_PICTURE_TYPE_B;
+}
+
+void plm_video_skip_picture(plm_video_t *self)
+{
+// printf("plm_video_skip_picture\n");
+	// Jump over the slices, extension and user data of the picture without
+	// parsing them
+	do
+	{
+		self->start_code = plm_buffer_next_start_code(self->buffer);
+	} while (
+			PLM_START_IS_SLICE(self->start_code) ||
+			self->start_code == PLM_START_EXTENSION ||
+			self->start_code == PLM_START_USER_DATA);
+}
+
+void plm_video_decode_picture(plm_video_t *self)
+{
+// printf("plm_video_decode_picture\n");
+	plm_buffer_skip(self->buffer, 10); // skip temporalReference
+	self->picture_type = plm_buffer_read(self->buffer, 3);
+	plm_buffer_skip(self->buffer, 16); // skip vbv_delay
+
+	// D frames or unknown coding type
+	if (self->picture_type <= 0 || self->picture_type > PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		return;
+	}
+
+	// Forward full_px, f_code
+	if (
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE ||
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		self->motion_forward.full_px = plm_buffer_read(self->buffer, 1);
+		int f_code = plm_buffer_read(self->buffer, 3);
+		if (f_code == 0)
+		{
+			// Ignore picture with zero f_code
+			return;
+		}
+		self->motion_forward.r_size = f_code - 1;
+	}
+
+	// Backward full_px, f_code
+	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		self->motion_backward.full_px = plm_buffer_read(self->buffer, 1);
+		int f_code = plm_buffer_read(self->buffer, 3);
+		if (f_code == 0)
+		{
+			// Ignore picture with zero f_code
+			return;
+		}
+		self->motion_backward.r_size = f_code - 1;
+	}
+
+	plm_frame_t frame_temp = self->frame_forward;
+	uint32_t *origins_temp = self->origins_forward;
+	if (
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA ||
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+	{
+		self->frame_forward = self->frame_backward;
+		self->origins_forward = self->origins_backward;
+	}
+	self->picture_serial++;
+
+	// Find first slice start code; skip extension and user data
+	do
+	{
+		self->start_code = plm_buffer_next_start_code(self->buffer);
+	} while (
+			self->start_code == PLM_START_EXTENSION ||
+			self->start_code == PLM_START_USER_DATA);
+
+	self->frame_current.skipped_macroblocks = 0;
+	plm_video_init_window(self);
+
+	// B-pictures can go straight to RGB565; reference pictures are converted
+	// by the caller once they are returned
+	self->frame_current.rgb565 = NULL;
+	if (
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_B &&
+			self->rgb565_target && !self->grayscale)
+	{
+		self->frame_current.rgb565 = self->rgb565_target;
+	}
+
+	// Decode all slices
+	if (self->workers)
+	{
+		plm_video_decode_slices_threaded(self);
+	}
+	while (PLM_START_IS_SLICE(self->start_code))
+	{
+		if (plm_video_skip_hidden_slice(self))
+		{
+			continue;
+		}
+		plm_video_decode_slice(self, self->start_code & 0x000000FF);
+		if (self->macroblock_address >= self->mb_size - 2)
+		{
+			break;
+		}
+		self->start_code = plm_buffer_next_start_code(self->buffer);
+	}
+
+	// If this is a reference picture rotate the prediction pointers
+	if (
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA ||
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+	{
+		self->frame_backward = self->frame_current;
+		self->frame_current = frame_temp;
+		self->origins_backward = self->origins_current;
+		self->origins_current = origins_temp;
+	}
+}
+
+void plm_video_init_window(plm_video_t *self)
+{
+// printf("plm_video_init_window\n");
+	// A reference picture can supply pixels to any part of the pictures that
+	// follow up to the next intra picture: vectors reach up to 1024 pixels per
+	// step, with no limit on the steps. A margin of the vector range of the
+	// picture (r_size) would not do, since every P-picture after it adds its
+	// own. Only B-pictures, which nothing is predicted from, can safely be
+	// clipped to the visible rect.
+	self->window_x0 = 0;
+	self->window_y0 = 0;
+	self->window_x1 = self->mb_width;
+	self->window_y1 = self->mb_height;
+	if (
+			self->visible_width > 0 && self->visible_height > 0 &&
+			self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		int size = 16 >> self->scale_shift;
+		int x0 = self->visible_x / size;
+		int y0 = self->visible_y / size;
+		int x1 = (self->visible_x + self->visible_width + size - 1) / size;
+		int y1 = (self->visible_y + self->visible_height + size - 1) / size;
+		self->window_x0 = x0 > 0 ? x0 : 0;
+		self->window_y0 = y0 > 0 ? y0 : 0;
+		self->window_x1 = x1 < self->mb_width ? x1 : self->mb_width;
+		self->window_y1 = y1 < self->mb_height ? y1 : self->mb_height;
+		if (self->window_x1 < self->window_x0 || self->window_y1 < self->window_y0)
+		{
+			self->window_x1 = self->window_x0;
+			self->window_y1 = self->window_y0;
+		}
+	}
+
+	int decoded = (self->window_x1 - self->window_x0) * (self->window_y1 - self->window_y0);
+	self->frame_current.hidden_macroblocks = self->mb_size - decoded;
+	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		self->hidden_macroblocks += self->mb_size - decoded;
+		self->b_macroblocks += self->mb_size;
+	}
+}
+
+int plm_video_skip_hidden_slice(plm_video_t *self)
+{
+// printf("plm_video_skip_hidden_slice\n");
+	// Slices decode independently, so one that lies completely outside the
+	// window is not parsed at all. Returns TRUE with the start code after it
+	// read if so.
+	int slice = self->start_code & 0x000000FF;
+	if (slice - 1 < self->window_y0)
+	{
+		// Look ahead to the row the next slice starts in
+		if (!plm_video_slice_is_hidden(self, slice, plm_buffer_peek_start_code(self->buffer)))
+		{
+			return FALSE;
+		}
+	}
+	else if (slice - 1 < self->window_y1)
+	{
+		return FALSE;
+	}
+	self->start_code = plm_buffer_next_start_code(self->buffer);
+	return TRUE;
+}
+
+int plm_video_slice_is_hidden(plm_video_t *self, int slice, int next_start_code)
+{
+// printf("plm_video_slice_is_hidden\n");
+	// A slice covers the rows from its own to the one the next slice starts
+	// in, or to the end of the picture
+	if (slice - 1 >= self->window_y1)
+	{
+		return TRUE;
+	}
+	if (!PLM_START_IS_SLICE(next_start_code))
+	{
+		return FALSE;
+	}
+	return (next_start_code & 0x000000FF) - 1 < self->window_y0;
+}
+
+int plm_video_macroblock_is_hidden(plm_video_t *self)
+{
+// printf("plm_video_macroblock_is_hidden\n");
+	int col = self->mb_col;
+	int row = self->mb_row;
+	return (col < self->window_x0 || col >= self->window_x1 || row < self->window_y0 || row >= self->window_y1);
+}
+
+void plm_video_decode_slice(plm_video_t *self, int slice)
+{
+// printf("plm_video_decode_slice\n");
+	self->slice_begin = TRUE;
+	self->macroblock_address = (slice - 1) * self->mb_width - 1;
+
+	// Reset motion vectors and DC predictors
+	self->motion_backward.h = self->motion_forward.h = 0;
+	self->motion_backward.v = self->motion_forward.v = 0;
+	self->dc_predictor[0] = 128;
+	self->dc_predictor[1] = 128;
+	self->dc_predictor[2] = 128;
+
+	plm_video_set_quantizer_scale(self, plm_buffer_read(self->buffer, 5));
+
+	// Skip extra
+	while (plm_buffer_read(self->buffer, 1))
+	{
+		plm_buffer_skip(self->buffer, 8);
+	}
+
+	do
+	{
+		plm_video_decode_macroblock(self);
+	} while (
+			self->macroblock_address < self->mb_size - 1 &&
+			plm_buffer_peek_non_zero(self->buffer, 23));
+}
+
+void plm_video_decode_slices_threaded(plm_video_t *self)
+{
+// printf("plm_video_decode_slices_threaded\n");
+	// Collect all slices of the picture
+	self->slice_count = 0;
+	self->slice_data_length = 0;
+	while (PLM_START_IS_SLICE(self->start_code))
+	{
+		if (self->slice_count == self->slice_capacity)
+		{
+			self->slice_capacity = self->slice_capacity ? self->slice_capacity * 2 : self->mb_height;
+			self->slices = (plm_video_slice_t *)PLM_REALLOC(self->slices, sizeof(plm_video_slice_t) * self->slice_capacity);
+		}
+		plm_video_slice_t *slice = &self->slices[self->slice_count++];
+		slice->slice = self->start_code & 0x000000FF;
+		slice->offset = self->slice_data_length;
+		self->start_code = plm_buffer_next_start_code_append(
+				self->buffer, &self->slice_data, &self->slice_data_length, &self->slice_data_capacity);
+		slice->length = self->slice_data_length - slice->offset;
+
+		// Drop it again if it need not be decoded
+		if (plm_video_slice_is_hidden(self, slice->slice, self->start_code))
+		{
+			self->slice_data_length = slice->offset;
+			self->slice_count--;
+		}
+	}
+
+	// Hand each worker a copy of the decoder state and decode them together
+	for (int i = 0; i < self->thread_count; i++)
+	{
+		plm_video_worker_t *worker = &self->workers[i];
+		*worker->state = *self;
+		worker->state->buffer = worker->buffer;
+	}
+	self->next_slice = 0;
+	for (int i = 1; i < self->thread_count; i++)
+	{
+		plm_semaphore_post(&self->workers[i].start);
+	}
+	plm_video_decode_worker_slices(&self->workers[0]);
+	for (int i = 1; i < self->thread_count; i++)
+	{
+		plm_semaphore_wait(&self->workers_done);
+	}
+
+	for (int i = 0; i < self->thread_count; i++)
+	{
+		self->frame_current.skipped_macroblocks += self->workers[i].state->frame_current.skipped_macroblocks;
+	}
+}
+
+void plm_video_decode_worker_slices(plm_video_worker_t *worker)
+{
+// printf("plm_video_decode_worker_slices\n");
+	plm_video_t *parent = worker->parent;
+	int i;
+	while ((i = PLM_ATOMIC_FETCH_ADD(&parent->next_slice, 1)) < parent->slice_count)
+	{
+		plm_video_slice_t *slice = &parent->slices[i];
+		plm_buffer_reset_memory(worker->buffer, parent->slice_data + slice->offset, slice->length);
+		plm_video_decode_slice(worker->state, slice->slice);
+	}
+}
+
+void plm_video_worker_thread(void *arg)
+{
+// printf("plm_video_worker_thread\n");
+	plm_video_worker_t *worker = (plm_video_worker_t *)arg;
+	plm_video_t *parent = worker->parent;
+	while (TRUE)
+	{
+		plm_semaphore_wait(&worker->start);
+		if (PLM_ATOMIC_LOAD(&parent->workers_stop))
+		{
+			break;
+		}
+		plm_video_decode_worker_slices(worker);
+		plm_semaphore_post(&parent->workers_done);
+	}
+}
+
+void plm_video_decode_macroblock(plm_video_t *self)
+{
+// printf("plm_video_decode_macroblock\n");
+	// Decode increment
+	int increment = 0;
+	int t = plm_buffer_read_vlc_lookup(self->buffer, self->macroblock_address_increment_lookup);
+
+	while (t == 34)
+	{
+		// macroblock_stuffing
+		t = plm_buffer_read_vlc_lookup(self->buffer, self->macroblock_address_increment_lookup);
+	}
+	while (t == 35)
+	{
+		// macroblock_escape
+		increment += 33;
+		t = plm_buffer_read_vlc_lookup(self->buffer, self->macroblock_address_increment_lookup);
+	}
+	increment += t;
+
+	// Process any skipped macroblocks
+	if (self->slice_begin)
+	{
+		// The first increment of each slice is relative to beginning of the
+		// previous row, not the previous macroblock
+		self->slice_begin = FALSE;
+		self->macroblock_address += increment;
+	}
+	else
+	{
+		if (self->macroblock_address + increment >= self->mb_size)
+		{
+			return; // invalid
+		}
+		if (increment > 1)
+		{
+			// Skipped macroblocks reset DC predictors
+			self->dc_predictor[0] = 128;
+			self->dc_predictor[1] = 128;
+			self->dc_predictor[2] = 128;
+
+			// Skipped macroblocks in P-pictures reset motion vectors
+			if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+			{
+				self->motion_forward.h = 0;
+				self->motion_forward.v = 0;
+			}
+		}
+
+		// Predict skipped macroblocks
+		if (increment > 1)
+		{
+			plm_video_skip_macroblocks(self, increment - 1);
+		}
+		self->macroblock_address++;
+	}
+
+	self->mb_row = self->macroblock_address / self->mb_width;
+	self->mb_col = self->macroblock_address % self->mb_width;
+
+	if (self->mb_col >= self->mb_width || self->mb_row >= self->mb_height)
+	{
+		return; // corrupt stream;
+	}
+	self->macroblock_hidden = plm_video_macroblock_is_hidden(self);
+
+	// Process the current macroblock
+	const plm_vlc_lookup_t *lookup = self->macroblock_type_lookup[self->picture_type];
+	self->macroblock_type = plm_buffer_read_vlc_lookup(self->buffer, lookup);
+
+	self->macroblock_intra = (self->macroblock_type & 0x01);
+	self->motion_forward.is_set = (self->macroblock_type & 0x08);
+	self->motion_backward.is_set = (self->macroblock_type & 0x04);
+
+	// Quantizer scale
+	if ((self->macroblock_type & 0x10) != 0)
+	{
+		plm_video_set_quantizer_scale(self, plm_buffer_read(self->buffer, 5));
+	}
+
+	if (self->macroblock_intra)
+	{
+		// Intra-coded macroblocks reset motion vectors
+		self->motion_backward.h = self->motion_forward.h = 0;
+		self->motion_backward.v = self->motion_forward.v = 0;
+	}
+	else
+	{
+		// Non-intra macroblocks reset DC predictors
+		self->dc_predictor[0] = 128;
+		self->dc_predictor[1] = 128;
+		self->dc_predictor[2] = 128;
+
+		plm_video_decode_motion_vectors(self);
+		if (!self->macroblock_hidden)
+		{
+			plm_video_predict_macroblock(self);
+		}
+	}
+
+	// Decode blocks
+	int cbp = ((self->macroblock_type & 0x02) != 0)
+								? plm_buffer_read_vlc_lookup(self->buffer, self->code_block_pattern_lookup)
+								: (self->macroblock_intra ? 0x3f : 0);
+
+	for (int block = 0, mask = 0x20; block < 6; block++)
+	{
+		if ((cbp & mask) != 0)
+		{
+			plm_video_decode_block(self, block);
+		}
+		mask >>= 1;
+	}
+
+	// Without coded blocks a prediction with zero motion leaves the pixels of
+	// the reference frame as they were
+	if (!self->macroblock_hidden)
+	{
+		plm_frame_t *s = cbp == 0 ? plm_video_zero_motion_source(self) : NULL;
+		self->origins_current[self->macroblock_address] = s
+				? plm_video_origins(self, s)[self->macroblock_address]
+				: self->picture_serial;
+	}
+
+	if (self->frame_current.rgb565)
+	{
+		plm_video_convert_macroblocks(self, self->macroblock_address, 1);
+	}
+}
+
+void plm_video_skip_macroblocks(plm_video_t *self, int count)
 {
-	int full_px;
-	int is_set;
-	int r_size;
-	int h;
-	int v;
-} plm_video_motion_t;
+// printf("plm_video_skip_macroblocks\n");
+	// Skipped macroblocks repeat the prediction of the one before them. When
+	// that is a copy from a single reference frame with zero motion - always
+	// the case in P-pictures - the whole run is copied plane by plane.
+	plm_frame_t *s = plm_video_zero_motion_source(self);
+	if (!s)
+	{
+		while (count > 0)
+		{
+			self->macroblock_address++;
+			self->mb_row = self->macroblock_address / self->mb_width;
+			self->mb_col = self->macroblock_address % self->mb_width;
 
-struct plm_video_t
+			if (!plm_video_macroblock_is_hidden(self))
+			{
+				plm_video_predict_macroblock(self);
+				self->origins_current[self->macroblock_address] = self->picture_serial;
+				if (self->frame_current.rgb565)
+				{
+					plm_video_convert_macroblocks(self, self->macroblock_address, 1);
+				}
+			}
+			count--;
+		}
+		return;
+	}
+
+	plm_frame_t *d = &self->frame_current;
+	int address = self->macroblock_address + 1;
+	int shift = self->scale_shift;
+	plm_video_copy_macroblock_run(self, s->y.data, d->y.data, address, count, 16 >> shift);
+	if (!self->grayscale)
+	{
+		plm_video_copy_macroblock_run(self, s->cr.data, d->cr.data, address, count, 8 >> shift);
+		plm_video_copy_macroblock_run(self, s->cb.data, d->cb.data, address, count, 8 >> shift);
+	}
+	memcpy(self->origins_current + address, plm_video_origins(self, s) + address, count * sizeof(uint32_t));
+	d->skipped_macroblocks += count;
+	if (d->rgb565)
+	{
+		plm_video_convert_macroblocks(self, address, count);
+	}
+
+	self->macroblock_address += count;
+	self->mb_row = self->macroblock_address / self->mb_width;
+	self->mb_col = self->macroblock_address % self->mb_width;
+}
+
+plm_frame_t *plm_video_zero_motion_source(plm_video_t *self)
 {
-	double framerate;
-	double time;
-	int frames_decoded;
-	int width;
-	int height;
-	int mb_width;
-	int mb_height;
-	int mb_size;
+// printf("plm_video_zero_motion_source\n");
+	// The reference frame the current macroblock is predicted from with zero
+	// motion, or NULL if it is predicted otherwise
+	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+	{
+		if (self->motion_forward.h == 0 && self->motion_forward.v == 0)
+		{
+			return &self->frame_forward;
+		}
+	}
+	else if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		if (self->motion_forward.is_set)
+		{
+			if (
+					!self->motion_backward.is_set &&
+					self->motion_forward.h == 0 && self->motion_forward.v == 0)
+			{
+				return &self->frame_forward;
+			}
+		}
+		else if (self->motion_backward.h == 0 && self->motion_backward.v == 0)
+		{
+			return &self->frame_backward;
+		}
+	}
+	return NULL;
+}
 
-	int luma_width;
-	int luma_height;
+void plm_video_convert_macroblocks(plm_video_t *self, int address, int count)
+{
+// printf("plm_video_convert_macroblocks\n");
+	// Convert the run one macroblock row at a time, clipped to the window and
+	// to the size of the frame
+	plm_frame_t *frame = &self->frame_current;
+	int size = 16 >> self->scale_shift;
+	while (count > 0)
+	{
+		int row = address / self->mb_width;
+		int col = address % self->mb_width;
+		int cols = self->mb_width - col;
+		if (cols > count)
+		{
+			cols = count;
+		}
+		address += cols;
+		count -= cols;
 
-	int chroma_width;
-	int chroma_height;
+		int x0 = col > self->window_x0 ? col : self->window_x0;
+		int x1 = col + cols < self->window_x1 ? col + cols : self->window_x1;
+		if (row < self->window_y0 || row >= self->window_y1 || x0 >= x1)
+		{
+			continue;
+		}
+		int x = x0 * size;
+		int y = row * size;
+		int width = x1 * size > (int)frame->width ? (int)frame->width - x : (x1 - x0) * size;
+		int height = y + size > (int)frame->height ? (int)frame->height - y : size;
+		if (width <= 0 || height <= 0)
+		{
+			continue;
+		}
+		if (self->rgb565_big_endian)
+		{
+			plm_frame_rect_to_rgb565_be(frame, x, y, width, height, frame->rgb565, self->rgb565_stride);
+		}
+		else
+		{
+			plm_frame_rect_to_rgb565(frame, x, y, width, height, frame->rgb565, self->rgb565_stride);
+		}
+	}
+}
 
-	int start_code;
-	int picture_type;
+void plm_video_copy_macroblock_run(plm_video_t *self, uint8_t *s, uint8_t *d, int address, int count, int block_size)
+{
+// printf("plm_video_copy_macroblock_run\n");
+	int dw = self->mb_width * block_size;
+	while (count > 0)
+	{
+		int row = address / self->mb_width;
+		int col = address % self->mb_width;
+		unsigned int di = (row * dw + col) * block_size;
 
-	plm_video_motion_t motion_forward;
-	plm_video_motion_t motion_backward;
+		if (col == 0 && count >= self->mb_width)
+		{
+			// Whole macroblock rows are contiguous in the plane
+			int rows = count / self->mb_width;
+			memcpy(d + di, s + di, rows * block_size * dw);
+			address += rows * self->mb_width;
+			count -= rows * self->mb_width;
+			continue;
+		}
 
-	int has_sequence_header;
+		int cols = self->mb_width - col;
+		if (cols > count)
+		{
+			cols = count;
+		}
+		for (int y = 0; y < block_size; y++, di += dw)
+		{
+			memcpy(d + di, s + di, cols * block_size);
+		}
+		address += cols;
+		count -= cols;
+	}
+}
 
-	int quantizer_scale;
-	int slice_begin;
-	int macroblock_address;
+void plm_video_decode_motion_vectors(plm_video_t *self)
+{
+// printf("plm_video_decode_motion_vectors\n");
 
-	int mb_row;
-	int mb_col;
+	// Forward
+	if (self->motion_forward.is_set)
+	{
+		int r_size = self->motion_forward.r_size;
+		self->motion_forward.h = plm_video_decode_motion_vector(self, r_size, self->motion_forward.h);
+		self->motion_forward.v = plm_video_decode_motion_vector(self, r_size, self->motion_forward.v);
+	}
+	else if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+	{
+		// No motion information in P-picture, reset vectors
+		self->motion_forward.h = 0;
+		self->motion_forward.v = 0;
+	}
 
-	int macroblock_type;
-	int macroblock_intra;
+	if (self->motion_backward.is_set)
+	{
+		int r_size = self->motion_backward.r_size;
+		self->motion_backward.h = plm_video_decode_motion_vector(self, r_size, self->motion_backward.h);
+		self->motion_backward.v = plm_video_decode_motion_vector(self, r_size, self->motion_backward.v);
+	}
+}
 
-	int dc_predictor[3];
+int plm_video_decode_motion_vector(plm_video_t *self, int r_size, int motion)
+{
+// printf("plm_video_decode_motion_vector\n");
+	int fscale = 1 << r_size;
+	int m_code = plm_buffer_read_vlc_lookup(self->buffer, self->motion_lookup);
+	int r = 0;
+	int d;
 
-	plm_buffer_t *buffer;
-	int destroy_buffer_when_done;
+	if ((m_code != 0) && (fscale != 1))
+	{
+		r = plm_buffer_read(self->buffer, r_size);
+		d = ((abs(m_code) - 1) << r_size) + r + 1;
+		if (m_code < 0)
+		{
+			d = -d;
+		}
+	}
+	else
+	{
+		d = m_code;
+	}
 
-	plm_frame_t frame_current;
-	plm_frame_t frame_forward;
-	plm_frame_t frame_backward;
+	motion += d;
+	if (motion > (fscale << 4) - 1)
+	{
+		motion -= fscale << 5;
+	}
+	else if (motion < ((-fscale) << 4))
+	{
+		motion += fscale << 5;
+	}
 
-	uint8_t *frames_data;
+	return motion;
+}
 
-	int block_data[64];
-	uint8_t intra_quant_matrix[64];
-	uint8_t non_intra_quant_matrix[64];
+void plm_video_predict_macroblock(plm_video_t *self)
+{
+// printf("plm_video_predict_macroblock\n");
+	int fw_h = self->motion_forward.h;
+	int fw_v = self->motion_forward.v;
 
-	int has_reference_frame;
-	int assume_no_b_frames;
-};
+	if (self->motion_forward.full_px)
+	{
+		fw_h <<= 1;
+		fw_v <<= 1;
+	}
 
-static inline uint8_t plm_clamp(int n)
+	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	{
+		int bw_h = self->motion_backward.h;
+		int bw_v = self->motion_backward.v;
+
+		if (self->motion_backward.full_px)
+		{
+			bw_h <<= 1;
+			bw_v <<= 1;
+		}
+
+		if (self->motion_forward.is_set)
+		{
+			plm_video_copy_macroblock(self, &self->frame_forward, fw_h, fw_v);
+			if (self->motion_backward.is_set)
+			{
+				plm_video_interpolate_macroblock(self, &self->frame_backward, bw_h, bw_v);
+			}
+		}
+		else
+		{
+			plm_video_copy_macroblock(self, &self->frame_backward, bw_h, bw_v);
+		}
+	}
+	else
+	{
+		plm_video_copy_macroblock(self, &self->frame_forward, fw_h, fw_v);
+	}
+}
+
+// Motion vectors are in half pixels of the coded size; downscaled decoding
+// divides them like the chroma vectors, rounding towards zero.
+
+void plm_video_copy_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v)
 {
-	if (n > 255)
+// printf("plm_video_copy_macroblock\n");
+	plm_frame_t *d = &self->frame_current;
+	int shift = self->scale_shift;
+	int luma_h = motion_h / (1 << shift);
+	int luma_v = motion_v / (1 << shift);
+	int chroma_h = motion_h / (2 << shift);
+	int chroma_v = motion_v / (2 << shift);
+	plm_video_process_macroblock(self, s->y.data, d->y.data, luma_h, luma_v, 16 >> shift, FALSE);
+	if (!self->grayscale)
 	{
-		n = 255;
+		plm_video_process_macroblock(self, s->cr.data, d->cr.data, chroma_h, chroma_v, 8 >> shift, FALSE);
+		plm_video_process_macroblock(self, s->cb.data, d->cb.data, chroma_h, chroma_v, 8 >> shift, FALSE);
 	}
-	else if (n < 0)
+}
+
+void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v)
+{
+// printf("plm_video_interpolate_macroblock\n");
+	plm_frame_t *d = &self->frame_current;
+	int shift = self->scale_shift;
+	int luma_h = motion_h / (1 << shift);
+	int luma_v = motion_v / (1 << shift);
+	int chroma_h = motion_h / (2 << shift);
+	int chroma_v = motion_v / (2 << shift);
+	plm_video_process_macroblock(self, s->y.data, d->y.data, luma_h, luma_v, 16 >> shift, TRUE);
+	if (!self->grayscale)
 	{
-		n = 0;
+		plm_video_process_macroblock(self, s->cr.data, d->cr.data, chroma_h, chroma_v, 8 >> shift, TRUE);
+		plm_video_process_macroblock(self, s->cb.data, d->cb.data, chroma_h, chroma_v, 8 >> shift, TRUE);
 	}
-	return n;
 }
 
-int plm_video_decode_sequence_header(plm_video_t *self);
-void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base);
-void plm_video_decode_picture(plm_video_t *self);
-void plm_video_decode_slice(plm_video_t *self, int slice);
-void plm_video_decode_macroblock(plm_video_t *self);
-void plm_video_decode_motion_vectors(plm_video_t *self);
-int plm_video_decode_motion_vector(plm_video_t *self, int r_size, int motion);
-void plm_video_predict_macroblock(plm_video_t *self);
-void plm_video_copy_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v);
-void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v);
-void plm_video_process_macroblock(plm_video_t *self, uint8_t *s, uint8_t *d, int mh, int mb, int bs, int interp);
-void plm_video_decode_block(plm_video_t *self, int block);
-void plm_video_idct(int *block);
+#define PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SOURCE_WIDTH, BLOCK_SIZE, OP) \
+	do                                                                                            \
+	{                                                                                             \
+		int dest_scan = DEST_WIDTH - BLOCK_SIZE;                                                    \
+		int source_scan = SOURCE_WIDTH - BLOCK_SIZE;                                                \
+		for (int y = 0; y < BLOCK_SIZE; y++)                                                        \
+		{                                                                                           \
+			for (int x = 0; x < BLOCK_SIZE; x++)                                                      \
+			{                                                                                         \
+				DEST[DEST_INDEX] = OP;                                                                  \
+				SOURCE_INDEX++;                                                                         \
+				DEST_INDEX++;                                                                           \
+			}                                                                                         \
+			SOURCE_INDEX += source_scan;                                                              \
+			DEST_INDEX += dest_scan;                                                                  \
+		}                                                                                           \
+	} while (FALSE)
+
+// Write a SIZE x SIZE block to DEST. VALUE is evaluated for each pixel with
+// SOURCE_INDEX running over the block; intra blocks replace the pixel,
+// others add to the prediction.
+#define PLM_BLOCK_PUT(INTRA, DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SIZE, VALUE) \
+	do \
+	{ \
+		if (INTRA) \
+		{ \
+			PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SIZE, SIZE, plm_clamp(VALUE)); \
+		} \
+		else \
+		{ \
+			PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SIZE, SIZE, plm_clamp(DEST[DEST_INDEX] + (VALUE))); \
+		} \
+	} while (FALSE)
 
-plm_video_t *plm_video_create_with_buffer(plm_buffer_t *buffer, int destroy_when_done)
-{
-// printf("plm_video_create_with_buffer\n");
-	plm_video_t *self = (plm_video_t *)PLM_MALLOC(sizeof(plm_video_t));
-	memset(self, 0, sizeof(plm_video_t));
+// Motion compensation kernels. Each predicts a block_size square of d from s,
+// both dw bytes per row, a vector of WIDTH pixels at a time. mode holds the
+// interpolate, odd_h and odd_v bits of plm_video_process_macroblock(). AVG is
+// the rounded average of two vectors of pixels and AVG4 that of four, both
+// exact, so the result is the same as averaging pixel by pixel.
 
-	self->buffer = buffer;
-	self->destroy_buffer_when_done = destroy_when_done;
+#define PLM_MB_CASE(INTERPOLATE, ODD_H, ODD_V, WIDTH, STORE, OP) \
+	case ((INTERPOLATE << 2) | (ODD_H << 1) | (ODD_V)): \
+		for (int y = 0; y < block_size; y++, s += dw, d += dw) \
+		{ \
+			for (int x = 0; x < block_size; x += WIDTH) \
+			{ \
+				STORE(d + x, OP); \
+			} \
+		} \
+		break
 
-	// Attempt to decode the sequence header
-	self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_SEQUENCE);
-	if (self->start_code != -1)
-	{
-		plm_video_decode_sequence_header(self);
-	}
-	return self;
+#define PLM_DEFINE_MB_PREDICT(NAME, WIDTH, LOAD, STORE, AVG, AVG4) \
+	static void NAME(const uint8_t *s, uint8_t *d, int dw, int block_size, int mode) \
+	{ \
+		switch (mode) \
+		{ \
+			PLM_MB_CASE(0, 0, 0, WIDTH, STORE, LOAD(s + x)); \
+			PLM_MB_CASE(0, 0, 1, WIDTH, STORE, AVG(LOAD(s + x), LOAD(s + x + dw))); \
+			PLM_MB_CASE(0, 1, 0, WIDTH, STORE, AVG(LOAD(s + x), LOAD(s + x + 1))); \
+			PLM_MB_CASE(0, 1, 1, WIDTH, STORE, AVG4(LOAD(s + x), LOAD(s + x + 1), LOAD(s + x + dw), LOAD(s + x + dw + 1))); \
+			PLM_MB_CASE(1, 0, 0, WIDTH, STORE, AVG(LOAD(d + x), LOAD(s + x))); \
+			PLM_MB_CASE(1, 0, 1, WIDTH, STORE, AVG(LOAD(d + x), AVG(LOAD(s + x), LOAD(s + x + dw)))); \
+			PLM_MB_CASE(1, 1, 0, WIDTH, STORE, AVG(LOAD(d + x), AVG(LOAD(s + x), LOAD(s + x + 1)))); \
+			PLM_MB_CASE(1, 1, 1, WIDTH, STORE, AVG(LOAD(d + x), AVG4(LOAD(s + x), LOAD(s + x + 1), LOAD(s + x + dw), LOAD(s + x + dw + 1)))); \
+		} \
+	}
+
+// Blocks narrower than a vector, in downscaled decoding, go pixel by pixel
+#define PLM_SCALAR_LOAD(P) (*(P))
+#define PLM_SCALAR_STORE(P, V) (*(P) = (uint8_t)(V))
+#define PLM_SCALAR_AVG(A, B) (((A) + (B) + 1) >> 1)
+#define PLM_SCALAR_AVG4(A, B, C, D) (((A) + (B) + (C) + (D) + 2) >> 2)
+
+PLM_DEFINE_MB_PREDICT(plm_video_predict_scalar, 1, PLM_SCALAR_LOAD, PLM_SCALAR_STORE, PLM_SCALAR_AVG, PLM_SCALAR_AVG4)
+
+#if defined(__SSE2__)
+
+static inline __m128i plm_mm_avg4_epu8(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	// Sum in 16 bit lanes; pavgb of pavgb results can be off by one
+	__m128i zero = _mm_setzero_si128();
+	__m128i round = _mm_set1_epi16(2);
+	__m128i lo = _mm_add_epi16(
+			_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+			_mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)));
+	__m128i hi = _mm_add_epi16(
+			_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+			_mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)));
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+	return _mm_packus_epi16(lo, hi);
 }
 
-void plm_video_destroy(plm_video_t *self)
-{
-// printf("plm_video_destroy\n");
-	if (self->destroy_buffer_when_done)
-	{
-		plm_buffer_destroy(self->buffer);
-	}
+#define PLM_MM_LOAD_16(P) _mm_loadu_si128((const __m128i *)(P))
+#define PLM_MM_STORE_16(P, V) _mm_storeu_si128((__m128i *)(P), V)
+#define PLM_MM_LOAD_8(P) _mm_loadl_epi64((const __m128i *)(P))
+#define PLM_MM_STORE_8(P, V) _mm_storel_epi64((__m128i *)(P), V)
 
-	if (self->has_sequence_header)
-	{
-		PLM_FREE(self->frames_data);
-	}
+PLM_DEFINE_MB_PREDICT(plm_video_predict_sse2_16, 16, PLM_MM_LOAD_16, PLM_MM_STORE_16, _mm_avg_epu8, plm_mm_avg4_epu8)
+PLM_DEFINE_MB_PREDICT(plm_video_predict_sse2_8, 8, PLM_MM_LOAD_8, PLM_MM_STORE_8, _mm_avg_epu8, plm_mm_avg4_epu8)
 
-	PLM_FREE(self);
-}
+#else
 
-double plm_video_get_framerate(plm_video_t *self)
-{
-// printf("plm_video_get_framerate\n");
-	return plm_video_has_header(self)
-						 ? self->framerate
-						 : 0;
-}
+// Whether 32-bit words may be loaded from and stored to any address. If not,
+// unaligned source words are put together from the two aligned words around
+// them. Destination blocks are always word aligned.
+#ifndef PLM_UNALIGNED_ACCESS
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64) || defined(__ARM_FEATURE_UNALIGNED)
+#define PLM_UNALIGNED_ACCESS 1
+#else
+#define PLM_UNALIGNED_ACCESS 0
+#endif
+#endif
 
-int plm_video_get_width(plm_video_t *self)
+static inline uint32_t plm_swar_load(const uint8_t *p)
 {
-// printf("plm_video_get_width\n");
-	return plm_video_has_header(self)
-						 ? self->width
-						 : 0;
+#if PLM_UNALIGNED_ACCESS
+	uint32_t word;
+	memcpy(&word, p, 4);
+	return word;
+#else
+	const uint32_t *words = (const uint32_t *)((uintptr_t)p & ~(uintptr_t)3);
+	unsigned int shift = ((uintptr_t)p & 3) * 8;
+	if (shift == 0)
+	{
+		return words[0];
+	}
+	// Written as a 64-bit shift, which compilers turn into a funnel shift
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (uint32_t)((((uint64_t)words[0] << 32) | words[1]) >> (32 - shift));
+#else
+	return (uint32_t)((((uint64_t)words[1] << 32) | words[0]) >> shift);
+#endif
+#endif
 }
 
-int plm_video_get_height(plm_video_t *self)
+static inline void plm_swar_store(uint8_t *p, uint32_t word)
 {
-// printf("plm_video_get_height\n");
-	return plm_video_has_header(self)
-						 ? self->height
-						 : 0;
+#if PLM_UNALIGNED_ACCESS
+	memcpy(p, &word, 4);
+#else
+	*(uint32_t *)p = word;
+#endif
 }
 
-void plm_video_set_no_delay(plm_video_t *self, int no_delay)
+static inline uint32_t plm_swar_avg(uint32_t a, uint32_t b)
 {
-// printf("plm_video_set_no_delay\n");
-	self->assume_no_b_frames = no_delay;
+	// (a + b + 1) >> 1 for each byte, without carries between them
+	return (a | b) - (((a ^ b) >> 1) & 0x7f7f7f7f);
 }
 
-double plm_video_get_time(plm_video_t *self)
+static inline uint32_t plm_swar_avg4(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
 {
-// printf("plm_video_get_time\n");
-	return self->time;
+	// (a + b + c + d + 2) >> 2 for each byte: the upper 6 bits of each byte
+	// are added on their own, the lower 2 bits and the rounding add up to at
+	// most 14 and contribute their carry.
+	uint32_t lo =
+			(a & 0x03030303) + (b & 0x03030303) + (c & 0x03030303) + (d & 0x03030303) +
+			0x02020202;
+	uint32_t hi =
+			((a >> 2) & 0x3f3f3f3f) + ((b >> 2) & 0x3f3f3f3f) +
+			((c >> 2) & 0x3f3f3f3f) + ((d >> 2) & 0x3f3f3f3f);
+	return hi + ((lo >> 2) & 0x03030303);
 }
 
-void plm_video_set_time(plm_video_t *self, double time)
-{
-// printf("plm_video_set_time\n");
-	self->frames_decoded = self->framerate * time;
-	self->time = time;
-}
+PLM_DEFINE_MB_PREDICT(plm_video_predict_swar, 4, plm_swar_load, plm_swar_store, plm_swar_avg, plm_swar_avg4)
 
-void plm_video_rewind(plm_video_t *self)
-{
-// printf("plm_video_rewind\n");
-	plm_buffer_rewind(self->buffer);
-	self->time = 0;
-	self->frames_decoded = 0;
-	self->has_reference_frame = FALSE;
-	self->start_code = -1;
-}
+#endif
 
-int plm_video_has_ended(plm_video_t *self)
-{
-// printf("plm_video_has_ended\n");
-	return plm_buffer_has_ended(self->buffer);
-}
+#undef PLM_DEFINE_MB_PREDICT
+#undef PLM_MB_CASE
 
-plm_frame_t *plm_video_decode(plm_video_t *self)
+void plm_video_process_macroblock(
+		plm_video_t *self, uint8_t *s, uint8_t *d,
+		int motion_h, int motion_v, int block_size, int interpolate)
 {
-// printf("plm_video_decode\n");
-	if (!plm_video_has_header(self))
+// printf("plm_video_process_macroblock\n");
+	int dw = self->mb_width * block_size;
+
+	int hp = motion_h >> 1;
+	int vp = motion_v >> 1;
+	int odd_h = (motion_h & 1) == 1;
+	int odd_v = (motion_v & 1) == 1;
+
+	unsigned int si = ((self->mb_row * block_size) + vp) * dw + (self->mb_col * block_size) + hp;
+	unsigned int di = (self->mb_row * dw + self->mb_col) * block_size;
+
+	unsigned int max_address = (dw * (self->mb_height * block_size - block_size + 1) - block_size);
+	if (si > max_address || di > max_address)
 	{
-		return NULL;
+		return; // corrupt video
 	}
 
-	plm_frame_t *frame = NULL;
-	do
+	int mode = (interpolate << 2) | (odd_h << 1) | (odd_v);
+#if defined(__SSE2__)
+	if (block_size == 16)
 	{
-		if (self->start_code != PLM_START_PICTURE)
-		{
-			self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_PICTURE);
+		plm_video_predict_sse2_16(s + si, d + di, dw, block_size, mode);
+	}
+	else if (block_size == 8)
+	{
+		plm_video_predict_sse2_8(s + si, d + di, dw, block_size, mode);
+	}
+#else
+	if (block_size >= 4)
+	{
+		plm_video_predict_swar(s + si, d + di, dw, block_size, mode);
+	}
+#endif
+	else
+	{
+		plm_video_predict_scalar(s + si, d + di, dw, block_size, mode);
+	}
+}
 
-			if (self->start_code == -1)
-			{
-				// If we reached the end of the file and the previously decoded
-				// frame was a reference frame, we still have to return it.
-				if (
-						self->has_reference_frame &&
-						!self->assume_no_b_frames &&
-						plm_buffer_has_ended(self->buffer) && (self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA || self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE))
-				{
-					self->has_reference_frame = FALSE;
-					frame = &self->frame_backward;
-					break;
-				}
+void plm_video_decode_block(plm_video_t *self, int block)
+{
+// printf("plm_video_decode_block\n");
 
-				return NULL;
-			}
-		}
+	int n = 0;
+	int rows = 0; // Bit mask of the rows holding nonzero coefficients
+	int cols = 0; // and of the columns
+	int *quant_table;
+	const uint8_t *premultiplier = self->premultiplier_matrix;
 
-		// Make sure we have a full picture in the buffer before attempting to
-		// decode it. Sadly, this can only be done by seeking for the start code
-		// of the next picture. Also, if we didn't find the start code for the
-		// next picture, but the source has ended, we assume that this last
-		// picture is in the buffer.
-		if (
-				plm_buffer_has_start_code(self->buffer, PLM_START_PICTURE) == -1 &&
-				!plm_buffer_has_ended(self->buffer))
-		{
-			return NULL;
-		}
-		plm_buffer_discard_read_bytes(self->buffer);
+	// Decode DC coefficient of intra-coded blocks
+	if (self->macroblock_intra)
+	{
+		int predictor;
+		int dct_size;
 
-		plm_video_decode_picture(self);
+		// DC prediction
+		int plane_index = block > 3 ? block - 3 : 0;
+		predictor = self->dc_predictor[plane_index];
+		dct_size = plm_buffer_read_vlc_lookup(self->buffer, self->dct_size_lookup[plane_index ? 1 : 0]);
 
-		if (self->assume_no_b_frames)
-		{
-			frame = &self->frame_backward;
-		}
-		else if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
-		{
-			frame = &self->frame_current;
-		}
-		else if (self->has_reference_frame)
+		// Read DC coeff
+		if (dct_size > 0)
 		{
-			frame = &self->frame_forward;
+			int differential = plm_buffer_read(self->buffer, dct_size);
+			if ((differential & (1 << (dct_size - 1))) != 0)
+			{
+				self->block_data[0] = predictor + differential;
+			}
+			else
+			{
+				self->block_data[0] = predictor + (-(1 << dct_size) | (differential + 1));
+			}
 		}
 		else
 		{
-			self->has_reference_frame = TRUE;
+			self->block_data[0] = predictor;
 		}
-	} while (!frame);
-
-	frame->time = self->time;
-	self->frames_decoded++;
-	self->time = (double)self->frames_decoded / self->framerate;
 
-	return frame;
-}
+		// Save predictor value
+		self->dc_predictor[plane_index] = self->block_data[0];
 
-int plm_video_has_header(plm_video_t *self)
-{
-// printf("plm_video_has_header\n");
-	if (self->has_sequence_header)
-	{
-		return TRUE;
-	}
+		// Dequantize + premultiply
+		self->block_data[0] *= 8 * premultiplier[0];
 
-	if (self->start_code != PLM_START_SEQUENCE)
-	{
-		self->start_code = plm_buffer_find_start_code(self->buffer, PLM_START_SEQUENCE);
+		quant_table = self->intra_quant_table;
+		n = 1;
+		rows = 1;
+		cols = 1;
 	}
-	if (self->start_code == -1)
+	else
 	{
-		return FALSE;
+		quant_table = self->non_intra_quant_table;
 	}
 
-	if (!plm_video_decode_sequence_header(self))
+	// Decode AC coefficients (+DC for non-intra)
+	plm_buffer_t *buffer = self->buffer;
+	while (TRUE)
 	{
-		return FALSE;
-	}
+		int run;
+		int level;
 
-	return TRUE;
-}
+		// Short codes resolve run, level, sign and end_of_block with a single
+		// peek; everything else takes the general path.
+		plm_video_dct_coeff_t coeff = {0, 0, 0};
+		if (n > 0 && plm_buffer_fill_cache(buffer, PLM_VIDEO_DCT_COEFF_LOOKUP_BITS))
+		{
+			coeff = self->dct_coeff_fast[plm_buffer_peek(buffer, PLM_VIDEO_DCT_COEFF_LOOKUP_BITS)];
+		}
 
-int plm_video_decode_sequence_header(plm_video_t *self)
-{
-// printf("plm_video_decode_sequence_header\n");
-	int max_header_size = 64 + 2 * 64 * 8; // 64 bit header + 2x 64 byte matrix
-	if (!plm_buffer_has(self->buffer, max_header_size))
-	{
-		return FALSE;
-	}
+		if (coeff.length)
+		{
+			buffer->bit_index += coeff.length;
+			if (coeff.level == 0)
+			{
+				// end_of_block
+				break;
+			}
+			run = coeff.run;
+			level = coeff.level;
+		}
+		else if (!plm_video_decode_dct_coeff(self, n, &run, &level))
+		{
+			// end_of_block
+			break;
+		}
 
-	self->width = plm_buffer_read(self->buffer, 12);
-	self->height = plm_buffer_read(self->buffer, 12);
+		n += run;
+		if (n < 0 || n >= 64)
+		{
+			return; // invalid
+		}
 
-	if (self->width <= 0 || self->height <= 0)
-	{
-		return FALSE;
-	}
+		int de_zig_zagged = PLM_VIDEO_ZIG_ZAG[n];
+		int quant = quant_table[n];
+		n++;
+		rows |= 1 << (de_zig_zagged >> 3);
+		cols |= 1 << (de_zig_zagged & 7);
 
-	// Skip pixel aspect ratio
-	plm_buffer_skip(self->buffer, 4);
+		// Dequantize, oddify, clip
+		level <<= 1;
+		if (!self->macroblock_intra)
+		{
+			level += (level < 0 ? -1 : 1);
+		}
+		level = (level * quant) >> 4;
+		if ((level & 1) == 0)
+		{
+			level -= level > 0 ? 1 : -1;
+		}
+		if (level > 2047)
+		{
+			level = 2047;
+		}
+		else if (level < -2048)
+		{
+			level = -2048;
+		}
+
+		// Save premultiplied coefficient
+		self->block_data[de_zig_zagged] = level * premultiplier[de_zig_zagged];
+	}
 
-	self->framerate = PLM_VIDEO_PICTURE_RATE[plm_buffer_read(self->buffer, 4)];
+	// Blocks outside the window, and chroma in grayscale mode, are only parsed
+	if (self->macroblock_hidden || (block >= 4 && self->grayscale))
+	{
+		memset(self->block_data, 0, sizeof(self->block_data));
+		return;
+	}
 
-	// Skip bit_rate, marker, buffer_size and constrained bit
-	plm_buffer_skip(self->buffer, 18 + 1 + 10 + 1);
+	// Move block to its place
+	uint8_t *d;
+	int dw;
+	int di;
+	int shift = self->scale_shift;
+	int size = 8 >> shift;
 
-	// Load custom intra quant matrix?
-	if (plm_buffer_read(self->buffer, 1))
+	if (block < 4)
 	{
-		for (int i = 0; i < 64; i++)
+		d = self->frame_current.y.data;
+		dw = self->luma_width;
+		di = (self->mb_row * self->luma_width + self->mb_col) << (4 - shift);
+		if ((block & 1) != 0)
 		{
-			int idx = PLM_VIDEO_ZIG_ZAG[i];
-			self->intra_quant_matrix[idx] = plm_buffer_read(self->buffer, 8);
+			di += size;
+		}
+		if ((block & 2) != 0)
+		{
+			di += self->luma_width << (3 - shift);
 		}
 	}
 	else
 	{
-		memcpy(self->intra_quant_matrix, PLM_VIDEO_INTRA_QUANT_MATRIX, 64);
+		d = (block == 4) ? self->frame_current.cb.data : self->frame_current.cr.data;
+		dw = self->chroma_width;
+		di = (self->mb_row * self->chroma_width + self->mb_col) << (3 - shift);
 	}
 
-	// Load custom non intra quant matrix?
-	if (plm_buffer_read(self->buffer, 1))
+	// Use the smallest transform that covers the nonzero coefficients. The
+	// reduced ones write to a separate buffer, so only the coefficients that
+	// were set have to be cleared again.
+	int *s = self->block_data;
+	int si = 0;
+	int intra = self->macroblock_intra;
+	int out[64];
+	if (shift)
 	{
-		for (int i = 0; i < 64; i++)
+		// Downscaled: the size x size transform of the top left coefficients,
+		// which are not premultiplied. The DC alone gives the block average.
+		if (n == 1 || shift == 3)
 		{
-			int idx = PLM_VIDEO_ZIG_ZAG[i];
-			self->non_intra_quant_matrix[idx] = plm_buffer_read(self->buffer, 8);
+			int value = (s[0] + 4) >> 3;
+			PLM_BLOCK_PUT(intra, d, di, dw, si, size, value);
 		}
+		else if (shift == 2)
+		{
+			plm_video_idct_scaled_2(s, out);
+			PLM_BLOCK_PUT(intra, d, di, dw, si, 2, out[si]);
+		}
+		else
+		{
+			plm_video_idct_scaled_4(s, out);
+			PLM_BLOCK_PUT(intra, d, di, dw, si, 4, out[si]);
+		}
+		memset(self->block_data, 0, sizeof(self->block_data));
 	}
-	else
+	else if (n == 1)
 	{
-		memcpy(self->non_intra_quant_matrix, PLM_VIDEO_NON_INTRA_QUANT_MATRIX, 64);
+		// DC only
+		int value = (s[0] + 128) >> 8;
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, value);
+		s[0] = 0;
 	}
-
-	self->mb_width = (self->width + 15) >> 4;
-	self->mb_height = (self->height + 15) >> 4;
-	self->mb_size = self->mb_width * self->mb_height;
-
-	self->luma_width = self->mb_width << 4;
-	self->luma_height = self->mb_height << 4;
-
-	self->chroma_width = self->mb_width << 3;
-	self->chroma_height = self->mb_height << 3;
-
-	// Allocate one big chunk of data for all 3 frames = 9 planes
-	uint32_t luma_plane_size = self->luma_width * self->luma_height;
-	uint32_t chroma_plane_size = self->chroma_width * self->chroma_height;
-	uint32_t frame_data_size = (luma_plane_size + 2 * chroma_plane_size);
-
-	self->frames_data = (uint8_t *)PLM_MALLOC(frame_data_size * 3);
-	plm_video_init_frame(self, &self->frame_current, self->frames_data + frame_data_size * 0);
-	plm_video_init_frame(self, &self->frame_forward, self->frames_data + frame_data_size * 1);
-	plm_video_init_frame(self, &self->frame_backward, self->frames_data + frame_data_size * 2);
-
-	self->has_sequence_header = TRUE;
-	return TRUE;
-}
-
-void plm_video_init_frame(plm_video_t *self, plm_frame_t *frame, uint8_t *base)
-{
-// printf("plm_video_init_frame\n");
-	uint32_t luma_plane_size = self->luma_width * self->luma_height;
-	uint32_t chroma_plane_size = self->chroma_width * self->chroma_height;
-
-	frame->width = self->width;
-	frame->height = self->height;
-	frame->y.width = self->luma_width;
-	frame->y.height = self->luma_height;
-	frame->y.data = base;
-
-	frame->cr.width = self->chroma_width;
-	frame->cr.height = self->chroma_height;
-	frame->cr.data = base + luma_plane_size;
-
-	frame->cb.width = self->chroma_width;
-	frame->cb.height = self->chroma_height;
-	frame->cb.data = base + luma_plane_size + chroma_plane_size;
-}
-
-void plm_video_decode_picture(plm_video_t *self)
-{
-// printf("plm_video_decode_picture\n");
-	plm_buffer_skip(self->buffer, 10); // skip temporalReference
-	self->picture_type = plm_buffer_read(self->buffer, 3);
-	plm_buffer_skip(self->buffer, 16); // skip vbv_delay
-
-	// D frames or unknown coding type
-	if (self->picture_type <= 0 || self->picture_type > PLM_VIDEO_PICTURE_TYPE_B)
+	else if (rows == 1)
 	{
-		return;
+		// First row only; all rows of the result are the same
+		plm_video_idct_row(s, out);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, out[si & 7]);
+		memset(s, 0, 8 * sizeof(int));
 	}
-
-	// Forward full_px, f_code
-	if (
-			self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE ||
-			self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	else if (cols == 1)
 	{
-		self->motion_forward.full_px = plm_buffer_read(self->buffer, 1);
-		int f_code = plm_buffer_read(self->buffer, 3);
-		if (f_code == 0)
+		// First column only; each row of the result is flat
+		plm_video_idct_column(s, out);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, out[si >> 3]);
+		for (int i = 0; i < 64; i += 8)
 		{
-			// Ignore picture with zero f_code
-			return;
+			s[i] = 0;
 		}
-		self->motion_forward.r_size = f_code - 1;
 	}
-
-	// Backward full_px, f_code
-	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
+	else if (PLM_VIDEO_IDCT_4X4 && (rows | cols) < 16)
 	{
-		self->motion_backward.full_px = plm_buffer_read(self->buffer, 1);
-		int f_code = plm_buffer_read(self->buffer, 3);
-		if (f_code == 0)
+		// Top left 4x4 only
+		plm_video_idct_4x4(s, out);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, out[si]);
+		for (int i = 0; i < 32; i += 8)
 		{
-			// Ignore picture with zero f_code
-			return;
+			memset(s + i, 0, 4 * sizeof(int));
 		}
-		self->motion_backward.r_size = f_code - 1;
 	}
-
-	plm_frame_t frame_temp = self->frame_forward;
-	if (
-			self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA ||
-			self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+	else
 	{
-		self->frame_forward = self->frame_backward;
+		plm_video_idct(s);
+		PLM_BLOCK_PUT(intra, d, di, dw, si, 8, s[si]);
+		memset(self->block_data, 0, sizeof(self->block_data));
 	}
+}
 
-	// Find first slice start code; skip extension and user data
-	do
-	{
-		self->start_code = plm_buffer_next_start_code(self->buffer);
-	} while (
-			self->start_code == PLM_START_EXTENSION ||
-			self->start_code == PLM_START_USER_DATA);
-
-	// Decode all slices
-	while (PLM_START_IS_SLICE(self->start_code))
+void plm_video_init_quant_tables(plm_video_t *self)
+{
+// printf("plm_video_init_quant_tables\n");
+	for (int i = 0; i < 64; i++)
 	{
-		plm_video_decode_slice(self, self->start_code & 0x000000FF);
-		if (self->macroblock_address >= self->mb_size - 2)
-		{
-			break;
-		}
-		self->start_code = plm_buffer_next_start_code(self->buffer);
+		int idx = PLM_VIDEO_ZIG_ZAG[i];
+		self->intra_quant_table[i] = self->quantizer_scale * self->intra_quant_matrix[idx];
+		self->non_intra_quant_table[i] = self->quantizer_scale * self->non_intra_quant_matrix[idx];
 	}
+}
 
-	// If this is a reference picture rotate the prediction pointers
-	if (
-			self->picture_type == PLM_VIDEO_PICTURE_TYPE_INTRA ||
-			self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+void plm_video_set_quantizer_scale(plm_video_t *self, int quantizer_scale)
+{
+// printf("plm_video_set_quantizer_scale\n");
+	// Slices mostly repeat the scale of the previous one
+	if (quantizer_scale != self->quantizer_scale)
 	{
-		self->frame_backward = self->frame_current;
-		self->frame_current = frame_temp;
+		self->quantizer_scale = quantizer_scale;
+		plm_video_init_quant_tables(self);
 	}
 }
 
-void plm_video_decode_slice(plm_video_t *self, int slice)
+void plm_video_init_dct_coeff_fast(plm_video_t *self)
 {
-// printf("plm_video_decode_slice\n");
-	self->slice_begin = TRUE;
-	self->macroblock_address = (slice - 1) * self->mb_width - 1;
+	const int bits = PLM_VIDEO_DCT_COEFF_LOOKUP_BITS;
+	const plm_vlc_t *table = (const plm_vlc_t *)PLM_VIDEO_DCT_COEFF;
 
-	// Reset motion vectors and DC predictors
-	self->motion_backward.h = self->motion_forward.h = 0;
-	self->motion_backward.v = self->motion_forward.v = 0;
-	self->dc_predictor[0] = 128;
-	self->dc_predictor[1] = 128;
-	self->dc_predictor[2] = 128;
+	for (uint32_t i = 0; i < (1u << bits); i++)
+	{
+		int index = 0;
+		plm_vlc_lookup_entry_t entry = plm_vlc_walk(table, &index, i, bits);
+		uint16_t value = (uint16_t)entry.value;
+		plm_video_dct_coeff_t coeff = {0, 0, 0};
 
-	self->quantizer_scale = plm_buffer_read(self->buffer, 5);
+		if (entry.length == 1 && value == 0x0001)
+		{
+			// "10" is end_of_block, "11s" is run 0, level 1
+			if (((i >> (bits - 2)) & 1) == 0)
+			{
+				coeff.length = 2;
+			}
+			else
+			{
+				coeff.level = ((i >> (bits - 3)) & 1) ? -1 : 1;
+				coeff.length = 3;
+			}
+		}
+		else if (entry.length != 0 && value != 0xffff && entry.length < bits)
+		{
+			int level = value & 0xff;
+			coeff.run = value >> 8;
+			coeff.level = ((i >> (bits - entry.length - 1)) & 1) ? -level : level;
+			coeff.length = entry.length + 1;
+		}
 
-	// Skip extra
-	while (plm_buffer_read(self->buffer, 1))
-	{
-		plm_buffer_skip(self->buffer, 8);
+		self->dct_coeff_fast[i] = coeff;
 	}
-
-	do
-	{
-		plm_video_decode_macroblock(self);
-	} while (
-			self->macroblock_address < self->mb_size - 1 &&
-			plm_buffer_peek_non_zero(self->buffer, 23));
 }
 
-void plm_video_decode_macroblock(plm_video_t *self)
+int plm_video_decode_dct_coeff(plm_video_t *self, int n, int *run, int *level)
 {
-// printf("plm_video_decode_macroblock\n");
-	// Decode increment
-	int increment = 0;
-	int t = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+	// General dct_coeff decoding, including escapes. Returns FALSE on
+	// end_of_block.
+	uint16_t coeff = (uint16_t)plm_buffer_read_vlc_lookup(self->buffer, self->dct_coeff_lookup);
 
-	while (t == 34)
-	{
-		// macroblock_stuffing
-		t = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
-	}
-	while (t == 35)
+	if ((coeff == 0x0001) && (n > 0) && (plm_buffer_read(self->buffer, 1) == 0))
 	{
-		// macroblock_escape
-		increment += 33;
-		t = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MACROBLOCK_ADDRESS_INCREMENT);
+		// end_of_block
+		return FALSE;
 	}
-	increment += t;
-
-	// Process any skipped macroblocks
-	if (self->slice_begin)
+	if (coeff == 0xffff)
 	{
-		// The first increment of each slice is relative to beginning of the
-		// previous row, not the previous macroblock
-		self->slice_begin = FALSE;
-		self->macroblock_address += increment;
+		// escape
+		*run = plm_buffer_read(self->buffer, 6);
+		*level = plm_buffer_read(self->buffer, 8);
+		if (*level == 0)
+		{
+			*level = plm_buffer_read(self->buffer, 8);
+		}
+		else if (*level == 128)
+		{
+			*level = plm_buffer_read(self->buffer, 8) - 256;
+		}
+		else if (*level > 128)
+		{
+			*level = *level - 256;
+		}
 	}
 	else
 	{
-		if (self->macroblock_address + increment >= self->mb_size)
+		*run = coeff >> 8;
+		*level = coeff & 0xff;
+		if (plm_buffer_read(self->buffer, 1))
 		{
-			return; // invalid
+			*level = -*level;
 		}
-		if (increment > 1)
-		{
-			// Skipped macroblocks reset DC predictors
-			self->dc_predictor[0] = 128;
-			self->dc_predictor[1] = 128;
-			self->dc_predictor[2] = 128;
+	}
+	return TRUE;
+}
 
-			// Skipped macroblocks in P-pictures reset motion vectors
-			if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
-			{
-				self->motion_forward.h = 0;
-				self->motion_forward.v = 0;
-			}
-		}
+#if PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2 || PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2
+
+// One pass of the scalar transform below on vectors of 32-bit lanes: v[k] holds
+// coefficient k of as many rows or columns as the vector has lanes. MUL
+// multiplies by a constant, SRAI is an arithmetic shift right. The operations
+// are the same as in the scalar code, so the results are bit-exact.
+#define PLM_DEFINE_IDCT_PASS(NAME, TYPE, ADD, SUB, MUL, SRAI, SET1) \
+	static inline void NAME(TYPE *v) \
+	{ \
+		TYPE round = SET1(128); \
+		TYPE b1 = v[4]; \
+		TYPE b3 = ADD(v[2], v[6]); \
+		TYPE b4 = SUB(v[5], v[3]); \
+		TYPE tmp1 = ADD(v[1], v[7]); \
+		TYPE tmp2 = ADD(v[3], v[5]); \
+		TYPE b6 = SUB(v[1], v[7]); \
+		TYPE b7 = ADD(tmp1, tmp2); \
+		TYPE m0 = v[0]; \
+		TYPE x4 = SUB(SRAI(ADD(SUB(MUL(b6, 473), MUL(b4, 196)), round), 8), b7); \
+		TYPE x0 = SUB(x4, SRAI(ADD(MUL(SUB(tmp1, tmp2), 362), round), 8)); \
+		TYPE x1 = SUB(m0, b1); \
+		TYPE x2 = SUB(SRAI(ADD(MUL(SUB(v[2], v[6]), 362), round), 8), b3); \
+		TYPE x3 = ADD(m0, b1); \
+		TYPE y3 = ADD(x1, x2); \
+		TYPE y4 = ADD(x3, b3); \
+		TYPE y5 = SUB(x1, x2); \
+		TYPE y6 = SUB(x3, b3); \
+		TYPE y7 = SUB(SUB(SET1(0), x0), SRAI(ADD(ADD(MUL(b4, 473), MUL(b6, 196)), round), 8)); \
+		v[0] = ADD(b7, y4); \
+		v[1] = ADD(x4, y3); \
+		v[2] = SUB(y5, x0); \
+		v[3] = SUB(y6, y7); \
+		v[4] = ADD(y6, y7); \
+		v[5] = ADD(x0, y5); \
+		v[6] = SUB(y3, x4); \
+		v[7] = SUB(y4, b7); \
+	}
+
+#endif
+
+#if PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_AVX2
+
+#define PLM_MM256_MUL(A, C) _mm256_mullo_epi32(A, _mm256_set1_epi32(C))
+
+PLM_DEFINE_IDCT_PASS(plm_video_idct_pass_avx2, __m256i, _mm256_add_epi32, _mm256_sub_epi32, PLM_MM256_MUL, _mm256_srai_epi32, _mm256_set1_epi32)
+
+static inline void plm_video_idct_transpose_avx2(__m256i *v)
+{
+	__m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+	__m256i s0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i s1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i s2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i s3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i s4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i s5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i s6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i s7 = _mm256_unpackhi_epi64(t5, t7);
+	v[0] = _mm256_permute2x128_si256(s0, s4, 0x20);
+	v[1] = _mm256_permute2x128_si256(s1, s5, 0x20);
+	v[2] = _mm256_permute2x128_si256(s2, s6, 0x20);
+	v[3] = _mm256_permute2x128_si256(s3, s7, 0x20);
+	v[4] = _mm256_permute2x128_si256(s0, s4, 0x31);
+	v[5] = _mm256_permute2x128_si256(s1, s5, 0x31);
+	v[6] = _mm256_permute2x128_si256(s2, s6, 0x31);
+	v[7] = _mm256_permute2x128_si256(s3, s7, 0x31);
+}
 
-		// Predict skipped macroblocks
-		while (increment > 1)
-		{
-			self->macroblock_address++;
-			self->mb_row = self->macroblock_address / self->mb_width;
-			self->mb_col = self->macroblock_address % self->mb_width;
+void plm_video_idct(int *block)
+{
+// printf("plm_video_idct\n");
+	// Spelled out, as the loops are not unrolled at -O2 and keep v[] on the stack
+	__m256i v[8];
+	v[0] = _mm256_loadu_si256((__m256i *)(block + 0 * 8));
+	v[1] = _mm256_loadu_si256((__m256i *)(block + 1 * 8));
+	v[2] = _mm256_loadu_si256((__m256i *)(block + 2 * 8));
+	v[3] = _mm256_loadu_si256((__m256i *)(block + 3 * 8));
+	v[4] = _mm256_loadu_si256((__m256i *)(block + 4 * 8));
+	v[5] = _mm256_loadu_si256((__m256i *)(block + 5 * 8));
+	v[6] = _mm256_loadu_si256((__m256i *)(block + 6 * 8));
+	v[7] = _mm256_loadu_si256((__m256i *)(block + 7 * 8));
+
+	// Transform columns, with one row per vector
+	plm_video_idct_pass_avx2(v);
 
-			plm_video_predict_macroblock(self);
-			increment--;
-		}
-		self->macroblock_address++;
-	}
+	// Transform rows
+	plm_video_idct_transpose_avx2(v);
+	plm_video_idct_pass_avx2(v);
+	__m256i round = _mm256_set1_epi32(128);
+	v[0] = _mm256_srai_epi32(_mm256_add_epi32(v[0], round), 8);
+	v[1] = _mm256_srai_epi32(_mm256_add_epi32(v[1], round), 8);
+	v[2] = _mm256_srai_epi32(_mm256_add_epi32(v[2], round), 8);
+	v[3] = _mm256_srai_epi32(_mm256_add_epi32(v[3], round), 8);
+	v[4] = _mm256_srai_epi32(_mm256_add_epi32(v[4], round), 8);
+	v[5] = _mm256_srai_epi32(_mm256_add_epi32(v[5], round), 8);
+	v[6] = _mm256_srai_epi32(_mm256_add_epi32(v[6], round), 8);
+	v[7] = _mm256_srai_epi32(_mm256_add_epi32(v[7], round), 8);
+	plm_video_idct_transpose_avx2(v);
+
+	_mm256_storeu_si256((__m256i *)(block + 0 * 8), v[0]);
+	_mm256_storeu_si256((__m256i *)(block + 1 * 8), v[1]);
+	_mm256_storeu_si256((__m256i *)(block + 2 * 8), v[2]);
+	_mm256_storeu_si256((__m256i *)(block + 3 * 8), v[3]);
+	_mm256_storeu_si256((__m256i *)(block + 4 * 8), v[4]);
+	_mm256_storeu_si256((__m256i *)(block + 5 * 8), v[5]);
+	_mm256_storeu_si256((__m256i *)(block + 6 * 8), v[6]);
+	_mm256_storeu_si256((__m256i *)(block + 7 * 8), v[7]);
+}
 
-	self->mb_row = self->macroblock_address / self->mb_width;
-	self->mb_col = self->macroblock_address % self->mb_width;
+#elif PLM_VIDEO_IDCT == PLM_VIDEO_IDCT_SSE2
 
-	if (self->mb_col >= self->mb_width || self->mb_row >= self->mb_height)
-	{
-		return; // corrupt stream;
-	}
+static inline __m128i plm_mm_mullo_epi32(__m128i a, __m128i b)
+{
+#if defined(__SSE4_1__)
+	return _mm_mullo_epi32(a, b);
+#else
+	// The low 32 bits of the unsigned and signed products are the same
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+}
+
+#define PLM_MM_MUL(A, C) plm_mm_mullo_epi32(A, _mm_set1_epi32(C))
+
+PLM_DEFINE_IDCT_PASS(plm_video_idct_pass_sse2, __m128i, _mm_add_epi32, _mm_sub_epi32, PLM_MM_MUL, _mm_srai_epi32, _mm_set1_epi32)
+
+static inline void plm_video_idct_transpose_4x4_sse2(__m128i *v)
+{
+	__m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+	__m128i t1 = _mm_unpacklo_epi32(v[2], v[3]);
+	__m128i t2 = _mm_unpackhi_epi32(v[0], v[1]);
+	__m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+	v[0] = _mm_unpacklo_epi64(t0, t1);
+	v[1] = _mm_unpackhi_epi64(t0, t1);
+	v[2] = _mm_unpacklo_epi64(t2, t3);
+	v[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+static inline void plm_video_idct_transpose_sse2(__m128i *left, __m128i *right)
+{
+	// Transpose the four 4x4 quadrants, then swap the off-diagonal ones
+	plm_video_idct_transpose_4x4_sse2(left);
+	plm_video_idct_transpose_4x4_sse2(left + 4);
+	plm_video_idct_transpose_4x4_sse2(right);
+	plm_video_idct_transpose_4x4_sse2(right + 4);
+	__m128i t0 = right[0], t1 = right[1], t2 = right[2], t3 = right[3];
+	right[0] = left[4];
+	right[1] = left[5];
+	right[2] = left[6];
+	right[3] = left[7];
+	left[4] = t0;
+	left[5] = t1;
+	left[6] = t2;
+	left[7] = t3;
+}
+
+void plm_video_idct(int *block)
+{
+// printf("plm_video_idct\n");
+	// Columns 0-3 and 4-7 of each row
+	__m128i left[8], right[8];
+	left[0] = _mm_loadu_si128((__m128i *)(block + 0 * 8));
+	right[0] = _mm_loadu_si128((__m128i *)(block + 0 * 8 + 4));
+	left[1] = _mm_loadu_si128((__m128i *)(block + 1 * 8));
+	right[1] = _mm_loadu_si128((__m128i *)(block + 1 * 8 + 4));
+	left[2] = _mm_loadu_si128((__m128i *)(block + 2 * 8));
+	right[2] = _mm_loadu_si128((__m128i *)(block + 2 * 8 + 4));
+	left[3] = _mm_loadu_si128((__m128i *)(block + 3 * 8));
+	right[3] = _mm_loadu_si128((__m128i *)(block + 3 * 8 + 4));
+	left[4] = _mm_loadu_si128((__m128i *)(block + 4 * 8));
+	right[4] = _mm_loadu_si128((__m128i *)(block + 4 * 8 + 4));
+	left[5] = _mm_loadu_si128((__m128i *)(block + 5 * 8));
+	right[5] = _mm_loadu_si128((__m128i *)(block + 5 * 8 + 4));
+	left[6] = _mm_loadu_si128((__m128i *)(block + 6 * 8));
+	right[6] = _mm_loadu_si128((__m128i *)(block + 6 * 8 + 4));
+	left[7] = _mm_loadu_si128((__m128i *)(block + 7 * 8));
+	right[7] = _mm_loadu_si128((__m128i *)(block + 7 * 8 + 4));
+
+	// Transform columns
+	plm_video_idct_pass_sse2(left);
+	plm_video_idct_pass_sse2(right);
+
+	// Transform rows
+	plm_video_idct_transpose_sse2(left, right);
+	plm_video_idct_pass_sse2(left);
+	plm_video_idct_pass_sse2(right);
+	__m128i round = _mm_set1_epi32(128);
+	left[0] = _mm_srai_epi32(_mm_add_epi32(left[0], round), 8);
+	right[0] = _mm_srai_epi32(_mm_add_epi32(right[0], round), 8);
+	left[1] = _mm_srai_epi32(_mm_add_epi32(left[1], round), 8);
+	right[1] = _mm_srai_epi32(_mm_add_epi32(right[1], round), 8);
+	left[2] = _mm_srai_epi32(_mm_add_epi32(left[2], round), 8);
+	right[2] = _mm_srai_epi32(_mm_add_epi32(right[2], round), 8);
+	left[3] = _mm_srai_epi32(_mm_add_epi32(left[3], round), 8);
+	right[3] = _mm_srai_epi32(_mm_add_epi32(right[3], round), 8);
+	left[4] = _mm_srai_epi32(_mm_add_epi32(left[4], round), 8);
+	right[4] = _mm_srai_epi32(_mm_add_epi32(right[4], round), 8);
+	left[5] = _mm_srai_epi32(_mm_add_epi32(left[5], round), 8);
+	right[5] = _mm_srai_epi32(_mm_add_epi32(right[5], round), 8);
+	left[6] = _mm_srai_epi32(_mm_add_epi32(left[6], round), 8);
+	right[6] = _mm_srai_epi32(_mm_add_epi32(right[6], round), 8);
+	left[7] = _mm_srai_epi32(_mm_add_epi32(left[7], round), 8);
+	right[7] = _mm_srai_epi32(_mm_add_epi32(right[7], round), 8);
+	plm_video_idct_transpose_sse2(left, right);
+
+	_mm_storeu_si128((__m128i *)(block + 0 * 8), left[0]);
+	_mm_storeu_si128((__m128i *)(block + 0 * 8 + 4), right[0]);
+	_mm_storeu_si128((__m128i *)(block + 1 * 8), left[1]);
+	_mm_storeu_si128((__m128i *)(block + 1 * 8 + 4), right[1]);
+	_mm_storeu_si128((__m128i *)(block + 2 * 8), left[2]);
+	_mm_storeu_si128((__m128i *)(block + 2 * 8 + 4), right[2]);
+	_mm_storeu_si128((__m128i *)(block + 3 * 8), left[3]);
+	_mm_storeu_si128((__m128i *)(block + 3 * 8 + 4), right[3]);
+	_mm_storeu_si128((__m128i *)(block + 4 * 8), left[4]);
+	_mm_storeu_si128((__m128i *)(block + 4 * 8 + 4), right[4]);
+	_mm_storeu_si128((__m128i *)(block + 5 * 8), left[5]);
+	_mm_storeu_si128((__m128i *)(block + 5 * 8 + 4), right[5]);
+	_mm_storeu_si128((__m128i *)(block + 6 * 8), left[6]);
+	_mm_storeu_si128((__m128i *)(block + 6 * 8 + 4), right[6]);
+	_mm_storeu_si128((__m128i *)(block + 7 * 8), left[7]);
+	_mm_storeu_si128((__m128i *)(block + 7 * 8 + 4), right[7]);
+}
 
-	// Process the current macroblock
-	const plm_vlc_t *table = PLM_VIDEO_MACROBLOCK_TYPE[self->picture_type];
-	self->macroblock_type = plm_buffer_read_vlc(self->buffer, table);
+#else
 
-	self->macroblock_intra = (self->macroblock_type & 0x01);
-	self->motion_forward.is_set = (self->macroblock_type & 0x08);
-	self->motion_backward.is_set = (self->macroblock_type & 0x04);
+void plm_video_idct(int *block)
+{
+// printf("plm_video_idct\n");
+	int
+			b1,
+			b3, b4, b6, b7, tmp1, tmp2, m0,
+			x0, x1, x2, x3, x4, y3, y4, y5, y6, y7;
 
-	// Quantizer scale
-	if ((self->macroblock_type & 0x10) != 0)
+	// Transform columns
+	for (int i = 0; i < 8; ++i)
 	{
-		self->quantizer_scale = plm_buffer_read(self->buffer, 5);
+		b1 = block[4 * 8 + i];
+		b3 = block[2 * 8 + i] + block[6 * 8 + i];
+		b4 = block[5 * 8 + i] - block[3 * 8 + i];
+		tmp1 = block[1 * 8 + i] + block[7 * 8 + i];
+		tmp2 = block[3 * 8 + i] + block[5 * 8 + i];
+		b6 = block[1 * 8 + i] - block[7 * 8 + i];
+		b7 = tmp1 + tmp2;
+		m0 = block[0 * 8 + i];
+		x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
+		x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
+		x1 = m0 - b1;
+		x2 = (((block[2 * 8 + i] - block[6 * 8 + i]) * 362 + 128) >> 8) - b3;
+		x3 = m0 + b1;
+		y3 = x1 + x2;
+		y4 = x3 + b3;
+		y5 = x1 - x2;
+		y6 = x3 - b3;
+		y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
+		block[0 * 8 + i] = b7 + y4;
+		block[1 * 8 + i] = x4 + y3;
+		block[2 * 8 + i] = y5 - x0;
+		block[3 * 8 + i] = y6 - y7;
+		block[4 * 8 + i] = y6 + y7;
+		block[5 * 8 + i] = x0 + y5;
+		block[6 * 8 + i] = y3 - x4;
+		block[7 * 8 + i] = y4 - b7;
 	}
 
-	if (self->macroblock_intra)
-	{
-		// Intra-coded macroblocks reset motion vectors
-		self->motion_backward.h = self->motion_forward.h = 0;
-		self->motion_backward.v = self->motion_forward.v = 0;
-	}
-	else
+	// Transform rows
+	for (int i = 0; i < 64; i += 8)
 	{
-		// Non-intra macroblocks reset DC predictors
-		self->dc_predictor[0] = 128;
-		self->dc_predictor[1] = 128;
-		self->dc_predictor[2] = 128;
-
-		plm_video_decode_motion_vectors(self);
-		plm_video_predict_macroblock(self);
+		b1 = block[4 + i];
+		b3 = block[2 + i] + block[6 + i];
+		b4 = block[5 + i] - block[3 + i];
+		tmp1 = block[1 + i] + block[7 + i];
+		tmp2 = block[3 + i] + block[5 + i];
+		b6 = block[1 + i] - block[7 + i];
+		b7 = tmp1 + tmp2;
+		m0 = block[0 + i];
+		x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
+		x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
+		x1 = m0 - b1;
+		x2 = (((block[2 + i] - block[6 + i]) * 362 + 128) >> 8) - b3;
+		x3 = m0 + b1;
+		y3 = x1 + x2;
+		y4 = x3 + b3;
+		y5 = x1 - x2;
+		y6 = x3 - b3;
+		y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
+		block[0 + i] = (b7 + y4 + 128) >> 8;
+		block[1 + i] = (x4 + y3 + 128) >> 8;
+		block[2 + i] = (y5 - x0 + 128) >> 8;
+		block[3 + i] = (y6 - y7 + 128) >> 8;
+		block[4 + i] = (y6 + y7 + 128) >> 8;
+		block[5 + i] = (x0 + y5 + 128) >> 8;
+		block[6 + i] = (y3 - x4 + 128) >> 8;
+		block[7 + i] = (y4 - b7 + 128) >> 8;
 	}
+}
 
-	// Decode blocks
-	int cbp = ((self->macroblock_type & 0x02) != 0)
-								? plm_buffer_read_vlc(self->buffer, PLM_VIDEO_CODE_BLOCK_PATTERN)
-								: (self->macroblock_intra ? 0x3f : 0);
+#endif // PLM_VIDEO_IDCT
 
-	for (int block = 0, mask = 0x20; block < 6; block++)
-	{
-		if ((cbp & mask) != 0)
-		{
-			plm_video_decode_block(self, block);
-		}
-		mask >>= 1;
-	}
+// One pass of the transform in plm_video_idct() on the coefficients v0-v7,
+// written to out[0], out[stride], ... out[7 * stride]. With descale set, the
+// results are rounded off by 8 bits like those of the row pass.
+static inline void plm_video_idct_1d(
+		int v0, int v1, int v2, int v3, int v4, int v5, int v6, int v7,
+		int *out, int stride, int descale)
+{
+	int b1 = v4;
+	int b3 = v2 + v6;
+	int b4 = v5 - v3;
+	int tmp1 = v1 + v7;
+	int tmp2 = v3 + v5;
+	int b6 = v1 - v7;
+	int b7 = tmp1 + tmp2;
+	int m0 = v0;
+	int x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
+	int x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
+	int x1 = m0 - b1;
+	int x2 = (((v2 - v6) * 362 + 128) >> 8) - b3;
+	int x3 = m0 + b1;
+	int y3 = x1 + x2;
+	int y4 = x3 + b3;
+	int y5 = x1 - x2;
+	int y6 = x3 - b3;
+	int y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
+	int round = descale ? 128 : 0;
+	int shift = descale ? 8 : 0;
+	out[0 * stride] = (b7 + y4 + round) >> shift;
+	out[1 * stride] = (x4 + y3 + round) >> shift;
+	out[2 * stride] = (y5 - x0 + round) >> shift;
+	out[3 * stride] = (y6 - y7 + round) >> shift;
+	out[4 * stride] = (y6 + y7 + round) >> shift;
+	out[5 * stride] = (x0 + y5 + round) >> shift;
+	out[6 * stride] = (y3 - x4 + round) >> shift;
+	out[7 * stride] = (y4 - b7 + round) >> shift;
 }
 
-void plm_video_decode_motion_vectors(plm_video_t *self)
-{
-// printf("plm_video_decode_motion_vectors\n");
+// Reduced forms of plm_video_idct() for blocks with all nonzero coefficients
+// in the top left 4x4, in the first row or in the first column. They give the
+// same result as the full transform, but leave block unchanged and write to
+// out instead: 64 values for the 4x4 form, the one row all rows share for the
+// row form and the one value per row for the column form.
 
-	// Forward
-	if (self->motion_forward.is_set)
+void plm_video_idct_4x4(const int *block, int *out)
+{
+// printf("plm_video_idct_4x4\n");
+	// Transform the 4 columns, then all 8 rows of them
+	int tmp[8 * 4];
+	for (int i = 0; i < 4; i++)
 	{
-		int r_size = self->motion_forward.r_size;
-		self->motion_forward.h = plm_video_decode_motion_vector(self, r_size, self->motion_forward.h);
-		self->motion_forward.v = plm_video_decode_motion_vector(self, r_size, self->motion_forward.v);
+		plm_video_idct_1d(
+				block[0 * 8 + i], block[1 * 8 + i], block[2 * 8 + i], block[3 * 8 + i], 0, 0, 0, 0,
+				tmp + i, 4, FALSE);
 	}
-	else if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_PREDICTIVE)
+	for (int i = 0; i < 8; i++)
 	{
-		// No motion information in P-picture, reset vectors
-		self->motion_forward.h = 0;
-		self->motion_forward.v = 0;
+		plm_video_idct_1d(
+				tmp[i * 4 + 0], tmp[i * 4 + 1], tmp[i * 4 + 2], tmp[i * 4 + 3], 0, 0, 0, 0,
+				out + i * 8, 1, TRUE);
 	}
+}
 
-	if (self->motion_backward.is_set)
-	{
-		int r_size = self->motion_backward.r_size;
-		self->motion_backward.h = plm_video_decode_motion_vector(self, r_size, self->motion_backward.h);
-		self->motion_backward.v = plm_video_decode_motion_vector(self, r_size, self->motion_backward.v);
-	}
+void plm_video_idct_row(const int *block, int *out)
+{
+// printf("plm_video_idct_row\n");
+	// The column pass passes a lone first coefficient through unchanged
+	plm_video_idct_1d(
+			block[0], block[1], block[2], block[3], block[4], block[5], block[6], block[7],
+			out, 1, TRUE);
 }
 
-int plm_video_decode_motion_vector(plm_video_t *self, int r_size, int motion)
+void plm_video_idct_column(const int *block, int *out)
 {
-// printf("plm_video_decode_motion_vector\n");
-	int fscale = 1 << r_size;
-	int m_code = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_MOTION);
-	int r = 0;
-	int d;
+// printf("plm_video_idct_column\n");
+	// Likewise the row pass, so only the rounding remains of it
+	plm_video_idct_1d(
+			block[0 * 8], block[1 * 8], block[2 * 8], block[3 * 8],
+			block[4 * 8], block[5 * 8], block[6 * 8], block[7 * 8],
+			out, 1, TRUE);
+}
 
-	if ((m_code != 0) && (fscale != 1))
-	{
-		r = plm_buffer_read(self->buffer, r_size);
-		d = ((abs(m_code) - 1) << r_size) + r + 1;
-		if (m_code < 0)
-		{
-			d = -d;
-		}
-	}
-	else
-	{
-		d = m_code;
-	}
+// Transforms for downscaled decoding. The 4 or 2 point inverse DCT of the top
+// left coefficients of a block, scaled by 4 / 8 or 2 / 8 in each direction,
+// gives the averages of its 2x2 or 4x4 pixel squares. The coefficients are
+// plain, not premultiplied; out holds the 4x4 or 2x2 result.
 
-	motion += d;
-	if (motion > (fscale << 4) - 1)
+static inline void plm_video_idct_scaled_4_1d(
+		int v0, int v1, int v2, int v3, int *out, int stride, int descale)
+{
+	// cos(k * pi / 8) / 2 and 1 / (2 * sqrt(2)) in 10 bit fixed point
+	int e0 = (v0 + v2) * 362;
+	int e1 = (v0 - v2) * 362;
+	int o0 = v1 * 473 + v3 * 196;
+	int o1 = v1 * 196 - v3 * 473;
+	int round = 1 << (descale - 1);
+	out[0 * stride] = (e0 + o0 + round) >> descale;
+	out[1 * stride] = (e1 + o1 + round) >> descale;
+	out[2 * stride] = (e1 - o1 + round) >> descale;
+	out[3 * stride] = (e0 - o0 + round) >> descale;
+}
+
+void plm_video_idct_scaled_4(const int *block, int *out)
+{
+// printf("plm_video_idct_scaled_4\n");
+	// The columns keep 6 fraction bits for the rows
+	int tmp[4 * 4];
+	for (int i = 0; i < 4; i++)
 	{
-		motion -= fscale << 5;
+		plm_video_idct_scaled_4_1d(
+				block[i], block[i + 8], block[i + 16], block[i + 24],
+				tmp + i, 4, 4);
 	}
-	else if (motion < ((-fscale) << 4))
+	for (int i = 0; i < 4; i++)
 	{
-		motion += fscale << 5;
+		const int *v = tmp + i * 4;
+		plm_video_idct_scaled_4_1d(v[0], v[1], v[2], v[3], out + i * 4, 1, 16);
 	}
-
-	return motion;
 }
 
-void plm_video_predict_macroblock(plm_video_t *self)
+void plm_video_idct_scaled_2(const int *block, int *out)
 {
-// printf("plm_video_predict_macroblock\n");
-	int fw_h = self->motion_forward.h;
-	int fw_v = self->motion_forward.v;
+// printf("plm_video_idct_scaled_2\n");
+	int a = block[0] + block[8];
+	int b = block[0] - block[8];
+	int c = block[1] + block[9];
+	int d = block[1] - block[9];
+	out[0] = (a + c + 4) >> 3;
+	out[1] = (a - c + 4) >> 3;
+	out[2] = (b + d + 4) >> 3;
+	out[3] = (b - d + 4) >> 3;
+}
 
-	if (self->motion_forward.full_px)
+// YCbCr to RGB565 conversion following the BT.601 standard:
+// https://infogalactic.com/info/YCbCr#ITU-R_BT.601_conversion
+// Each chroma term is rounded down on its own. The scalar code looks
+// everything up in tables laid out like those of Arduino_GFX: the luma, the
+// red, green and blue terms of the chroma and, indexed by the sum of luma and
+// term, the bits of each channel in the pixel. The pixel bits are byte swapped
+// as for the _be variants; the others swap them back. Each 2x2 quad of pixels
+// shares one chroma sample. Runs of 16 or 8 quads are converted with AVX2 or
+// SSE2, giving the same result as the tables.
+
+// Whether the pixels are dithered instead of truncated to RGB565, which shows
+// as banding in smooth gradients. The entry of a 4x4 Bayer matrix, aligned to
+// the frame so that separately converted rects line up, is added below the
+// dropped bits: 0 to 7 for red and blue, 0 to 3 for green. The scalar loops
+// come in one variant per phase of the matrix at the start of a pair of quads,
+// so the entries are constants in the table offsets and cost nothing per
+// pixel. SIMD code adds them, two additions per vector.
+#ifndef PLM_RGB565_DITHER
+#define PLM_RGB565_DITHER 0
+#endif
+
+static const uint8_t PLM_RGB565_BAYER[4][4] = {
+		{0, 8, 2, 10},
+		{12, 4, 14, 6},
+		{3, 11, 1, 9},
+		{15, 7, 13, 5}};
+
+// Define PLM_RGB565_ARDUINO_GFX_TABLES to 1 to use the tables of Arduino_GFX
+// (Y2I16, CR2R16, CB2G16, CR2G16, CB2B16, CLIPRBE, CLIPGBE and CLIPBBE) in
+// place of the built-in ones, so that the colours match its drawYCbCrBitmap().
+// They must be declared before the implementation. Their clip tables have no
+// room for the dither bias and AVX2 and SSE2 do not compute their values.
+#ifndef PLM_RGB565_ARDUINO_GFX_TABLES
+#define PLM_RGB565_ARDUINO_GFX_TABLES 0
+#endif
+
+#if PLM_RGB565_ARDUINO_GFX_TABLES && PLM_RGB565_DITHER
+#error "PLM_RGB565_DITHER needs the built-in RGB565 tables"
+#endif
+
+#if PLM_RGB565_ARDUINO_GFX_TABLES
+
+#define PLM_RGB565_Y Y2I16
+#define PLM_RGB565_CR_R CR2R16
+#define PLM_RGB565_CB_G CB2G16
+#define PLM_RGB565_CR_G CR2G16
+#define PLM_RGB565_CB_B CB2B16
+#define PLM_RGB565_CLIP_R CLIPRBE
+#define PLM_RGB565_CLIP_G CLIPGBE
+#define PLM_RGB565_CLIP_B CLIPBBE
+
+#else
+
+// The built-in tables are generated by the preprocessor: PLM_REPEAT_256 calls
+// ENTRY with the 256 hex numbers that start with P, e.g. 0x00 to 0xFF for 0x.
+// Luma plus a chroma term and the dither bias range from -278 to 541; the clip
+// tables cover -384 to 639.
+#define PLM_REPEAT_16(ENTRY, P) \
+	ENTRY(P##0) ENTRY(P##1) ENTRY(P##2) ENTRY(P##3) ENTRY(P##4) ENTRY(P##5) ENTRY(P##6) ENTRY(P##7) \
+	ENTRY(P##8) ENTRY(P##9) ENTRY(P##A) ENTRY(P##B) ENTRY(P##C) ENTRY(P##D) ENTRY(P##E) ENTRY(P##F)
+#define PLM_REPEAT_256(ENTRY, P) \
+	PLM_REPEAT_16(ENTRY, P##0) PLM_REPEAT_16(ENTRY, P##1) PLM_REPEAT_16(ENTRY, P##2) PLM_REPEAT_16(ENTRY, P##3) \
+	PLM_REPEAT_16(ENTRY, P##4) PLM_REPEAT_16(ENTRY, P##5) PLM_REPEAT_16(ENTRY, P##6) PLM_REPEAT_16(ENTRY, P##7) \
+	PLM_REPEAT_16(ENTRY, P##8) PLM_REPEAT_16(ENTRY, P##9) PLM_REPEAT_16(ENTRY, P##A) PLM_REPEAT_16(ENTRY, P##B) \
+	PLM_REPEAT_16(ENTRY, P##C) PLM_REPEAT_16(ENTRY, P##D) PLM_REPEAT_16(ENTRY, P##E) PLM_REPEAT_16(ENTRY, P##F)
+#define PLM_REPEAT_1024(ENTRY) \
+	PLM_REPEAT_256(ENTRY, 0x0) PLM_REPEAT_256(ENTRY, 0x1) PLM_REPEAT_256(ENTRY, 0x2) PLM_REPEAT_256(ENTRY, 0x3)
+
+#define PLM_RGB565_Y_ENTRY(I) (int16_t)((((I) - 16) * 76309) >> 16),
+#define PLM_RGB565_CR_R_ENTRY(I) (int16_t)((((I) - 128) * 104597) >> 16),
+#define PLM_RGB565_CB_G_ENTRY(I) (int16_t)((((I) - 128) * 25674) >> 16),
+#define PLM_RGB565_CR_G_ENTRY(I) (int16_t)((((I) - 128) * 53278) >> 16),
+#define PLM_RGB565_CB_B_ENTRY(I) (int16_t)((((I) - 128) * 132201) >> 16),
+
+#define PLM_RGB565_CLAMP(I) ((I) < 384 ? 0 : (I) > 639 ? 255 : (I) - 384)
+#define PLM_RGB565_CLIP_R_ENTRY(I) (uint16_t)(PLM_RGB565_CLAMP(I) & 0xf8),
+#define PLM_RGB565_CLIP_G_ENTRY(I) (uint16_t)((PLM_RGB565_CLAMP(I) >> 5) | ((PLM_RGB565_CLAMP(I) & 0x1c) << 11)),
+#define PLM_RGB565_CLIP_B_ENTRY(I) (uint16_t)((PLM_RGB565_CLAMP(I) & 0xf8) << 5),
+
+static const int16_t PLM_RGB565_Y[256] = {PLM_REPEAT_256(PLM_RGB565_Y_ENTRY, 0x)};
+static const int16_t PLM_RGB565_CR_R[256] = {PLM_REPEAT_256(PLM_RGB565_CR_R_ENTRY, 0x)};
+static const int16_t PLM_RGB565_CB_G[256] = {PLM_REPEAT_256(PLM_RGB565_CB_G_ENTRY, 0x)};
+static const int16_t PLM_RGB565_CR_G[256] = {PLM_REPEAT_256(PLM_RGB565_CR_G_ENTRY, 0x)};
+static const int16_t PLM_RGB565_CB_B[256] = {PLM_REPEAT_256(PLM_RGB565_CB_B_ENTRY, 0x)};
+static const uint16_t PLM_RGB565_CLIP_TABLES[3][1024] = {
+		{PLM_REPEAT_1024(PLM_RGB565_CLIP_R_ENTRY)},
+		{PLM_REPEAT_1024(PLM_RGB565_CLIP_G_ENTRY)},
+		{PLM_REPEAT_1024(PLM_RGB565_CLIP_B_ENTRY)}};
+
+#define PLM_RGB565_CLIP_R (PLM_RGB565_CLIP_TABLES[0] + 384)
+#define PLM_RGB565_CLIP_G (PLM_RGB565_CLIP_TABLES[1] + 384)
+#define PLM_RGB565_CLIP_B (PLM_RGB565_CLIP_TABLES[2] + 384)
+
+#undef PLM_REPEAT_16
+#undef PLM_REPEAT_256
+#undef PLM_REPEAT_1024
+#undef PLM_RGB565_Y_ENTRY
+#undef PLM_RGB565_CR_R_ENTRY
+#undef PLM_RGB565_CB_G_ENTRY
+#undef PLM_RGB565_CR_G_ENTRY
+#undef PLM_RGB565_CB_B_ENTRY
+#undef PLM_RGB565_CLAMP
+#undef PLM_RGB565_CLIP_R_ENTRY
+#undef PLM_RGB565_CLIP_G_ENTRY
+#undef PLM_RGB565_CLIP_B_ENTRY
+
+#endif
+
+static inline uint64_t plm_rgb565_bias_lanes(const uint8_t *bias, int phase)
+{
+	// Four 16 bit lanes of a matrix row, starting at column phase; zero without
+	// dithering, so that the additions fold away
+	uint64_t lanes = 0;
+	if (PLM_RGB565_DITHER)
 	{
-		fw_h <<= 1;
-		fw_v <<= 1;
+		for (int i = 3; i >= 0; i--)
+		{
+			lanes = (lanes << 16) | bias[(phase + i) & 3];
+		}
 	}
+	return lanes;
+}
 
-	if (self->picture_type == PLM_VIDEO_PICTURE_TYPE_B)
-	{
-		int bw_h = self->motion_backward.h;
-		int bw_v = self->motion_backward.v;
+#if defined(__SSE2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
 
-		if (self->motion_backward.full_px)
-		{
-			bw_h <<= 1;
-			bw_v <<= 1;
-		}
+static inline __m128i plm_mm_rgb565(__m128i y, __m128i r, __m128i g, __m128i b, __m128i rb_bias, __m128i g_bias, int swap)
+{
+	// ((y - 16) * 76309) >> 16 with 76309 = 65536 + 10773
+	__m128i zero = _mm_setzero_si128();
+	__m128i max = _mm_set1_epi16(255);
+	y = _mm_sub_epi16(y, _mm_set1_epi16(16));
+	y = _mm_add_epi16(y, _mm_mulhi_epi16(y, _mm_set1_epi16(10773)));
+	__m128i y_rb = _mm_add_epi16(y, rb_bias);
+	__m128i y_g = _mm_add_epi16(y, g_bias);
+	r = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(y_rb, r), zero), max);
+	g = _mm_min_epi16(_mm_max_epi16(_mm_sub_epi16(y_g, g), zero), max);
+	b = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(y_rb, b), zero), max);
+	__m128i pixel = _mm_or_si128(
+			_mm_or_si128(_mm_slli_epi16(_mm_srli_epi16(r, 3), 11), _mm_slli_epi16(_mm_srli_epi16(g, 2), 5)),
+			_mm_srli_epi16(b, 3));
+	if (swap)
+	{
+		pixel = _mm_or_si128(_mm_slli_epi16(pixel, 8), _mm_srli_epi16(pixel, 8));
+	}
+	return pixel;
+}
 
-		if (self->motion_forward.is_set)
-		{
-			plm_video_copy_macroblock(self, &self->frame_forward, fw_h, fw_v);
-			if (self->motion_backward.is_set)
-			{
-				plm_video_interpolate_macroblock(self, &self->frame_backward, bw_h, bw_v);
-			}
-		}
-		else
+static inline int plm_rgb565_quads_sse2(
+		const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw,
+		uint16_t *dest, int stride, int quads, const uint64_t *bias, int swap)
+{
+	// The factors above 2^15 are split into multiples of 2^16 and a 16 bit
+	// rest: 104597 = 2 * 65536 - 26475, 132201 = 2 * 65536 + 1129 and
+	// 53278 = 65536 - 12258.
+	__m128i zero = _mm_setzero_si128();
+	__m128i offset = _mm_set1_epi16(128);
+	__m128i rb_bias[2], g_bias[2];
+	for (int row = 0; row < 2; row++)
+	{
+		__m128i lanes = _mm_set1_epi64x((long long)bias[row]);
+		rb_bias[row] = _mm_srli_epi16(lanes, 1);
+		g_bias[row] = _mm_srli_epi16(lanes, 2);
+	}
+	int done = 0;
+	for (; done + 8 <= quads; done += 8)
+	{
+		__m128i vcr = _mm_sub_epi16(_mm_unpacklo_epi8(PLM_MM_LOAD_8(cr + done), zero), offset);
+		__m128i vcb = _mm_sub_epi16(_mm_unpacklo_epi8(PLM_MM_LOAD_8(cb + done), zero), offset);
+		__m128i r = _mm_add_epi16(_mm_add_epi16(vcr, vcr), _mm_mulhi_epi16(vcr, _mm_set1_epi16(-26475)));
+		__m128i b = _mm_add_epi16(_mm_add_epi16(vcb, vcb), _mm_mulhi_epi16(vcb, _mm_set1_epi16(1129)));
+		__m128i g = _mm_add_epi16(
+				_mm_mulhi_epi16(vcb, _mm_set1_epi16(25674)),
+				_mm_add_epi16(vcr, _mm_mulhi_epi16(vcr, _mm_set1_epi16(-12258))));
+
+		// Each chroma term covers two pixels of both rows
+		__m128i r_lo = _mm_unpacklo_epi16(r, r);
+		__m128i r_hi = _mm_unpackhi_epi16(r, r);
+		__m128i g_lo = _mm_unpacklo_epi16(g, g);
+		__m128i g_hi = _mm_unpackhi_epi16(g, g);
+		__m128i b_lo = _mm_unpacklo_epi16(b, b);
+		__m128i b_hi = _mm_unpackhi_epi16(b, b);
+		for (int row = 0; row < 2; row++)
 		{
-			plm_video_copy_macroblock(self, &self->frame_backward, bw_h, bw_v);
+			__m128i luma = PLM_MM_LOAD_16(y + row * yw + done * 2);
+			uint16_t *d = dest + row * stride + done * 2;
+			PLM_MM_STORE_16(d, plm_mm_rgb565(
+					_mm_unpacklo_epi8(luma, zero), r_lo, g_lo, b_lo, rb_bias[row], g_bias[row], swap));
+			PLM_MM_STORE_16(d + 8, plm_mm_rgb565(
+					_mm_unpackhi_epi8(luma, zero), r_hi, g_hi, b_hi, rb_bias[row], g_bias[row], swap));
 		}
 	}
-	else
-	{
-		plm_video_copy_macroblock(self, &self->frame_forward, fw_h, fw_v);
-	}
+	return done;
 }
 
-void plm_video_copy_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v)
+#endif
+
+#if defined(__AVX2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+
+// The same 16 quads at a time
+
+static inline __m256i plm_mm256_rgb565(__m256i y, __m256i r, __m256i g, __m256i b, __m256i rb_bias, __m256i g_bias, int swap)
 {
-// printf("plm_video_copy_macroblock\n");
-	plm_frame_t *d = &self->frame_current;
-	plm_video_process_macroblock(self, s->y.data, d->y.data, motion_h, motion_v, 16, FALSE);
-	plm_video_process_macroblock(self, s->cr.data, d->cr.data, motion_h / 2, motion_v / 2, 8, FALSE);
-	plm_video_process_macroblock(self, s->cb.data, d->cb.data, motion_h / 2, motion_v / 2, 8, FALSE);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i max = _mm256_set1_epi16(255);
+	y = _mm256_sub_epi16(y, _mm256_set1_epi16(16));
+	y = _mm256_add_epi16(y, _mm256_mulhi_epi16(y, _mm256_set1_epi16(10773)));
+	__m256i y_rb = _mm256_add_epi16(y, rb_bias);
+	__m256i y_g = _mm256_add_epi16(y, g_bias);
+	r = _mm256_min_epi16(_mm256_max_epi16(_mm256_add_epi16(y_rb, r), zero), max);
+	g = _mm256_min_epi16(_mm256_max_epi16(_mm256_sub_epi16(y_g, g), zero), max);
+	b = _mm256_min_epi16(_mm256_max_epi16(_mm256_add_epi16(y_rb, b), zero), max);
+	__m256i pixel = _mm256_or_si256(
+			_mm256_or_si256(_mm256_slli_epi16(_mm256_srli_epi16(r, 3), 11), _mm256_slli_epi16(_mm256_srli_epi16(g, 2), 5)),
+			_mm256_srli_epi16(b, 3));
+	if (swap)
+	{
+		pixel = _mm256_or_si256(_mm256_slli_epi16(pixel, 8), _mm256_srli_epi16(pixel, 8));
+	}
+	return pixel;
 }
 
-void plm_video_interpolate_macroblock(plm_video_t *self, plm_frame_t *s, int motion_h, int motion_v)
+static inline int plm_rgb565_quads_avx2(
+		const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw,
+		uint16_t *dest, int stride, int quads, const uint64_t *bias, int swap)
 {
-// printf("plm_video_interpolate_macroblock\n");
-	plm_frame_t *d = &self->frame_current;
-	plm_video_process_macroblock(self, s->y.data, d->y.data, motion_h, motion_v, 16, TRUE);
-	plm_video_process_macroblock(self, s->cr.data, d->cr.data, motion_h / 2, motion_v / 2, 8, TRUE);
-	plm_video_process_macroblock(self, s->cb.data, d->cb.data, motion_h / 2, motion_v / 2, 8, TRUE);
+	__m256i offset = _mm256_set1_epi16(128);
+	__m256i rb_bias[2], g_bias[2];
+	for (int row = 0; row < 2; row++)
+	{
+		__m256i lanes = _mm256_set1_epi64x((long long)bias[row]);
+		rb_bias[row] = _mm256_srli_epi16(lanes, 1);
+		g_bias[row] = _mm256_srli_epi16(lanes, 2);
+	}
+	int done = 0;
+	for (; done + 16 <= quads; done += 16)
+	{
+		__m256i vcr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(cr + done))), offset);
+		__m256i vcb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(cb + done))), offset);
+		__m256i r = _mm256_add_epi16(_mm256_add_epi16(vcr, vcr), _mm256_mulhi_epi16(vcr, _mm256_set1_epi16(-26475)));
+		__m256i b = _mm256_add_epi16(_mm256_add_epi16(vcb, vcb), _mm256_mulhi_epi16(vcb, _mm256_set1_epi16(1129)));
+		__m256i g = _mm256_add_epi16(
+				_mm256_mulhi_epi16(vcb, _mm256_set1_epi16(25674)),
+				_mm256_add_epi16(vcr, _mm256_mulhi_epi16(vcr, _mm256_set1_epi16(-12258))));
+
+		// Unpacking works within 128 bit lanes; put the quads back in order
+		__m256i r_lo = _mm256_unpacklo_epi16(r, r);
+		__m256i r_hi = _mm256_unpackhi_epi16(r, r);
+		__m256i g_lo = _mm256_unpacklo_epi16(g, g);
+		__m256i g_hi = _mm256_unpackhi_epi16(g, g);
+		__m256i b_lo = _mm256_unpacklo_epi16(b, b);
+		__m256i b_hi = _mm256_unpackhi_epi16(b, b);
+		__m256i r0 = _mm256_permute2x128_si256(r_lo, r_hi, 0x20);
+		__m256i r1 = _mm256_permute2x128_si256(r_lo, r_hi, 0x31);
+		__m256i g0 = _mm256_permute2x128_si256(g_lo, g_hi, 0x20);
+		__m256i g1 = _mm256_permute2x128_si256(g_lo, g_hi, 0x31);
+		__m256i b0 = _mm256_permute2x128_si256(b_lo, b_hi, 0x20);
+		__m256i b1 = _mm256_permute2x128_si256(b_lo, b_hi, 0x31);
+		for (int row = 0; row < 2; row++)
+		{
+			const uint8_t *luma = y + row * yw + done * 2;
+			__m256i *d = (__m256i *)(dest + row * stride + done * 2);
+			__m256i y0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)luma));
+			__m256i y1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(luma + 16)));
+			_mm256_storeu_si256(d, plm_mm256_rgb565(y0, r0, g0, b0, rb_bias[row], g_bias[row], swap));
+			_mm256_storeu_si256(d + 1, plm_mm256_rgb565(y1, r1, g1, b1, rb_bias[row], g_bias[row], swap));
+		}
+	}
+	return done;
 }
 
-#define PLM_BLOCK_SET(DEST, DEST_INDEX, DEST_WIDTH, SOURCE_INDEX, SOURCE_WIDTH, BLOCK_SIZE, OP) \
-	do                                                                                            \
-	{                                                                                             \
-		int dest_scan = DEST_WIDTH - BLOCK_SIZE;                                                    \
-		int source_scan = SOURCE_WIDTH - BLOCK_SIZE;                                                \
-		for (int y = 0; y < BLOCK_SIZE; y++)                                                        \
-		{                                                                                           \
-			for (int x = 0; x < BLOCK_SIZE; x++)                                                      \
-			{                                                                                         \
-				DEST[DEST_INDEX] = OP;                                                                  \
-				SOURCE_INDEX++;                                                                         \
-				DEST_INDEX++;                                                                           \
-			}                                                                                         \
-			SOURCE_INDEX += source_scan;                                                              \
-			DEST_INDEX += dest_scan;                                                                  \
-		}                                                                                           \
-	} while (FALSE)
+#endif
 
-void plm_video_process_macroblock(
-		plm_video_t *self, uint8_t *s, uint8_t *d,
-		int motion_h, int motion_v, int block_size, int interpolate)
-{
-// printf("plm_video_process_macroblock\n");
-	int dw = self->mb_width * block_size;
+// The per pixel steps are macros, like the motion compensation kernels: as
+// inline functions, compilers left them as calls at -Os and a quad of them at
+// -O2, which made the conversion slower than YCbCr2RGB565Be() of the
+// Arduino_GFX examples.
 
-	int hp = motion_h >> 1;
-	int vp = motion_v >> 1;
-	int odd_h = (motion_h & 1) == 1;
-	int odd_v = (motion_v & 1) == 1;
+// Set R, G and B to the chroma terms of the CR and CB sample
 
-	unsigned int si = ((self->mb_row * block_size) + vp) * dw + (self->mb_col * block_size) + hp;
-	unsigned int di = (self->mb_row * dw + self->mb_col) * block_size;
+#define PLM_RGB565_CHROMA(CR, CB, R, G, B) \
+	do \
+	{ \
+		int chroma_cr = (CR); \
+		int chroma_cb = (CB); \
+		R = PLM_RGB565_CR_R[chroma_cr]; \
+		G = -PLM_RGB565_CB_G[chroma_cb] - PLM_RGB565_CR_G[chroma_cr]; \
+		B = PLM_RGB565_CB_B[chroma_cb]; \
+	} while (FALSE)
 
-	unsigned int max_address = (dw * (self->mb_height * block_size - block_size + 1) - block_size);
-	if (si > max_address || di > max_address)
-	{
-		return; // corrupt video
-	}
+// Set DEST to the pixel of luma sample Y with these chroma terms, dithered
+// with the PLM_RGB565_BAYER entry ENTRY. SWAP is known at compile time in
+// loops, and so is ENTRY in those of the quads.
+
+#define PLM_RGB565_PIXEL(DEST, Y, R, G, B, ENTRY, SWAP) \
+	do \
+	{ \
+		int entry = PLM_RGB565_DITHER ? (ENTRY) : 0; \
+		int luma = PLM_RGB565_Y[Y]; \
+		int pixel = \
+				PLM_RGB565_CLIP_R[luma + (R) + (entry >> 1)] | \
+				PLM_RGB565_CLIP_G[luma + (G) + (entry >> 2)] | \
+				PLM_RGB565_CLIP_B[luma + (B) + (entry >> 1)]; \
+		DEST = (SWAP) ? (uint16_t)pixel : (uint16_t)((pixel << 8) | (pixel >> 8)); \
+	} while (FALSE)
 
-#define PLM_MB_CASE(INTERPOLATE, ODD_H, ODD_V, OP)    \
-	case ((INTERPOLATE << 2) | (ODD_H << 1) | (ODD_V)): \
-		PLM_BLOCK_SET(d, di, dw, si, dw, block_size, OP); \
-		break
+// The next quad of the two rows, whose top left pixel is dithered with the
+// matrix entry in ROW and COL
+
+#define PLM_RGB565_QUAD(ROW, COL, SWAP) \
+	do \
+	{ \
+		int r, g, b; \
+		PLM_RGB565_CHROMA(*cr++, *cb++, r, g, b); \
+		PLM_RGB565_PIXEL(*dest++, *y++, r, g, b, PLM_RGB565_BAYER[ROW][COL], SWAP); \
+		PLM_RGB565_PIXEL(*dest++, *y++, r, g, b, PLM_RGB565_BAYER[ROW][(COL) + 1], SWAP); \
+		PLM_RGB565_PIXEL(*dest2++, *y2++, r, g, b, PLM_RGB565_BAYER[(ROW) + 1][COL], SWAP); \
+		PLM_RGB565_PIXEL(*dest2++, *y2++, r, g, b, PLM_RGB565_BAYER[(ROW) + 1][(COL) + 1], SWAP); \
+	} while (FALSE)
 
-	switch ((interpolate << 2) | (odd_h << 1) | (odd_v))
+// One function per byte order and, when dithering, per matrix row and column
+// of the first pixel (both 0 or 2), so that the loop tests neither and the
+// entries of the quads are constants
+
+#define PLM_DEFINE_RGB565_QUADS_FUNCTION(NAME, SWAP, ROW, COL) \
+	static void NAME( \
+			const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw, \
+			uint16_t *dest, int stride, int quads) \
+	{ \
+		const uint8_t *y2 = y + yw; \
+		uint16_t *dest2 = dest + stride; \
+		for (int i = 0; i + 2 <= quads; i += 2) \
+		{ \
+			PLM_RGB565_QUAD(ROW, COL, SWAP); \
+			PLM_RGB565_QUAD(ROW, (COL) ^ 2, SWAP); \
+		} \
+		if (quads & 1) \
+		{ \
+			PLM_RGB565_QUAD(ROW, COL, SWAP); \
+		} \
+	}
+
+typedef void (*plm_rgb565_quads_t)(
+		const uint8_t *y, const uint8_t *cr, const uint8_t *cb, int yw,
+		uint16_t *dest, int stride, int quads);
+
+#if PLM_RGB565_DITHER
+
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_00, FALSE, 0, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_02, FALSE, 0, 2)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_20, FALSE, 2, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_22, FALSE, 2, 2)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_00, TRUE, 0, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_02, TRUE, 0, 2)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_20, TRUE, 2, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap_22, TRUE, 2, 2)
+
+// Indexed by byte order and by the matrix row and column of the first pixel,
+// halved
+static const plm_rgb565_quads_t PLM_RGB565_QUADS_SCALAR[2][4] = {
+		{plm_rgb565_quads_scalar_00, plm_rgb565_quads_scalar_02, plm_rgb565_quads_scalar_20, plm_rgb565_quads_scalar_22},
+		{plm_rgb565_quads_scalar_swap_00, plm_rgb565_quads_scalar_swap_02, plm_rgb565_quads_scalar_swap_20, plm_rgb565_quads_scalar_swap_22}};
+
+#else
+
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar, FALSE, 0, 0)
+PLM_DEFINE_RGB565_QUADS_FUNCTION(plm_rgb565_quads_scalar_swap, TRUE, 0, 0)
+
+static const plm_rgb565_quads_t PLM_RGB565_QUADS_SCALAR[2][4] = {
+		{plm_rgb565_quads_scalar, plm_rgb565_quads_scalar, plm_rgb565_quads_scalar, plm_rgb565_quads_scalar},
+		{plm_rgb565_quads_scalar_swap, plm_rgb565_quads_scalar_swap, plm_rgb565_quads_scalar_swap, plm_rgb565_quads_scalar_swap}};
+
+#endif
+
+#undef PLM_RGB565_QUAD
+#undef PLM_DEFINE_RGB565_QUADS_FUNCTION
+
+// dest points to the top left pixel of the rect
+
+static inline void plm_frame_rect_convert_rgb565(
+		plm_frame_t *frame, int x, int y, int width, int height,
+		uint16_t *dest, int stride, int swap)
+{
+	int quads = width >> 1;
+	int yw = frame->y.width;
+	int cw = frame->cb.width;
+
+#if defined(__SSE2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+	// The matrix rows, starting at the column of the first pixel. Runs start at
+	// multiples of 16 pixels, so that column stays the same.
+	uint64_t bias[4];
+	for (int i = 0; i < 4; i++)
 	{
-		PLM_MB_CASE(0, 0, 0, (s[si]));
-		PLM_MB_CASE(0, 0, 1, (s[si] + s[si + dw] + 1) >> 1);
-		PLM_MB_CASE(0, 1, 0, (s[si] + s[si + 1] + 1) >> 1);
-		PLM_MB_CASE(0, 1, 1, (s[si] + s[si + 1] + s[si + dw] + s[si + dw + 1] + 2) >> 2);
-
-		PLM_MB_CASE(1, 0, 0, (d[di] + (s[si]) + 1) >> 1);
-		PLM_MB_CASE(1, 0, 1, (d[di] + ((s[si] + s[si + dw] + 1) >> 1) + 1) >> 1);
-		PLM_MB_CASE(1, 1, 0, (d[di] + ((s[si] + s[si + 1] + 1) >> 1) + 1) >> 1);
-		PLM_MB_CASE(1, 1, 1, (d[di] + ((s[si] + s[si + 1] + s[si + dw] + s[si + dw + 1] + 2) >> 2) + 1) >> 1);
+		bias[i] = plm_rgb565_bias_lanes(PLM_RGB565_BAYER[i], x & 3);
+	}
+#endif
+	const plm_rgb565_quads_t *scalar = PLM_RGB565_QUADS_SCALAR[swap ? 1 : 0];
+	for (int row = y >> 1; row < (y + height) >> 1; row++)
+	{
+		const uint8_t *y_row = frame->y.data + row * 2 * yw + x;
+		const uint8_t *cr_row = frame->cr.data + row * cw + (x >> 1);
+		const uint8_t *cb_row = frame->cb.data + row * cw + (x >> 1);
+		uint16_t *d = dest + (row * 2 - y) * stride;
+		int done = 0;
+#if defined(__AVX2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+		done = plm_rgb565_quads_avx2(y_row, cr_row, cb_row, yw, d, stride, quads, bias + ((row * 2) & 3), swap);
+#endif
+#if defined(__SSE2__) && !PLM_RGB565_ARDUINO_GFX_TABLES
+		done += plm_rgb565_quads_sse2(
+				y_row + done * 2, cr_row + done, cb_row + done, yw,
+				d + done * 2, stride, quads - done, bias + ((row * 2) & 3), swap);
+#endif
+		scalar[(row & 1) * 2 + ((x >> 1) & 1)](
+				y_row + done * 2, cr_row + done, cb_row + done, yw,
+				d + done * 2, stride, quads - done);
 	}
-
-#undef PLM_MB_CASE
 }
 
-void plm_video_decode_block(plm_video_t *self, int block)
+void plm_frame_rect_to_rgb565(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride)
 {
-// printf("plm_video_decode_block\n");
-
-	int n = 0;
-	uint8_t *quant_matrix;
+// printf("plm_frame_rect_to_rgb565\n");
+	plm_frame_rect_convert_rgb565(frame, x, y, width, height, dest + y * stride + x, stride, FALSE);
+}
 
-	// Decode DC coefficient of intra-coded blocks
-	if (self->macroblock_intra)
-	{
-		int predictor;
-		int dct_size;
+void plm_frame_rect_to_rgb565_be(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride)
+{
+// printf("plm_frame_rect_to_rgb565_be\n");
+	plm_frame_rect_convert_rgb565(frame, x, y, width, height, dest + y * stride + x, stride, TRUE);
+}
 
-		// DC prediction
-		int plane_index = block > 3 ? block - 3 : 0;
-		predictor = self->dc_predictor[plane_index];
-		dct_size = plm_buffer_read_vlc(self->buffer, PLM_VIDEO_DCT_SIZE[plane_index]);
+void plm_frame_to_rgb565(plm_frame_t *frame, uint16_t *dest, int stride)
+{
+// printf("plm_frame_to_rgb565\n");
+	plm_frame_rect_to_rgb565(frame, 0, 0, frame->width, frame->height, dest, stride);
+}
 
-		// Read DC coeff
-		if (dct_size > 0)
+void plm_frame_to_rgb565_be(plm_frame_t *frame, uint16_t *dest, int stride)
+{
+// printf("plm_frame_to_rgb565_be\n");
+	plm_frame_rect_to_rgb565_be(frame, 0, 0, frame->width, frame->height, dest, stride);
+}
+
+int plm_frame_get_dirty_rects(plm_frame_t *frame, plm_rect_t *rects, int max_rects)
+{
+// printf("plm_frame_get_dirty_rects\n");
+	if (max_rects < 1)
+	{
+		return 0;
+	}
+	if (!frame->dirty)
+	{
+		rects[0].x = 0;
+		rects[0].y = 0;
+		rects[0].width = frame->width;
+		rects[0].height = frame->height;
+		return 1;
+	}
+
+	// Join the dirty macroblocks of each row into runs, and a run into the rect
+	// of the same columns that ends right above it. Coordinates are in
+	// macroblocks until the end.
+	int size = frame->macroblock_size;
+	int mb_width = (frame->width + size - 1) / size;
+	int mb_height = (frame->height + size - 1) / size;
+	int count = 0;
+	int overflow = FALSE;
+	int x0 = mb_width, y0 = mb_height, x1 = 0, y1 = 0;
+	for (int row = 0; row < mb_height; row++)
+	{
+		const uint8_t *dirty = frame->dirty + row * mb_width;
+		int col = 0;
+		while (col < mb_width)
 		{
-			int differential = plm_buffer_read(self->buffer, dct_size);
-			if ((differential & (1 << (dct_size - 1))) != 0)
+			if (!dirty[col])
 			{
-				self->block_data[0] = predictor + differential;
+				col++;
+				continue;
+			}
+			int end = col + 1;
+			while (end < mb_width && dirty[end])
+			{
+				end++;
+			}
+			x0 = col < x0 ? col : x0;
+			x1 = end > x1 ? end : x1;
+			y0 = row < y0 ? row : y0;
+			y1 = row + 1;
+
+			int i = 0;
+			while (
+					i < count &&
+					(rects[i].x != col || rects[i].width != end - col || rects[i].y + rects[i].height != row))
+			{
+				i++;
+			}
+			if (i < count)
+			{
+				rects[i].height++;
+			}
+			else if (count < max_rects)
+			{
+				rects[count].x = col;
+				rects[count].y = row;
+				rects[count].width = end - col;
+				rects[count].height = 1;
+				count++;
 			}
 			else
 			{
-				self->block_data[0] = predictor + (-(1 << dct_size) | (differential + 1));
+				overflow = TRUE;
 			}
+			col = end;
 		}
-		else
+	}
+
+	// Too many rects; fall back to one around all dirty macroblocks
+	if (overflow)
+	{
+		rects[0].x = x0;
+		rects[0].y = y0;
+		rects[0].width = x1 - x0;
+		rects[0].height = y1 - y0;
+		count = 1;
+	}
+
+	// In pixels, clipped to the frame
+	for (int i = 0; i < count; i++)
+	{
+		plm_rect_t *rect = &rects[i];
+		rect->x *= size;
+		rect->y *= size;
+		rect->width *= size;
+		rect->height *= size;
+		if (rect->x + rect->width > (int)frame->width)
 		{
-			self->block_data[0] = predictor;
+			rect->width = frame->width - rect->x;
 		}
+		if (rect->y + rect->height > (int)frame->height)
+		{
+			rect->height = frame->height - rect->y;
+		}
+	}
+	return count;
+}
 
-		// Save predictor value
-		self->dc_predictor[plane_index] = self->block_data[0];
 
-		// Dequantize + premultiply
-		self->block_data[0] <<= (3 + 5);
+// -----------------------------------------------------------------------------
+// plm_scaler implementation
 
-		quant_matrix = self->intra_quant_matrix;
-		n = 1;
+// Every destination column and row has a step that names the source luma and
+// chroma sample it starts from and, for bilinear scaling, the weight of the
+// next sample in 1/256. The tables are built once in plm_scaler_create(), so
+// a frame is scaled and converted in one pass, without a scaled YCrCb copy.
+
+typedef struct
+{
+	uint16_t luma;
+	uint16_t luma_weight;
+	uint16_t chroma;
+	uint16_t chroma_weight;
+} plm_scaler_step_t;
+
+struct plm_scaler_t
+{
+	plm_scale_mode_t mode;
+	int src_width;
+	int src_height;
+	int dest_width;
+	int dest_height;
+	plm_scaler_step_t *cols;
+	plm_scaler_step_t *rows;
+	uint16_t *lines;
+};
+
+static void plm_scaler_tap(int pos, int size, uint16_t *index, uint16_t *weight)
+{
+// printf("plm_scaler_tap\n");
+	// Clamp at the edges, so that index + 1 is always a valid sample
+	if (pos < 0)
+	{
+		pos = 0;
+	}
+	else if (pos > (size - 1) * 256)
+	{
+		pos = (size - 1) * 256;
+	}
+	if (pos >> 8 == size - 1)
+	{
+		*index = (uint16_t)(size - 2);
+		*weight = 256;
 	}
 	else
 	{
-		quant_matrix = self->non_intra_quant_matrix;
+		*index = (uint16_t)(pos >> 8);
+		*weight = (uint16_t)(pos & 255);
 	}
+}
 
-	// Decode AC coefficients (+DC for non-intra)
-	int level = 0;
-	while (TRUE)
+static void plm_scaler_init_steps(plm_scaler_step_t *steps, int src, int dest, plm_scale_mode_t mode)
+{
+// printf("plm_scaler_init_steps\n");
+	for (int i = 0; i < dest; i++)
 	{
-		int run = 0;
-		uint16_t coeff = plm_buffer_read_vlc_uint(self->buffer, PLM_VIDEO_DCT_COEFF);
-
-		if ((coeff == 0x0001) && (n > 0) && (plm_buffer_read(self->buffer, 1) == 0))
+		plm_scaler_step_t *step = &steps[i];
+		if (mode == PLM_SCALE_BILINEAR)
 		{
-			// end_of_block
-			break;
+			// Center of the destination pixel in 1/256 source pixels. Chroma
+			// samples sit between two luma samples.
+			int pos = (int)(((int64_t)(i * 2 + 1) * src * 128) / dest) - 128;
+			plm_scaler_tap(pos, src, &step->luma, &step->luma_weight);
+			plm_scaler_tap((pos - 128) >> 1, (src + 1) >> 1, &step->chroma, &step->chroma_weight);
 		}
-		if (coeff == 0xffff)
+		else
 		{
-			// escape
-			run = plm_buffer_read(self->buffer, 6);
-			level = plm_buffer_read(self->buffer, 8);
-			if (level == 0)
-			{
-				level = plm_buffer_read(self->buffer, 8);
-			}
-			else if (level == 128)
-			{
-				level = plm_buffer_read(self->buffer, 8) - 256;
-			}
-			else if (level > 128)
-			{
-				level = level - 256;
-			}
+			step->luma = (uint16_t)(((int64_t)(i * 2 + 1) * src) / (dest * 2));
+			step->luma_weight = 0;
+			step->chroma = step->luma >> 1;
+			step->chroma_weight = 0;
 		}
-		else
+	}
+}
+
+plm_scaler_t *plm_scaler_create(int src_width, int src_height, int dest_width, int dest_height, plm_scale_mode_t mode)
+{
+// printf("plm_scaler_create\n");
+	if (
+			src_width < 4 || src_height < 4 || dest_width < 1 || dest_height < 1 ||
+			src_width > 0xffff || src_height > 0xffff)
+	{
+		return NULL;
+	}
+	if (
+			mode == PLM_SCALE_DOUBLE &&
+			(dest_width != src_width * 2 || dest_height != src_height * 2))
+	{
+		return NULL;
+	}
+
+	// The steps and the blended source lines for bilinear scaling are kept in
+	// the same allocation
+	int line_size = src_width + ((src_width + 1) >> 1) * 2;
+	size_t size =
+			sizeof(plm_scaler_t) +
+			(dest_width + dest_height) * sizeof(plm_scaler_step_t) +
+			line_size * sizeof(uint16_t);
+	plm_scaler_t *self = (plm_scaler_t *)PLM_MALLOC(size);
+	memset(self, 0, sizeof(plm_scaler_t));
+
+	self->mode = mode;
+	self->src_width = src_width;
+	self->src_height = src_height;
+	self->dest_width = dest_width;
+	self->dest_height = dest_height;
+	self->cols = (plm_scaler_step_t *)(self + 1);
+	self->rows = self->cols + dest_width;
+	self->lines = (uint16_t *)(self->rows + dest_height);
+
+	plm_scaler_init_steps(self->cols, src_width, dest_width, mode);
+	plm_scaler_init_steps(self->rows, src_height, dest_height, mode);
+	return self;
+}
+
+void plm_scaler_destroy(plm_scaler_t *self)
+{
+// printf("plm_scaler_destroy\n");
+	PLM_FREE(self);
+}
+
+static inline void plm_scaler_double(
+		plm_scaler_t *self, plm_frame_t *frame, int x, int y, int width, int height,
+		uint16_t *dest, int stride, int swap)
+{
+	// Each pair of source rows is converted into every other destination row,
+	// then stretched in place from the right and copied to the row below. A
+	// last single row of an odd height is converted with the padding row of the
+	// planes, into the destination row that its own copy then overwrites.
+	int src_x = x >> 1;
+	int src_width = width >> 1;
+	for (int row = y >> 1; row < self->src_height && row * 2 < y + height; row += 2)
+	{
+		uint16_t *rows = dest + (row * 2 - y) * stride;
+		int count = row + 1 < self->src_height ? 2 : 1;
+		plm_frame_rect_convert_rgb565(frame, src_x, row, src_width, 2, rows, stride * count, swap);
+		for (int i = 0; i < count * 2; i += 2)
 		{
-			run = coeff >> 8;
-			level = coeff & 0xff;
-			if (plm_buffer_read(self->buffer, 1))
+			uint16_t *d = rows + i * stride;
+			for (int col = src_width - 1; col >= 0; col--)
 			{
-				level = -level;
+				d[col * 2 + 1] = d[col * 2] = d[col];
 			}
+			memcpy(d + stride, d, src_width * 2 * sizeof(uint16_t));
 		}
+	}
+}
 
-		n += run;
-		if (n < 0 || n >= 64)
+static inline void plm_scaler_nearest_row(
+		plm_scaler_t *self, plm_frame_t *frame, const plm_scaler_step_t *row,
+		int x, int width, uint16_t *dest, const uint8_t *bias, int swap)
+{
+	const uint8_t *y_row = frame->y.data + row->luma * frame->y.width;
+	const uint8_t *cr_row = frame->cr.data + row->chroma * frame->cr.width;
+	const uint8_t *cb_row = frame->cb.data + row->chroma * frame->cb.width;
+	int chroma = -1;
+	int r = 0, g = 0, b = 0;
+	for (int i = 0; i < width; i++)
+	{
+		const plm_scaler_step_t *col = &self->cols[x + i];
+		if (col->chroma != chroma)
 		{
-			return; // invalid
+			chroma = col->chroma;
+			PLM_RGB565_CHROMA(cr_row[chroma], cb_row[chroma], r, g, b);
 		}
+		PLM_RGB565_PIXEL(dest[i], y_row[col->luma], r, g, b, bias[(x + i) & 3], swap);
+	}
+}
 
-		int de_zig_zagged = PLM_VIDEO_ZIG_ZAG[n];
-		n++;
+static inline void plm_scaler_blend_line(const uint8_t *src, int stride, int weight, uint16_t *dest, int count)
+{
+	const uint8_t *next = src + stride;
+	for (int i = 0; i < count; i++)
+	{
+		dest[i] = (uint16_t)(src[i] * (256 - weight) + next[i] * weight);
+	}
+}
 
-		// Dequantize, oddify, clip
-		level <<= 1;
-		if (!self->macroblock_intra)
-		{
-			level += (level < 0 ? -1 : 1);
-		}
-		level = (level * self->quantizer_scale * quant_matrix[de_zig_zagged]) >> 4;
-		if ((level & 1) == 0)
-		{
-			level -= level > 0 ? 1 : -1;
-		}
-		if (level > 2047)
-		{
-			level = 2047;
-		}
-		else if (level < -2048)
-		{
-			level = -2048;
-		}
+static inline int plm_scaler_lerp(const uint16_t *line, int index, int weight)
+{
+	return (line[index] * (256 - weight) + line[index + 1] * weight + 32768) >> 16;
+}
 
-		// Save premultiplied coefficient
-		self->block_data[de_zig_zagged] = level * PLM_VIDEO_PREMULTIPLIER_MATRIX[de_zig_zagged];
+static inline void plm_scaler_bilinear_row(
+		plm_scaler_t *self, plm_frame_t *frame, const plm_scaler_step_t *row,
+		int x, int width, uint16_t *dest, const uint8_t *bias, int swap)
+{
+	// Blend the two source rows first, the columns per pixel after that. Only
+	// the source samples of the columns x to x + width are needed.
+	const plm_scaler_step_t *cols = self->cols + x;
+	int luma = cols[0].luma;
+	int luma_count = cols[width - 1].luma + 2 - luma;
+	int chroma = cols[0].chroma;
+	int chroma_count = cols[width - 1].chroma + 2 - chroma;
+	uint16_t *y_line = self->lines;
+	uint16_t *cr_line = y_line + self->src_width;
+	uint16_t *cb_line = cr_line + ((self->src_width + 1) >> 1);
+	plm_scaler_blend_line(
+			frame->y.data + row->luma * frame->y.width + luma, frame->y.width,
+			row->luma_weight, y_line + luma, luma_count);
+	plm_scaler_blend_line(
+			frame->cr.data + row->chroma * frame->cr.width + chroma, frame->cr.width,
+			row->chroma_weight, cr_line + chroma, chroma_count);
+	plm_scaler_blend_line(
+			frame->cb.data + row->chroma * frame->cb.width + chroma, frame->cb.width,
+			row->chroma_weight, cb_line + chroma, chroma_count);
+
+	for (int i = 0; i < width; i++)
+	{
+		const plm_scaler_step_t *col = &cols[i];
+		int r, g, b;
+		PLM_RGB565_CHROMA(
+				plm_scaler_lerp(cr_line, col->chroma, col->chroma_weight),
+				plm_scaler_lerp(cb_line, col->chroma, col->chroma_weight),
+				r, g, b);
+		int y = plm_scaler_lerp(y_line, col->luma, col->luma_weight);
+		PLM_RGB565_PIXEL(dest[i], y, r, g, b, bias[(x + i) & 3], swap);
 	}
+}
 
-	// Move block to its place
-	uint8_t *d;
-	int dw;
-	int di;
+#undef PLM_RGB565_CHROMA
+#undef PLM_RGB565_PIXEL
 
-	if (block < 4)
+// Convert the destination rect of width x height pixels at x, y. dest points
+// to its top left pixel. For PLM_SCALE_DOUBLE, x and y must be multiples of 4.
+
+static inline void plm_scaler_convert_rect(
+		plm_scaler_t *self, plm_frame_t *frame, int x, int y, int width, int height,
+		uint16_t *dest, int stride, int swap)
+{
+	if (self->mode == PLM_SCALE_DOUBLE)
 	{
-		d = self->frame_current.y.data;
-		dw = self->luma_width;
-		di = (self->mb_row * self->luma_width + self->mb_col) << 4;
-		if ((block & 1) != 0)
-		{
-			di += 8;
-		}
-		if ((block & 2) != 0)
-		{
-			di += self->luma_width << 3;
-		}
+		plm_scaler_double(self, frame, x, y, width, height, dest, stride, swap);
+		return;
 	}
-	else
+
+	// Repeated rows are dithered with the matrix row of the first row of their
+	// run, so that they look the same whether copied or converted at the top of
+	// a rect
+	int run = y;
+	while (run > 0 && memcmp(&self->rows[run], &self->rows[run - 1], sizeof(plm_scaler_step_t)) == 0)
 	{
-		d = (block == 4) ? self->frame_current.cb.data : self->frame_current.cr.data;
-		dw = self->chroma_width;
-		di = ((self->mb_row * self->luma_width) << 2) + (self->mb_col << 3);
+		run--;
 	}
-
-	int *s = self->block_data;
-	int si = 0;
-	if (self->macroblock_intra)
+	for (int j = y; j < y + height; j++)
 	{
-		// Overwrite (no prediction)
-		if (n == 1)
+		const plm_scaler_step_t *row = &self->rows[j];
+		uint16_t *d = dest + (j - y) * stride;
+
+		// Upscaling repeats rows, which only need to be copied
+		if (j > y && memcmp(row, row - 1, sizeof(plm_scaler_step_t)) == 0)
 		{
-			int clamped = plm_clamp((s[0] + 128) >> 8);
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, clamped);
-			s[0] = 0;
+			memcpy(d, d - stride, width * sizeof(uint16_t));
+			continue;
 		}
-		else
+		if (j > y)
 		{
-			plm_video_idct(s);
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, plm_clamp(s[si]));
-			memset(self->block_data, 0, sizeof(self->block_data));
+			run = j;
 		}
-	}
-	else
-	{
-		// Add data to the predicted macroblock
-		if (n == 1)
+		if (self->mode == PLM_SCALE_BILINEAR)
 		{
-			int value = (s[0] + 128) >> 8;
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, plm_clamp(d[di] + value));
-			s[0] = 0;
+			plm_scaler_bilinear_row(self, frame, row, x, width, d, PLM_RGB565_BAYER[run & 3], swap);
 		}
 		else
 		{
-			plm_video_idct(s);
-			PLM_BLOCK_SET(d, di, dw, si, 8, 8, plm_clamp(d[di] + s[si]));
-			memset(self->block_data, 0, sizeof(self->block_data));
+			plm_scaler_nearest_row(self, frame, row, x, width, d, PLM_RGB565_BAYER[run & 3], swap);
 		}
 	}
 }
 
-void plm_video_idct(int *block)
-{
-// printf("plm_video_idct\n");
-	int
-			b1,
-			b3, b4, b6, b7, tmp1, tmp2, m0,
-			x0, x1, x2, x3, x4, y3, y4, y5, y6, y7;
+// Find the destination rows or columns that read any of the luma samples
+// start to end (exclusive) or the chroma samples next to them
 
-	// Transform columns
-	for (int i = 0; i < 8; ++i)
+static void plm_scaler_map_range(const plm_scaler_step_t *steps, int count, int start, int end, int *first, int *last)
+{
+	*first = 0;
+	*last = 0;
+	for (int i = 0; i < count; i++)
 	{
-		b1 = block[4 * 8 + i];
-		b3 = block[2 * 8 + i] + block[6 * 8 + i];
-		b4 = block[5 * 8 + i] - block[3 * 8 + i];
-		tmp1 = block[1 * 8 + i] + block[7 * 8 + i];
-		tmp2 = block[3 * 8 + i] + block[5 * 8 + i];
-		b6 = block[1 * 8 + i] - block[7 * 8 + i];
-		b7 = tmp1 + tmp2;
-		m0 = block[0 * 8 + i];
-		x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
-		x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
-		x1 = m0 - b1;
-		x2 = (((block[2 * 8 + i] - block[6 * 8 + i]) * 362 + 128) >> 8) - b3;
-		x3 = m0 + b1;
-		y3 = x1 + x2;
-		y4 = x3 + b3;
-		y5 = x1 - x2;
-		y6 = x3 - b3;
-		y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
-		block[0 * 8 + i] = b7 + y4;
-		block[1 * 8 + i] = x4 + y3;
-		block[2 * 8 + i] = y5 - x0;
-		block[3 * 8 + i] = y6 - y7;
-		block[4 * 8 + i] = y6 + y7;
-		block[5 * 8 + i] = x0 + y5;
-		block[6 * 8 + i] = y3 - x4;
-		block[7 * 8 + i] = y4 - b7;
+		const plm_scaler_step_t *step = &steps[i];
+		int luma_last = step->luma + (step->luma_weight ? 1 : 0);
+		int chroma_last = step->chroma + (step->chroma_weight ? 1 : 0);
+		if (
+				(step->luma < end && luma_last >= start) ||
+				(step->chroma < (end + 1) >> 1 && chroma_last >= start >> 1))
+		{
+			if (*last == 0)
+			{
+				*first = i;
+			}
+			*last = i + 1;
+		}
 	}
+}
 
-	// Transform rows
-	for (int i = 0; i < 64; i += 8)
-	{
-		b1 = block[4 + i];
-		b3 = block[2 + i] + block[6 + i];
-		b4 = block[5 + i] - block[3 + i];
-		tmp1 = block[1 + i] + block[7 + i];
-		tmp2 = block[3 + i] + block[5 + i];
-		b6 = block[1 + i] - block[7 + i];
-		b7 = tmp1 + tmp2;
-		m0 = block[0 + i];
-		x4 = ((b6 * 473 - b4 * 196 + 128) >> 8) - b7;
-		x0 = x4 - (((tmp1 - tmp2) * 362 + 128) >> 8);
-		x1 = m0 - b1;
-		x2 = (((block[2 + i] - block[6 + i]) * 362 + 128) >> 8) - b3;
-		x3 = m0 + b1;
-		y3 = x1 + x2;
-		y4 = x3 + b3;
-		y5 = x1 - x2;
-		y6 = x3 - b3;
-		y7 = -x0 - ((b4 * 473 + b6 * 196 + 128) >> 8);
-		block[0 + i] = (b7 + y4 + 128) >> 8;
-		block[1 + i] = (x4 + y3 + 128) >> 8;
-		block[2 + i] = (y5 - x0 + 128) >> 8;
-		block[3 + i] = (y6 - y7 + 128) >> 8;
-		block[4 + i] = (y6 + y7 + 128) >> 8;
-		block[5 + i] = (x0 + y5 + 128) >> 8;
-		block[6 + i] = (y3 - x4 + 128) >> 8;
-		block[7 + i] = (y4 - b7 + 128) >> 8;
+void plm_scaler_to_rgb565(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride)
+{
+// printf("plm_scaler_to_rgb565\n");
+	plm_scaler_convert_rect(self, frame, 0, 0, self->dest_width, self->dest_height, dest, stride, FALSE);
+}
+
+void plm_scaler_to_rgb565_be(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride)
+{
+// printf("plm_scaler_to_rgb565_be\n");
+	plm_scaler_convert_rect(self, frame, 0, 0, self->dest_width, self->dest_height, dest, stride, TRUE);
+}
+
+void plm_frame_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink)
+{
+// printf("plm_frame_to_rgb565_strips\n");
+	plm_rect_t rect = {0, 0, (int)frame->width, (int)frame->height};
+	plm_frame_rects_to_rgb565_strips(frame, scaler, &rect, 1, buffers, strip_height, big_endian, sink);
+}
+
+void plm_frame_rects_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, const plm_rect_t *rects, int count, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink)
+{
+// printf("plm_frame_rects_to_rgb565_strips\n");
+	int buffer_size = (scaler ? scaler->dest_width : (int)frame->width) * strip_height;
+	int strip = 0;
+	for (int i = 0; i < count; i++)
+	{
+		// The part of the destination that shows the rect
+		plm_rect_t rect = rects[i];
+		if (scaler)
+		{
+			int x1, y1;
+			plm_scaler_map_range(scaler->cols, scaler->dest_width, rect.x, rect.x + rect.width, &rect.x, &x1);
+			plm_scaler_map_range(scaler->rows, scaler->dest_height, rect.y, rect.y + rect.height, &rect.y, &y1);
+			rect.width = x1 - rect.x;
+			rect.height = y1 - rect.y;
+		}
+		if (rect.width <= 0)
+		{
+			continue;
+		}
+
+		// Strips are packed at the width of the rect
+		for (int y = rect.y; y < rect.y + rect.height; y += strip_height)
+		{
+			// Alternate between the two buffers, so that one can be converted
+			// into while the sink is still busy with the other
+			uint16_t *pixels = buffers + strip * buffer_size;
+			int rows = rect.y + rect.height - y < strip_height ? rect.y + rect.height - y : strip_height;
+			if (sink->wait)
+			{
+				sink->wait(pixels, sink->user);
+			}
+			if (scaler)
+			{
+				plm_scaler_convert_rect(scaler, frame, rect.x, y, rect.width, rows, pixels, rect.width, big_endian);
+			}
+			else
+			{
+				plm_frame_rect_convert_rgb565(frame, rect.x, y, rect.width, rows, pixels, rect.width, big_endian);
+			}
+			sink->push(rect.x, y, rect.width, rows, pixels, sink->user);
+			strip ^= 1;
+		}
 	}
-}
\ No newline at end of file
+}
@@ -119,7 +119,8 @@ Data can be supplied to the high level interface, the demuxer and the decoders
 in three different ways:
 
  1. Using plm_create_from_filename() or with a file handle with
-		plm_create_from_file().
+		plm_create_from_file(). The *_async() variants of these read the file
+		ahead on a separate thread, so that slow reads don't stall decoding.
 
  2. Using plm_create_with_memory() and supplying a pointer to memory that
 		contains the whole file.
@@ -180,6 +181,7 @@ extern "C"
 	typedef struct plm_demux_t plm_demux_t;
 	typedef struct plm_video_t plm_video_t;
 	typedef struct plm_audio_t plm_audio_t;
+	typedef struct plm_scaler_t plm_scaler_t;
 
 	// Demuxed MPEG PS packet
 	// The type maps directly to the various MPEG-PES start codes. PTS is the
@@ -213,7 +215,16 @@ extern "C"
 
 	// Decoded Video Frame
 	// width and height denote the desired display size of the frame. This may be
-	// different from the internal size of the 3 planes.
+	// different from the internal size of the 3 planes. skipped_macroblocks is
+	// the number of skipped macroblocks that were copied unchanged from a
+	// reference frame instead of being predicted one by one. hidden_macroblocks is
+	// the number of macroblocks of a B-picture outside the part that was decoded,
+	// see plm_video_set_b_picture_rect(). rgb565 is the buffer the frame was
+	// already converted into, see plm_video_set_rgb565_target(), or NULL. dirty has
+	// one byte per macroblock of macroblock_size pixels, row by row, that is
+	// non-zero if the macroblock changed since the frame returned before; a frame
+	// that only skips macroblocks without motion changes few. dirty_macroblocks is
+	// the number of them, see plm_frame_get_dirty_rects().
 
 	typedef struct
 	{
@@ -223,6 +234,12 @@ extern "C"
 		plm_plane_t y;
 		plm_plane_t cr;
 		plm_plane_t cb;
+		unsigned int skipped_macroblocks;
+		unsigned int hidden_macroblocks;
+		uint16_t *rgb565;
+		uint8_t *dirty;
+		unsigned int dirty_macroblocks;
+		unsigned int macroblock_size;
 	} plm_frame_t;
 
 	// Callback function type for decoded video frames used by the high-level
@@ -230,6 +247,11 @@ extern "C"
 
 	typedef void (*plm_video_decode_callback)(plm_t *self, plm_frame_t *frame, void *user);
 
+	// Callback function type for the luma plane of decoded video frames used by
+	// the high-level plm_* interface, see plm_set_video_luma_callback()
+
+	typedef void (*plm_video_luma_callback)(plm_t *self, plm_plane_t *luma, void *user);
+
 	// Decoded Audio Samples
 	// Samples are stored as normalized (-1, 1) float either interleaved, or if
 	// PLM_AUDIO_SEPARATE_CHANNELS is defined, in two separate arrays.
@@ -259,6 +281,59 @@ extern "C"
 
 	typedef void (*plm_buffer_load_callback)(plm_buffer_t *self, void *user);
 
+	// Ways a plm_buffer gets its data, see plm_buffer_get_input_mode()
+
+	typedef enum
+	{
+		PLM_INPUT_BUFFER,     // Data written with plm_buffer_write()
+		PLM_INPUT_FILE,       // File streamed with fread()
+		PLM_INPUT_READ_AHEAD, // File streamed by a reader thread
+		PLM_INPUT_MEMORY,     // Memory supplied by the caller
+		PLM_INPUT_PRELOADED,  // Whole file read into memory
+		PLM_INPUT_MAPPED      // Whole file mapped into memory with mmap()
+	} plm_input_mode_t;
+
+	// Which frames plm_decode() may skip when it falls behind, see
+	// plm_set_drop_policy()
+
+	typedef enum
+	{
+		PLM_DROP_NONE,         // Decode every frame
+		PLM_DROP_LATE_B_FRAMES // Skip B-pictures that are already late
+	} plm_drop_policy_t;
+
+	// Scaling filters for plm_scaler_create()
+
+	typedef enum
+	{
+		PLM_SCALE_NEAREST, // Repeat or skip source pixels
+		PLM_SCALE_DOUBLE,  // Exactly twice the source size in both directions
+		PLM_SCALE_BILINEAR // Blend the four nearest source pixels
+	} plm_scale_mode_t;
+
+	// Receiver of the RGB565 strips of plm_frame_to_rgb565_strips(). push is
+	// called with each converted strip of width x height pixels at x, y and may
+	// start an asynchronous transfer, e.g. with DMA, and return right away. wait is
+	// called before a strip buffer is converted into again and must block until
+	// no transfer from pixels is pending. wait may be NULL if push is synchronous.
+
+	typedef struct
+	{
+		void (*push)(int x, int y, int width, int height, uint16_t *pixels, void *user);
+		void (*wait)(uint16_t *pixels, void *user);
+		void *user;
+	} plm_rgb565_sink_t;
+
+	// Rect of width x height pixels at x, y, see plm_frame_get_dirty_rects()
+
+	typedef struct
+	{
+		int x;
+		int y;
+		int width;
+		int height;
+	} plm_rect_t;
+
 	// -----------------------------------------------------------------------------
 	// plm_* public API
 	// High-Level API for loading/demuxing/decoding MPEG-PS data
@@ -273,6 +348,19 @@ extern "C"
 
 	plm_t *plm_create_with_file(FILE *fh, int close_when_done);
 
+	// Create a plmpeg instance with a filename, loading small files as a whole
+	// and reading others ahead on a separate thread, see
+	// plm_buffer_create_with_filename_async(). Returns NULL if the file could not
+	// be opened.
+
+	plm_t *plm_create_with_filename_async(const char *filename);
+
+	// Create a plmpeg instance with a file handle that is read ahead on a
+	// separate thread. Pass TRUE to close_when_done to let plmpeg call fclose()
+	// on the handle when plm_destroy() is called.
+
+	plm_t *plm_create_with_file_async(FILE *fh, int close_when_done);
+
 	// Create a plmpeg instance with a pointer to memory as source. This assumes the
 	// whole file is in memory. The memory is not copied. Pass TRUE to
 	// free_when_done to let plmpeg call free() on the pointer when plm_destroy()
@@ -317,6 +405,36 @@ extern "C"
 	int plm_get_video_enabled(plm_t *self);
 	void plm_set_video_enabled(plm_t *self, int enabled);
 
+	// Set the number of threads that decode video, see
+	// plm_video_set_thread_count(). Default 1.
+
+	void plm_set_video_thread_count(plm_t *self, int count);
+
+	// Set whether video is decoded in grayscale, see plm_video_set_grayscale().
+	// Default FALSE.
+
+	void plm_set_video_grayscale(plm_t *self, int enabled);
+
+	// Set a buffer that B-pictures are converted into as RGB565 while they are
+	// decoded, see plm_video_set_rgb565_target(). Default NULL.
+
+	void plm_set_video_rgb565_target(plm_t *self, uint16_t *dest, int stride, int big_endian);
+
+	// Set the size of decoded frames to 1/factor of the coded size in both
+	// directions, see plm_video_set_downscale(). Default 1.
+
+	int plm_set_video_downscale(plm_t *self, int factor);
+
+	// Set the part of the frame that is displayed, to which B-pictures are
+	// decoded, see plm_video_set_b_picture_rect(). Default is the whole frame.
+
+	void plm_set_video_b_picture_rect(plm_t *self, int x, int y, int width, int height);
+
+	// Get the fraction of the macroblocks of B-pictures that were not decoded
+	// because they lie outside the rect, see plm_video_get_hidden_b_fraction().
+
+	double plm_get_video_hidden_b_fraction(plm_t *self);
+
 	// Get the number of video streams (0--1) reported in the system header.
 
 	int plm_get_num_video_streams(plm_t *self);
@@ -363,6 +481,10 @@ extern "C"
 
 	double plm_get_duration(plm_t *self);
 
+	// Get how the source data is read, see plm_buffer_get_input_mode().
+
+	plm_input_mode_t plm_get_input_mode(plm_t *self);
+
 	// Rewind all buffers back to the beginning.
 
 	void plm_rewind(plm_t *self);
@@ -383,6 +505,13 @@ extern "C"
 
 	void plm_set_video_decode_callback(plm_t *self, plm_video_decode_callback fp, void *user);
 
+	// Set a callback that gets only the luma (Y) plane of decoded video frames in
+	// plm_decode() and plm_seek(), meant to go with plm_set_video_grayscale(). The
+	// plane is padded to whole macroblocks; plm_get_width/height() give the size
+	// to display. If a video decode callback is set as well, it is called first.
+
+	void plm_set_video_luma_callback(plm_t *self, plm_video_luma_callback fp, void *user);
+
 	// Set the callback for decoded audio samples used with plm_decode(). If no
 	// callback is set, audio data will be ignored and not be decoded. The *user
 	// Parameter will be passed to your callback.
@@ -391,11 +520,25 @@ extern "C"
 
 	// Advance the internal timer by seconds and decode video/audio up to this time.
 	// This will call the video_decode_callback and audio_decode_callback any number
-	// of times. A frame-skip is not implemented, i.e. everything up to current time
-	// will be decoded.
+	// of times. Everything up to current time will be decoded, except for the
+	// frames that plm_set_drop_policy() allows to skip.
 
 	void plm_decode(plm_t *self, double seconds);
 
+	// Set which frames plm_decode() may skip when it is behind, i.e. when it has
+	// to decode more than one frame to reach the requested time. With
+	// PLM_DROP_LATE_B_FRAMES, B-pictures that would be followed by another frame
+	// within the same call are skipped at the bitstream level, without decoding
+	// them. Reference pictures are always decoded. Default PLM_DROP_NONE.
+
+	void plm_set_drop_policy(plm_t *self, plm_drop_policy_t policy);
+
+	// Get the number of frames skipped by the drop policy, and of frames that
+	// plm_decode() decoded although the next one was already due.
+
+	int plm_get_dropped_frames(plm_t *self);
+	int plm_get_late_frames(plm_t *self);
+
 	// Decode and return one video frame. Returns NULL if no frame could be decoded
 	// (either because the source ended or data is corrupt). If you only want to
 	// decode video, you should disable audio via plm_set_audio_enabled().
@@ -429,7 +572,8 @@ extern "C"
 
 	// Similar to plm_seek(), but will not call the video_decode_callback,
 	// audio_decode_callback or make any attempts to sync audio.
-	// Returns the found frame or NULL if no frame could be found.
+	// Returns the found frame or NULL if no frame could be found. All of the
+	// found frame is dirty, see plm_frame_get_dirty_rects().
 
 	plm_frame_t *plm_seek_frame(plm_t *self, double time, int seek_exact);
 
@@ -441,6 +585,29 @@ extern "C"
 
 #ifndef PLM_BUFFER_DEFAULT_SIZE
 #define PLM_BUFFER_DEFAULT_SIZE (128 * 1024)
+#endif
+
+	// The size and number of chunks that buffers created with
+	// plm_buffer_create_with_file_async() keep read ahead
+
+#ifndef PLM_READ_AHEAD_CHUNK_SIZE
+#define PLM_READ_AHEAD_CHUNK_SIZE (16 * 1024)
+#endif
+
+#ifndef PLM_READ_AHEAD_CHUNKS
+#define PLM_READ_AHEAD_CHUNKS 3
+#endif
+
+	// The largest files that plm_buffer_create_with_filename_async() maps into
+	// memory (where mmap() is available) or reads into memory in one go. Larger
+	// files are streamed. Define as 0 to always stream.
+
+#ifndef PLM_MMAP_MAX_SIZE
+#define PLM_MMAP_MAX_SIZE (256 * 1024 * 1024)
+#endif
+
+#ifndef PLM_PRELOAD_MAX_SIZE
+#define PLM_PRELOAD_MAX_SIZE (2 * 1024 * 1024)
 #endif
 
 	// Create a buffer instance with a filename. Returns NULL if the file could not
@@ -453,6 +620,24 @@ extern "C"
 
 	plm_buffer_t *plm_buffer_create_with_file(FILE *fh, int close_when_done);
 
+	// Create a buffer instance with a filename. Returns NULL if the file could not
+	// be opened. A file that fits PLM_MMAP_MAX_SIZE is mapped into memory where
+	// mmap() is available, else one that fits PLM_PRELOAD_MAX_SIZE is read into
+	// memory in one go if that much can be allocated. Seeking then doesn't touch
+	// the file. Larger files are read ahead on a separate thread, see
+	// plm_buffer_create_with_file_async().
+
+	plm_buffer_t *plm_buffer_create_with_filename_async(const char *filename);
+
+	// Create a buffer instance with a file handle that a reader thread reads
+	// ahead of the decoder, keeping up to PLM_READ_AHEAD_CHUNKS chunks of
+	// PLM_READ_AHEAD_CHUNK_SIZE bytes ready, so that a slow read only stalls
+	// decoding once all of them are used up. The handle must not be used
+	// elsewhere while the buffer exists. Without thread support (or with
+	// PLM_NO_THREADS defined) this is the same as plm_buffer_create_with_file().
+
+	plm_buffer_t *plm_buffer_create_with_file_async(FILE *fh, int close_when_done);
+
 	// Create a buffer instance with a pointer to memory as source. This assumes
 	// the whole file is in memory. The bytes are not copied. Pass 1 to
 	// free_when_done to let plmpeg call free() on the pointer when plm_destroy()
@@ -472,6 +657,15 @@ extern "C"
 
 	plm_buffer_t *plm_buffer_create_for_appending(uint32_t initial_capacity);
 
+	// Create a buffer that reads packet payloads in place from a source buffer,
+	// e.g. the one a demuxer reads from. plm_buffer_write() takes data that lies
+	// within the source's buffered bytes and only records where it is, so the
+	// data is never copied. The source keeps those bytes until they have been
+	// read; if it has to seek, the unread data is copied over. The source must
+	// not be destroyed before this buffer.
+
+	plm_buffer_t *plm_buffer_create_for_packets(plm_buffer_t *source);
+
 	// Destroy a buffer instance and free all data
 
 	void plm_buffer_destroy(plm_buffer_t *self);
@@ -510,6 +704,16 @@ extern "C"
 
 	uint32_t plm_buffer_get_remaining(plm_buffer_t *self);
 
+	// Get how the buffer gets its data.
+
+	plm_input_mode_t plm_buffer_get_input_mode(plm_buffer_t *self);
+
+	// Get the number of bytes that have been examined while searching for start
+	// codes. Divided by the number of decoded frames, this shows how much data
+	// is scanned per frame.
+
+	uint32_t plm_buffer_get_scanned_bytes(plm_buffer_t *self);
+
 	// Get whether the read position of the buffer is at the end and no more data
 	// is expected.
 
@@ -610,7 +814,7 @@ extern "C"
 
 	double plm_video_get_framerate(plm_video_t *self);
 
-	// Get the display width/height.
+	// Get the display width/height, divided by the downscale factor.
 
 	int plm_video_get_width(plm_video_t *self);
 	int plm_video_get_height(plm_video_t *self);
@@ -621,6 +825,73 @@ extern "C"
 
 	void plm_video_set_no_delay(plm_video_t *self, int no_delay);
 
+	// Set the number of threads that decode the slices of each picture,
+	// including the calling one. The others are worker threads: FreeRTOS tasks
+	// pinned to the following cores on ESP32, pthreads elsewhere. Returns the
+	// number of threads in use, which is 1 if no worker could be started. The
+	// default is 1.
+
+	int plm_video_set_thread_count(plm_video_t *self, int count);
+
+	// Skip B-pictures without decoding them as long as the frame after them is
+	// due before the given time in seconds; 0 disables this. This is how
+	// plm_decode() drops late frames, see plm_set_drop_policy(). Default 0.
+
+	void plm_video_set_drop_time(plm_video_t *self, double time);
+
+	// Get the number of B-pictures skipped with plm_video_set_drop_time().
+
+	int plm_video_get_dropped_frames(plm_video_t *self);
+
+	// Set the size of decoded frames to 1/factor of the coded size in both
+	// directions; factor is 1, 2, 4 or 8. Reduced sizes decode with 4x4, 2x2 or
+	// DC-only inverse transforms, scaled motion vectors and smaller frames, which
+	// cuts transform, motion compensation and frame memory accordingly. Motion
+	// compensation at reduced size is not exact, so errors build up until the next
+	// intra frame. Changing the factor reallocates the frames and drops the
+	// reference frames; set it before decoding. Returns FALSE for an unsupported
+	// factor.
+
+	int plm_video_set_downscale(plm_video_t *self, int factor);
+
+	// Set grayscale mode. Chroma coefficients are still parsed to keep in sync with
+	// the bitstream, but chroma is neither transformed nor predicted and no memory
+	// is allocated for it: the Cr and Cb planes of the frames are empty, with NULL
+	// data. Changing the mode reallocates the frames and drops the reference
+	// frames; set it before decoding. Default FALSE.
+
+	void plm_video_set_grayscale(plm_video_t *self, int enabled);
+
+	// Set a buffer that B-pictures are converted into as RGB565, macroblock by
+	// macroblock right after they are reconstructed, instead of in a separate pass
+	// over the returned frame. B-pictures are never used as references, so this
+	// saves reading the whole frame back. The rgb565 member of a returned frame is
+	// dest if it was converted like that, NULL otherwise; those frames still need
+	// plm_frame_to_rgb565() or plm_frame_to_rgb565_be(), matching big_endian. The
+	// stride is the width of dest in pixels, dest must hold (stride * height)
+	// pixels of the decoded frame. Macroblocks outside the rect of
+	// plm_video_set_b_picture_rect() are left out. Not used in grayscale mode.
+	// Pass NULL to disable. Default NULL.
+
+	void plm_video_set_rgb565_target(plm_video_t *self, uint16_t *dest, int stride, int big_endian);
+
+	// Set the part of the frame that is displayed, in pixels of the decoded (maybe
+	// downscaled) frame; a width or height of 0 selects the whole frame. This only
+	// speeds up B-pictures: their slices outside the rect are not parsed and
+	// their macroblocks outside it are not reconstructed, which is safe because
+	// no other picture is predicted from them. I- and P-pictures are always
+	// decoded whole, since motion vectors can carry pixels from anywhere in a
+	// reference picture into the rect over the pictures that follow. Pixels of
+	// B-pictures outside the rect are undefined.
+
+	void plm_video_set_b_picture_rect(plm_video_t *self, int x, int y, int width, int height);
+
+	// Get the fraction (0--1) of the macroblocks of the B-pictures decoded so far
+	// that were outside the rect of plm_video_set_b_picture_rect() and skipped.
+	// 0 for streams without B-pictures.
+
+	double plm_video_get_hidden_b_fraction(plm_video_t *self);
+
 	// Get the current internal time in seconds.
 
 	double plm_video_get_time(plm_video_t *self);
@@ -645,6 +916,72 @@ extern "C"
 
 	plm_frame_t *plm_video_decode(plm_video_t *self);
 
+	// Convert the YCrCb data of a frame into RGB565 pixels, in native byte order or
+	// byte swapped (_be) for displays that take the high byte first. The stride
+	// is the width of the destination buffer in pixels and must be at least
+	// frame->width. The buffer pointed to by *dest must have a size of at least
+	// (stride * frame->height) pixels. The _rect variants only convert the given
+	// part of the frame into the same place in dest; x and y must be even.
+	// Define PLM_RGB565_DITHER to 1 for the implementation to dither the pixels
+	// with a 4x4 Bayer matrix instead of truncating them, which hides the banding
+	// of smooth gradients. This applies to all RGB565 conversions. Define
+	// PLM_RGB565_ARDUINO_GFX_TABLES to 1 instead to convert with the tables of
+	// Arduino_GFX, for the colours of its drawYCbCrBitmap().
+
+	void plm_frame_to_rgb565(plm_frame_t *frame, uint16_t *dest, int stride);
+	void plm_frame_to_rgb565_be(plm_frame_t *frame, uint16_t *dest, int stride);
+	void plm_frame_rect_to_rgb565(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride);
+	void plm_frame_rect_to_rgb565_be(plm_frame_t *frame, int x, int y, int width, int height, uint16_t *dest, int stride);
+
+	// Get the parts of a frame that changed since the frame plm_video_decode()
+	// returned before, as up to max_rects rects in frame pixels. Dirty macroblocks
+	// next to each other in a row, and runs of the same columns in the rows below,
+	// make one rect. If more rects are needed, a single one around all dirty
+	// macroblocks is returned. Returns the number of rects, 0 if nothing changed.
+	// This only covers what is shown if every returned frame is shown.
+
+	int plm_frame_get_dirty_rects(plm_frame_t *frame, plm_rect_t *rects, int max_rects);
+
+	// -----------------------------------------------------------------------------
+	// plm_scaler public API
+	// Scale frames to another size while converting them to RGB565
+
+	// Create a scaler from frames of src_width x src_height pixels to dest_width x
+	// dest_height pixels. The source and destination positions of every row and
+	// column are computed here once. PLM_SCALE_DOUBLE needs a destination of
+	// exactly twice the source size. Returns NULL if the sizes are not supported.
+
+	plm_scaler_t *plm_scaler_create(int src_width, int src_height, int dest_width, int dest_height, plm_scale_mode_t mode);
+
+	// Destroy a scaler and free all data.
+
+	void plm_scaler_destroy(plm_scaler_t *self);
+
+	// Scale a frame of the source size and convert it into RGB565 pixels, in
+	// native byte order or byte swapped (_be), see plm_frame_to_rgb565(). The
+	// stride is the width of the destination buffer in pixels and must be at least
+	// dest_width. The buffer pointed to by *dest must have a size of at least
+	// (stride * dest_height) pixels.
+
+	void plm_scaler_to_rgb565(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride);
+	void plm_scaler_to_rgb565_be(plm_scaler_t *self, plm_frame_t *frame, uint16_t *dest, int stride);
+
+	// Convert a frame into RGB565 pixels, scaled with scaler or at frame size if
+	// scaler is NULL, one strip of strip_height rows at a time, and hand each strip
+	// to sink. Two strips are converted into buffers in turn, so it must have a
+	// size of at least (2 * width * strip_height) pixels, with width the scaled or
+	// the frame width. strip_height must be even and for PLM_SCALE_DOUBLE a
+	// multiple of 4; 16 rows match a macroblock row of unscaled frames.
+
+	void plm_frame_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink);
+
+	// Like plm_frame_to_rgb565_strips(), but only convert the parts of the
+	// destination that show the given rects of the frame, e.g. the ones from
+	// plm_frame_get_dirty_rects(). The strips of each rect are as wide as the rect,
+	// and pushed at its place in the destination.
+
+	void plm_frame_rects_to_rgb565_strips(plm_frame_t *frame, plm_scaler_t *scaler, const plm_rect_t *rects, int count, uint16_t *buffers, int strip_height, int big_endian, plm_rgb565_sink_t *sink);
+
 	// -----------------------------------------------------------------------------
 	// plm_audio public API
 	// Decode MPEG-1 Audio Layer II ("mp2") data into raw samples
@@ -713,9 +1050,26 @@ enum plm_buffer_mode
 	PLM_BUFFER_MODE_FILE,
 	PLM_BUFFER_MODE_FIXED_MEM,
 	PLM_BUFFER_MODE_RING,
-	PLM_BUFFER_MODE_APPEND
+	PLM_BUFFER_MODE_APPEND,
+	PLM_BUFFER_MODE_CHAIN
 };
 
+// A packet chain buffer (PLM_BUFFER_MODE_CHAIN) reads its data from spans
+// of a source buffer. offset is relative to the start of the source's data
+// (see base_offset); data is set once the span had to be copied.
+#ifndef PLM_BUFFER_INITIAL_SPANS
+#define PLM_BUFFER_INITIAL_SPANS 16
+#endif
+
+typedef struct
+{
+	uint32_t offset;
+	uint32_t length;
+	uint8_t *data;
+} plm_buffer_span_t;
+
+typedef struct plm_read_ahead_t plm_read_ahead_t;
+
 struct plm_buffer_t
 {
 	uint32_t bit_index;
@@ -727,10 +1081,40 @@ struct plm_buffer_t
 	int free_when_done;
 	int close_when_done;
 	FILE *fh;
+	plm_read_ahead_t *read_ahead;
 	plm_buffer_load_callback load_callback;
 	void *load_callback_user_data;
 	uint8_t *bytes;
 	enum plm_buffer_mode mode;
+	plm_input_mode_t input_mode;
+
+	// Bit reservoir: up to 64 bits starting at byte bit_cache_start >> 3,
+	// valid for bit positions [bit_cache_start, bit_cache_end).
+	uint64_t bit_cache;
+	uint32_t bit_cache_start;
+	uint32_t bit_cache_end;
+
+	// Start code index: written bytes below index_scanned have been scanned for
+	// index_code (-1 if disabled); index_last is the byte offset of the last
+	// one found, or -1.
+	int index_code;
+	int index_last;
+	uint32_t index_scanned;
+	uint32_t scanned_bytes;
+
+	// Number of bytes discarded from the front since the last seek; packet
+	// chains reading from this buffer are linked through consumers.
+	uint32_t base_offset;
+	plm_buffer_t *consumers;
+
+	// Packet chain: spans in source, and the span found by the last lookup
+	plm_buffer_t *source;
+	plm_buffer_t *next_consumer;
+	plm_buffer_span_t *spans;
+	uint32_t span_count;
+	uint32_t span_capacity;
+	uint32_t span_cursor;
+	uint32_t span_cursor_start;
 };
 
 typedef struct
@@ -745,18 +1129,73 @@ typedef struct
 	uint16_t value;
 } plm_vlc_uint_t;
 
+// Lookup table decoding of the plm_vlc_t trees. The first PLM_VLC_LOOKUP_BITS
+// bits of a code index the primary table; longer codes link to a second-level
+// table indexed by the remaining bits.
+#ifndef PLM_VLC_LOOKUP_BITS
+#define PLM_VLC_LOOKUP_BITS 8
+#endif
+
+typedef struct
+{
+	int16_t value;	// Decoded value, or offset of the second-level table
+	uint8_t length; // Code length in bits; 0 for a second-level link
+	uint8_t bits;		// Index width of the linked second-level table
+} plm_vlc_lookup_entry_t;
+
+typedef struct
+{
+	const plm_vlc_t *table;
+	int bits;
+	int max_length;
+	plm_vlc_lookup_entry_t *entries;
+} plm_vlc_lookup_t;
+
 void plm_buffer_seek(plm_buffer_t *self, uint32_t pos);
 uint32_t plm_buffer_tell(plm_buffer_t *self);
 void plm_buffer_discard_read_bytes(plm_buffer_t *self);
+void plm_buffer_index_start_code(plm_buffer_t *self, int code);
+void plm_buffer_update_index(plm_buffer_t *self);
+uint32_t plm_buffer_write_span(plm_buffer_t *self, uint8_t *bytes, uint32_t length);
+uint32_t plm_buffer_drop_spans(plm_buffer_t *self, uint32_t byte_pos);
+void plm_buffer_clear_spans(plm_buffer_t *self);
+uint8_t *plm_buffer_get_span_bytes(plm_buffer_t *self, uint32_t pos, uint32_t *available);
+uint8_t plm_buffer_get_byte(plm_buffer_t *self, uint32_t pos);
+int plm_buffer_scan_start_code(plm_buffer_t *self, uint32_t pos, uint32_t positions);
+uint32_t plm_buffer_get_retained_offset(plm_buffer_t *self, uint32_t byte_pos);
+void plm_buffer_detach(plm_buffer_t *self);
+void plm_buffer_detach_consumers(plm_buffer_t *self);
 void plm_buffer_load_file_callback(plm_buffer_t *self, void *user);
+plm_buffer_t *plm_buffer_create_with_whole_file(FILE *fh);
+
+plm_read_ahead_t *plm_read_ahead_create(FILE *fh);
+void plm_read_ahead_destroy(plm_read_ahead_t *self);
+uint32_t plm_read_ahead_read(plm_read_ahead_t *self, uint8_t *dest, uint32_t length);
+void plm_read_ahead_seek(plm_read_ahead_t *self, uint32_t pos);
 
 int plm_buffer_has(plm_buffer_t *self, uint32_t count);
+void plm_buffer_refill(plm_buffer_t *self);
+void plm_buffer_invalidate_cache(plm_buffer_t *self);
+int plm_buffer_peek(plm_buffer_t *self, int count);
+int plm_buffer_fill_cache(plm_buffer_t *self, int count);
 int plm_buffer_read(plm_buffer_t *self, int count);
 void plm_buffer_align(plm_buffer_t *self);
 void plm_buffer_skip(plm_buffer_t *self, uint32_t count);
 int plm_buffer_skip_bytes(plm_buffer_t *self, uint8_t v);
 int plm_buffer_next_start_code(plm_buffer_t *self);
+int plm_buffer_next_start_code_append(plm_buffer_t *self, uint8_t **bytes, uint32_t *length, uint32_t *capacity);
+void plm_buffer_append_bytes(plm_buffer_t *self, uint32_t pos, uint32_t count, uint8_t **bytes, uint32_t *length, uint32_t *capacity);
+void plm_buffer_reset_memory(plm_buffer_t *self, uint8_t *bytes, uint32_t length);
+int plm_scan_start_code(const uint8_t *bytes, uint32_t length);
 int plm_buffer_find_start_code(plm_buffer_t *self, int code);
+int plm_buffer_peek_start_code(plm_buffer_t *self);
 int plm_buffer_no_start_code(plm_buffer_t *self);
+int plm_buffer_has_indexed_start_code(plm_buffer_t *self);
 int16_t plm_buffer_read_vlc(plm_buffer_t *self, const plm_vlc_t *table);
 uint16_t plm_buffer_read_vlc_uint(plm_buffer_t *self, const plm_vlc_uint_t *table);
+int16_t plm_buffer_read_vlc_lookup(plm_buffer_t *self, const plm_vlc_lookup_t *lookup);
+
+int plm_vlc_depth(const plm_vlc_t *table, int index);
+plm_vlc_lookup_entry_t plm_vlc_walk(const plm_vlc_t *table, int *index, uint32_t code, int bits);
+plm_vlc_lookup_t *plm_vlc_lookup_create(const plm_vlc_t *table);
+void plm_vlc_lookup_destroy(plm_vlc_lookup_t *self);
@@ -49,6 +49,8 @@ uint16_t yt_skip;
 uint16_t cbcrs_skip;
 uint16_t frame_count;
 
+const char *input_mode_names[] = {"buffer", "file", "read-ahead", "memory", "preloaded", "mapped"};
+unsigned long open_ms;
 unsigned long next_frame_ms;
 unsigned long cur_ms;
 unsigned long remain_ms = 0;
@@ -78,6 +80,11 @@ static void convert_video_task(void *arg)
 // This function gets called for each decoded video frame
 void my_video_callback(plm_t *plm, plm_frame_t *frame, void *user)
 {
+  if (decode_video_count == 0)
+  {
+    Serial.printf("Time to first frame: %lu ms (input mode: %s)\n", millis() - open_ms, input_mode_names[plm_get_input_mode(plm)]);
+  }
+
   // if (cur_ms < next_frame_ms)
   // if (decode_video_count % 2)
   {
@@ -198,7 +205,14 @@ void setup(void)
   }
   else
   {
+    open_ms = millis();
+#if defined(SPI_SCK) && defined(SD_CS)
+    // Display and SD share the bus, so the file is not read ahead on another
+    // task while a frame is drawn
     plm = plm_create_with_filename(mpeg_file);
+#else
+    plm = plm_create_with_filename_async(mpeg_file);
+#endif
     if (!plm)
     {
       printf("Couldn't open file %s\n", mpeg_file);
@@ -211,6 +225,9 @@ void setup(void)
     plm_set_video_decode_callback(plm, my_video_callback, NULL);
     plm_set_audio_decode_callback(plm, my_audio_callback, NULL);
 
+    // Skip B-frames that are already late instead of falling further behind
+    plm_set_drop_policy(plm, PLM_DROP_LATE_B_FRAMES);
+
     // plm_video_set_no_delay(plm->video_decoder, true);
     // plm_set_video_enabled(plm, false);
     // plm_set_audio_enabled(plm, false);
@@ -241,6 +258,8 @@ void setup(void)
     {
       disp_h = plm_h;
     }
+    // Only the centered crop is shown, so B-pictures are only decoded there
+    plm_set_video_b_picture_rect(plm, x_skip / 2, (plm_h - disp_h) / 2, disp_w, disp_h);
     ys_skip = (plm_w >> 2) + (x_skip >> 2);
     yt_skip = disp_w >> 2;
     cbcrs_skip = x_skip >> 3;
@@ -267,6 +286,7 @@ void loop()
   next_frame_ms = start_ms;
   do
   {
+    double tick = plm_frame_interval;
     cur_ms = millis();
     if (next_frame_ms > cur_ms)
     {
@@ -282,14 +302,19 @@ void loop()
     else
     {
       // Serial.printf("Excess: %lu\n", cur_ms - next_frame_ms);
+      // Catch up with the clock, dropping late B-frames on the way
+      unsigned long late_ms = cur_ms - next_frame_ms;
+      tick += late_ms / 1000.0;
+      next_frame_ms += late_ms;
     }
 
-    plm_decode(plm, plm_frame_interval);
+    plm_decode(plm, tick);
 
     next_frame_ms += frame_interval_ms;
   } while (!plm_has_ended(plm));
 
   Serial.printf("Time used: %lu, decode_video_count: %d, display_video_count: %d, decode_audio_count: %d, remain: %lu\n", millis() - start_ms, decode_video_count, display_video_count, decode_audio_count, total_remain_ms);
+  Serial.printf("Dropped frames: %d, late frames: %d\n", plm_get_dropped_frames(plm), plm_get_late_frames(plm));
 
   vQueueDelete(video_queue_handle);
 
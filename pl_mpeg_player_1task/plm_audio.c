@@ -108,8 +108,8 @@ int plm_audio_find_frame_sync(plm_audio_t *self)
 	for (i = self->buffer->bit_index >> 3; i < self->buffer->length - 1; i++)
 	{
 		if (
-				self->buffer->bytes[i] == 0xFF &&
-				(self->buffer->bytes[i + 1] & 0xFE) == 0xFC)
+				plm_buffer_get_byte(self->buffer, i) == 0xFF &&
+				(plm_buffer_get_byte(self->buffer, i + 1) & 0xFE) == 0xFC)
 		{
 			self->buffer->bit_index = ((i + 1) << 3) + 3;
 			return TRUE;